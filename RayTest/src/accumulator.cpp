@@ -0,0 +1,131 @@
+#include "accumulator.h"
+
+#include <algorithm>
+
+const float Accumulator::MIN_LUMINANCE = 0.05f;
+
+static inline float Luminance(const Vector3f& color)
+{
+	return 0.2126f * color.GetX() + 0.7152f * color.GetY() + 0.0722f * color.GetZ();
+}
+
+Accumulator::Accumulator(unsigned int width, unsigned int height) :
+	m_width(width),
+	m_height(height),
+	m_numPasses(0)
+{
+	Pixel empty;
+	empty.sum = Vector3f(0.0f, 0.0f, 0.0f);
+	empty.mean = 0.0f;
+	empty.m2 = 0.0f;
+	empty.numSamples = 0;
+	m_pixels.assign(width * height, empty);
+	m_active.assign(width * height, 1);
+}
+
+void Accumulator::AddSample(unsigned int x, unsigned int y, const Vector3f& color)
+{
+	Pixel& pixel = m_pixels[x + y * m_width];
+	pixel.sum += color;
+	pixel.numSamples++;
+
+	float luminance = Luminance(color);
+	float delta = luminance - pixel.mean;
+	pixel.mean += delta / (float)pixel.numSamples;
+	pixel.m2 += delta * (luminance - pixel.mean);
+}
+
+bool Accumulator::IsConverged(unsigned int x, unsigned int y,
+		unsigned int minSamples, float maxError) const
+{
+	const Pixel& pixel = m_pixels[x + y * m_width];
+	if(pixel.numSamples < minSamples || pixel.numSamples < 2)
+	{
+		return false;
+	}
+
+	// The variance of the mean is the sample variance over the count
+	float n = (float)pixel.numSamples;
+	float varianceOfMean = pixel.m2 / ((n - 1.0f) * n);
+	float maxDeviation = maxError * std::max(pixel.mean, MIN_LUMINANCE);
+	return varianceOfMean <= maxDeviation * maxDeviation;
+}
+
+unsigned int Accumulator::UpdateActive(unsigned int minSamples,
+		unsigned int maxSamples, float maxError)
+{
+	std::vector<unsigned char> converged(m_pixels.size());
+	for(unsigned int y = 0; y < m_height; y++)
+	{
+		for(unsigned int x = 0; x < m_width; x++)
+		{
+			converged[x + y * m_width] = IsConverged(x, y, minSamples, maxError);
+		}
+	}
+
+	unsigned int numActive = 0;
+	for(unsigned int y = 0; y < m_height; y++)
+	{
+		for(unsigned int x = 0; x < m_width; x++)
+		{
+			unsigned int index = x + y * m_width;
+			if(!m_active[index])
+			{
+				continue;
+			}
+			if(m_pixels[index].numSamples >= maxSamples)
+			{
+				m_active[index] = 0;
+				continue;
+			}
+
+			bool neighboursConverged = true;
+			unsigned int minY = y > 0 ? y - 1 : 0;
+			unsigned int maxY = std::min(y + 1, m_height - 1);
+			unsigned int minX = x > 0 ? x - 1 : 0;
+			unsigned int maxX = std::min(x + 1, m_width - 1);
+			for(unsigned int j = minY; j <= maxY; j++)
+			{
+				for(unsigned int i = minX; i <= maxX; i++)
+				{
+					neighboursConverged = neighboursConverged &&
+						converged[i + j * m_width];
+				}
+			}
+			if(neighboursConverged)
+			{
+				m_active[index] = 0;
+				continue;
+			}
+			numActive++;
+		}
+	}
+	return numActive;
+}
+
+uint64_t Accumulator::GetTotalSamples() const
+{
+	uint64_t result = 0;
+	for(size_t i = 0; i < m_pixels.size(); i++)
+	{
+		result += m_pixels[i].numSamples;
+	}
+	return result;
+}
+
+void Accumulator::Draw(Bitmap* display, float exposure) const
+{
+	for(unsigned int y = 0; y < m_height; y++)
+	{
+		for(unsigned int x = 0; x < m_width; x++)
+		{
+			const Pixel& pixel = m_pixels[x + y * m_width];
+			Vector3f color(0.0f, 0.0f, 0.0f);
+			if(pixel.numSamples != 0)
+			{
+				color = pixel.sum * (1.0f / (float)pixel.numSamples);
+			}
+			display->DrawPixel(x, y, color, exposure);
+		}
+	}
+}
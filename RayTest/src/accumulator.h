@@ -0,0 +1,71 @@
+#ifndef ACCUMULATOR_H_INCLUDED
+#define ACCUMULATOR_H_INCLUDED
+
+#include "bitmap.h"
+#include "math3d.h"
+
+#include <stdint.h>
+#include <vector>
+
+// The samples of a progressive render so far. Each pixel keeps the sum of
+// its samples, and the running mean and variance of their luminance by
+// Welford's method, so that it can tell when its mean is known well enough.
+// Threads may add samples at once to different pixels, but UpdateActive must
+// run by itself between passes.
+class Accumulator
+{
+public:
+	Accumulator(unsigned int width, unsigned int height);
+
+	void AddSample(unsigned int x, unsigned int y, const Vector3f& color);
+
+	// Whether the pixel has minSamples, and the standard error of its mean
+	// luminance is no more than maxError times the mean, or times
+	// MIN_LUMINANCE where it's darker
+	bool IsConverged(unsigned int x, unsigned int y, unsigned int minSamples,
+			float maxError) const;
+
+	// Stops sampling pixels that have maxSamples, or that have converged
+	// along with every pixel next to them, so that a rare bright sample one
+	// pixel missed still gets found by its neighbours. Pixels that stop never
+	// start again. Returns how many are still active.
+	unsigned int UpdateActive(unsigned int minSamples, unsigned int maxSamples,
+			float maxError);
+	inline bool IsActive(unsigned int x, unsigned int y) const
+	{
+		return m_active[x + y * m_width] != 0;
+	}
+
+	inline unsigned int GetNumSamples(unsigned int x, unsigned int y) const
+	{
+		return m_pixels[x + y * m_width].numSamples;
+	}
+	uint64_t GetTotalSamples() const;
+	inline unsigned int GetNumPasses() const { return m_numPasses; }
+	inline void AddPass() { m_numPasses++; }
+	inline unsigned int GetWidth() const { return m_width; }
+	inline unsigned int GetHeight() const { return m_height; }
+
+	// Draws the mean of every pixel, or black where there's no sample yet
+	void Draw(Bitmap* display, float exposure) const;
+private:
+	// Errors are relative to at least this, as noise in the darkest pixels
+	// can't be seen however large it is next to their mean
+	static const float MIN_LUMINANCE;
+
+	struct Pixel
+	{
+		Vector3f sum;
+		float mean;
+		float m2;
+		unsigned int numSamples;
+	};
+
+	std::vector<Pixel> m_pixels;
+	std::vector<unsigned char> m_active;
+	unsigned int m_width;
+	unsigned int m_height;
+	unsigned int m_numPasses;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include "bvh.h"
+
+#include <algorithm>
+
+// Costs the surface area heuristic weighs, relative to each other
+static const float TRAVERSAL_COST = 1.0f;
+static const float INTERSECT_COST = 1.0f;
+// Centroids are sorted into this many bins along each axis, and the splits
+// between bins are the only ones tried
+static const unsigned int NUM_BINS = 16;
+// Leaves are split past this size, or the batch size if that's larger, even
+// where the heuristic says not to
+static const uint32_t MAX_LEAF_SIZE = 8;
+
+void BVH::Build(const std::vector<BVHBounds>& bounds, uint32_t batchSize)
+{
+	m_batchSize = std::max(batchSize, 1u);
+	m_nodes.clear();
+	m_indices.clear();
+	if(bounds.empty())
+	{
+		return;
+	}
+
+	std::vector<Vector3f> centroids(bounds.size());
+	m_indices.resize(bounds.size());
+	for(size_t i = 0; i < bounds.size(); i++)
+	{
+		centroids[i] = Vector3f(
+				(bounds[i].min[0] + bounds[i].max[0]) * 0.5f,
+				(bounds[i].min[1] + bounds[i].max[1]) * 0.5f,
+				(bounds[i].min[2] + bounds[i].max[2]) * 0.5f);
+		m_indices[i] = (uint32_t)i;
+	}
+
+	// A binary tree with n leaves has 2n - 1 nodes
+	m_nodes.reserve(bounds.size() * 2);
+	Node root;
+	root.first = 0;
+	root.count = (uint32_t)bounds.size();
+	m_nodes.push_back(root);
+	Subdivide(0, bounds, centroids, 1);
+}
+
+void BVH::Subdivide(uint32_t nodeIndex, const std::vector<BVHBounds>& bounds,
+		const std::vector<Vector3f>& centroids, unsigned int depth)
+{
+	uint32_t first = m_nodes[nodeIndex].first;
+	uint32_t count = m_nodes[nodeIndex].count;
+
+	BVHBounds nodeBounds = BVHBounds::Empty();
+	BVHBounds centroidBounds = BVHBounds::Empty();
+	for(uint32_t i = first; i < first + count; i++)
+	{
+		const Vector3f& centroid = centroids[m_indices[i]];
+		BVHBounds point = { { centroid[0], centroid[1], centroid[2] },
+			{ centroid[0], centroid[1], centroid[2] } };
+		nodeBounds.Grow(bounds[m_indices[i]]);
+		centroidBounds.Grow(point);
+	}
+	m_nodes[nodeIndex].bounds = nodeBounds;
+
+	if(count == 1 || depth == MAX_DEPTH)
+	{
+		return;
+	}
+
+	// Finds the cheapest split between bins on any axis
+	float leafCost = INTERSECT_COST * GetNumBatches(count);
+	float bestCost = FLT_MAX;
+	unsigned int bestAxis = 0;
+	unsigned int bestSplit = 0;
+	for(unsigned int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+		if(extent <= 0.0f)
+		{
+			continue;
+		}
+
+		BVHBounds binBounds[NUM_BINS];
+		uint32_t binCounts[NUM_BINS] = { 0 };
+		for(unsigned int i = 0; i < NUM_BINS; i++)
+		{
+			binBounds[i] = BVHBounds::Empty();
+		}
+
+		float scale = (float)NUM_BINS / extent;
+		for(uint32_t i = first; i < first + count; i++)
+		{
+			float offset = centroids[m_indices[i]][axis] - centroidBounds.min[axis];
+			unsigned int bin = std::min((unsigned int)(offset * scale), NUM_BINS - 1);
+			binCounts[bin]++;
+			binBounds[bin].Grow(bounds[m_indices[i]]);
+		}
+
+		// Sweeps from the right for the area of every right side, then from
+		// the left costing every split
+		float rightAreas[NUM_BINS];
+		uint32_t rightCounts[NUM_BINS];
+		BVHBounds side = BVHBounds::Empty();
+		uint32_t sideCount = 0;
+		for(unsigned int i = NUM_BINS - 1; i > 0; i--)
+		{
+			side.Grow(binBounds[i]);
+			sideCount += binCounts[i];
+			rightAreas[i] = side.HalfArea();
+			rightCounts[i] = sideCount;
+		}
+
+		side = BVHBounds::Empty();
+		sideCount = 0;
+		for(unsigned int split = 1; split < NUM_BINS; split++)
+		{
+			side.Grow(binBounds[split - 1]);
+			sideCount += binCounts[split - 1];
+			if(sideCount == 0 || rightCounts[split] == 0)
+			{
+				continue;
+			}
+
+			float cost = TRAVERSAL_COST + INTERSECT_COST *
+				(side.HalfArea() * GetNumBatches(sideCount) +
+				 rightAreas[split] * GetNumBatches(rightCounts[split])) /
+				nodeBounds.HalfArea();
+			if(cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = split;
+			}
+		}
+	}
+
+	// No split where every centroid is in one place
+	if(bestCost == FLT_MAX || (bestCost >= leafCost &&
+				count <= std::max(MAX_LEAF_SIZE, m_batchSize)))
+	{
+		return;
+	}
+
+	float axisMin = centroidBounds.min[bestAxis];
+	float scale = (float)NUM_BINS / (centroidBounds.max[bestAxis] - axisMin);
+	uint32_t* middle = std::partition(&m_indices[first], &m_indices[first] + count,
+			[&](uint32_t index)
+	{
+		float offset = centroids[index][bestAxis] - axisMin;
+		return std::min((unsigned int)(offset * scale), NUM_BINS - 1) < bestSplit;
+	});
+	uint32_t leftCount = (uint32_t)(middle - &m_indices[first]);
+
+	uint32_t leftIndex = (uint32_t)m_nodes.size();
+	Node left;
+	left.first = first;
+	left.count = leftCount;
+	Node right;
+	right.first = first + leftCount;
+	right.count = count - leftCount;
+	m_nodes.push_back(left);
+	m_nodes.push_back(right);
+
+	m_nodes[nodeIndex].first = leftIndex;
+	m_nodes[nodeIndex].count = 0;
+	Subdivide(leftIndex, bounds, centroids, depth + 1);
+	Subdivide(leftIndex + 1, bounds, centroids, depth + 1);
+}
@@ -0,0 +1,259 @@
+#ifndef BVH_H_INCLUDED
+#define BVH_H_INCLUDED
+
+#include "math3d.h"
+
+#include <float.h>
+#include <stdint.h>
+#include <vector>
+
+struct BVHBounds
+{
+	float min[3];
+	float max[3];
+
+	inline void Grow(const BVHBounds& r)
+	{
+		for(unsigned int i = 0; i < 3; i++)
+		{
+			min[i] = std::min(min[i], r.min[i]);
+			max[i] = std::max(max[i], r.max[i]);
+		}
+	}
+
+	inline float HalfArea() const
+	{
+		float x = max[0] - min[0];
+		float y = max[1] - min[1];
+		float z = max[2] - min[2];
+		return x * y + y * z + z * x;
+	}
+
+	static inline BVHBounds Empty()
+	{
+		BVHBounds result;
+		for(unsigned int i = 0; i < 3; i++)
+		{
+			result.min[i] = FLT_MAX;
+			result.max[i] = -FLT_MAX;
+		}
+		return result;
+	}
+};
+
+// Bounds on a packet of rays from one origin, from the inverses of their
+// directions, which a box is tested against for all of them at once. Axes
+// that the directions aren't all on the same side of bound nothing.
+struct BVHFrustum
+{
+	float origin[3];
+	float invDirectionMin[3];
+	float invDirectionMax[3];
+	bool bounded[3];
+
+	BVHFrustum(const float originIn[3], const float* const directions[3],
+			unsigned int count)
+	{
+		for(unsigned int i = 0; i < 3; i++)
+		{
+			origin[i] = originIn[i];
+			invDirectionMin[i] = FLT_MAX;
+			invDirectionMax[i] = -FLT_MAX;
+			unsigned int numPositive = 0;
+			unsigned int numNegative = 0;
+			for(unsigned int j = 0; j < count; j++)
+			{
+				numPositive += directions[i][j] > 0.0f;
+				numNegative += directions[i][j] < 0.0f;
+				float invDirection = 1.0f / directions[i][j];
+				invDirectionMin[i] = std::min(invDirectionMin[i], invDirection);
+				invDirectionMax[i] = std::max(invDirectionMax[i], invDirection);
+			}
+			bounded[i] = numPositive == count || numNegative == count;
+		}
+	}
+
+	// No more than where any of the rays enters the box, or FLT_MAX if none
+	// does before tMax
+	inline float IntersectBounds(const BVHBounds& bounds, float tMax) const
+	{
+		float tEnter = 0.0f;
+		float tExit = tMax;
+		for(unsigned int i = 0; i < 3; i++)
+		{
+			if(!bounded[i])
+			{
+				continue;
+			}
+
+			bool positive = invDirectionMin[i] > 0.0f;
+			float nearSide = (positive ? bounds.min[i] : bounds.max[i]) - origin[i];
+			float farSide = (positive ? bounds.max[i] : bounds.min[i]) - origin[i];
+			tEnter = std::max(tEnter, std::min(nearSide * invDirectionMin[i],
+						nearSide * invDirectionMax[i]));
+			tExit = std::min(tExit, std::max(farSide * invDirectionMin[i],
+						farSide * invDirectionMax[i]));
+		}
+		return tEnter <= tExit ? tEnter : FLT_MAX;
+	}
+};
+
+// Bounding volume hierarchy over any primitives that have bounds, split by
+// the surface area heuristic. Every leaf holds a run of positions in
+// GetOrder, so primitives stored in that order are tested together.
+class BVH
+{
+public:
+	BVH() : m_batchSize(1) {}
+
+	// Leaves are costed by how many batches of batchSize primitives they
+	// hold, for primitives that are tested that many at a time
+	void Build(const std::vector<BVHBounds>& bounds, uint32_t batchSize = 1);
+
+	// Indices in the bounds the BVH was built from, in the order the leaves
+	// hold them
+	inline const std::vector<uint32_t>& GetOrder() const { return m_indices; }
+
+	// Visits the leaves the ray reaches before *tMax, nearest child first,
+	// calling visit(first, count, tMax) with the run of positions in GetOrder
+	// each holds. visit may lower *tMax, and returns whether to stop, which
+	// is what Traverse then returns.
+	template<typename VisitFunc>
+	bool Traverse(const Vector3f& originIn, const Vector3f& direction,
+			float* tMax, VisitFunc visit) const
+	{
+		float origin[3] = { originIn.GetX(), originIn.GetY(), originIn.GetZ() };
+		float invDirection[3] = {
+			1.0f / direction.GetX(),
+			1.0f / direction.GetY(),
+			1.0f / direction.GetZ() };
+
+		return TraverseBounds([&](const BVHBounds& bounds, float tLimit)
+		{
+			return IntersectBounds(bounds, origin, invDirection, tLimit);
+		}, tMax, visit);
+	}
+
+	// As above, for the leaves any ray of the frustum might reach, where
+	// *tMax is the furthest any of them still looks
+	template<typename VisitFunc>
+	bool Traverse(const BVHFrustum& frustum, float* tMax, VisitFunc visit) const
+	{
+		return TraverseBounds([&](const BVHBounds& bounds, float tLimit)
+		{
+			return frustum.IntersectBounds(bounds, tLimit);
+		}, tMax, visit);
+	}
+
+	inline size_t GetNumNodes() const { return m_nodes.size(); }
+private:
+	// Nodes with a count are leaves, holding that many indices from first
+	// on. The children of the others are next to each other, from first on.
+	struct Node
+	{
+		BVHBounds bounds;
+		uint32_t first;
+		uint32_t count;
+	};
+
+	// Enough for any tree, as it's never built deeper
+	static const unsigned int MAX_DEPTH = 64;
+
+	std::vector<Node> m_nodes;
+	std::vector<uint32_t> m_indices;
+	uint32_t m_batchSize;
+
+	inline float GetNumBatches(uint32_t count) const
+	{
+		return (float)((count + m_batchSize - 1) / m_batchSize);
+	}
+
+	void Subdivide(uint32_t nodeIndex, const std::vector<BVHBounds>& bounds,
+			const std::vector<Vector3f>& centroids, unsigned int depth);
+
+	// Distance to where the ray enters the box, or FLT_MAX if it doesn't
+	// before tMax
+	static inline float IntersectBounds(const BVHBounds& bounds,
+			const float origin[3], const float invDirection[3], float tMax)
+	{
+		float tEnter = 0.0f;
+		float tExit = tMax;
+		for(unsigned int i = 0; i < 3; i++)
+		{
+			float t0 = (bounds.min[i] - origin[i]) * invDirection[i];
+			float t1 = (bounds.max[i] - origin[i]) * invDirection[i];
+			tEnter = std::max(tEnter, std::min(t0, t1));
+			tExit = std::min(tExit, std::max(t0, t1));
+		}
+		return tEnter <= tExit ? tEnter : FLT_MAX;
+	}
+
+	// The traversal both Traverses share, given how far along the ray or
+	// rays a box is entered, or FLT_MAX where it isn't before the limit
+	template<typename IntersectFunc, typename VisitFunc>
+	bool TraverseBounds(IntersectFunc intersect, float* tMax,
+			VisitFunc visit) const
+	{
+		if(m_nodes.empty())
+		{
+			return false;
+		}
+
+		if(intersect(m_nodes[0].bounds, *tMax) == FLT_MAX)
+		{
+			return false;
+		}
+
+		// Far children, with where the ray enters them, which may be past
+		// the nearest hit by the time they're popped
+		const Node* stack[MAX_DEPTH];
+		float stackT[MAX_DEPTH];
+		unsigned int stackSize = 0;
+		const Node* node = &m_nodes[0];
+		for(;;)
+		{
+			if(node->count > 0)
+			{
+				if(visit(node->first, node->count, tMax))
+				{
+					return true;
+				}
+				node = NULL;
+			}
+			else
+			{
+				const Node* nearChild = &m_nodes[node->first];
+				const Node* farChild = &m_nodes[node->first + 1];
+				float tNear = intersect(nearChild->bounds, *tMax);
+				float tFar = intersect(farChild->bounds, *tMax);
+				if(tFar < tNear)
+				{
+					std::swap(nearChild, farChild);
+					std::swap(tNear, tFar);
+				}
+
+				node = tNear != FLT_MAX ? nearChild : NULL;
+				if(tFar != FLT_MAX)
+				{
+					stack[stackSize] = farChild;
+					stackT[stackSize++] = tFar;
+				}
+			}
+
+			while(node == NULL)
+			{
+				if(stackSize == 0)
+				{
+					return false;
+				}
+				stackSize--;
+				if(stackT[stackSize] <= *tMax)
+				{
+					node = stack[stackSize];
+				}
+			}
+		}
+	}
+};
+
+#endif
@@ -1,8 +1,18 @@
+#include "accumulator.h"
 #include "bitmap.h"
+#include "bvh.h"
 #include "math3d.h"
+#include "random.h"
+#include "sphereSet.h"
+#include "tileScheduler.h"
 
 #include <iostream>
+#include <assert.h>
+#include <chrono>
 #include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <vector>
 
 struct Camera
@@ -13,6 +23,20 @@ struct Camera
 	float exposure;
 };
 
+// How a progressive render goes. Every pass adds a sample to each pixel
+// still to be sampled, until it has at least minSamples, and either the
+// standard error of its mean is below maxError relative to the mean, or it
+// has maxSamples.
+struct ProgressiveSettings
+{
+	unsigned int minSamples;
+	unsigned int maxSamples;
+	float maxError;
+	// Passes between saving the image so far, or 0 for never
+	unsigned int snapshotInterval;
+	std::string snapshotFileName;
+};
+
 class Ray
 {
 public:
@@ -179,11 +203,6 @@ private:
 	float m_reflectivity;
 };
 
-static float Randf()
-{
-	return (float)rand()/RAND_MAX;
-}
-
 class Sphere
 {
 public:
@@ -223,10 +242,10 @@ public:
 		return (surfaceLoc - m_center).Normalized();
 	}
 
-	Vector3f GetRandomDirectionFromPoint(const Vector3f& point) const
+	Vector3f GetRandomDirectionFromPoint(const Vector3f& point, Random& random) const
 	{
-		float r1 = Randf();
-		float r2 = Randf();
+		float r1 = random.NextFloat();
+		float r2 = random.NextFloat();
 		r1 *= 2.0f * (float)MATH_PI;
 		r2 = acosf(2.0f * r2 - 1.0f);
 
@@ -238,6 +257,19 @@ public:
 		return ((randomDir.Normalized() * m_radius + m_center) - point).Normalized();
 	}
 
+	BVHBounds GetBounds() const
+	{
+		BVHBounds result;
+		for(unsigned int i = 0; i < 3; i++)
+		{
+			result.min[i] = m_center[i] - m_radius;
+			result.max[i] = m_center[i] + m_radius;
+		}
+		return result;
+	}
+
+	inline const Vector3f& GetCenter() const { return m_center; }
+	inline float GetRadius() const { return m_radius; }
 	inline const Material& GetMaterial() const { return m_material; }
 private:
 	Vector3f m_center;
@@ -260,9 +292,11 @@ public:
 		m_camera(camera),
 		m_background(&background),
 		m_maxTraceDepth(maxTraceDepth),
-		m_samples(samples) {}
+		m_samples(samples),
+		m_finalized(false) {}
 	void AddSphere(const Sphere& sphere) 
 	{
+		m_finalized = false;
 		if(sphere.GetMaterial().GetEmissionColor().Length() != 0.0f)
 		{
 			m_spheres[SPHERE_TYPE_LIGHT].push_back(sphere);
@@ -273,22 +307,311 @@ public:
 		}
 	}
 
-	void Render(Bitmap* display) const
+	// Builds the BVH over the spheres, and stores them in its order for the
+	// kernels, which must be done after the last AddSphere and before any
+	// ray is traced
+	void Finalize()
+	{
+		std::vector<const Sphere*> spheres;
+		std::vector<BVHBounds> bounds;
+		for(size_t j = 0; j < SPHERE_TYPE_SIZE; j++)
+		{
+			for(size_t i = 0; i < m_spheres[j].size(); i++)
+			{
+				spheres.push_back(&m_spheres[j][i]);
+				bounds.push_back(m_spheres[j][i].GetBounds());
+			}
+		}
+
+		m_bvh.Build(bounds, SphereSet::GetKernelWidth(SphereSet::GetKernel()));
+
+		// Lights come after the other spheres in what the BVH was built from
+		const std::vector<uint32_t>& order = m_bvh.GetOrder();
+		size_t firstLight = m_spheres[SPHERE_TYPE_NORMAL].size();
+		m_bvhSpheres.clear();
+		m_sphereSet.Clear();
+		m_lightPositions.assign(m_spheres[SPHERE_TYPE_LIGHT].size(), 0);
+		for(size_t i = 0; i < order.size(); i++)
+		{
+			const Sphere* sphere = spheres[order[i]];
+			m_bvhSpheres.push_back(sphere);
+			m_sphereSet.Add(sphere->GetCenter(), sphere->GetRadius());
+			if(order[i] >= firstLight)
+			{
+				m_lightPositions[order[i] - firstLight] = (uint32_t)i;
+			}
+		}
+		m_finalized = true;
+	}
+
+	// Renders on the given number of threads, or on every core for 0. The
+	// image only depends on the seed, as every tile seeds its own generator.
+	void Render(Bitmap* display, unsigned int numThreads = 0,
+			uint64_t seed = 0) const
+	{
+		assert(m_finalized);
+		TileScheduler scheduler(display->GetWidth(), display->GetHeight(),
+				TILE_SIZE, numThreads);
+
+		scheduler.Run([&](const Tile& tile, unsigned int threadIndex)
+		{
+			(void)threadIndex;
+			Random random(seed * scheduler.GetNumTiles() + tile.index);
+			RenderTile(display, tile, random);
+		});
+	}
+
+	// Adds a sample to every pixel of the accumulator that's still active,
+	// after first stopping those that are done, and returns how many were
+	// added, which is 0 once there's nothing left to do. Passes can be
+	// stopped after any one, and carried on from there. As with Render, the
+	// image only depends on the seed.
+	uint64_t RenderPass(Accumulator* accumulator,
+			const ProgressiveSettings& settings, unsigned int numThreads = 0,
+			uint64_t seed = 0) const
+	{
+		assert(m_finalized);
+		if(accumulator->UpdateActive(settings.minSamples, settings.maxSamples,
+					settings.maxError) == 0)
+		{
+			return 0;
+		}
+		TileScheduler scheduler(accumulator->GetWidth(), accumulator->GetHeight(),
+				TILE_SIZE, numThreads);
+
+		std::vector<uint64_t> numSamples(scheduler.GetNumThreads(), 0);
+		uint64_t pass = accumulator->GetNumPasses();
+		scheduler.Run([&](const Tile& tile, unsigned int threadIndex)
+		{
+			Random random((pass << 32) + seed * scheduler.GetNumTiles() + tile.index);
+			numSamples[threadIndex] += RenderTilePass(accumulator, tile, random);
+		});
+		uint64_t result = 0;
+		for(size_t i = 0; i < numSamples.size(); i++)
+		{
+			result += numSamples[i];
+		}
+		if(result != 0)
+		{
+			accumulator->AddPass();
+		}
+		return result;
+	}
+
+	// Renders passes from wherever the accumulator is up to, until every
+	// pixel has converged or has maxSamples, saving what there is so far
+	// every snapshotInterval passes, and draws the result
+	void RenderProgressive(Bitmap* display, Accumulator* accumulator,
+			const ProgressiveSettings& settings, unsigned int numThreads = 0,
+			uint64_t seed = 0) const
+	{
+		while(RenderPass(accumulator, settings, numThreads, seed) != 0)
+		{
+			if(settings.snapshotInterval != 0 &&
+					accumulator->GetNumPasses() % settings.snapshotInterval == 0)
+			{
+				accumulator->Draw(display, m_camera.exposure);
+				display->Save(settings.snapshotFileName);
+			}
+		}
+		accumulator->Draw(display, m_camera.exposure);
+	}
+	NearestIntersection FindNearestIntersection(const Ray& ray) const
+	{
+		float origin[3];
+		float direction[3];
+		ToArrays(ray, origin, direction);
+
+		NearestIntersection result;
+		result.t = FLT_MAX;
+		result.sphere = NULL;
+		uint32_t index;
+		if(m_bvhSpheres.size() < MIN_BVH_SPHERES)
+		{
+			m_sphereSet.FindNearest(origin, direction, 0, m_sphereSet.GetSize(),
+					SphereSet::NONE, &result.t, &index);
+		}
+		else
+		{
+			m_bvh.Traverse(ray.GetOrigin(), ray.GetDirection(), &result.t,
+					[&](uint32_t first, uint32_t count, float* tMax)
+			{
+				m_sphereSet.FindNearest(origin, direction, first, count,
+						SphereSet::NONE, tMax, &index);
+				return false;
+			});
+		}
+
+		if(result.t != FLT_MAX)
+		{
+			result.sphere = m_bvhSpheres[index];
+		}
+		return result;
+	}
+
+	// As FindNearestIntersection for each of up to a packet of rays, which
+	// must all leave the same point. They're traced together, down to the
+	// leaves of the BVH any of them might reach.
+	void FindNearestIntersections(const Ray* rays, unsigned int numRays,
+			NearestIntersection* results) const
+	{
+		assert(numRays > 0 && numRays <= RayPacket::SIZE);
+
+		RayPacket packet;
+		float tNear[RayPacket::SIZE];
+		uint32_t index[RayPacket::SIZE];
+		for(unsigned int i = 0; i < 3; i++)
+		{
+			packet.origin[i] = rays[0].GetOrigin()[i];
+		}
+		for(unsigned int lane = 0; lane < RayPacket::SIZE; lane++)
+		{
+			const Ray& ray = rays[std::min(lane, numRays - 1)];
+			assert(ray.GetOrigin() == rays[0].GetOrigin());
+			for(unsigned int i = 0; i < 3; i++)
+			{
+				packet.direction[i][lane] = ray.GetDirection()[i];
+			}
+			tNear[lane] = FLT_MAX;
+			index[lane] = SphereSet::NONE;
+		}
+
+		if(m_bvhSpheres.size() < MIN_BVH_SPHERES)
+		{
+			m_sphereSet.FindNearestPacket(packet, 0, m_sphereSet.GetSize(),
+					tNear, index);
+		}
+		else
+		{
+			const float* directions[3] = {
+				packet.direction[0], packet.direction[1], packet.direction[2] };
+			BVHFrustum frustum(packet.origin, directions, RayPacket::SIZE);
+			float tMax = FLT_MAX;
+			m_bvh.Traverse(frustum, &tMax,
+					[&](uint32_t first, uint32_t count, float* tLimit)
+			{
+				m_sphereSet.FindNearestPacket(packet, first, count, tNear, index);
+				*tLimit = *std::max_element(tNear, tNear + RayPacket::SIZE);
+				return false;
+			});
+		}
+
+		for(unsigned int lane = 0; lane < numRays; lane++)
+		{
+			results[lane].t = tNear[lane];
+			results[lane].sphere = tNear[lane] != FLT_MAX ?
+				m_bvhSpheres[index[lane]] : NULL;
+		}
+	}
+
+	// Tests every sphere one at a time, which is what the BVH and the
+	// kernels are checked against
+	NearestIntersection FindNearestIntersectionBruteForce(const Ray& ray) const
+	{
+		float tNear = FLT_MAX;
+		const Sphere* sphere = NULL;
+		for(size_t j = 0; j < SPHERE_TYPE_SIZE; j++)
+		{
+			for(size_t i = 0; i < m_spheres[j].size(); i++)
+			{
+				float tCurrent = m_spheres[j][i].IntersectRay(ray);
+				if(tCurrent < tNear)
+				{
+					tNear = tCurrent;
+					sphere = &m_spheres[j][i];
+				}
+			}
+		}
+
+		NearestIntersection result;
+		result.t = tNear;
+		result.sphere = sphere;
+		return result;
+	}
+
+	inline size_t GetNumBVHNodes() const { return m_bvh.GetNumNodes(); }
+
+	// Whether any sphere but the one at the excluded position in the BVH's
+	// order, if any, is hit before tMax
+	bool IsOccluded(const Ray& ray, float tMax,
+			uint32_t excluded = SphereSet::NONE) const
+	{
+		float origin[3];
+		float direction[3];
+		ToArrays(ray, origin, direction);
+
+		uint32_t index;
+		if(m_bvhSpheres.size() < MIN_BVH_SPHERES)
+		{
+			return m_sphereSet.FindNearest(origin, direction, 0,
+					m_sphereSet.GetSize(), excluded, &tMax, &index);
+		}
+
+		return m_bvh.Traverse(ray.GetOrigin(), ray.GetDirection(), &tMax,
+				[&](uint32_t first, uint32_t count, float* tLimit)
+		{
+			return m_sphereSet.FindNearest(origin, direction, first, count,
+					excluded, tLimit, &index);
+		});
+	}
+private:
+	static const unsigned int TILE_SIZE = 16;
+	// Below this, testing every sphere beats traversing the BVH
+	static const size_t MIN_BVH_SPHERES = 32;
+
+	// Where the rays through points on an image of the given size go
+	struct ImagePlane
+	{
+		float aspect;
+		float invWidth;
+		float invHeight;
+		float tanHalfFOV;
+
+		ImagePlane(const Camera& camera, unsigned int widthIn, unsigned int heightIn)
+		{
+			float width = (float)widthIn;
+			float height = (float)heightIn;
+			aspect = width/height;
+			invWidth = 1.0f/width;
+			invHeight = 1.0f/height;
+			tanHalfFOV = (float)tan(0.5*camera.fov);
+		}
+
+		// Through the point the given number of pixels from the top left
+		inline Vector3f GetDirection(float x, float y) const
+		{
+			float dirX = (2 * (x * invWidth) - 1) * tanHalfFOV * aspect;
+			float dirY = (1 - 2 * (y * invHeight)) * tanHalfFOV;
+			return Vector3f(dirX, dirY, -1).Normalized();
+		}
+	};
+
+	// Moves where the ray leaves the camera, keeping the point it's aimed at
+	// in focus
+	Ray GetDepthOfFieldRay(const Vector3f& direction, Random& random) const
+	{
+		Vector3f disturbance(
+				m_camera.depthOfField * random.NextFloat(),
+				m_camera.depthOfField * random.NextFloat(), 0.0f);
+
+		Vector3f aimedPoint = m_camera.pos + direction;
+		Vector3f origin = m_camera.pos + disturbance;
+		return Ray(origin, (aimedPoint - origin).Normalized());
+	}
+
+	void RenderTile(Bitmap* display, const Tile& tile, Random& random) const
 	{
 		float sampleFactor = 1.0f/(float)m_samples;
 		float sampleFactorSqrt = sqrtf(sampleFactor);
+		ImagePlane plane(m_camera, display->GetWidth(), display->GetHeight());
+
+		// Rays from a pinhole camera all leave the same point, so each
+		// pixel's are traced in packets
+		std::vector<Ray> rays;
 		
-		float width = (float)display->GetWidth();
-		float height = (float)display->GetHeight();
-		float aspect = width/height;
-		float invWidth = 1.0f/width;
-		float invHeight = 1.0f/height;
-		float fov = m_camera.fov;
-		float tanHalfFOV = (float)tan(0.5*fov);
-		
-		for(unsigned int j = 0; j < display->GetHeight(); j++)
+		for(unsigned int j = tile.y; j < tile.y + tile.height; j++)
 		{
-			for(unsigned int i = 0; i < display->GetWidth(); i++)	
+			for(unsigned int i = tile.x; i < tile.x + tile.width; i++)	
 			{
 				Vector3f color(0.0f, 0.0f, 0.0f);
 
@@ -296,34 +619,108 @@ public:
 				{
 					for(float ii = (float)i; ii < (float)(i + 1); ii += sampleFactorSqrt)
 					{
-						float x = (2 * ((ii + sampleFactorSqrt / 2.0f) * invWidth) - 1)
-							* tanHalfFOV * aspect;
-						float y = (1 - 2 * ((jj + sampleFactorSqrt / 2.0f) * invHeight))
-							* tanHalfFOV;
-
-						Vector3f origin = m_camera.pos;
-						Vector3f direction = Vector3f(x, y, -1).Normalized();
-
-						if(m_camera.depthOfField != 0.0f)
+						Vector3f direction = plane.GetDirection(
+								ii + sampleFactorSqrt / 2.0f, jj + sampleFactorSqrt / 2.0f);
+						if(m_camera.depthOfField == 0.0f)
 						{
-							Vector3f disturbance(
-									m_camera.depthOfField * Randf(),
-									m_camera.depthOfField * Randf(), 0.0f);
-
-							Vector3f aimedPoint = origin + direction;
-							origin = origin + disturbance;
-							direction = (aimedPoint - origin).Normalized();
+							rays.push_back(Ray(m_camera.pos, direction));
+							continue;
 						}
 
-						color += Trace(Ray(origin, direction), 0) * sampleFactor;
+						color += Trace(GetDepthOfFieldRay(direction, random), 0, random)
+							* sampleFactor;
 					}
 				}
 
+				// Only the first hits are found together. The rays go
+				// their own ways from there.
+				for(size_t k = 0; k < rays.size(); k += RayPacket::SIZE)
+				{
+					unsigned int numRays = (unsigned int)std::min(
+							rays.size() - k, (size_t)RayPacket::SIZE);
+					NearestIntersection hits[RayPacket::SIZE];
+					FindNearestIntersections(&rays[k], numRays, hits);
+					for(unsigned int l = 0; l < numRays; l++)
+					{
+						color += Shade(rays[k + l], hits[l], 0, random) * sampleFactor;
+					}
+				}
+				rays.clear();
+
 				display->DrawPixel(i, j, color, m_camera.exposure);
 			}
 		}
 	}
-private:
+
+	// The digits of the index in the base, mirrored about the point, which
+	// spreads any number of indices from 0 on evenly over [0, 1)
+	static float RadicalInverse(unsigned int index, unsigned int base)
+	{
+		float result = 0.0f;
+		float digitScale = 1.0f / (float)base;
+		for(; index != 0; index /= base)
+		{
+			result += (float)(index % base) * digitScale;
+			digitScale /= (float)base;
+		}
+		return result;
+	}
+
+	// Adds a sample to each pixel of the tile that's still active, and
+	// returns how many were added
+	unsigned int RenderTilePass(Accumulator* accumulator, const Tile& tile,
+			Random& random) const
+	{
+		ImagePlane plane(m_camera, accumulator->GetWidth(), accumulator->GetHeight());
+
+		// Pixels from a pinhole camera, in packets of neighbours, as in
+		// RenderTile
+		std::vector<Ray> rays;
+		std::vector<unsigned int> rayPixels;
+		unsigned int numSamples = 0;
+		for(unsigned int j = tile.y; j < tile.y + tile.height; j++)
+		{
+			for(unsigned int i = tile.x; i < tile.x + tile.width; i++)
+			{
+				if(!accumulator->IsActive(i, j))
+				{
+					continue;
+				}
+				unsigned int sample = accumulator->GetNumSamples(i, j);
+
+				// Each pixel's samples go where the Halton sequence puts them
+				Vector3f direction = plane.GetDirection(
+						i + RadicalInverse(sample, 2), j + RadicalInverse(sample, 3));
+				if(m_camera.depthOfField == 0.0f)
+				{
+					rays.push_back(Ray(m_camera.pos, direction));
+					rayPixels.push_back(i + j * accumulator->GetWidth());
+					continue;
+				}
+
+				accumulator->AddSample(i, j,
+						Trace(GetDepthOfFieldRay(direction, random), 0, random));
+				numSamples++;
+			}
+		}
+
+		for(size_t k = 0; k < rays.size(); k += RayPacket::SIZE)
+		{
+			unsigned int numRays = (unsigned int)std::min(
+					rays.size() - k, (size_t)RayPacket::SIZE);
+			NearestIntersection hits[RayPacket::SIZE];
+			FindNearestIntersections(&rays[k], numRays, hits);
+			for(unsigned int l = 0; l < numRays; l++)
+			{
+				unsigned int pixel = rayPixels[k + l];
+				accumulator->AddSample(pixel % accumulator->GetWidth(),
+						pixel / accumulator->GetWidth(),
+						Shade(rays[k + l], hits[l], 0, random));
+			}
+		}
+		return numSamples + (unsigned int)rays.size();
+	}
+
 	enum
 	{
 		SPHERE_TYPE_NORMAL,
@@ -336,40 +733,39 @@ private:
 	const Cubemap* m_background;
 	unsigned int m_maxTraceDepth;
 	unsigned int m_samples;
-
-	NearestIntersection FindNearestIntersection(const Ray& ray) const
+	// Every sphere, in the BVH's order, and their shapes as the kernels
+	// read them
+	std::vector<const Sphere*> m_bvhSpheres;
+	SphereSet m_sphereSet;
+	// Where each light is in that order
+	std::vector<uint32_t> m_lightPositions;
+	BVH m_bvh;
+	bool m_finalized;
+
+	static inline void ToArrays(const Ray& ray, float origin[3],
+			float direction[3])
 	{
-		float tNear = FLT_MAX;
-		const Sphere* sphere = NULL;
-		for(size_t j = 0; j < SPHERE_TYPE_SIZE; j++)
+		for(unsigned int i = 0; i < 3; i++)
 		{
-			for(size_t i = 0; i < m_spheres[j].size(); i++)
-			{
-				float tCurrent = m_spheres[j][i].IntersectRay(ray);
-				if(tCurrent < tNear)
-				{
-					tNear = tCurrent;
-					sphere = &m_spheres[j][i];
-				}
-			}
+			origin[i] = ray.GetOrigin()[i];
+			direction[i] = ray.GetDirection()[i];
 		}
-
-		NearestIntersection result;
-		result.t = tNear;
-		result.sphere = sphere;
-		return result;
 	}
 
-	Vector3f CalculateDiffuseLighting(const Vector3f& p, const Vector3f& normal) const
+	Vector3f CalculateDiffuseLighting(const Vector3f& p, const Vector3f& normal,
+			Random& random) const
 	{
 		Vector3f result(0.0f, 0.0f, 0.0f);
 		for(size_t i = 0; i < m_spheres[SPHERE_TYPE_LIGHT].size(); i++)
 		{
 			const Sphere& currentSphere = m_spheres[SPHERE_TYPE_LIGHT][i];
-			Vector3f lightDir = currentSphere.GetRandomDirectionFromPoint(p);
-			NearestIntersection intersect = FindNearestIntersection(Ray(p, lightDir));
+			Vector3f lightDir = currentSphere.GetRandomDirectionFromPoint(p, random);
+			Ray shadowRay(p, lightDir);
 
-			if(intersect.sphere == NULL || intersect.sphere == &currentSphere)
+			// Lit unless something else is hit first, or at all if the light
+			// isn't
+			if(!IsOccluded(shadowRay, currentSphere.IntersectRay(shadowRay),
+						m_lightPositions[i]))
 			{
 				float lightAmt = normal.Dot(lightDir);
 				result += currentSphere.GetMaterial().GetEmissionColor() * lightAmt;
@@ -378,12 +774,18 @@ private:
 		return result;
 	}
 
-	Vector3f Trace(const Ray& ray, const unsigned int depthIn) const
+	Vector3f Trace(const Ray& ray, const unsigned int depth, Random& random) const
+	{
+		return Shade(ray, FindNearestIntersection(ray), depth, random);
+	}
+
+	// The light back along the ray from what it hits
+	Vector3f Shade(const Ray& ray, const NearestIntersection& intersect,
+			const unsigned int depthIn, Random& random) const
 	{
 		static const float BIAS = (float)1e-4;
 		const unsigned int depth = depthIn + 1;
 
-		NearestIntersection intersect = FindNearestIntersection(ray);
 		float t = intersect.t;
 		const Sphere* sphere = intersect.sphere;
 
@@ -430,7 +832,7 @@ private:
 //					Trace(Ray(hitLoc + normal * BIAS, newDirection), 
 //						depth)) * diffuseRatio;
 
-			Vector3f lightAmt = CalculateDiffuseLighting(hitLoc, normal);
+			Vector3f lightAmt = CalculateDiffuseLighting(hitLoc, normal, random);
 			surfaceColor += diffuseColor.ComponentMultiply(lightAmt)
 				* diffuseRatio;
 		}
@@ -445,7 +847,7 @@ private:
 			Vector3f reflectDir = ray.GetDirection().Reflect(normal).Normalized();
 			Ray reflectRay(hitLoc + normal * BIAS, reflectDir);
 
-			Vector3f reflection = Trace(reflectRay, depth);
+			Vector3f reflection = Trace(reflectRay, depth, random);
 			surfaceColor += diffuseColor.ComponentMultiply(
 					reflection * fresnel) * reflectRatio;
 		}
@@ -455,8 +857,364 @@ private:
 };
 
 
-int main()
+static double SecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+}
+
+// Times building the BVH and tracing random rays through scenes of 10 to
+// 1M randomly placed spheres, against testing every sphere where that
+// finishes in reasonable time, and checks both find the same hits
+static int BenchmarkBVH(const Cubemap& background)
+{
+	static const unsigned int NUM_RAYS = 200000;
+	// Sphere tests the brute force is given for each scene size
+	static const double BRUTE_FORCE_BUDGET = 2e8;
+	static const unsigned int MAX_BRUTE_FORCE_SPHERES = 10000;
+
+	Camera camera;
+	camera.pos = Vector3f(0.0f, 0.0f, 0.0f);
+	camera.fov = ToRadians(30.0f);
+	camera.exposure = 0.0f;
+	camera.depthOfField = 0.0f;
+
+	printf("%9s %10s %8s %12s %12s %12s %9s\n", "spheres", "build ms", "nodes",
+			"BVH Mray/s", "any Mray/s", "brute Mray/s", "speedup");
+	for(unsigned int numSpheres = 10; numSpheres <= 1000000; numSpheres *= 10)
+	{
+		Scene scene(camera, background, 5, 1);
+		Random random(numSpheres);
+
+		// The same density at every size, so rays cross about as many
+		// spheres as each other
+		float extent = 4.0f * cbrtf((float)numSpheres);
+		for(unsigned int i = 0; i < numSpheres; i++)
+		{
+			Vector3f center(
+					(random.NextFloat() * 2.0f - 1.0f) * extent,
+					(random.NextFloat() * 2.0f - 1.0f) * extent,
+					(random.NextFloat() * 2.0f - 1.0f) * extent);
+			scene.AddSphere(Sphere(center, 0.5f + random.NextFloat(),
+						Material(Vector3f(0.5f, 0.5f, 0.5f), 0.0f)));
+		}
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		scene.Finalize();
+		double buildTime = SecondsSince(start);
+
+		std::vector<Ray> rays;
+		rays.reserve(NUM_RAYS);
+		for(unsigned int i = 0; i < NUM_RAYS; i++)
+		{
+			Vector3f origin(
+					(random.NextFloat() * 2.0f - 1.0f) * extent,
+					(random.NextFloat() * 2.0f - 1.0f) * extent,
+					(random.NextFloat() * 2.0f - 1.0f) * extent);
+			Vector3f direction(
+					random.NextFloat() * 2.0f - 1.0f,
+					random.NextFloat() * 2.0f - 1.0f,
+					random.NextFloat() * 2.0f - 1.0f);
+			rays.push_back(Ray(origin, direction));
+		}
+
+		std::vector<NearestIntersection> hits(NUM_RAYS);
+		start = std::chrono::steady_clock::now();
+		for(unsigned int i = 0; i < NUM_RAYS; i++)
+		{
+			hits[i] = scene.FindNearestIntersection(rays[i]);
+		}
+		double bvhTime = SecondsSince(start);
+
+		unsigned int numOccluded = 0;
+		start = std::chrono::steady_clock::now();
+		for(unsigned int i = 0; i < NUM_RAYS; i++)
+		{
+			numOccluded += scene.IsOccluded(rays[i], FLT_MAX);
+		}
+		double anyTime = SecondsSince(start);
+
+		char bruteRate[32] = "-";
+		char speedup[32] = "-";
+		if(numSpheres <= MAX_BRUTE_FORCE_SPHERES)
+		{
+			unsigned int numBruteRays = (unsigned int)std::min(
+					(double)NUM_RAYS, BRUTE_FORCE_BUDGET / numSpheres);
+			start = std::chrono::steady_clock::now();
+			for(unsigned int i = 0; i < numBruteRays; i++)
+			{
+				NearestIntersection hit = scene.FindNearestIntersectionBruteForce(rays[i]);
+				if(hit.t != hits[i].t)
+				{
+					fprintf(stderr, "Error: The BVH finds a hit at %f on ray %u, "
+							"rather than at %f\n", hits[i].t, i, hit.t);
+					return 1;
+				}
+			}
+			double bruteTime = SecondsSince(start);
+			snprintf(bruteRate, sizeof(bruteRate), "%.3f",
+					numBruteRays / bruteTime * 1e-6);
+			snprintf(speedup, sizeof(speedup), "%.1fx",
+					(bruteTime / numBruteRays) / (bvhTime / NUM_RAYS));
+		}
+
+		unsigned int numHits = 0;
+		for(unsigned int i = 0; i < NUM_RAYS; i++)
+		{
+			numHits += hits[i].sphere != NULL;
+		}
+		if(numHits != numOccluded)
+		{
+			fprintf(stderr, "Error: %u rays hit a sphere, but %u are occluded\n",
+					numHits, numOccluded);
+			return 1;
+		}
+
+		printf("%9u %10.2f %8zu %12.3f %12.3f %12s %9s\n", numSpheres,
+				buildTime * 1e3, scene.GetNumBVHNodes(),
+				NUM_RAYS / bvhTime * 1e-6, NUM_RAYS / anyTime * 1e-6,
+				bruteRate, speedup);
+	}
+	return 0;
+}
+
+// Times testing random rays against every sphere of sets of 4 to 4096 with
+// each kernel the CPU runs, against calling Sphere::IntersectRay on each in
+// turn, and checks they all find the same hits
+static int BenchmarkSphereKernels()
+{
+	// Sphere tests each kernel is given for each set size
+	static const double SPHERE_TEST_BUDGET = 5e7;
+
+	SphereSet::Kernel bestKernel = SphereSet::GetKernel();
+	printf("%7s %12s", "spheres", "one Mray/s");
+	for(int kernel = 0; kernel < SphereSet::KERNEL_SIZE; kernel++)
+	{
+		if(SphereSet::IsKernelSupported((SphereSet::Kernel)kernel))
+		{
+			printf(" %9s Mray/s", SphereSet::GetKernelName((SphereSet::Kernel)kernel));
+		}
+	}
+	printf("\n");
+
+	for(unsigned int numSpheres = 4; numSpheres <= 4096; numSpheres *= 4)
+	{
+		Random random(numSpheres);
+		float extent = 4.0f * cbrtf((float)numSpheres);
+		std::vector<Sphere> spheres;
+		SphereSet set;
+		for(unsigned int i = 0; i < numSpheres; i++)
+		{
+			Vector3f center(
+					(random.NextFloat() * 2.0f - 1.0f) * extent,
+					(random.NextFloat() * 2.0f - 1.0f) * extent,
+					(random.NextFloat() * 2.0f - 1.0f) * extent);
+			spheres.push_back(Sphere(center, 0.5f + random.NextFloat(),
+						Material(Vector3f(0.5f, 0.5f, 0.5f), 0.0f)));
+			set.Add(center, spheres.back().GetRadius());
+		}
+
+		unsigned int numRays = (unsigned int)(SPHERE_TEST_BUDGET / numSpheres);
+		std::vector<Ray> rays;
+		rays.reserve(numRays);
+		for(unsigned int i = 0; i < numRays; i++)
+		{
+			Vector3f origin(
+					(random.NextFloat() * 2.0f - 1.0f) * extent,
+					(random.NextFloat() * 2.0f - 1.0f) * extent,
+					(random.NextFloat() * 2.0f - 1.0f) * extent);
+			Vector3f direction(
+					random.NextFloat() * 2.0f - 1.0f,
+					random.NextFloat() * 2.0f - 1.0f,
+					random.NextFloat() * 2.0f - 1.0f);
+			rays.push_back(Ray(origin, direction));
+		}
+
+		std::vector<float> hits(numRays);
+		std::vector<uint32_t> hitIndices(numRays);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for(unsigned int i = 0; i < numRays; i++)
+		{
+			hits[i] = FLT_MAX;
+			hitIndices[i] = SphereSet::NONE;
+			for(unsigned int j = 0; j < numSpheres; j++)
+			{
+				float t = spheres[j].IntersectRay(rays[i]);
+				if(t < hits[i])
+				{
+					hits[i] = t;
+					hitIndices[i] = j;
+				}
+			}
+		}
+		printf("%7u %12.3f", numSpheres, numRays / SecondsSince(start) * 1e-6);
+
+		for(int kernel = 0; kernel < SphereSet::KERNEL_SIZE; kernel++)
+		{
+			if(!SphereSet::IsKernelSupported((SphereSet::Kernel)kernel))
+			{
+				continue;
+			}
+
+			SphereSet::SetKernel((SphereSet::Kernel)kernel);
+			unsigned int numWrong = 0;
+			start = std::chrono::steady_clock::now();
+			for(unsigned int i = 0; i < numRays; i++)
+			{
+				float origin[3];
+				float direction[3];
+				for(unsigned int k = 0; k < 3; k++)
+				{
+					origin[k] = rays[i].GetOrigin()[k];
+					direction[k] = rays[i].GetDirection()[k];
+				}
+
+				float t = FLT_MAX;
+				uint32_t index = SphereSet::NONE;
+				set.FindNearest(origin, direction, 0, numSpheres, SphereSet::NONE,
+						&t, &index);
+				numWrong += t != hits[i] || index != hitIndices[i];
+			}
+			double time = SecondsSince(start);
+			if(numWrong != 0)
+			{
+				fprintf(stderr, "\nError: The %s kernel finds the wrong hit on "
+						"%u rays\n", SphereSet::GetKernelName((SphereSet::Kernel)kernel),
+						numWrong);
+				SphereSet::SetKernel(bestKernel);
+				return 1;
+			}
+			printf(" %16.3f", numRays / time * 1e-6);
+		}
+		printf("\n");
+	}
+
+	SphereSet::SetKernel(bestKernel);
+	return 0;
+}
+
+// Times finding what the camera rays of a 160x120 image with 16 samples a
+// pixel hit, in scenes of 10 to 100k spheres in front of the camera, one ray
+// at a time and in packets, and checks both find the same hits
+static int BenchmarkPackets(const Cubemap& background)
 {
+	static const unsigned int WIDTH = 160;
+	static const unsigned int HEIGHT = 120;
+	static const unsigned int SAMPLES_SQRT = 4;
+
+	Camera camera;
+	camera.pos = Vector3f(0.0f, 0.0f, 0.0f);
+	camera.fov = ToRadians(30.0f);
+	camera.exposure = 0.0f;
+	camera.depthOfField = 0.0f;
+
+	// Each pixel's samples, one after another, as they're rendered
+	float tanHalfFOV = tanf(0.5f * camera.fov);
+	std::vector<Ray> rays;
+	for(unsigned int i = 0; i < WIDTH * HEIGHT * SAMPLES_SQRT * SAMPLES_SQRT; i++)
+	{
+		unsigned int pixel = i / (SAMPLES_SQRT * SAMPLES_SQRT);
+		unsigned int sample = i % (SAMPLES_SQRT * SAMPLES_SQRT);
+		float x = (float)(pixel % WIDTH) + (sample % SAMPLES_SQRT + 0.5f) / SAMPLES_SQRT;
+		float y = (float)(pixel / WIDTH) + (sample / SAMPLES_SQRT + 0.5f) / SAMPLES_SQRT;
+		Vector3f direction(
+				(2.0f * x / WIDTH - 1.0f) * tanHalfFOV * WIDTH / HEIGHT,
+				(1.0f - 2.0f * y / HEIGHT) * tanHalfFOV,
+				-1.0f);
+		rays.push_back(Ray(camera.pos, direction));
+	}
+	unsigned int numRays = (unsigned int)rays.size();
+
+	printf("%9s %12s %14s %9s\n", "spheres", "one Mray/s", "packet Mray/s",
+			"speedup");
+	for(unsigned int numSpheres = 10; numSpheres <= 100000; numSpheres *= 10)
+	{
+		Scene scene(camera, background, 5, 1);
+		Random random(numSpheres);
+
+		// Filling the view, a little further away than they're spread
+		float extent = 4.0f * cbrtf((float)numSpheres);
+		for(unsigned int i = 0; i < numSpheres; i++)
+		{
+			Vector3f center(
+					(random.NextFloat() * 2.0f - 1.0f) * extent * 0.3f,
+					(random.NextFloat() * 2.0f - 1.0f) * extent * 0.3f,
+					-(1.0f + random.NextFloat()) * extent);
+			scene.AddSphere(Sphere(center, 0.5f + random.NextFloat(),
+						Material(Vector3f(0.5f, 0.5f, 0.5f), 0.0f)));
+		}
+		scene.Finalize();
+
+		std::vector<NearestIntersection> hits(numRays);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for(unsigned int i = 0; i < numRays; i++)
+		{
+			hits[i] = scene.FindNearestIntersection(rays[i]);
+		}
+		double singleTime = SecondsSince(start);
+
+		std::vector<NearestIntersection> packetHits(numRays);
+		start = std::chrono::steady_clock::now();
+		for(unsigned int i = 0; i < numRays; i += RayPacket::SIZE)
+		{
+			scene.FindNearestIntersections(&rays[i],
+					std::min(numRays - i, (unsigned int)RayPacket::SIZE), &packetHits[i]);
+		}
+		double packetTime = SecondsSince(start);
+
+		for(unsigned int i = 0; i < numRays; i++)
+		{
+			if(packetHits[i].t != hits[i].t)
+			{
+				fprintf(stderr, "Error: The packet finds a hit at %f on ray %u, "
+						"rather than at %f\n", packetHits[i].t, i, hits[i].t);
+				return 1;
+			}
+		}
+
+		printf("%9u %12.3f %14.3f %8.1fx\n", numSpheres,
+				numRays / singleTime * 1e-6, numRays / packetTime * 1e-6,
+				singleTime / packetTime);
+	}
+	return 0;
+}
+
+// What --progressive renders the demo scene with
+static const unsigned int PROGRESSIVE_MIN_SAMPLES = 4;
+static const unsigned int PROGRESSIVE_MAX_SAMPLES = 32;
+static const float PROGRESSIVE_MAX_ERROR = 0.2f;
+
+// Optionally takes the number of threads, which defaults to every core, and
+// the seed of the random numbers, after --progressive to render until the
+// image converges rather than with a fixed number of samples. --bench-bvh,
+// --bench-kernels and --bench-packets run the benchmarks instead.
+int main(int argc, char** argv)
+{
+	if(argc > 1 && !strcmp(argv[1], "--bench-bvh"))
+	{
+		Cubemap background("./res/envmap.png");
+		return BenchmarkBVH(background);
+	}
+	if(argc > 1 && !strcmp(argv[1], "--bench-kernels"))
+	{
+		return BenchmarkSphereKernels();
+	}
+	if(argc > 1 && !strcmp(argv[1], "--bench-packets"))
+	{
+		Cubemap background("./res/envmap.png");
+		return BenchmarkPackets(background);
+	}
+
+	bool progressive = argc > 1 && !strcmp(argv[1], "--progressive");
+	if(progressive)
+	{
+		argc--;
+		argv++;
+	}
+
+	unsigned int numThreads = argc > 1 ? (unsigned int)atoi(argv[1]) : 0;
+	uint64_t seed = argc > 2 ? (uint64_t)strtoull(argv[2], NULL, 10) : 0;
+
 	Bitmap result(320, 240);
 	
 	Camera camera;
@@ -481,7 +1239,28 @@ int main()
 	scene.AddSphere(Sphere(Vector3f(0.0f, 20.0f, -30.0f), 3.0f, 
 				Material(Vector3f(0.0f, 0.0f, 0.0f), 0.0f, Vector3f(3.0f, 3.0f, 3.0f))));
 
-	scene.Render(&result);
+	scene.Finalize();
+	if(progressive)
+	{
+		ProgressiveSettings settings;
+		settings.minSamples = PROGRESSIVE_MIN_SAMPLES;
+		settings.maxSamples = PROGRESSIVE_MAX_SAMPLES;
+		settings.maxError = PROGRESSIVE_MAX_ERROR;
+		settings.snapshotInterval = 8;
+		settings.snapshotFileName = "./output.ppm";
+
+		Accumulator accumulator(result.GetWidth(), result.GetHeight());
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		scene.RenderProgressive(&result, &accumulator, settings, numThreads, seed);
+		printf("%u passes, %.2f samples a pixel, %.3f s\n",
+				accumulator.GetNumPasses(),
+				(double)accumulator.GetTotalSamples() /
+				(result.GetWidth() * result.GetHeight()), SecondsSince(start));
+	}
+	else
+	{
+		scene.Render(&result, numThreads, seed);
+	}
 	result.Save("./output.ppm");
     return 0;
 }
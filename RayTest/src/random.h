@@ -0,0 +1,41 @@
+#ifndef RANDOM_H_INCLUDED
+#define RANDOM_H_INCLUDED
+
+#include <stdint.h>
+
+// A small generator that each thread owns, unlike rand(). Every seed gives
+// the same sequence on every platform.
+class Random
+{
+public:
+	Random(uint64_t seed = 0) { Seed(seed); }
+
+	// Seeds are mixed first, so that neighbouring seeds, like the indices
+	// of tiles, give unrelated sequences.
+	inline void Seed(uint64_t seed)
+	{
+		uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		m_state = (z ^ (z >> 31)) | 1;
+	}
+
+	// xorshift64*
+	inline uint32_t Next()
+	{
+		m_state ^= m_state >> 12;
+		m_state ^= m_state << 25;
+		m_state ^= m_state >> 27;
+		return (uint32_t)((m_state * 0x2545F4914F6CDD1Dull) >> 32);
+	}
+
+	// Uniform in [0, 1)
+	inline float NextFloat()
+	{
+		return (float)(Next() >> 8) * (1.0f / 16777216.0f);
+	}
+private:
+	uint64_t m_state;
+};
+
+#endif
@@ -0,0 +1,412 @@
+#include "sphereSet.h"
+
+#include <assert.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SPHERE_SET_X86
+#include <immintrin.h>
+#endif
+
+// GCC would otherwise fuse the multiplies and adds of the AVX-512 kernel, where
+// FMA comes with it, which rounds differently to Sphere::IntersectRay
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+// Nearer than this is where the ray left from, as in Sphere::IntersectRay
+static const float MIN_T = 0.1f;
+
+SphereSet::Kernel SphereSet::s_kernel = SphereSet::GetBestKernel();
+SphereSet::FindNearestFunc SphereSet::s_findNearest =
+	SphereSet::GetFindNearest(SphereSet::s_kernel);
+SphereSet::FindNearestPacketFunc SphereSet::s_findNearestPacket =
+	SphereSet::GetFindNearestPacket(SphereSet::s_kernel);
+
+void SphereSet::Clear()
+{
+	m_size = 0;
+	m_centerX.assign(PADDING, 0.0f);
+	m_centerY.assign(PADDING, 0.0f);
+	m_centerZ.assign(PADDING, 0.0f);
+	m_radiusSq.assign(PADDING, 0.0f);
+}
+
+void SphereSet::Add(const Vector3f& center, float radius)
+{
+	m_centerX.insert(m_centerX.begin() + m_size, center.GetX());
+	m_centerY.insert(m_centerY.begin() + m_size, center.GetY());
+	m_centerZ.insert(m_centerZ.begin() + m_size, center.GetZ());
+	m_radiusSq.insert(m_radiusSq.begin() + m_size, radius * radius);
+	m_size++;
+}
+
+bool SphereSet::IsKernelSupported(Kernel kernel)
+{
+	switch(kernel)
+	{
+	case KERNEL_SCALAR:
+		return true;
+#if defined(__SSE2__)
+	case KERNEL_SSE:
+		return true;
+#endif
+#if defined(SPHERE_SET_X86)
+	// These also check the OS saves the wider registers
+	case KERNEL_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+	case KERNEL_AVX512:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx512f");
+#endif
+	default:
+		return false;
+	}
+}
+
+SphereSet::Kernel SphereSet::GetBestKernel()
+{
+	for(int kernel = KERNEL_SIZE - 1; kernel > KERNEL_SCALAR; kernel--)
+	{
+		if(IsKernelSupported((Kernel)kernel))
+		{
+			return (Kernel)kernel;
+		}
+	}
+	return KERNEL_SCALAR;
+}
+
+const char* SphereSet::GetKernelName(Kernel kernel)
+{
+	static const char* const NAMES[KERNEL_SIZE] = { "scalar", "SSE", "AVX2", "AVX-512" };
+	return NAMES[kernel];
+}
+
+uint32_t SphereSet::GetKernelWidth(Kernel kernel)
+{
+	static const uint32_t WIDTHS[KERNEL_SIZE] = { 1, 4, 8, 16 };
+	return WIDTHS[kernel];
+}
+
+void SphereSet::SetKernel(Kernel kernel)
+{
+	assert(IsKernelSupported(kernel));
+	s_kernel = kernel;
+	s_findNearest = GetFindNearest(kernel);
+	s_findNearestPacket = GetFindNearestPacket(kernel);
+}
+
+SphereSet::FindNearestFunc SphereSet::GetFindNearest(Kernel kernel)
+{
+	switch(kernel)
+	{
+#if defined(__SSE2__)
+	case KERNEL_SSE:
+		return FindNearestSSE;
+#endif
+#if defined(SPHERE_SET_X86)
+	case KERNEL_AVX2:
+		return FindNearestAVX2;
+	case KERNEL_AVX512:
+		return FindNearestAVX512;
+#endif
+	default:
+		return FindNearestScalar;
+	}
+}
+
+SphereSet::FindNearestPacketFunc SphereSet::GetFindNearestPacket(Kernel kernel)
+{
+#if defined(SPHERE_SET_X86)
+	if(kernel >= KERNEL_AVX2)
+	{
+		return FindNearestPacketAVX2;
+	}
+#endif
+	(void)kernel;
+	return FindNearestPacketSingle;
+}
+
+// The lanes of a vector of width spheres from base on that are before end and
+// not excluded, as bits
+static inline uint32_t GetLaneMask(uint32_t base, uint32_t end,
+		uint32_t excluded, uint32_t width)
+{
+	uint32_t remaining = end - base;
+	uint32_t mask = remaining >= width ? (uint32_t)((1ull << width) - 1) :
+		(1u << remaining) - 1;
+	if(excluded - base < width)
+	{
+		mask &= ~(1u << (excluded - base));
+	}
+	return mask;
+}
+
+// Takes the nearest of the lanes in the mask. Where lanes are as near as each
+// other, the first wins, as it would testing one sphere at a time.
+static inline bool PickNearest(const float* t, uint32_t mask, uint32_t base,
+		float* tNear, uint32_t* hitIndex)
+{
+	bool found = false;
+	while(mask != 0)
+	{
+		uint32_t lane = (uint32_t)__builtin_ctz(mask);
+		mask &= mask - 1;
+		if(t[lane] < *tNear)
+		{
+			*tNear = t[lane];
+			*hitIndex = base + lane;
+			found = true;
+		}
+	}
+	return found;
+}
+
+// Every kernel does the same operations in the same order as
+// Sphere::IntersectRay, so finds exactly the same distances. The nearer root
+// is taken where it's past MIN_T, or otherwise the further.
+bool SphereSet::FindNearestScalar(const SphereSet& set, const float origin[3],
+		const float direction[3], uint32_t first, uint32_t count,
+		uint32_t excluded, float* tNear, uint32_t* hitIndex)
+{
+	bool found = false;
+	for(uint32_t i = first; i < first + count; i++)
+	{
+		float x = set.m_centerX[i] - origin[0];
+		float y = set.m_centerY[i] - origin[1];
+		float z = set.m_centerZ[i] - origin[2];
+		float B = direction[0] * x + direction[1] * y + direction[2] * z;
+		float D = B * B - (x * x + y * y + z * z) + set.m_radiusSq[i];
+		if(D < 0.0f || i == excluded)
+		{
+			continue;
+		}
+
+		float t = B - sqrtf(D);
+		if(t <= MIN_T)
+		{
+			t = B + sqrtf(D);
+		}
+		if(t > MIN_T && t < *tNear)
+		{
+			*tNear = t;
+			*hitIndex = i;
+			found = true;
+		}
+	}
+	return found;
+}
+
+void SphereSet::FindNearestPacketSingle(const SphereSet& set,
+		const RayPacket& packet, uint32_t first, uint32_t count,
+		float tNear[RayPacket::SIZE], uint32_t hitIndex[RayPacket::SIZE])
+{
+	for(unsigned int lane = 0; lane < RayPacket::SIZE; lane++)
+	{
+		float direction[3] = {
+			packet.direction[0][lane],
+			packet.direction[1][lane],
+			packet.direction[2][lane] };
+		s_findNearest(set, packet.origin, direction, first, count, NONE,
+				&tNear[lane], &hitIndex[lane]);
+	}
+}
+
+#if defined(__SSE2__)
+bool SphereSet::FindNearestSSE(const SphereSet& set, const float origin[3],
+		const float direction[3], uint32_t first, uint32_t count,
+		uint32_t excluded, float* tNear, uint32_t* hitIndex)
+{
+	const __m128 originX = _mm_set1_ps(origin[0]);
+	const __m128 originY = _mm_set1_ps(origin[1]);
+	const __m128 originZ = _mm_set1_ps(origin[2]);
+	const __m128 directionX = _mm_set1_ps(direction[0]);
+	const __m128 directionY = _mm_set1_ps(direction[1]);
+	const __m128 directionZ = _mm_set1_ps(direction[2]);
+	const __m128 minT = _mm_set1_ps(MIN_T);
+
+	bool found = false;
+	uint32_t end = first + count;
+	for(uint32_t base = first; base < end; base += 4)
+	{
+		__m128 x = _mm_sub_ps(_mm_loadu_ps(set.m_centerX.data() + base), originX);
+		__m128 y = _mm_sub_ps(_mm_loadu_ps(set.m_centerY.data() + base), originY);
+		__m128 z = _mm_sub_ps(_mm_loadu_ps(set.m_centerZ.data() + base), originZ);
+		__m128 B = _mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX, x),
+					_mm_mul_ps(directionY, y)), _mm_mul_ps(directionZ, z));
+		__m128 distSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x),
+					_mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+		__m128 D = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(B, B), distSq),
+				_mm_loadu_ps(set.m_radiusSq.data() + base));
+
+		// Misses have a negative D, so a NaN root, which fails every compare
+		__m128 sqrtD = _mm_sqrt_ps(D);
+		__m128 t0 = _mm_sub_ps(B, sqrtD);
+		__m128 t1 = _mm_add_ps(B, sqrtD);
+		__m128 useT0 = _mm_cmpgt_ps(t0, minT);
+		__m128 t = _mm_or_ps(_mm_and_ps(useT0, t0), _mm_andnot_ps(useT0, t1));
+		__m128 hit = _mm_and_ps(_mm_cmpgt_ps(t, minT),
+				_mm_cmplt_ps(t, _mm_set1_ps(*tNear)));
+
+		uint32_t mask = (uint32_t)_mm_movemask_ps(hit) &
+			GetLaneMask(base, end, excluded, 4);
+		if(mask != 0)
+		{
+			float lanes[4];
+			_mm_storeu_ps(lanes, t);
+			found |= PickNearest(lanes, mask, base, tNear, hitIndex);
+		}
+	}
+	return found;
+}
+#endif
+
+#if defined(SPHERE_SET_X86)
+__attribute__((target("avx2")))
+bool SphereSet::FindNearestAVX2(const SphereSet& set, const float origin[3],
+		const float direction[3], uint32_t first, uint32_t count,
+		uint32_t excluded, float* tNear, uint32_t* hitIndex)
+{
+	const __m256 originX = _mm256_set1_ps(origin[0]);
+	const __m256 originY = _mm256_set1_ps(origin[1]);
+	const __m256 originZ = _mm256_set1_ps(origin[2]);
+	const __m256 directionX = _mm256_set1_ps(direction[0]);
+	const __m256 directionY = _mm256_set1_ps(direction[1]);
+	const __m256 directionZ = _mm256_set1_ps(direction[2]);
+	const __m256 minT = _mm256_set1_ps(MIN_T);
+
+	bool found = false;
+	uint32_t end = first + count;
+	for(uint32_t base = first; base < end; base += 8)
+	{
+		__m256 x = _mm256_sub_ps(_mm256_loadu_ps(set.m_centerX.data() + base), originX);
+		__m256 y = _mm256_sub_ps(_mm256_loadu_ps(set.m_centerY.data() + base), originY);
+		__m256 z = _mm256_sub_ps(_mm256_loadu_ps(set.m_centerZ.data() + base), originZ);
+		__m256 B = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(directionX, x),
+					_mm256_mul_ps(directionY, y)), _mm256_mul_ps(directionZ, z));
+		__m256 distSq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x),
+					_mm256_mul_ps(y, y)), _mm256_mul_ps(z, z));
+		__m256 D = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(B, B), distSq),
+				_mm256_loadu_ps(set.m_radiusSq.data() + base));
+
+		__m256 sqrtD = _mm256_sqrt_ps(D);
+		__m256 t0 = _mm256_sub_ps(B, sqrtD);
+		__m256 t1 = _mm256_add_ps(B, sqrtD);
+		__m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, minT, _CMP_GT_OQ));
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(t, minT, _CMP_GT_OQ),
+				_mm256_cmp_ps(t, _mm256_set1_ps(*tNear), _CMP_LT_OQ));
+
+		uint32_t mask = (uint32_t)_mm256_movemask_ps(hit) &
+			GetLaneMask(base, end, excluded, 8);
+		if(mask != 0)
+		{
+			float lanes[8];
+			_mm256_storeu_ps(lanes, t);
+			found |= PickNearest(lanes, mask, base, tNear, hitIndex);
+		}
+	}
+	return found;
+}
+
+__attribute__((target("avx512f")))
+bool SphereSet::FindNearestAVX512(const SphereSet& set, const float origin[3],
+		const float direction[3], uint32_t first, uint32_t count,
+		uint32_t excluded, float* tNear, uint32_t* hitIndex)
+{
+	// Spheres that fit in half a vector are left to the AVX2 kernel. Besides
+	// doing no more, it keeps the clock from dropping for the wider vectors
+	// where scenes are small enough never to need them.
+	if(count <= 8)
+	{
+		return FindNearestAVX2(set, origin, direction, first, count, excluded,
+				tNear, hitIndex);
+	}
+
+	const __m512 originX = _mm512_set1_ps(origin[0]);
+	const __m512 originY = _mm512_set1_ps(origin[1]);
+	const __m512 originZ = _mm512_set1_ps(origin[2]);
+	const __m512 directionX = _mm512_set1_ps(direction[0]);
+	const __m512 directionY = _mm512_set1_ps(direction[1]);
+	const __m512 directionZ = _mm512_set1_ps(direction[2]);
+	const __m512 minT = _mm512_set1_ps(MIN_T);
+
+	bool found = false;
+	uint32_t end = first + count;
+	for(uint32_t base = first; base < end; base += 16)
+	{
+		__m512 x = _mm512_sub_ps(_mm512_loadu_ps(set.m_centerX.data() + base), originX);
+		__m512 y = _mm512_sub_ps(_mm512_loadu_ps(set.m_centerY.data() + base), originY);
+		__m512 z = _mm512_sub_ps(_mm512_loadu_ps(set.m_centerZ.data() + base), originZ);
+		__m512 B = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(directionX, x),
+					_mm512_mul_ps(directionY, y)), _mm512_mul_ps(directionZ, z));
+		__m512 distSq = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(x, x),
+					_mm512_mul_ps(y, y)), _mm512_mul_ps(z, z));
+		__m512 D = _mm512_add_ps(_mm512_sub_ps(_mm512_mul_ps(B, B), distSq),
+				_mm512_loadu_ps(set.m_radiusSq.data() + base));
+
+		// As _mm512_sqrt_ps, which GCC warns reads an undefined vector
+		__m512 sqrtD = _mm512_maskz_sqrt_ps(0xFFFF, D);
+		__m512 t0 = _mm512_sub_ps(B, sqrtD);
+		__m512 t1 = _mm512_add_ps(B, sqrtD);
+		__m512 t = _mm512_mask_blend_ps(
+				_mm512_cmp_ps_mask(t0, minT, _CMP_GT_OQ), t1, t0);
+		__mmask16 hit = _mm512_cmp_ps_mask(t, minT, _CMP_GT_OQ) &
+			_mm512_cmp_ps_mask(t, _mm512_set1_ps(*tNear), _CMP_LT_OQ);
+
+		uint32_t mask = (uint32_t)hit & GetLaneMask(base, end, excluded, 16);
+		if(mask != 0)
+		{
+			float lanes[16];
+			_mm512_storeu_ps(lanes, t);
+			found |= PickNearest(lanes, mask, base, tNear, hitIndex);
+		}
+	}
+	return found;
+}
+
+// What the rays share is worked out once for each sphere, so the vectors
+// only hold what differs between them
+__attribute__((target("avx2")))
+void SphereSet::FindNearestPacketAVX2(const SphereSet& set,
+		const RayPacket& packet, uint32_t first, uint32_t count,
+		float tNear[RayPacket::SIZE], uint32_t hitIndex[RayPacket::SIZE])
+{
+	const __m256 directionX = _mm256_loadu_ps(packet.direction[0]);
+	const __m256 directionY = _mm256_loadu_ps(packet.direction[1]);
+	const __m256 directionZ = _mm256_loadu_ps(packet.direction[2]);
+	const __m256 minT = _mm256_set1_ps(MIN_T);
+
+	__m256 nearest = _mm256_loadu_ps(tNear);
+	__m256 nearestIndex = _mm256_castsi256_ps(
+			_mm256_loadu_si256((const __m256i*)hitIndex));
+	for(uint32_t i = first; i < first + count; i++)
+	{
+		float x = set.m_centerX[i] - packet.origin[0];
+		float y = set.m_centerY[i] - packet.origin[1];
+		float z = set.m_centerZ[i] - packet.origin[2];
+		float distSq = x * x + y * y + z * z;
+
+		__m256 B = _mm256_add_ps(_mm256_add_ps(
+					_mm256_mul_ps(directionX, _mm256_set1_ps(x)),
+					_mm256_mul_ps(directionY, _mm256_set1_ps(y))),
+				_mm256_mul_ps(directionZ, _mm256_set1_ps(z)));
+		__m256 D = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(B, B),
+					_mm256_set1_ps(distSq)), _mm256_set1_ps(set.m_radiusSq[i]));
+
+		__m256 sqrtD = _mm256_sqrt_ps(D);
+		__m256 t0 = _mm256_sub_ps(B, sqrtD);
+		__m256 t1 = _mm256_add_ps(B, sqrtD);
+		__m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, minT, _CMP_GT_OQ));
+		__m256 hit = _mm256_and_ps(_mm256_cmp_ps(t, minT, _CMP_GT_OQ),
+				_mm256_cmp_ps(t, nearest, _CMP_LT_OQ));
+
+		// Hits in later spheres only replace strictly nearer ones, as they
+		// would testing one at a time
+		nearest = _mm256_blendv_ps(nearest, t, hit);
+		nearestIndex = _mm256_blendv_ps(nearestIndex,
+				_mm256_castsi256_ps(_mm256_set1_epi32((int)i)), hit);
+	}
+	_mm256_storeu_ps(tNear, nearest);
+	_mm256_storeu_si256((__m256i*)hitIndex, _mm256_castps_si256(nearestIndex));
+}
+#endif
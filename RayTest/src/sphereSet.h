@@ -0,0 +1,124 @@
+#ifndef SPHERE_SET_H_INCLUDED
+#define SPHERE_SET_H_INCLUDED
+
+#include "math3d.h"
+
+#include <stdint.h>
+#include <vector>
+
+// Rays from one origin, as many as the packet kernels trace at once. Packets
+// of fewer rays repeat the last in the lanes left over.
+struct RayPacket
+{
+	static const unsigned int SIZE = 8;
+
+	float origin[3];
+	float direction[3][SIZE];
+};
+
+// Spheres kept as separate arrays of the coordinates of their centers and of
+// their squared radii, so that a ray is tested against a whole vector of them
+// at once. Which kernel does that is chosen once, from what CPUID says the
+// CPU runs.
+class SphereSet
+{
+public:
+	static const uint32_t NONE = UINT32_MAX;
+
+	enum Kernel
+	{
+		KERNEL_SCALAR,
+		KERNEL_SSE,
+		KERNEL_AVX2,
+		KERNEL_AVX512,
+
+		KERNEL_SIZE
+	};
+
+	SphereSet() { Clear(); }
+
+	void Clear();
+	void Add(const Vector3f& center, float radius);
+
+	inline uint32_t GetSize() const { return m_size; }
+
+	// Finds the nearest of the count spheres from first on, other than
+	// excluded, that the ray hits before *tNear, as Sphere::IntersectRay
+	// would. Lowers *tNear to it and sets *hitIndex, or leaves both alone and
+	// returns false where there is none. The direction must be normalized.
+	inline bool FindNearest(const float origin[3], const float direction[3],
+			uint32_t first, uint32_t count, uint32_t excluded, float* tNear,
+			uint32_t* hitIndex) const
+	{
+		return s_findNearest(*this, origin, direction, first, count, excluded,
+				tNear, hitIndex);
+	}
+
+	// As FindNearest, for every ray of the packet, with tNear and hitIndex
+	// holding one for each
+	inline void FindNearestPacket(const RayPacket& packet, uint32_t first,
+			uint32_t count, float tNear[RayPacket::SIZE],
+			uint32_t hitIndex[RayPacket::SIZE]) const
+	{
+		s_findNearestPacket(*this, packet, first, count, tNear, hitIndex);
+	}
+
+	static bool IsKernelSupported(Kernel kernel);
+	// The widest kernel that's supported
+	static Kernel GetBestKernel();
+	static const char* GetKernelName(Kernel kernel);
+	static inline Kernel GetKernel() { return s_kernel; }
+	// How many spheres the kernel tests at once
+	static uint32_t GetKernelWidth(Kernel kernel);
+	// Which kernel every set uses, which must be supported
+	static void SetKernel(Kernel kernel);
+private:
+	typedef bool (*FindNearestFunc)(const SphereSet& set, const float origin[3],
+			const float direction[3], uint32_t first, uint32_t count,
+			uint32_t excluded, float* tNear, uint32_t* hitIndex);
+
+	typedef void (*FindNearestPacketFunc)(const SphereSet& set,
+			const RayPacket& packet, uint32_t first, uint32_t count,
+			float tNear[RayPacket::SIZE], uint32_t hitIndex[RayPacket::SIZE]);
+
+	// The arrays go on this far past the last sphere, so the kernels read
+	// whole vectors
+	static const uint32_t PADDING = 16;
+
+	std::vector<float> m_centerX;
+	std::vector<float> m_centerY;
+	std::vector<float> m_centerZ;
+	std::vector<float> m_radiusSq;
+	uint32_t m_size;
+
+	static Kernel s_kernel;
+	static FindNearestFunc s_findNearest;
+	static FindNearestPacketFunc s_findNearestPacket;
+
+	static FindNearestFunc GetFindNearest(Kernel kernel);
+	static FindNearestPacketFunc GetFindNearestPacket(Kernel kernel);
+
+	static bool FindNearestScalar(const SphereSet& set, const float origin[3],
+			const float direction[3], uint32_t first, uint32_t count,
+			uint32_t excluded, float* tNear, uint32_t* hitIndex);
+	static bool FindNearestSSE(const SphereSet& set, const float origin[3],
+			const float direction[3], uint32_t first, uint32_t count,
+			uint32_t excluded, float* tNear, uint32_t* hitIndex);
+	static bool FindNearestAVX2(const SphereSet& set, const float origin[3],
+			const float direction[3], uint32_t first, uint32_t count,
+			uint32_t excluded, float* tNear, uint32_t* hitIndex);
+	static bool FindNearestAVX512(const SphereSet& set, const float origin[3],
+			const float direction[3], uint32_t first, uint32_t count,
+			uint32_t excluded, float* tNear, uint32_t* hitIndex);
+
+	// Tests each ray of the packet in turn, with whichever kernel is chosen
+	static void FindNearestPacketSingle(const SphereSet& set,
+			const RayPacket& packet, uint32_t first, uint32_t count,
+			float tNear[RayPacket::SIZE], uint32_t hitIndex[RayPacket::SIZE]);
+	// Tests every ray of the packet against one sphere at a time
+	static void FindNearestPacketAVX2(const SphereSet& set,
+			const RayPacket& packet, uint32_t first, uint32_t count,
+			float tNear[RayPacket::SIZE], uint32_t hitIndex[RayPacket::SIZE]);
+};
+
+#endif
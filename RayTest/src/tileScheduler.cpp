@@ -0,0 +1,92 @@
+#include "tileScheduler.h"
+
+#include <algorithm>
+#include <thread>
+
+TileScheduler::TileScheduler(unsigned int width, unsigned int height,
+		unsigned int tileSize, unsigned int numThreads) :
+	m_numThreads(numThreads)
+{
+	if(m_numThreads == 0)
+	{
+		m_numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	}
+
+	for(unsigned int y = 0; y < height; y += tileSize)
+	{
+		for(unsigned int x = 0; x < width; x += tileSize)
+		{
+			Tile tile;
+			tile.x = x;
+			tile.y = y;
+			tile.width = std::min(tileSize, width - x);
+			tile.height = std::min(tileSize, height - y);
+			tile.index = (unsigned int)m_tiles.size();
+			m_tiles.push_back(tile);
+		}
+	}
+}
+
+void TileScheduler::Run(
+		const std::function<void(const Tile&, unsigned int)>& renderTile)
+{
+	// Dealt out in turn, so that every thread starts on every part of the
+	// image rather than on one band of it
+	std::vector<TileQueue> queues(m_numThreads);
+	for(size_t i = 0; i < m_tiles.size(); i++)
+	{
+		queues[i % m_numThreads].tiles.push_back(m_tiles[i]);
+	}
+
+	auto work = [&](unsigned int threadIndex)
+	{
+		Tile tile;
+		while(NextTile(queues, threadIndex, &tile))
+		{
+			renderTile(tile, threadIndex);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for(unsigned int i = 1; i < m_numThreads; i++)
+	{
+		threads.push_back(std::thread(work, i));
+	}
+	work(0);
+
+	for(size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+// Takes the first tile of the thread's own queue, or else the last of the
+// next queue that has any. No tiles are added once running, so when none
+// are found, there's nothing left to do.
+bool TileScheduler::NextTile(std::vector<TileQueue>& queues,
+		unsigned int threadIndex, Tile* tile) const
+{
+	for(unsigned int i = 0; i < m_numThreads; i++)
+	{
+		unsigned int victim = (threadIndex + i) % m_numThreads;
+		std::lock_guard<std::mutex> lock(queues[victim].mutex);
+		std::deque<Tile>& tiles = queues[victim].tiles;
+		if(tiles.empty())
+		{
+			continue;
+		}
+
+		if(i == 0)
+		{
+			*tile = tiles.front();
+			tiles.pop_front();
+		}
+		else
+		{
+			*tile = tiles.back();
+			tiles.pop_back();
+		}
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,50 @@
+#ifndef TILE_SCHEDULER_H_INCLUDED
+#define TILE_SCHEDULER_H_INCLUDED
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+struct Tile
+{
+	unsigned int x;
+	unsigned int y;
+	unsigned int width;
+	unsigned int height;
+	// Position in row-major order, which is the same whatever thread
+	// renders the tile
+	unsigned int index;
+};
+
+// Splits an image into tiles, and renders them on a pool of threads. Each
+// thread starts with its share of the tiles and, once out of them, takes
+// the last ones left of another thread.
+class TileScheduler
+{
+public:
+	// 0 threads uses every core
+	TileScheduler(unsigned int width, unsigned int height,
+			unsigned int tileSize, unsigned int numThreads = 0);
+
+	// Calls renderTile(tile, threadIndex) once for every tile, and returns
+	// when all are done. The calling thread is one of the threads.
+	void Run(const std::function<void(const Tile&, unsigned int)>& renderTile);
+
+	inline unsigned int GetNumThreads() const { return m_numThreads; }
+	inline size_t GetNumTiles() const { return m_tiles.size(); }
+private:
+	struct TileQueue
+	{
+		std::mutex mutex;
+		std::deque<Tile> tiles;
+	};
+
+	std::vector<Tile> m_tiles;
+	unsigned int m_numThreads;
+
+	bool NextTile(std::vector<TileQueue>& queues, unsigned int threadIndex,
+			Tile* tile) const;
+};
+
+#endif
@@ -2,13 +2,120 @@
 #include "util.h"
 
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TOKENIZER_CHUNK_SIZE 32
+#define TOKENIZER_CHUNK_BITS 0xFFFFFFFFu
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define TOKENIZER_CHUNK_SIZE 16
+#define TOKENIZER_CHUNK_BITS 0xFFFFu
+#endif
+
+/* Most runs end sooner looking a character at a time than setting up the vectors */
+#define TOKENIZER_SHORT_RUN 8
+
+/* Chunks are aligned, so reading past the ends of the input never crosses into another page */
+#if defined(TOKENIZER_CHUNK_SIZE) && defined(__GNUC__)
+#define TOKENIZER_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define TOKENIZER_NO_SANITIZE
+#endif
+
+static void AddChar(char* chars, size_t* length, int* vector, char c);
+#ifdef TOKENIZER_CHUNK_SIZE
+static unsigned int ChunkMatches(const char* chunk, const char* chars, size_t length);
+static const char* Scan(const char* input, const char* chars, size_t length, int ignored);
+#endif
+
+void TokenizerClasses_Init(TokenizerClasses* classes, const char* charsToIgnore, const char* tokenChars)
+{
+	const unsigned char* c;
+	size_t i;
+
+	memset(classes->m_classes, 0, sizeof(classes->m_classes));
+	for(c = (const unsigned char*)charsToIgnore; *c; c++)
+	{
+		classes->m_classes[*c] |= TOKENIZER_CLASS_IGNORE;
+	}
+	for(c = (const unsigned char*)tokenChars; *c; c++)
+	{
+		classes->m_classes[*c] = TOKENIZER_CLASS_TOKEN;
+	}
+
+	classes->m_ignoreLength = 0;
+	classes->m_delimiterLength = 0;
+	classes->m_vector = 1;
+	for(i = 1; i < sizeof(classes->m_classes); i++)
+	{
+		if(classes->m_classes[i] == TOKENIZER_CLASS_IGNORE)
+		{
+			AddChar(classes->m_ignoreChars, &classes->m_ignoreLength, &classes->m_vector, (char)i);
+		}
+		if(classes->m_classes[i] != 0)
+		{
+			AddChar(classes->m_delimiterChars, &classes->m_delimiterLength, &classes->m_vector, (char)i);
+		}
+	}
+}
+
+const char* TokenizerClasses_SkipIgnored(const TokenizerClasses* classes, const char* input)
+{
+	const char* shortEnd = input + TOKENIZER_SHORT_RUN;
+
+	for(; input != shortEnd; input++)
+	{
+		if(classes->m_classes[(unsigned char)*input] != TOKENIZER_CLASS_IGNORE)
+		{
+			return input;
+		}
+	}
+#ifdef TOKENIZER_CHUNK_SIZE
+	if(classes->m_vector)
+	{
+		return Scan(input, classes->m_ignoreChars, classes->m_ignoreLength, 1);
+	}
+#endif
+	while(classes->m_classes[(unsigned char)*input] == TOKENIZER_CLASS_IGNORE)
+	{
+		input++;
+	}
+	return input;
+}
+
+const char* TokenizerClasses_FindDelimiter(const TokenizerClasses* classes, const char* input)
+{
+	const char* shortEnd = input + TOKENIZER_SHORT_RUN;
+
+	for(; input != shortEnd; input++)
+	{
+		if(*input == 0 || classes->m_classes[(unsigned char)*input] != 0)
+		{
+			return input;
+		}
+	}
+#ifdef TOKENIZER_CHUNK_SIZE
+	if(classes->m_vector)
+	{
+		return Scan(input, classes->m_delimiterChars, classes->m_delimiterLength, 0);
+	}
+#endif
+	while(*input != 0 && classes->m_classes[(unsigned char)*input] == 0)
+	{
+		input++;
+	}
+	return input;
+}
+
 void Tokenizer_Init(Tokenizer* tokenizer, const char* input, const char* charsToIgnore, const char* tokenChars)
 {
 	tokenizer->m_input = input;
 	tokenizer->m_charsToIgnore = charsToIgnore;
 	tokenizer->m_tokenChars = tokenChars;
+	TokenizerClasses_Init(&tokenizer->m_classes, charsToIgnore, tokenChars);
 }
 
 void Tokenizer_Deinit(Tokenizer* tokenizer)          { UNUSED_PARAMETER(tokenizer); }
@@ -19,43 +126,25 @@ int Tokenizer_NextToken(Tokenizer* tokenizer, char* result, const unsigned int m
 	const char* tokenStart;
 	unsigned long tokenLength;
 
-	while(*tokenizer->m_input != 0)
-	{
-		if(strchr(tokenizer->m_tokenChars, *tokenizer->m_input) != NULL)
-		{
-			assert(maxResultLength >= 1);
-			result[0] = *tokenizer->m_input;
-			result[1] = 0;
-			
-			tokenizer->m_input++;
-			return 1;
-		}
-		
-		if(strchr(tokenizer->m_charsToIgnore, *tokenizer->m_input) == NULL)
-		{
-			break;
-		}
-		
-		tokenizer->m_input++;
-	}
-
+	tokenizer->m_input = TokenizerClasses_SkipIgnored(&tokenizer->m_classes, tokenizer->m_input);
 	if(*tokenizer->m_input == 0)
 	{
 		return 0;
 	}
-	
-	tokenStart = tokenizer->m_input;
-	
-	while(*tokenizer->m_input != 0)
+
+	if(tokenizer->m_classes.m_classes[(unsigned char)*tokenizer->m_input] == TOKENIZER_CLASS_TOKEN)
 	{
-		if(strchr(tokenizer->m_charsToIgnore, *tokenizer->m_input) != NULL || strchr(tokenizer->m_tokenChars, *tokenizer->m_input) != NULL)
-		{
-			break;
-		}
-	
+		assert(maxResultLength >= 1);
+		result[0] = *tokenizer->m_input;
+		result[1] = 0;
+
 		tokenizer->m_input++;
+		return 1;
 	}
-	
+
+	tokenStart = tokenizer->m_input;
+	tokenizer->m_input = TokenizerClasses_FindDelimiter(&tokenizer->m_classes, tokenizer->m_input);
+
 	tokenLength = (unsigned long)(tokenizer->m_input - tokenStart);
 	assert(maxResultLength >= tokenLength);
 
@@ -65,13 +154,82 @@ int Tokenizer_NextToken(Tokenizer* tokenizer, char* result, const unsigned int m
 	return 1;
 }
 
+static void AddChar(char* chars, size_t* length, int* vector, char c)
+{
+	if(*length == TOKENIZER_VECTOR_CHARS)
+	{
+		*vector = 0;
+		return;
+	}
+	chars[(*length)++] = c;
+}
+
+#ifdef TOKENIZER_CHUNK_SIZE
+TOKENIZER_NO_SANITIZE
+static unsigned int ChunkMatches(const char* chunk, const char* chars, size_t length)
+{
+	size_t i;
+#if defined(__AVX2__)
+	__m256i data = _mm256_load_si256((const __m256i*)(const void*)chunk);
+	__m256i found = _mm256_setzero_si256();
+
+	for(i = 0; i < length; i++)
+	{
+		found = _mm256_or_si256(found, _mm256_cmpeq_epi8(data, _mm256_set1_epi8(chars[i])));
+	}
+	return (unsigned int)_mm256_movemask_epi8(found);
+#else
+	__m128i data = _mm_load_si128((const __m128i*)(const void*)chunk);
+	__m128i found = _mm_setzero_si128();
+
+	for(i = 0; i < length; i++)
+	{
+		found = _mm_or_si128(found, _mm_cmpeq_epi8(data, _mm_set1_epi8(chars[i])));
+	}
+	return (unsigned int)_mm_movemask_epi8(found);
+#endif
+}
+
+/* First byte that is one of the chars or the NUL, or if ignored, the first that is none of them */
+TOKENIZER_NO_SANITIZE
+static const char* Scan(const char* input, const char* chars, size_t length, int ignored)
+{
+	size_t offset = (uintptr_t)input % TOKENIZER_CHUNK_SIZE;
+	const char* chunk = input - offset;
+	unsigned int matches;
+
+	for(;;)
+	{
+		matches = ChunkMatches(chunk, chars, length);
+		if(ignored)
+		{
+			matches = ~matches & TOKENIZER_CHUNK_BITS;
+		}
+		else
+		{
+			matches |= ChunkMatches(chunk, "", 1);
+		}
+		matches &= TOKENIZER_CHUNK_BITS << offset;
+		if(matches != 0)
+		{
+			return chunk + __builtin_ctz(matches);
+		}
+		chunk += TOKENIZER_CHUNK_SIZE;
+		offset = 0;
+	}
+}
+#endif
+
 void TokenizerUnitTest()
 {
 	Tokenizer test;
 	char token[6];
-	
+	char longInput[100];
+	TokenizerClasses classes;
+	size_t i;
+
 	Tokenizer_Init(&test, "Hello, World!", ", ", "!");
-    
+
     assert(Tokenizer_NextToken(&test, token, sizeof(token)));
     assert(strcmp(token, "Hello\n"));
     assert(Tokenizer_NextToken(&test, token, sizeof(token)));
@@ -79,6 +237,21 @@ void TokenizerUnitTest()
 	assert(Tokenizer_NextToken(&test, token, sizeof(token)));
 	assert(strcmp(token, "!\n"));
 	assert(!Tokenizer_NextToken(&test, token, sizeof(token)));
-	
+
 	Tokenizer_Deinit(&test);
+
+	memset(longInput, ' ', sizeof(longInput));
+	longInput[70] = 'x';
+	longInput[71] = ';';
+	longInput[80] = 0;
+	TokenizerClasses_Init(&classes, " ", ";");
+	for(i = 0; i < 70; i++)
+	{
+		assert(TokenizerClasses_SkipIgnored(&classes, longInput + i) == longInput + 70);
+	}
+	memset(longInput, 'a', 80);
+	for(i = 0; i < 80; i++)
+	{
+		assert(TokenizerClasses_FindDelimiter(&classes, longInput + i) == longInput + 80);
+	}
 }
@@ -1,13 +1,39 @@
 #ifndef TOKENIZER_H_INCLUDED
 #define TOKENIZER_H_INCLUDED
 
+#include <stddef.h>
+
+#define TOKENIZER_CLASS_IGNORE 1
+#define TOKENIZER_CLASS_TOKEN 2
+
+/* Sets larger than this are scanned a character at a time */
+#define TOKENIZER_VECTOR_CHARS 8
+
+/* The class of every character, made once per tokenizer. Past the first few
+   characters of a run, the sets are compared against a whole vector of input
+   at once where SSE2 or AVX2 is there. */
+typedef struct
+{
+	unsigned char m_classes[256];
+	char m_ignoreChars[TOKENIZER_VECTOR_CHARS];
+	size_t m_ignoreLength;
+	char m_delimiterChars[TOKENIZER_VECTOR_CHARS];
+	size_t m_delimiterLength;
+	int m_vector;
+} TokenizerClasses;
+
 typedef struct
 {
 	const char* m_input;
 	const char* m_charsToIgnore;
 	const char* m_tokenChars;
+	TokenizerClasses m_classes;
 } Tokenizer;
 
+void TokenizerClasses_Init(TokenizerClasses* classes, const char* charsToIgnore, const char* tokenChars);
+const char* TokenizerClasses_SkipIgnored(const TokenizerClasses* classes, const char* input);
+const char* TokenizerClasses_FindDelimiter(const TokenizerClasses* classes, const char* input);
+
 void Tokenizer_Init(Tokenizer* tokenizer, const char* input, const char* charsToIgnore, const char* tokenChars);
 void Tokenizer_Deinit(Tokenizer* tokenizer);
 void Tokenizer_Copy(Tokenizer* dest, Tokenizer* src);
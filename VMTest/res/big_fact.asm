@@ -0,0 +1,14 @@
+fact:;(n)
+	equals?.n s0 1
+	branch fact_one
+	sub.n s1 1
+	fact s0
+	mul.n s0 s3
+	ret.n s0
+fact_one:
+	ret.n 1
+
+main:;()
+	iton 30
+	fact s0
+	ret.n s0
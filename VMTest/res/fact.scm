@@ -0,0 +1,8 @@
+;; Run with ./run res/fact.scm, or add --dump to see the assembly it gives.
+
+(define (fact n)
+  (if (= n 1)
+	1
+	(* n (fact (- n 1)))))
+
+(fact 10)
@@ -0,0 +1,13 @@
+sum:;(n acc)
+	equals? s1 0
+	branch sum_done
+	add s1 s2
+	sub s3 1
+	sum s0 s1
+	ret s0
+sum_done:
+	ret s1
+
+main:;()
+	sum 1000000 0
+	ret s0
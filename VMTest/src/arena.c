@@ -0,0 +1,257 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(size) \
+	(((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+/* The chunk header is padded, so the data after it stays aligned */
+#define ARENA_CHUNK_HEADER ARENA_ALIGN(sizeof(struct arena_chunk))
+
+static struct arena_chunk* arena_chunk_create(struct arena* self,
+		size_t size);
+static void arena_chunks_release(struct arena_chunk* chunk);
+
+
+void arena_create(struct arena* self, size_t chunk_size)
+{
+	assert(chunk_size > 0);
+	self->chunks = NULL;
+	self->large_chunks = NULL;
+	self->chunk_size = chunk_size;
+	self->allocation_count = 0;
+	self->chunk_count = 0;
+	self->bytes_allocated = 0;
+}
+
+void arena_release(struct arena* self)
+{
+	arena_clear(self);
+}
+
+void* arena_alloc(struct arena* self, size_t size)
+{
+	struct arena_chunk* chunk = self->chunks;
+	void* result;
+
+	size = ARENA_ALIGN(size);
+
+	if(size > self->chunk_size) {
+		/* The current chunk keeps its free space */
+		chunk = arena_chunk_create(self, size);
+		chunk->next = self->large_chunks;
+		self->large_chunks = chunk;
+	} else if(chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = arena_chunk_create(self, self->chunk_size);
+		chunk->next = self->chunks;
+		self->chunks = chunk;
+	}
+
+	result = (char*)chunk + ARENA_CHUNK_HEADER + chunk->used;
+	chunk->used += size;
+	self->allocation_count++;
+	self->bytes_allocated += size;
+	return result;
+}
+
+char* arena_strdup(struct arena* self, const char* str)
+{
+	size_t length = strlen(str) + 1;
+	char* result = (char*)arena_alloc(self, length);
+
+	memcpy(result, str, length);
+	return result;
+}
+
+void* arena_realloc(struct arena* self, void* data, size_t old_size,
+		size_t new_size)
+{
+	struct arena_chunk* chunk = self->chunks;
+	struct arena_chunk** link;
+	void* result;
+
+	if(data == NULL) {
+		return arena_alloc(self, new_size);
+	}
+
+	old_size = ARENA_ALIGN(old_size);
+	new_size = ARENA_ALIGN(new_size);
+	if(new_size <= old_size) {
+		return data;
+	}
+
+	if(chunk != NULL && (char*)data + old_size ==
+			(char*)chunk + ARENA_CHUNK_HEADER + chunk->used &&
+			chunk->size - chunk->used >= new_size - old_size) {
+		chunk->used += new_size - old_size;
+		self->bytes_allocated += new_size - old_size;
+		return data;
+	}
+
+	/* Large allocations are few, so they're simply searched for */
+	if(old_size > self->chunk_size) {
+		for(link = &self->large_chunks; *link != NULL; link = &(*link)->next) {
+			if((char*)*link + ARENA_CHUNK_HEADER != data) {
+				continue;
+			}
+
+			chunk = (struct arena_chunk*)realloc(*link,
+					ARENA_CHUNK_HEADER + new_size);
+			assert(chunk != NULL);
+			chunk->size = new_size;
+			chunk->used = new_size;
+			*link = chunk;
+			self->bytes_allocated += new_size - old_size;
+			return (char*)chunk + ARENA_CHUNK_HEADER;
+		}
+	}
+
+	result = arena_alloc(self, new_size);
+	memcpy(result, data, old_size);
+	return result;
+}
+
+void arena_free(struct arena* self, void* data)
+{
+	struct arena_chunk** link;
+
+	for(link = &self->large_chunks; *link != NULL; link = &(*link)->next) {
+		if((char*)*link + ARENA_CHUNK_HEADER == data) {
+			struct arena_chunk* chunk = *link;
+
+			*link = chunk->next;
+			free(chunk);
+			return;
+		}
+	}
+}
+
+void arena_clear(struct arena* self)
+{
+	arena_chunks_release(self->chunks);
+	arena_chunks_release(self->large_chunks);
+	self->chunks = NULL;
+	self->large_chunks = NULL;
+}
+
+
+void* arena_heap_alloc(struct arena* arena, size_t size)
+{
+	if(arena != NULL) {
+		return arena_alloc(arena, size);
+	}
+
+	return malloc(size);
+}
+
+void* arena_heap_calloc(struct arena* arena, size_t count, size_t size)
+{
+	void* result;
+
+	if(arena == NULL) {
+		return calloc(count, size);
+	}
+
+	result = arena_alloc(arena, count * size);
+	memset(result, 0, count * size);
+	return result;
+}
+
+void* arena_heap_realloc(struct arena* arena, void* data, size_t old_size,
+		size_t new_size)
+{
+	if(arena != NULL) {
+		return arena_realloc(arena, data, old_size, new_size);
+	}
+
+	return realloc(data, new_size);
+}
+
+void arena_heap_free(struct arena* arena, void* data)
+{
+	if(arena != NULL) {
+		arena_free(arena, data);
+	} else {
+		free(data);
+	}
+}
+
+
+static struct arena_chunk* arena_chunk_create(struct arena* self,
+		size_t size)
+{
+	struct arena_chunk* chunk;
+
+	chunk = (struct arena_chunk*)malloc(ARENA_CHUNK_HEADER + size);
+	assert(chunk != NULL);
+	self->chunk_count++;
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+static void arena_chunks_release(struct arena_chunk* chunk)
+{
+	while(chunk != NULL) {
+		struct arena_chunk* next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+}
+
+
+
+void arena_unit_test(void)
+{
+	struct arena a;
+	char* small[100];
+	char* big;
+	size_t i;
+
+	arena_create(&a, 64);
+
+	for(i = 0; i < 100; i++) {
+		small[i] = (char*)arena_alloc(&a, 3);
+		assert(((size_t)small[i] % ARENA_ALIGNMENT) == 0);
+		memset(small[i], (int)i, 3);
+	}
+
+	big = (char*)arena_alloc(&a, 1000);
+	memset(big, 0xff, 1000);
+
+	for(i = 0; i < 100; i++) {
+		assert(small[i][0] == (char)i && small[i][2] == (char)i);
+	}
+
+	assert(!strcmp(arena_strdup(&a, "label"), "label"));
+	assert(a.allocation_count == 102);
+
+	/* The latest allocation grows in place, anything else moves */
+	arena_clear(&a);
+	small[0] = (char*)arena_alloc(&a, 8);
+	memset(small[0], 1, 8);
+	assert(arena_realloc(&a, small[0], 8, 40) == small[0]);
+	small[1] = (char*)arena_alloc(&a, 8);
+	small[2] = (char*)arena_realloc(&a, small[0], 40, 56);
+	assert(small[2] != small[0] && small[2][7] == 1);
+	assert(a.allocation_count == 105);
+
+	/* Large allocations keep their chunk, and grow with it */
+	big = (char*)arena_alloc(&a, 100);
+	memset(big, 2, 100);
+	big = (char*)arena_realloc(&a, big, 100, 10000);
+	assert(big[99] == 2 && a.allocation_count == 106);
+	assert(a.large_chunks != NULL && a.large_chunks->size == 10000);
+	arena_free(&a, big);
+	assert(a.large_chunks == NULL);
+
+	arena_clear(&a);
+	assert(a.chunks == NULL);
+	arena_alloc(&a, 1);
+	arena_release(&a);
+}
@@ -0,0 +1,66 @@
+#ifndef ARENA_INCLUDED_H
+#define ARENA_INCLUDED_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Bump allocator over a list of chunks. Allocations can't be freed on their
+ * own; everything goes away at once when the arena is cleared or released.
+ */
+struct arena_chunk {
+	struct arena_chunk* next;
+	size_t size;
+	size_t used;
+};
+
+struct arena {
+	/* The first chunk is the one being allocated from */
+	struct arena_chunk* chunks;
+	/* Chunks holding a single allocation larger than chunk_size */
+	struct arena_chunk* large_chunks;
+	size_t chunk_size;
+
+	/* Debug counters, since the arena was created */
+	size_t allocation_count;
+	size_t chunk_count;
+	size_t bytes_allocated;
+};
+
+void arena_create(struct arena* self, size_t chunk_size);
+void arena_release(struct arena* self);
+
+/* Aligned for any type. Requests larger than the chunk size get a chunk of
+   their own. */
+void* arena_alloc(struct arena* self, size_t size);
+char* arena_strdup(struct arena* self, const char* str);
+/* Grows in place if data is the latest allocation and there is room after
+   it, and reallocates the chunk if data is a large allocation. Otherwise
+   copies, leaving the old block unused until the arena is cleared. */
+void* arena_realloc(struct arena* self, void* data, size_t old_size,
+		size_t new_size);
+/* Gives a large allocation's chunk back to the heap right away. Anything
+   else stays until the arena is cleared. */
+void arena_free(struct arena* self, void* data);
+void arena_clear(struct arena* self);
+
+/*
+ * For containers that can live either in an arena or on the heap. With a
+ * NULL arena these behave like malloc, calloc, realloc and free.
+ */
+void* arena_heap_alloc(struct arena* arena, size_t size);
+void* arena_heap_calloc(struct arena* arena, size_t count, size_t size);
+void* arena_heap_realloc(struct arena* arena, void* data, size_t old_size,
+		size_t new_size);
+void arena_heap_free(struct arena* arena, void* data);
+
+void arena_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,725 @@
+#include "benchmark.h"
+#include "interpreter.h"
+#include "map.h"
+#include "timing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Each measurement repeats its program until at least this much time has
+   passed, so small programs still give stable numbers */
+#define BENCHMARK_MIN_TIME 0.5
+#define BENCHMARK_LINE_SIZE 128
+
+#define CHAIN_FUNCTIONS 1000
+#define CHAIN_ITERATIONS 1000
+#define LOOP_ITERATIONS 1000000
+#define SUM_DEPTH 1000
+#define SUM_ITERATIONS 100
+#define TAIL_DEPTH 100000
+#define TAIL_ITERATIONS 10
+/* Scripts in a batch, each summing up to around BATCH_DEPTH */
+#define BATCH_RUNS 20000
+#define BATCH_DEPTH 200
+
+/* Around 50 MB of source */
+#define LOAD_FUNCTIONS 400000
+#define LOAD_FILE_NAME "vmtest_load_benchmark.asm"
+#define LOAD_RUNS 3
+
+/* The unbalanced map recurses once per level, so the largest size is kept
+   low enough for its degenerate trees not to exhaust the stack */
+static const size_t map_sizes[] = {1000, 10000, 30000};
+
+static const char* const dispatch_names[] = {
+	"switch",
+	"threaded"
+};
+
+/* Program forms compared by run_dispatch_benchmark, the first of which
+   gives the reference result */
+static const struct {
+	const char* name;
+	int optimize;
+	enum interpreter_mode mode;
+} program_forms[] = {
+	{"plain", 0, INTERPRETER_MODE_RING},
+	{"optimized", 1, INTERPRETER_MODE_RING},
+	{"registers", 1, INTERPRETER_MODE_REGISTERS},
+	{"jit", 1, INTERPRETER_MODE_JIT}
+};
+
+static const char* const map_mode_names[] = {
+	"balanced",
+	"unbalanced"
+};
+
+enum key_order {
+	KEY_ORDER_SORTED,
+	KEY_ORDER_RANDOM,
+	KEY_ORDER_ZIGZAG,
+	KEY_ORDER_COUNT
+};
+
+static const char* const key_order_names[] = {
+	"sorted",
+	"random",
+	"zigzag"
+};
+
+/* The cached method comes after one that writes the cache */
+enum load_method {
+	LOAD_METHOD_STREAM,
+	LOAD_METHOD_FILE,
+	LOAD_METHOD_WRITE_CACHE,
+	LOAD_METHOD_CACHED,
+	LOAD_METHOD_COUNT
+};
+
+static const char* const load_method_names[] = {
+	"stream",
+	"mapped",
+	"caching",
+	"cached"
+};
+
+static void add_linef(struct interpreter* interp, const char* format,
+		size_t a, size_t b);
+static void generate_chain_program(struct interpreter* interp,
+		size_t functions, size_t iterations);
+static void generate_loop_program(struct interpreter* interp,
+		size_t iterations);
+static void add_sum_function(struct interpreter* interp);
+static void generate_sum_program(struct interpreter* interp, size_t depth,
+		size_t iterations);
+static void generate_tail_program(struct interpreter* interp, size_t depth,
+		size_t iterations);
+static int run_dispatch_benchmark(const char* name,
+		struct interpreter* interp);
+static int run_batch_benchmark(struct interpreter* interp, size_t workers,
+		const inttype* arguments, double* time);
+static int charptr_cmp(const void* a, const void* b);
+static char** generate_keys(size_t count, enum key_order order);
+static void run_map_benchmark(char** keys, size_t count,
+		enum key_order order, enum map_mode mode);
+static int write_load_program(const char* file_name, size_t functions);
+static int run_load_benchmark(const char* file_name, enum load_method method,
+		size_t* instructions);
+
+
+int benchmark_dispatch(const char* file_name)
+{
+	struct interpreter interp;
+	enum io_error ioerror;
+	int failed = 0;
+
+	interpreter_create(&interp, NULL);
+	ioerror = interpreter_add_file(&interp, file_name);
+	if(ioerror != IO_ERROR_NONE) {
+		fprintf(stderr, "Error: File %s could not be loaded, due to error "
+				"code: %d\n", file_name, ioerror);
+		interpreter_release(&interp);
+		return 1;
+	}
+	failed |= run_dispatch_benchmark(file_name, &interp);
+	interpreter_release(&interp);
+
+	interpreter_create(&interp, NULL);
+	generate_chain_program(&interp, CHAIN_FUNCTIONS, CHAIN_ITERATIONS);
+	failed |= run_dispatch_benchmark("generated call chain", &interp);
+	interpreter_release(&interp);
+
+	interpreter_create(&interp, NULL);
+	generate_loop_program(&interp, LOOP_ITERATIONS);
+	failed |= run_dispatch_benchmark("generated loop", &interp);
+	interpreter_release(&interp);
+
+	interpreter_create(&interp, NULL);
+	generate_sum_program(&interp, SUM_DEPTH, SUM_ITERATIONS);
+	failed |= run_dispatch_benchmark("generated recursive sum", &interp);
+	interpreter_release(&interp);
+
+	interpreter_create(&interp, NULL);
+	generate_tail_program(&interp, TAIL_DEPTH, TAIL_ITERATIONS);
+	failed |= run_dispatch_benchmark("generated tail recursion", &interp);
+	interpreter_release(&interp);
+
+	return failed;
+}
+
+int benchmark_batch(void)
+{
+	struct interpreter interp;
+	inttype* arguments;
+	double serial_time = 0.0;
+	double time;
+	size_t workers[] = {1, 2, 4, 0};
+	size_t i;
+	int failed = 0;
+
+	interpreter_create(&interp, NULL);
+	add_sum_function(&interp);
+	add_linef(&interp, "main:;(n)", 0, 0);
+	add_linef(&interp, "\tsum s0", 0, 0);
+	add_linef(&interp, "\tret s0", 0, 0);
+
+	arguments = (inttype*)malloc(BATCH_RUNS * sizeof(inttype));
+	for(i = 0; i < BATCH_RUNS; i++) {
+		arguments[i] = (inttype)(BATCH_DEPTH / 2 + i % BATCH_DEPTH);
+	}
+
+	for(i = 0; i < sizeof(workers) / sizeof(workers[0]) && !failed; i++) {
+		failed = run_batch_benchmark(&interp, workers[i], arguments, &time);
+		if(i == 0) {
+			serial_time = time;
+		}
+		if(!failed) {
+			printf("    %5.2fx\n", serial_time / time);
+		}
+	}
+
+	free(arguments);
+	interpreter_release(&interp);
+	return failed;
+}
+
+int benchmark_map(void)
+{
+	size_t i;
+	size_t order;
+	size_t mode;
+
+	for(i = 0; i < sizeof(map_sizes) / sizeof(map_sizes[0]); i++) {
+		for(order = 0; order < KEY_ORDER_COUNT; order++) {
+			char** keys = generate_keys(map_sizes[i], (enum key_order)order);
+			size_t k;
+
+			for(mode = MAP_MODE_BALANCED; mode <= MAP_MODE_UNBALANCED; mode++) {
+				run_map_benchmark(keys, map_sizes[i], (enum key_order)order,
+						(enum map_mode)mode);
+			}
+
+			for(k = 0; k < map_sizes[i]; k++) {
+				free(keys[k]);
+			}
+			free(keys);
+		}
+	}
+
+	return 0;
+}
+
+int benchmark_load(void)
+{
+	size_t method;
+	size_t instructions[LOAD_METHOD_COUNT];
+	int failed = 0;
+
+	if(write_load_program(LOAD_FILE_NAME, LOAD_FUNCTIONS)) {
+		fprintf(stderr, "Error: Could not write %s\n", LOAD_FILE_NAME);
+		return 1;
+	}
+
+	for(method = 0; method < LOAD_METHOD_COUNT; method++) {
+		failed |= run_load_benchmark(LOAD_FILE_NAME, (enum load_method)method,
+				&instructions[method]);
+	}
+
+	for(method = 1; method < LOAD_METHOD_COUNT && !failed; method++) {
+		if(instructions[method] != instructions[LOAD_METHOD_STREAM]) {
+			fprintf(stderr, "Error: Loading methods disagree on the "
+					"program\n");
+			failed = 1;
+		}
+	}
+
+	remove(LOAD_FILE_NAME);
+	remove(LOAD_FILE_NAME PROGRAM_CACHE_EXTENSION);
+	return failed;
+}
+
+
+static void add_linef(struct interpreter* interp, const char* format,
+		size_t a, size_t b)
+{
+	char line[BENCHMARK_LINE_SIZE];
+
+	snprintf(line, sizeof(line), format, a, b);
+	interpreter_add_line(interp, line);
+}
+
+/*
+ * main calls f0 the given number of times, and every fN calls fN+1, so each
+ * iteration goes through the whole chain of functions.
+ */
+static void generate_chain_program(struct interpreter* interp,
+		size_t functions, size_t iterations)
+{
+	size_t i;
+
+	for(i = 0; i < functions; i++) {
+		add_linef(interp, "f%lu:;(x)", i, 0);
+		add_linef(interp, "\tmul s0 3", 0, 0);
+		add_linef(interp, "\tadd s0 s1", 0, 0);
+		if(i + 1 < functions) {
+			add_linef(interp, "\tf%lu s0", i + 1, 0);
+		}
+		add_linef(interp, "\tret s0", 0, 0);
+	}
+
+	/* The counter is kept at s2 at the top of every iteration */
+	add_linef(interp, "main:;()", 0, 0);
+	add_linef(interp, "\tpush %lu", iterations, 0);
+	add_linef(interp, "\tpush 0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "main_loop:", 0, 0);
+	add_linef(interp, "\tsub s2 1", 0, 0);
+	add_linef(interp, "\tequals? s0 0", 0, 0);
+	add_linef(interp, "\tbranch main_done", 0, 0);
+	add_linef(interp, "\tf0 s1", 0, 0);
+	add_linef(interp, "\tpush s2", 0, 0);
+	add_linef(interp, "\tpush 0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "\tbranch main_loop", 0, 0);
+	add_linef(interp, "main_done:", 0, 0);
+	add_linef(interp, "\tret s1", 0, 0);
+}
+
+/*
+ * A single frame running arithmetic in a loop, with no calls.
+ */
+static void generate_loop_program(struct interpreter* interp,
+		size_t iterations)
+{
+	add_linef(interp, "main:;()", 0, 0);
+	add_linef(interp, "\tpush %lu", iterations, 0);
+	add_linef(interp, "\tpush 0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "main_loop:", 0, 0);
+	add_linef(interp, "\tsub s2 1", 0, 0);
+	add_linef(interp, "\tequals? s0 0", 0, 0);
+	add_linef(interp, "\tbranch main_done", 0, 0);
+	add_linef(interp, "\tmul s1 7", 0, 0);
+	add_linef(interp, "\tadd s0 s2", 0, 0);
+	add_linef(interp, "\tdiv s0 3", 0, 0);
+	add_linef(interp, "\tpush s5", 0, 0);
+	add_linef(interp, "\tpush 0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "\tbranch main_loop", 0, 0);
+	add_linef(interp, "main_done:", 0, 0);
+	add_linef(interp, "\tret s1", 0, 0);
+}
+
+/*
+ * Sums 1 to depth recursively, written the way the naive compilation in
+ * res/compilation-example.scm would, with every value copied to the top
+ * before use. The recursion is run the given number of times.
+ */
+/* sum(n) adds 1 to n, recursing once per number */
+static void add_sum_function(struct interpreter* interp)
+{
+	add_linef(interp, "sum:;(n)", 0, 0);
+	add_linef(interp, "\tpush s0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "\tequals? s0 s1", 0, 0);
+	add_linef(interp, "\tbranch sum_one", 0, 0);
+	add_linef(interp, "\tpush s3", 0, 0);
+	add_linef(interp, "\tpush s4", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "\tsub s1 s0", 0, 0);
+	add_linef(interp, "\tsum s0", 0, 0);
+	add_linef(interp, "\tadd s8 s0", 0, 0);
+	add_linef(interp, "\tret s0", 0, 0);
+	add_linef(interp, "sum_one:", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "\tret s0", 0, 0);
+}
+
+static void generate_sum_program(struct interpreter* interp, size_t depth,
+		size_t iterations)
+{
+	add_sum_function(interp);
+
+	/* Same loop as the other generated programs, keeping the counter at s2
+	   at the top of every iteration */
+	add_linef(interp, "main:;()", 0, 0);
+	add_linef(interp, "\tpush %lu", iterations, 0);
+	add_linef(interp, "\tpush 0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "main_loop:", 0, 0);
+	add_linef(interp, "\tsub s2 1", 0, 0);
+	add_linef(interp, "\tequals? s0 0", 0, 0);
+	add_linef(interp, "\tbranch main_done", 0, 0);
+	add_linef(interp, "\tsum %lu", depth, 0);
+	add_linef(interp, "\tpush s2", 0, 0);
+	add_linef(interp, "\tpush 0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "\tbranch main_loop", 0, 0);
+	add_linef(interp, "main_done:", 0, 0);
+	add_linef(interp, "\tret s1", 0, 0);
+}
+
+/*
+ * Sums 1 to depth with an accumulator, recursing in tail position as in
+ * res/tail_sum.asm, so that optimized runs use a single frame.
+ */
+static void generate_tail_program(struct interpreter* interp, size_t depth,
+		size_t iterations)
+{
+	add_linef(interp, "sum:;(n acc)", 0, 0);
+	add_linef(interp, "\tequals? s1 0", 0, 0);
+	add_linef(interp, "\tbranch sum_done", 0, 0);
+	add_linef(interp, "\tadd s1 s2", 0, 0);
+	add_linef(interp, "\tsub s3 1", 0, 0);
+	add_linef(interp, "\tsum s0 s1", 0, 0);
+	add_linef(interp, "\tret s0", 0, 0);
+	add_linef(interp, "sum_done:", 0, 0);
+	add_linef(interp, "\tret s1", 0, 0);
+
+	add_linef(interp, "main:;()", 0, 0);
+	add_linef(interp, "\tpush %lu", iterations, 0);
+	add_linef(interp, "\tpush 0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "main_loop:", 0, 0);
+	add_linef(interp, "\tsub s2 1", 0, 0);
+	add_linef(interp, "\tequals? s0 0", 0, 0);
+	add_linef(interp, "\tbranch main_done", 0, 0);
+	add_linef(interp, "\tsum %lu 0", depth, 0);
+	add_linef(interp, "\tpush s2", 0, 0);
+	add_linef(interp, "\tpush 0", 0, 0);
+	add_linef(interp, "\tpush 1", 0, 0);
+	add_linef(interp, "\tbranch main_loop", 0, 0);
+	add_linef(interp, "main_done:", 0, 0);
+	add_linef(interp, "\tret s1", 0, 0);
+}
+
+/* Runs every program form under every dispatch strategy */
+static int run_dispatch_benchmark(const char* name,
+		struct interpreter* interp)
+{
+	enum interpreter_error error;
+	inttype result;
+	inttype plain_result = 0;
+	size_t dispatch;
+	size_t form;
+
+	for(form = 0; form < sizeof(program_forms) / sizeof(program_forms[0]);
+			form++) {
+		for(dispatch = INTERPRETER_DISPATCH_SWITCH;
+				dispatch <= INTERPRETER_DISPATCH_THREADED; dispatch++) {
+			int native = program_forms[form].mode == INTERPRETER_MODE_JIT;
+			const char* dispatch_name = native ? "native" :
+				dispatch_names[dispatch];
+			double start;
+			double elapsed;
+			size_t instructions = 0;
+			size_t runs = 0;
+
+			/* Native code doesn't dispatch */
+			if(native && dispatch != INTERPRETER_DISPATCH_SWITCH) {
+				continue;
+			}
+
+			interpreter_set_optimize(interp, program_forms[form].optimize);
+			interpreter_set_mode(interp, program_forms[form].mode);
+			interpreter_set_dispatch(interp,
+					(enum interpreter_dispatch)dispatch);
+			if(interp->dispatch != dispatch) {
+				printf("%-24s %-9s %-9s unsupported by this compiler\n",
+						name, program_forms[form].name,
+						dispatch_names[dispatch]);
+				continue;
+			}
+
+			/* Warm up, which also compiles the program */
+			error = interpreter_run(interp, &result);
+			if(error != INTERPRETER_ERROR_NONE) {
+				fprintf(stderr, "Error: Interpretation of %s failed with error "
+						"code: %d\n", name, error);
+				return 1;
+			}
+
+			if(form == 0) {
+				plain_result = result;
+			} else if(result != plain_result) {
+				fprintf(stderr, "Error: The %s form of %s changed its result\n",
+						program_forms[form].name, name);
+				return 1;
+			}
+			if(program_forms[form].mode != INTERPRETER_MODE_RING &&
+					interp->registers < 0) {
+				printf("%-24s %-9s %-9s no register form\n",
+						name, program_forms[form].name, dispatch_name);
+				continue;
+			}
+			if(native && interp->jitted < 0) {
+				printf("%-24s %-9s %-9s not compiled\n",
+						name, program_forms[form].name, dispatch_name);
+				continue;
+			}
+
+			start = timing_get_time();
+			do {
+				interpreter_run(interp, &result);
+				instructions += interp->instructions_executed;
+				runs++;
+				elapsed = timing_get_time() - start;
+			} while(elapsed < BENCHMARK_MIN_TIME);
+
+			printf("%-24s %-9s %-9s %6lu runs %12lu instructions %8.3f s "
+					"%9.2f Minstr/s %10.2f us/run\n",
+					name, program_forms[form].name, dispatch_name,
+					runs, instructions, elapsed,
+					(double)instructions / elapsed / 1000000.0,
+					elapsed * 1000000.0 / (double)runs);
+		}
+	}
+
+	return 0;
+}
+
+/* Runs every script of the batch on a pool of the given workers, 0 for one
+   per processor, and checks every result */
+static int run_batch_benchmark(struct interpreter* interp, size_t workers,
+		const inttype* arguments, double* time)
+{
+	struct thread_pool pool;
+	enum interpreter_error error;
+	inttype* results;
+	double start;
+	size_t i;
+
+	thread_pool_create(&pool, workers);
+	results = (inttype*)malloc(BATCH_RUNS * sizeof(inttype));
+
+	start = timing_get_time();
+	error = interpreter_run_batch(interp, &pool, arguments, 1, BATCH_RUNS,
+			results, NULL);
+	*time = timing_get_time() - start;
+
+	printf("batch of %d sums  %3lu workers    %.3f s  %8.2f us/run",
+			BATCH_RUNS, (unsigned long)thread_pool_workers(&pool), *time,
+			*time * 1e6 / BATCH_RUNS);
+	thread_pool_release(&pool);
+
+	if(error != INTERPRETER_ERROR_NONE) {
+		fprintf(stderr, "\nError: Batch failed with error code: %d\n",
+				error);
+		free(results);
+		return 1;
+	}
+	for(i = 0; i < BATCH_RUNS; i++) {
+		if(results[i] != arguments[i] * (arguments[i] + 1) / 2) {
+			fprintf(stderr, "\nError: Script %lu of the batch gave %lld\n",
+					(unsigned long)i, (long long)results[i]);
+			free(results);
+			return 1;
+		}
+	}
+
+	free(results);
+	return 0;
+}
+
+static int charptr_cmp(const void* a, const void* b)
+{
+	return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+/*
+ * Keys share a long prefix, like generated labels do, so every comparison
+ * has to look past it. Zigzag alternates between the smallest and largest
+ * remaining key, which builds an unbalanced tree as deep as the sorted order
+ * does, but one that turns at every level.
+ */
+static char** generate_keys(size_t count, enum key_order order)
+{
+	char** keys = (char**)malloc(count * sizeof(char*));
+	size_t i;
+
+	for(i = 0; i < count; i++) {
+		size_t index = i;
+
+		if(order == KEY_ORDER_ZIGZAG) {
+			index = i % 2 == 0 ? i / 2 : count - 1 - i / 2;
+		}
+
+		keys[i] = (char*)malloc(BENCHMARK_LINE_SIZE);
+		snprintf(keys[i], BENCHMARK_LINE_SIZE, "generated_function_label_%08lu",
+				index);
+	}
+
+	if(order == KEY_ORDER_RANDOM) {
+		/* Fixed seed, so every mode sees the same order */
+		srand(1);
+		for(i = count - 1; i > 0; i--) {
+			size_t j = (size_t)rand() % (i + 1);
+			char* temp = keys[i];
+
+			keys[i] = keys[j];
+			keys[j] = temp;
+		}
+	}
+
+	return keys;
+}
+
+static void run_map_benchmark(char** keys, size_t count,
+		enum key_order order, enum map_mode mode)
+{
+	struct map m;
+	double start;
+	double insert_time;
+	double find_time;
+	size_t i;
+
+	map_create_mode(&m, sizeof(char*), sizeof(size_t), charptr_cmp, mode);
+
+	start = timing_get_time();
+	for(i = 0; i < count; i++) {
+		map_insert(&m, &keys[i], &i);
+	}
+	insert_time = timing_get_time() - start;
+
+	start = timing_get_time();
+	for(i = 0; i < count; i++) {
+		if(*(size_t*)map_at(&m, &keys[i]) != i) {
+			fprintf(stderr, "Error: Map lookup returned the wrong value\n");
+		}
+	}
+	find_time = timing_get_time() - start;
+
+	printf("map %-10s %-7s %6lu keys  insert %9.3f ms  find %9.3f ms\n",
+			map_mode_names[mode], key_order_names[order], count,
+			insert_time * 1000.0, find_time * 1000.0);
+
+	map_release(&m);
+}
+
+/*
+ * Written the way a code generator would, with a comment on every function
+ * and operands of every kind.
+ */
+static int write_load_program(const char* file_name, size_t functions)
+{
+	FILE* file = fopen(file_name, "w");
+	size_t i;
+
+	if(file == NULL) {
+		return 1;
+	}
+
+	for(i = 0; i < functions; i++) {
+		fprintf(file, "generated_function_%lu: ; (x y) -> x * %lu + y\n",
+				i, i);
+		fprintf(file, "\tmul s1 %lu\n", i);
+		fprintf(file, "\tadd s0 s1\n");
+		fprintf(file, "\tequals? s0 %lu\n", i * 7);
+		if(i + 1 < functions) {
+			fprintf(file, "\tgenerated_function_%lu s1 s2\n", i + 1);
+		}
+		fprintf(file, "\tret s0\n\n");
+	}
+
+	fprintf(file, "main:\n\tgenerated_function_0 1 2\n\tret s0");
+	return fclose(file) != 0;
+}
+
+static int run_load_benchmark(const char* file_name, enum load_method method,
+		size_t* instructions)
+{
+	struct interpreter interp;
+	enum io_error ioerror = IO_ERROR_NONE;
+	enum interpreter_error error;
+	double best_load = 0.0;
+	double best_compile = 0.0;
+	double best_release = 0.0;
+	double start;
+	double load_time;
+	double compile_time;
+	double release_time;
+	struct arena arena_counters;
+	long file_size = 0;
+	size_t run;
+
+	for(run = 0; run < LOAD_RUNS; run++) {
+		FILE* file;
+
+		interpreter_create(&interp, NULL);
+
+		start = timing_get_time();
+		if(method == LOAD_METHOD_STREAM) {
+			file = fopen(file_name, "r");
+			if(file == NULL) {
+				ioerror = IO_ERROR_FILE_NOT_FOUND;
+			} else {
+				ioerror = interpreter_add_stream(&interp, file);
+				file_size = ftell(file);
+				fclose(file);
+			}
+		} else if(method == LOAD_METHOD_FILE) {
+			ioerror = interpreter_add_file(&interp, file_name);
+		} else {
+			/* Without the cache, this compiles and writes it every time */
+			if(method == LOAD_METHOD_WRITE_CACHE) {
+				remove(LOAD_FILE_NAME PROGRAM_CACHE_EXTENSION);
+			}
+			ioerror = interpreter_add_file_cached(&interp, file_name);
+		}
+		load_time = timing_get_time() - start;
+
+		if(ioerror != IO_ERROR_NONE) {
+			fprintf(stderr, "Error: File %s could not be loaded, due to error "
+					"code: %d\n", file_name, ioerror);
+			interpreter_release(&interp);
+			return 1;
+		}
+
+		/* Nothing to do if the program came from the cache */
+		start = timing_get_time();
+		error = INTERPRETER_ERROR_NONE;
+		if(!interp.compiled) {
+			error = interpreter_compile(&interp);
+		}
+		compile_time = timing_get_time() - start;
+
+		if(error != INTERPRETER_ERROR_NONE) {
+			fprintf(stderr, "Error: Compilation failed with error code: %d\n",
+					error);
+			interpreter_release(&interp);
+			return 1;
+		}
+
+		if(run == 0 || load_time < best_load) {
+			best_load = load_time;
+		}
+		if(run == 0 || compile_time < best_compile) {
+			best_compile = compile_time;
+		}
+
+		*instructions = interp.code.instructions_length;
+		arena_counters = *interp.arena;
+
+		start = timing_get_time();
+		interpreter_release(&interp);
+		release_time = timing_get_time() - start;
+		if(run == 0 || release_time < best_release) {
+			best_release = release_time;
+		}
+	}
+
+	if(method == LOAD_METHOD_STREAM) {
+		printf("load %-7s %8.2f MB  %lu instructions\n", "source",
+				(double)file_size / (1024.0 * 1024.0), *instructions);
+	}
+	printf("load %-7s load %8.3f ms  compile %8.3f ms  release %8.3f ms\n",
+			load_method_names[method], best_load * 1000.0,
+			best_compile * 1000.0, best_release * 1000.0);
+	printf("load %-7s arena %lu allocations  %lu chunks  %.2f MB\n",
+			load_method_names[method], arena_counters.allocation_count,
+			arena_counters.chunk_count,
+			(double)arena_counters.bytes_allocated / (1024.0 * 1024.0));
+
+	return 0;
+}
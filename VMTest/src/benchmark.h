@@ -0,0 +1,32 @@
+#ifndef BENCHMARK_INCLUDED_H
+#define BENCHMARK_INCLUDED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reports instructions per second of every dispatch strategy, on the given
+   program and on larger generated ones, with the optimizer off and on and
+   with frame slots addressed through the ring and as registers, and
+   compiled to native code. Returns nonzero on failure. */
+int benchmark_dispatch(const char* file_name);
+
+/* Reports how long a batch of small scripts takes on a thread pool of
+   1, 2, 4 and one worker per processor, running one program on each
+   script's input. Returns nonzero on failure. */
+int benchmark_batch(void);
+
+/* Reports insert and lookup times of every map mode, on label-like string
+   keys inserted in sorted, random and adversarial order */
+int benchmark_map(void);
+
+/* Reports how long a large generated program takes to load from a file,
+   through a stream and through a memory mapping. Returns nonzero on
+   failure. */
+int benchmark_load(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
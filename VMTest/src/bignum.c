@@ -0,0 +1,571 @@
+#include "bignum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define LIMB_BITS 32
+#define LIMBS_CHUNK_SIZE (16 * 1024)
+/* Largest power of ten in a limb, which to_string divides by */
+#define DECIMAL_BASE 1000000000u
+#define DECIMAL_DIGITS 9
+
+static void unpack(const struct bignum_heap* self, inttype value,
+		struct bignum* result, uint32_t* scratch);
+static inttype pack(struct bignum_heap* self, uint32_t* limbs,
+		size_t length, int negative);
+static inttype from_magnitude(struct bignum_heap* self, uint64_t magnitude,
+		int negative);
+static uint32_t* alloc_limbs(struct bignum_heap* self, size_t length);
+static size_t normalize(const uint32_t* limbs, size_t length);
+static int compare_magnitudes(const struct bignum* a, const struct bignum* b);
+static size_t add_magnitudes(const struct bignum* a, const struct bignum* b,
+		uint32_t* result);
+static size_t sub_magnitudes(const struct bignum* a, const struct bignum* b,
+		uint32_t* result);
+static inttype add_signed(struct bignum_heap* self, inttype a, inttype b,
+		int negate_b);
+static uint32_t divide_limb(uint32_t* limbs, size_t length,
+		uint32_t divisor);
+
+
+void bignum_heap_create(struct bignum_heap* self)
+{
+	vector_create(&self->values__struct_bignum, sizeof(struct bignum), NULL);
+	arena_create(&self->limbs, LIMBS_CHUNK_SIZE);
+}
+
+void bignum_heap_release(struct bignum_heap* self)
+{
+	vector_release(&self->values__struct_bignum);
+	arena_release(&self->limbs);
+}
+
+void bignum_heap_clear(struct bignum_heap* self)
+{
+	if(vector_empty(&self->values__struct_bignum)) {
+		return;
+	}
+
+	vector_clear(&self->values__struct_bignum);
+	arena_clear(&self->limbs);
+}
+
+inttype bignum_from_int(struct bignum_heap* self, int64_t value)
+{
+	if(value >= BIGNUM_SMALL_MIN && value <= BIGNUM_SMALL_MAX) {
+		return BIGNUM_SMALL(value);
+	}
+
+	/* Negated as unsigned, which INT64_MIN needs */
+	return from_magnitude(self, value < 0 ? 0 - (uint64_t)value :
+			(uint64_t)value, value < 0);
+}
+
+int bignum_to_int(const struct bignum_heap* self, inttype value,
+		int64_t* result)
+{
+	struct bignum big;
+	uint32_t scratch[2];
+	uint64_t magnitude;
+
+	if(BIGNUM_IS_SMALL(value)) {
+		*result = BIGNUM_SMALL_VALUE(value);
+		return 1;
+	}
+
+	unpack(self, value, &big, scratch);
+	magnitude = big.limbs[0];
+	if(big.length > 1) {
+		magnitude |= (uint64_t)big.limbs[1] << LIMB_BITS;
+	}
+
+	*result = (int64_t)(big.negative ? 0 - magnitude : magnitude);
+	return big.length <= 2 && (big.negative ?
+			magnitude <= (uint64_t)INT64_MAX + 1 :
+			magnitude <= (uint64_t)INT64_MAX);
+}
+
+inttype bignum_add(struct bignum_heap* self, inttype a, inttype b)
+{
+	return add_signed(self, a, b, 0);
+}
+
+inttype bignum_sub(struct bignum_heap* self, inttype a, inttype b)
+{
+	return add_signed(self, a, b, 1);
+}
+
+inttype bignum_mul(struct bignum_heap* self, inttype a, inttype b)
+{
+	struct bignum x, y;
+	uint32_t x_scratch[2], y_scratch[2];
+	uint32_t* result;
+	size_t i, j;
+
+	if(BIGNUM_IS_SMALL(a) && BIGNUM_IS_SMALL(b)) {
+		int64_t x_value = BIGNUM_SMALL_VALUE(a);
+		int64_t y_value = BIGNUM_SMALL_VALUE(b);
+#if defined(__GNUC__)
+		int64_t product;
+
+		if(!__builtin_mul_overflow(x_value, y_value, &product)) {
+			return bignum_from_int(self, product);
+		}
+#else
+		if(x_value > -0x80000000LL && x_value < 0x80000000LL &&
+				y_value > -0x80000000LL && y_value < 0x80000000LL) {
+			return bignum_from_int(self, x_value * y_value);
+		}
+#endif
+	}
+
+	unpack(self, a, &x, x_scratch);
+	unpack(self, b, &y, y_scratch);
+	if(x.length == 0 || y.length == 0) {
+		return BIGNUM_SMALL(0);
+	}
+
+	result = alloc_limbs(self, x.length + y.length);
+	memset(result, 0, (x.length + y.length) * sizeof(uint32_t));
+	for(i = 0; i < x.length; i++) {
+		uint64_t carry = 0;
+
+		for(j = 0; j < y.length; j++) {
+			uint64_t current = (uint64_t)x.limbs[i] * y.limbs[j] +
+				result[i + j] + carry;
+
+			result[i + j] = (uint32_t)current;
+			carry = current >> LIMB_BITS;
+		}
+		result[i + y.length] = (uint32_t)carry;
+	}
+
+	return pack(self, result, x.length + y.length,
+			x.negative != y.negative);
+}
+
+int bignum_div(struct bignum_heap* self, inttype a, inttype b,
+		inttype* quotient, inttype* remainder)
+{
+	struct bignum x, y, rest;
+	uint32_t x_scratch[2], y_scratch[2];
+	uint32_t* q;
+	uint32_t* r;
+	size_t i;
+
+	if(BIGNUM_IS_SMALL(a) && BIGNUM_IS_SMALL(b)) {
+		int64_t x_value = BIGNUM_SMALL_VALUE(a);
+		int64_t y_value = BIGNUM_SMALL_VALUE(b);
+
+		if(y_value == 0) {
+			return 0;
+		}
+
+		/* Only BIGNUM_SMALL_MIN / -1 leaves the small range */
+		*quotient = bignum_from_int(self, x_value / y_value);
+		*remainder = BIGNUM_SMALL(x_value % y_value);
+		return 1;
+	}
+
+	unpack(self, a, &x, x_scratch);
+	unpack(self, b, &y, y_scratch);
+	if(y.length == 0) {
+		return 0;
+	}
+
+	if(compare_magnitudes(&x, &y) < 0) {
+		*quotient = BIGNUM_SMALL(0);
+		*remainder = a;
+		return 1;
+	}
+
+	q = alloc_limbs(self, x.length);
+	if(y.length == 1) {
+		uint32_t rest_limb;
+
+		memcpy(q, x.limbs, x.length * sizeof(uint32_t));
+		rest_limb = divide_limb(q, x.length, y.limbs[0]);
+		*quotient = pack(self, q, x.length, x.negative != y.negative);
+		*remainder = from_magnitude(self, rest_limb, x.negative);
+		return 1;
+	}
+
+	/* Long division a bit at a time, shifting x into the remainder */
+	r = alloc_limbs(self, y.length + 1);
+	memset(q, 0, x.length * sizeof(uint32_t));
+	memset(r, 0, (y.length + 1) * sizeof(uint32_t));
+	rest.limbs = r;
+	rest.length = 0;
+	rest.negative = 0;
+	for(i = x.length * LIMB_BITS; i > 0; i--) {
+		size_t bit = i - 1;
+		uint32_t carry = (x.limbs[bit / LIMB_BITS] >> (bit % LIMB_BITS)) & 1;
+		size_t j;
+
+		for(j = 0; j < y.length + 1; j++) {
+			uint32_t shifted = r[j] >> (LIMB_BITS - 1);
+
+			r[j] = (r[j] << 1) | carry;
+			carry = shifted;
+		}
+		rest.length = normalize(r, y.length + 1);
+
+		if(compare_magnitudes(&rest, &y) >= 0) {
+			rest.length = sub_magnitudes(&rest, &y, r);
+			q[bit / LIMB_BITS] |= (uint32_t)1 << (bit % LIMB_BITS);
+		}
+	}
+
+	*quotient = pack(self, q, x.length, x.negative != y.negative);
+	*remainder = pack(self, r, rest.length, x.negative);
+	return 1;
+}
+
+int bignum_equals(const struct bignum_heap* self, inttype a, inttype b)
+{
+	struct bignum x, y;
+
+	if(a == b) {
+		return 1;
+	}
+	if(BIGNUM_IS_SMALL(a) || BIGNUM_IS_SMALL(b)) {
+		return 0;
+	}
+
+	unpack(self, a, &x, NULL);
+	unpack(self, b, &y, NULL);
+	return x.negative == y.negative && x.length == y.length &&
+		!memcmp(x.limbs, y.limbs, x.length * sizeof(uint32_t));
+}
+
+char* bignum_to_string(const struct bignum_heap* self, inttype value)
+{
+	struct bignum big;
+	uint32_t scratch[2];
+	uint32_t* magnitude;
+	uint32_t* chunks;
+	size_t chunks_length = 0;
+	size_t length;
+	char* result;
+	char* out;
+
+	/* Enough for any limb, or anything small, with a sign */
+	if(BIGNUM_IS_SMALL(value)) {
+		result = (char*)malloc(24);
+		assert(result != NULL);
+		sprintf(result, "%lld", (long long)BIGNUM_SMALL_VALUE(value));
+		return result;
+	}
+
+	unpack(self, value, &big, scratch);
+	length = big.length;
+	magnitude = (uint32_t*)malloc(length * sizeof(uint32_t));
+	/* Each chunk of nine digits takes more than 29 bits */
+	chunks = (uint32_t*)malloc((length * LIMB_BITS / 29 + 1) *
+			sizeof(uint32_t));
+	result = (char*)malloc(length * LIMB_BITS / 3 + 3);
+	assert(magnitude != NULL && chunks != NULL && result != NULL);
+	memcpy(magnitude, big.limbs, length * sizeof(uint32_t));
+
+	/* Large values always have limbs */
+	do {
+		chunks[chunks_length++] = divide_limb(magnitude, length,
+				DECIMAL_BASE);
+		length = normalize(magnitude, length);
+	} while(length > 0);
+
+	out = result;
+	if(big.negative) {
+		*out++ = '-';
+	}
+	out += sprintf(out, "%lu", (unsigned long)chunks[--chunks_length]);
+	while(chunks_length > 0) {
+		out += sprintf(out, "%0*lu", DECIMAL_DIGITS,
+				(unsigned long)chunks[--chunks_length]);
+	}
+
+	free(magnitude);
+	free(chunks);
+	return result;
+}
+
+
+/* Small values are spread into scratch, which needs room for two limbs */
+static void unpack(const struct bignum_heap* self, inttype value,
+		struct bignum* result, uint32_t* scratch)
+{
+	int64_t small;
+	uint64_t magnitude;
+
+	if(!BIGNUM_IS_SMALL(value)) {
+		*result = *(const struct bignum*)vector_at(
+				&self->values__struct_bignum, value >> 1);
+		return;
+	}
+
+	small = BIGNUM_SMALL_VALUE(value);
+	magnitude = small < 0 ? (uint64_t)-small : (uint64_t)small;
+	scratch[0] = (uint32_t)magnitude;
+	scratch[1] = (uint32_t)(magnitude >> LIMB_BITS);
+	result->limbs = scratch;
+	result->length = normalize(scratch, 2);
+	result->negative = small < 0;
+}
+
+/* The value of the magnitude in limbs, which must have come from
+   alloc_limbs, since a large value keeps them */
+static inttype pack(struct bignum_heap* self, uint32_t* limbs,
+		size_t length, int negative)
+{
+	struct bignum big;
+
+	length = normalize(limbs, length);
+	if(length <= 2) {
+		uint64_t magnitude = length > 0 ? limbs[0] : 0;
+
+		if(length > 1) {
+			magnitude |= (uint64_t)limbs[1] << LIMB_BITS;
+		}
+		if(magnitude <= (uint64_t)BIGNUM_SMALL_MAX + (negative ? 1 : 0)) {
+			return BIGNUM_SMALL(negative ? 0 - magnitude : magnitude);
+		}
+	}
+
+	big.limbs = limbs;
+	big.length = length;
+	big.negative = negative;
+	vector_push_back(&self->values__struct_bignum, &big);
+	return (inttype)((vector_size(&self->values__struct_bignum) - 1) << 1 |
+			1);
+}
+
+static inttype from_magnitude(struct bignum_heap* self, uint64_t magnitude,
+		int negative)
+{
+	uint32_t* limbs;
+
+	if(magnitude <= (uint64_t)BIGNUM_SMALL_MAX) {
+		return BIGNUM_SMALL(negative ? 0 - magnitude : magnitude);
+	}
+
+	limbs = alloc_limbs(self, 2);
+	limbs[0] = (uint32_t)magnitude;
+	limbs[1] = (uint32_t)(magnitude >> LIMB_BITS);
+	return pack(self, limbs, 2, negative);
+}
+
+static uint32_t* alloc_limbs(struct bignum_heap* self, size_t length)
+{
+	return (uint32_t*)arena_alloc(&self->limbs, length * sizeof(uint32_t));
+}
+
+/* Length without leading zeros */
+static size_t normalize(const uint32_t* limbs, size_t length)
+{
+	while(length > 0 && limbs[length - 1] == 0) {
+		length--;
+	}
+
+	return length;
+}
+
+static int compare_magnitudes(const struct bignum* a, const struct bignum* b)
+{
+	size_t i;
+
+	if(a->length != b->length) {
+		return a->length < b->length ? -1 : 1;
+	}
+
+	for(i = a->length; i > 0; i--) {
+		if(a->limbs[i - 1] != b->limbs[i - 1]) {
+			return a->limbs[i - 1] < b->limbs[i - 1] ? -1 : 1;
+		}
+	}
+
+	return 0;
+}
+
+/* result needs room for one limb more than the longer of the two */
+static size_t add_magnitudes(const struct bignum* a, const struct bignum* b,
+		uint32_t* result)
+{
+	size_t length = a->length > b->length ? a->length : b->length;
+	uint64_t carry = 0;
+	size_t i;
+
+	for(i = 0; i < length; i++) {
+		carry += (uint64_t)(i < a->length ? a->limbs[i] : 0) +
+			(i < b->length ? b->limbs[i] : 0);
+		result[i] = (uint32_t)carry;
+		carry >>= LIMB_BITS;
+	}
+	result[length] = (uint32_t)carry;
+
+	return normalize(result, length + 1);
+}
+
+/* a must be at least b. result may be a's own limbs. */
+static size_t sub_magnitudes(const struct bignum* a, const struct bignum* b,
+		uint32_t* result)
+{
+	uint32_t borrow = 0;
+	size_t i;
+
+	for(i = 0; i < a->length; i++) {
+		uint64_t subtrahend = (uint64_t)(i < b->length ? b->limbs[i] : 0) +
+			borrow;
+
+		borrow = a->limbs[i] < subtrahend;
+		result[i] = (uint32_t)(a->limbs[i] - subtrahend);
+	}
+
+	return normalize(result, a->length);
+}
+
+static inttype add_signed(struct bignum_heap* self, inttype a, inttype b,
+		int negate_b)
+{
+	struct bignum x, y;
+	uint32_t x_scratch[2], y_scratch[2];
+	uint32_t* result;
+	size_t length;
+	int negative;
+
+	/* Can't overflow, since small values have a bit to spare */
+	if(BIGNUM_IS_SMALL(a) && BIGNUM_IS_SMALL(b)) {
+		return bignum_from_int(self, negate_b ?
+				BIGNUM_SMALL_VALUE(a) - BIGNUM_SMALL_VALUE(b) :
+				BIGNUM_SMALL_VALUE(a) + BIGNUM_SMALL_VALUE(b));
+	}
+
+	unpack(self, a, &x, x_scratch);
+	unpack(self, b, &y, y_scratch);
+	if(negate_b) {
+		y.negative = !y.negative && y.length > 0;
+	}
+
+	result = alloc_limbs(self, (x.length > y.length ? x.length : y.length) +
+			1);
+	if(x.negative == y.negative) {
+		length = add_magnitudes(&x, &y, result);
+		negative = x.negative;
+	} else if(compare_magnitudes(&x, &y) >= 0) {
+		length = sub_magnitudes(&x, &y, result);
+		negative = x.negative;
+	} else {
+		length = sub_magnitudes(&y, &x, result);
+		negative = y.negative;
+	}
+
+	return pack(self, result, length, negative);
+}
+
+/* Divides in place, returning the remainder */
+static uint32_t divide_limb(uint32_t* limbs, size_t length, uint32_t divisor)
+{
+	uint64_t rest = 0;
+	size_t i;
+
+	for(i = length; i > 0; i--) {
+		uint64_t current = rest << LIMB_BITS | limbs[i - 1];
+
+		limbs[i - 1] = (uint32_t)(current / divisor);
+		rest = current % divisor;
+	}
+
+	return (uint32_t)rest;
+}
+
+
+static void unit_test_expect(const struct bignum_heap* heap, inttype value,
+		const char* expected)
+{
+	char* string = bignum_to_string(heap, value);
+
+	assert(!strcmp(string, expected));
+	free(string);
+}
+
+void bignum_unit_test(void)
+{
+	struct bignum_heap heap;
+	inttype fact;
+	inttype value;
+	inttype quotient;
+	inttype remainder;
+	int64_t result;
+	int64_t i;
+
+	bignum_heap_create(&heap);
+
+	/* Past the small range, and back */
+	value = bignum_add(&heap, BIGNUM_SMALL(BIGNUM_SMALL_MAX), BIGNUM_SMALL(1));
+	assert(!BIGNUM_IS_SMALL(value));
+	unit_test_expect(&heap, value, "4611686018427387904");
+	value = bignum_sub(&heap, value, BIGNUM_SMALL(1));
+	assert(value == BIGNUM_SMALL(BIGNUM_SMALL_MAX));
+	assert(BIGNUM_IS_SMALL(bignum_from_int(&heap, BIGNUM_SMALL_MIN)));
+
+	/* INT64_MIN only fits as a large value */
+	value = bignum_from_int(&heap, INT64_MIN);
+	unit_test_expect(&heap, value, "-9223372036854775808");
+	assert(bignum_to_int(&heap, value, &result) && result == INT64_MIN);
+	assert(bignum_to_int(&heap, bignum_sub(&heap, value, BIGNUM_SMALL(1)),
+				&result) == 0);
+
+	fact = BIGNUM_SMALL(1);
+	for(i = 2; i <= 30; i++) {
+		fact = bignum_mul(&heap, fact, BIGNUM_SMALL(i));
+	}
+	unit_test_expect(&heap, fact, "265252859812191058636308480000000");
+	assert(bignum_equals(&heap, fact,
+				bignum_mul(&heap, BIGNUM_SMALL(1), fact)));
+	assert(!bignum_equals(&heap, fact, bignum_add(&heap, fact,
+					BIGNUM_SMALL(1))));
+
+	/* By one limb */
+	value = fact;
+	for(i = 30; i >= 2; i--) {
+		assert(bignum_div(&heap, value, BIGNUM_SMALL(i), &value,
+					&remainder));
+		assert(remainder == BIGNUM_SMALL(0));
+	}
+	assert(value == BIGNUM_SMALL(1));
+
+	/* By more than one limb */
+	value = BIGNUM_SMALL(1);
+	for(i = 2; i <= 20; i++) {
+		value = bignum_mul(&heap, value, BIGNUM_SMALL(i));
+	}
+	assert(bignum_div(&heap, fact, bignum_add(&heap, value, BIGNUM_SMALL(7)),
+				&quotient, &remainder));
+	unit_test_expect(&heap, quotient, "109027350431999");
+	unit_test_expect(&heap, remainder, "2432138816723616007");
+
+	/* Signs follow C's truncating division */
+	value = bignum_add(&heap, bignum_from_int(&heap, (int64_t)1 << 40),
+			BIGNUM_SMALL(3));
+	assert(bignum_div(&heap, bignum_sub(&heap, BIGNUM_SMALL(0), fact), value,
+				&quotient, &remainder));
+	unit_test_expect(&heap, quotient, "-241246070628646812496");
+	unit_test_expect(&heap, remainder, "-751722073616");
+	assert(bignum_div(&heap, BIGNUM_SMALL(-7), BIGNUM_SMALL(2), &quotient,
+				&remainder));
+	assert(quotient == BIGNUM_SMALL(-3) && remainder == BIGNUM_SMALL(-1));
+
+	assert(!bignum_div(&heap, fact, BIGNUM_SMALL(0), &quotient, &remainder));
+
+	/* Only the lowest 64 bits are left of 2^64 + 5 */
+	value = bignum_add(&heap, bignum_mul(&heap,
+				bignum_from_int(&heap, (int64_t)1 << 32),
+				bignum_from_int(&heap, (int64_t)1 << 32)), BIGNUM_SMALL(5));
+	unit_test_expect(&heap, value, "18446744073709551621");
+	assert(bignum_to_int(&heap, value, &result) == 0 && result == 5);
+
+	bignum_heap_clear(&heap);
+	assert(vector_empty(&heap.values__struct_bignum));
+	bignum_heap_release(&heap);
+}
@@ -0,0 +1,73 @@
+#ifndef BIGNUM_INCLUDED_H
+#define BIGNUM_INCLUDED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bytecode.h"
+#include "vector.h"
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Integers of any size, as the .n instructions work on them. A value is one
+ * word, like anything else in a frame. Integers from BIGNUM_SMALL_MIN to
+ * BIGNUM_SMALL_MAX are stored in the word itself, shifted left by one, and
+ * larger ones are kept in a heap, which the word refers to with its low bit
+ * set. Every operation gives the small form whenever the result fits it, so
+ * a small value is never equal to a large one.
+ */
+#define BIGNUM_SMALL_MAX ((int64_t)(INT64_MAX >> 1))
+#define BIGNUM_SMALL_MIN (-BIGNUM_SMALL_MAX - 1)
+#define BIGNUM_IS_SMALL(value) (((value) & 1) == 0)
+#define BIGNUM_SMALL(value) ((inttype)(uint64_t)(value) << 1)
+#define BIGNUM_SMALL_VALUE(value) ((int64_t)(value) >> 1)
+
+struct bignum {
+	/* Magnitude, least significant limb first, without leading zeros */
+	const uint32_t* limbs;
+	size_t length;
+	int negative;
+};
+
+/* Large values are never freed on their own, but stay until the heap is
+   cleared, which the interpreter does at the start of every run */
+struct bignum_heap {
+	/* (struct vector<struct bignum>) */
+	struct vector values__struct_bignum;
+	/* Holds the limbs of every value */
+	struct arena limbs;
+};
+
+void bignum_heap_create(struct bignum_heap* self);
+void bignum_heap_release(struct bignum_heap* self);
+void bignum_heap_clear(struct bignum_heap* self);
+
+inttype bignum_from_int(struct bignum_heap* self, int64_t value);
+/* Sets result to the lowest 64 bits of the value, as two's complement, and
+   returns whether that's all of it */
+int bignum_to_int(const struct bignum_heap* self, inttype value,
+		int64_t* result);
+
+inttype bignum_add(struct bignum_heap* self, inttype a, inttype b);
+inttype bignum_sub(struct bignum_heap* self, inttype a, inttype b);
+inttype bignum_mul(struct bignum_heap* self, inttype a, inttype b);
+/* Truncates like C's division does, so the remainder takes the sign of a.
+   Returns 0 on division by zero. */
+int bignum_div(struct bignum_heap* self, inttype a, inttype b,
+		inttype* quotient, inttype* remainder);
+int bignum_equals(const struct bignum_heap* self, inttype a, inttype b);
+
+/* The value in decimal, which the caller frees */
+char* bignum_to_string(const struct bignum_heap* self, inttype value);
+
+void bignum_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
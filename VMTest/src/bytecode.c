@@ -0,0 +1,224 @@
+#include "bytecode.h"
+#include "bignum.h"
+
+#include <string.h>
+
+/* Indexed by enum opcode. OPCODE_CALL has no mnemonic of its own. */
+static const char* const opcode_mnemonics[OPCODE_COUNT] = {
+	"push",
+	"add",
+	"sub",
+	"mul",
+	"div",
+	"equals?",
+	"branch",
+	"ret",
+	"div.i",
+	"add.f",
+	"sub.f",
+	"mul.f",
+	"div.f",
+	"equals?.f",
+	"add.n",
+	"sub.n",
+	"mul.n",
+	"div.n",
+	"equals?.n",
+	"itof",
+	"ftoi",
+	"iton",
+	"ntoi",
+	NULL,
+	"equals?+branch",
+	"sub+call",
+	"tail-call"
+};
+
+/* Indexed by enum value_type */
+static const char* const type_suffixes[VALUE_TYPE_COUNT] = {
+	"",
+	".i",
+	".f",
+	".n"
+};
+
+static enum opcode find_mnemonic(const char* mnemonic, size_t length);
+static enum value_type opcode_type(enum opcode opcode);
+static int takes_suffix(enum opcode opcode);
+static void print_immediate(inttype value, enum value_type type,
+		FILE* file);
+
+
+/* Typed forms with an opcode of their own are found by their full
+   mnemonic, and the rest by the mnemonic before the suffix */
+enum opcode opcode_from_mnemonic(const char* mnemonic,
+		enum value_type* type)
+{
+	size_t length = strlen(mnemonic);
+	enum opcode opcode;
+	size_t i;
+
+	opcode = find_mnemonic(mnemonic, length);
+	if(opcode != OPCODE_CALL) {
+		*type = opcode_type(opcode);
+		return opcode;
+	}
+
+	*type = VALUE_TYPE_WORD;
+	for(i = VALUE_TYPE_WORD + 1; i < VALUE_TYPE_COUNT; i++) {
+		size_t suffix_length = strlen(type_suffixes[i]);
+
+		if(length <= suffix_length || strcmp(mnemonic + length -
+					suffix_length, type_suffixes[i])) {
+			continue;
+		}
+
+		opcode = find_mnemonic(mnemonic, length - suffix_length);
+		if(opcode == OPCODE_CALL) {
+			break;
+		}
+		if(!takes_suffix(opcode)) {
+			return OPCODE_COUNT;
+		}
+
+		*type = (enum value_type)i;
+		return opcode;
+	}
+
+	return OPCODE_CALL;
+}
+
+const char* opcode_to_mnemonic(enum opcode opcode)
+{
+	if(opcode >= OPCODE_COUNT || opcode_mnemonics[opcode] == NULL) {
+		return "call";
+	}
+
+	return opcode_mnemonics[opcode];
+}
+
+void bytecode_dump(const struct bytecode* self,
+		const char* const* label_names, FILE* file)
+{
+	size_t i, j;
+
+	for(i = 0; i < self->instructions_length; i++) {
+		const struct instruction* ins = &self->instructions[i];
+
+		if(label_names != NULL && label_names[i] != NULL) {
+			fprintf(file, "%s:\n", label_names[i]);
+		}
+
+		fprintf(file, "%6lu  %s%-*s", i, opcode_to_mnemonic(ins->opcode),
+				(int)(15 - strlen(opcode_to_mnemonic(ins->opcode))),
+				takes_suffix(ins->opcode) ? type_suffixes[ins->type] : "");
+		for(j = 0; j < ins->operands_length; j++) {
+			const struct operand* operand =
+				&self->operands[ins->operands_begin + j];
+
+			if(operand->is_stack) {
+				fprintf(file, " s%lu", operand->value);
+			} else {
+				print_immediate(operand->value, ins->type, file);
+			}
+		}
+
+		if(ins->target != BYTECODE_UNRESOLVED) {
+			fprintf(file, " -> %lu", ins->target);
+		} else if(ins->opcode == OPCODE_BRANCH ||
+				ins->opcode == OPCODE_CALL ||
+				ins->opcode == OPCODE_EQUALS_BRANCH ||
+				ins->opcode == OPCODE_SUB_CALL ||
+				ins->opcode == OPCODE_TAIL_CALL) {
+			fprintf(file, " -> unresolved");
+		}
+		fprintf(file, "\n");
+	}
+}
+
+
+/* OPCODE_CALL if there's no builtin of that name */
+static enum opcode find_mnemonic(const char* mnemonic, size_t length)
+{
+	size_t i;
+
+	for(i = 0; i < OPCODE_CALL; i++) {
+		if(opcode_mnemonics[i] != NULL &&
+				strlen(opcode_mnemonics[i]) == length &&
+				!strncmp(mnemonic, opcode_mnemonics[i], length)) {
+			return (enum opcode)i;
+		}
+	}
+
+	return OPCODE_CALL;
+}
+
+/* Type of the opcodes whose mnemonic already says it */
+static enum value_type opcode_type(enum opcode opcode)
+{
+	switch(opcode) {
+	case OPCODE_DIV_I:
+	case OPCODE_I_TO_F:
+	case OPCODE_I_TO_N:
+		return VALUE_TYPE_I64;
+	case OPCODE_ADD_F:
+	case OPCODE_SUB_F:
+	case OPCODE_MUL_F:
+	case OPCODE_DIV_F:
+	case OPCODE_EQUALS_F:
+	case OPCODE_F_TO_I:
+		return VALUE_TYPE_F64;
+	case OPCODE_ADD_N:
+	case OPCODE_SUB_N:
+	case OPCODE_MUL_N:
+	case OPCODE_DIV_N:
+	case OPCODE_EQUALS_N:
+	case OPCODE_N_TO_I:
+		return VALUE_TYPE_BIG;
+	default:
+		return VALUE_TYPE_WORD;
+	}
+}
+
+/* Whether the opcode is the typed form of itself for any suffix, which
+   leaves the type to the instruction. Superinstructions keep the type of
+   the instruction they were made from. */
+static int takes_suffix(enum opcode opcode)
+{
+	switch(opcode) {
+	case OPCODE_PUSH:
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_MUL:
+	case OPCODE_EQUALS:
+	case OPCODE_RET:
+	case OPCODE_EQUALS_BRANCH:
+	case OPCODE_SUB_CALL:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void print_immediate(inttype value, enum value_type type,
+		FILE* file)
+{
+	double f64;
+
+	switch(type) {
+	case VALUE_TYPE_I64:
+		fprintf(file, " %lld", (long long)value);
+		break;
+	case VALUE_TYPE_F64:
+		memcpy(&f64, &value, sizeof(f64));
+		fprintf(file, " %.17g", f64);
+		break;
+	case VALUE_TYPE_BIG:
+		/* Immediates are always small */
+		fprintf(file, " %lld", (long long)BIGNUM_SMALL_VALUE(value));
+		break;
+	default:
+		fprintf(file, " %lu", value);
+		break;
+	}
+}
@@ -0,0 +1,142 @@
+#ifndef BYTECODE_INCLUDED_H
+#define BYTECODE_INCLUDED_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef size_t inttype;
+
+/* Marks a branch or call whose label could not be found when compiling. The
+   error is only raised if the instruction is actually executed. */
+#define BYTECODE_UNRESOLVED ((size_t)-1)
+
+/*
+ * How an instruction reads its operands, picked in source by a suffix on
+ * the mnemonic. Every value is one word in a frame, so values of any type
+ * are pushed, passed and returned alike, and only the arithmetic that reads
+ * them differs. Immediates are stored as the word they stand for.
+ */
+enum value_type {
+	/* Unsigned machine word, which instructions without a suffix use */
+	VALUE_TYPE_WORD,
+	/* ".i", a signed 64-bit integer */
+	VALUE_TYPE_I64,
+	/* ".f", a double, stored as its bits */
+	VALUE_TYPE_F64,
+	/* ".n", an integer of any size (see bignum.h) */
+	VALUE_TYPE_BIG,
+	VALUE_TYPE_COUNT
+};
+
+enum opcode {
+	OPCODE_PUSH,
+	OPCODE_ADD,
+	OPCODE_SUB,
+	OPCODE_MUL,
+	OPCODE_DIV,
+	OPCODE_EQUALS,
+	OPCODE_BRANCH,
+	OPCODE_RET,
+
+	/* Typed arithmetic, each pushing what its untyped form does. Adding,
+	   subtracting, multiplying and comparing signed integers works the same
+	   as it does on words, so only division has a form of its own for
+	   them. */
+	OPCODE_DIV_I,
+	OPCODE_ADD_F,
+	OPCODE_SUB_F,
+	OPCODE_MUL_F,
+	OPCODE_DIV_F,
+	OPCODE_EQUALS_F,
+	OPCODE_ADD_N,
+	OPCODE_SUB_N,
+	OPCODE_MUL_N,
+	OPCODE_DIV_N,
+	OPCODE_EQUALS_N,
+	/* Conversions, pushing the operand as another type. Doubles are
+	   truncated and clamped to integers, and integers of any size wrap to
+	   their lowest 64 bits. */
+	OPCODE_I_TO_F,
+	OPCODE_F_TO_I,
+	OPCODE_I_TO_N,
+	OPCODE_N_TO_I,
+
+	/* Any mnemonic that isn't a builtin is a call to the label of that name */
+	OPCODE_CALL,
+
+	/* Superinstructions, which only the optimizer produces. Each behaves
+	   exactly like the pair it replaces, and takes the operands of both. */
+	/* equals? a b, then branch */
+	OPCODE_EQUALS_BRANCH,
+	/* sub a b, then a call taking the remaining operands */
+	OPCODE_SUB_CALL,
+	/* A call followed by ret s0, which the optimizer turns into a jump that
+	   replaces the caller's frame with the callee's. Only used where the
+	   callee always returns exactly one value, so that the callee returning
+	   straight to the caller's caller gives the same result. */
+	OPCODE_TAIL_CALL,
+
+	OPCODE_COUNT
+};
+
+struct operand {
+	/* Immediate value, or the ring-relative slot index for stack operands */
+	inttype value;
+	size_t is_stack;
+};
+
+struct instruction {
+	enum opcode opcode;
+	/* Range of this instruction's operands in the operand pool */
+	size_t operands_begin;
+	size_t operands_length;
+	/* Instruction index to continue at, for branches and calls */
+	size_t target;
+	/* Size of the frame to create, for calls */
+	size_t frame_size;
+	/* Type the operands are read as. For push and ret, this is the only
+	   thing the suffix changes. */
+	enum value_type type;
+};
+
+/*
+ * A compiled program, as run by the interpreter. The arrays are owned by
+ * whatever produced them, be it the compiler or a mapped cache file.
+ */
+struct bytecode {
+	const struct instruction* instructions;
+	size_t instructions_length;
+	const struct operand* operands;
+	size_t operands_length;
+	/* Instruction index and frame size of the startup function, or
+	   BYTECODE_UNRESOLVED and 1 if there is none */
+	size_t startup_target;
+	size_t startup_frame_size;
+	/* Type of the startup function's first ret, which is how its result
+	   is read */
+	enum value_type result_type;
+};
+
+/*
+ * Only opcodes that can be written in source are found, setting type to
+ * how they read their operands. Returns OPCODE_COUNT for a builtin with a
+ * type suffix it has no form for.
+ */
+enum opcode opcode_from_mnemonic(const char* mnemonic,
+		enum value_type* type);
+const char* opcode_to_mnemonic(enum opcode opcode);
+
+/* Prints one instruction per line. label_names holds, for every instruction
+   index, the name of the label there or NULL; it may itself be NULL. */
+void bytecode_dump(const struct bytecode* self,
+		const char* const* label_names, FILE* file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,189 @@
+#include "frame_stack.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define DEFAULT_VALUES_CAPACITY 4096
+#define DEFAULT_FRAMES_CAPACITY 256
+
+static void frame_stack_grow_values(struct frame_stack* self,
+		size_t min_capacity);
+static void frame_stack_grow_frames(struct frame_stack* self);
+
+
+void frame_stack_create(struct frame_stack* self)
+{
+	self->values_length = 0;
+	self->values_capacity = DEFAULT_VALUES_CAPACITY;
+	self->values = (size_t*)malloc(self->values_capacity * sizeof(size_t));
+	assert(self->values != NULL);
+
+	self->frames_length = 0;
+	self->frames_capacity = DEFAULT_FRAMES_CAPACITY;
+	self->frames = (struct frame*)malloc(
+			self->frames_capacity * sizeof(struct frame));
+	assert(self->frames != NULL);
+}
+
+void frame_stack_release(struct frame_stack* self)
+{
+	free(self->values);
+	free(self->frames);
+}
+
+struct frame* frame_stack_push(struct frame_stack* self, size_t size,
+		size_t return_ptr)
+{
+	struct frame* frame;
+
+	if(self->values_length + size > self->values_capacity) {
+		frame_stack_grow_values(self, self->values_length + size);
+	}
+
+	if(self->frames_length == self->frames_capacity) {
+		frame_stack_grow_frames(self);
+	}
+
+	frame = &self->frames[self->frames_length];
+	ring_buffer_create_at(&frame->slots, self->values + self->values_length,
+			size);
+	frame->return_ptr = return_ptr;
+
+	self->values_length += size;
+	self->frames_length++;
+	return frame;
+}
+
+void frame_stack_pop(struct frame_stack* self)
+{
+	assert(self->frames_length > 0);
+	self->frames_length--;
+	self->values_length -= self->frames[self->frames_length].slots.length;
+}
+
+void frame_stack_drop_caller(struct frame_stack* self)
+{
+	struct frame* caller;
+	struct frame* top;
+
+	assert(self->frames_length > 1);
+	caller = &self->frames[self->frames_length - 2];
+	top = &self->frames[self->frames_length - 1];
+
+	/* The ring keeps its position, so only the data has to move */
+	memmove(caller->slots.data, top->slots.data,
+			top->slots.length * sizeof(size_t));
+	self->values_length -= caller->slots.length;
+
+	top->slots.data = caller->slots.data;
+	*caller = *top;
+	self->frames_length--;
+}
+
+void frame_stack_clear(struct frame_stack* self)
+{
+	self->frames_length = 0;
+	self->values_length = 0;
+}
+
+struct frame* frame_stack_top(const struct frame_stack* self)
+{
+	assert(self->frames_length > 0);
+	return &self->frames[self->frames_length - 1];
+}
+
+struct frame* frame_stack_caller(const struct frame_stack* self)
+{
+	assert(self->frames_length > 1);
+	return &self->frames[self->frames_length - 2];
+}
+
+size_t frame_stack_depth(const struct frame_stack* self)
+{
+	return self->frames_length;
+}
+
+static void frame_stack_grow_values(struct frame_stack* self,
+		size_t min_capacity)
+{
+	size_t offset = 0;
+	size_t i;
+
+	while(self->values_capacity < min_capacity) {
+		self->values_capacity *= 2;
+	}
+
+	self->values = (size_t*)realloc(self->values,
+			self->values_capacity * sizeof(size_t));
+	assert(self->values != NULL);
+
+	/* Frames are laid out back to back, so their views can be rebuilt from
+	   their lengths alone */
+	for(i = 0; i < self->frames_length; i++) {
+		struct ring_buffer* slots = &self->frames[i].slots;
+		slots->data = self->values + offset;
+		offset += slots->length;
+	}
+}
+
+static void frame_stack_grow_frames(struct frame_stack* self)
+{
+	self->frames_capacity *= 2;
+	self->frames = (struct frame*)realloc(self->frames,
+			self->frames_capacity * sizeof(struct frame));
+	assert(self->frames != NULL);
+}
+
+void frame_stack_unit_test(void)
+{
+	struct frame_stack test;
+	struct frame* frame;
+	size_t i;
+
+	frame_stack_create(&test);
+
+	frame = frame_stack_push(&test, 2, 7);
+	ring_buffer_add(&frame->slots, 1);
+	ring_buffer_add(&frame->slots, 2);
+
+	/* Enough frames to force both arrays to grow */
+	for(i = 0; i < DEFAULT_FRAMES_CAPACITY * 2; i++) {
+		frame = frame_stack_push(&test, DEFAULT_VALUES_CAPACITY / 64, i);
+		ring_buffer_add(&frame->slots, i);
+	}
+
+	for(i = DEFAULT_FRAMES_CAPACITY * 2; i > 0; i--) {
+		frame = frame_stack_top(&test);
+		assert(frame->return_ptr == i - 1);
+		assert(ring_buffer_get(&frame->slots, 0) == i - 1);
+		frame_stack_pop(&test);
+	}
+
+	frame = frame_stack_top(&test);
+	assert(frame_stack_depth(&test) == 1);
+	assert(frame->return_ptr == 7);
+	assert(ring_buffer_get(&frame->slots, 0) == 2);
+	assert(ring_buffer_get(&frame->slots, 1) == 1);
+
+	/* A tail call's frame takes the place of its caller's, and keeps its
+	   return address */
+	frame = frame_stack_push(&test, 3, 11);
+	ring_buffer_add(&frame->slots, 4);
+	ring_buffer_add(&frame->slots, 5);
+	ring_buffer_add(&frame->slots, 6);
+	ring_buffer_add(&frame->slots, 7);
+	frame_stack_drop_caller(&test);
+	frame = frame_stack_top(&test);
+	assert(frame_stack_depth(&test) == 1);
+	assert(test.values_length == 3);
+	assert(frame->return_ptr == 11);
+	assert(ring_buffer_get(&frame->slots, 0) == 7);
+	assert(ring_buffer_get(&frame->slots, 2) == 5);
+
+	frame_stack_pop(&test);
+	assert(frame_stack_depth(&test) == 0);
+	assert(test.values_length == 0);
+
+	frame_stack_release(&test);
+}
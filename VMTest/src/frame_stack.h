@@ -0,0 +1,56 @@
+#ifndef FRAME_STACK_INCLUDED_H
+#define FRAME_STACK_INCLUDED_H
+
+#include <stddef.h>
+#include "ring_buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct frame {
+	/* View into frame_stack's values; not owned by the frame */
+	struct ring_buffer slots;
+	/* Instruction to continue at when this frame returns */
+	size_t return_ptr;
+};
+
+/*
+ * A call stack where every frame's slots are carved out of one contiguous
+ * array of values with a bump pointer. Storage is only ever grown, so once
+ * a program has reached its deepest call, calls and returns don't touch
+ * the heap at all.
+ */
+struct frame_stack {
+	size_t* values;
+	size_t values_length;
+	size_t values_capacity;
+	struct frame* frames;
+	size_t frames_length;
+	size_t frames_capacity;
+};
+
+void frame_stack_create(struct frame_stack* self);
+void frame_stack_release(struct frame_stack* self);
+
+/* Pointers to frames are invalidated by pushing a new frame */
+struct frame* frame_stack_push(struct frame_stack* self, size_t size,
+		size_t return_ptr);
+void frame_stack_pop(struct frame_stack* self);
+/* Removes the frame below the top one, moving the top frame's values down
+   into its place. This is how a tail call gives up its caller's frame. */
+void frame_stack_drop_caller(struct frame_stack* self);
+void frame_stack_clear(struct frame_stack* self);
+
+struct frame* frame_stack_top(const struct frame_stack* self);
+/* Frame below the top one, which is the caller of the top one */
+struct frame* frame_stack_caller(const struct frame_stack* self);
+size_t frame_stack_depth(const struct frame_stack* self);
+
+void frame_stack_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,587 @@
+#include "fuzz.h"
+#include "interpreter.h"
+#include "timing.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+#include <assert.h>
+
+#define FUZZ_LINE_SIZE 128
+#define FUZZ_OPERAND_SIZE 16
+#define FUZZ_ARENA_CHUNK_SIZE 4096
+/* Each timing repeats the program until at least this much time has
+   passed */
+#define FUZZ_MIN_TIME 0.002
+
+/* Shape of the generated programs */
+#define FUZZ_MAX_FUNCTIONS 4
+#define FUZZ_MAX_PARAMS 3
+/* Slots a function reads beyond its parameters */
+#define FUZZ_MAX_LOCALS 6
+#define FUZZ_MAX_STATEMENTS 12
+/* Calls to other functions in each function, which with the recursion
+   budget keeps the number of calls in a run low */
+#define FUZZ_MAX_CALL_SITES 2
+#define FUZZ_MAX_BUDGET 2
+#define FUZZ_ITERATIONS 16
+#define FUZZ_MAX_CONSTANT 9
+
+struct fuzz_function {
+	size_t params;
+	/* Counts its first parameter down to 0, calling itself on the way */
+	int recursive;
+	/* Values every ret in it gives */
+	size_t returns;
+};
+
+struct generator {
+	uint64_t state;
+	struct vector* lines__charptr;
+	struct arena* arena;
+	struct fuzz_function functions[FUZZ_MAX_FUNCTIONS];
+	size_t functions_length;
+	/* Typed instructions, which native code leaves to the interpreter */
+	int typed;
+};
+
+/* The first is the reference, and each form of the program is first run
+   as the ring runs it */
+static const struct {
+	const char* name;
+	int optimize;
+	enum interpreter_mode mode;
+	enum interpreter_dispatch dispatch;
+} engines[] = {
+	{"reference", 0, INTERPRETER_MODE_RING, INTERPRETER_DISPATCH_SWITCH},
+	{"threaded", 0, INTERPRETER_MODE_RING, INTERPRETER_DISPATCH_THREADED},
+	{"optimized", 1, INTERPRETER_MODE_RING, INTERPRETER_DISPATCH_SWITCH},
+	{"optimized threaded", 1, INTERPRETER_MODE_RING,
+		INTERPRETER_DISPATCH_THREADED},
+	{"registers", 1, INTERPRETER_MODE_REGISTERS,
+		INTERPRETER_DISPATCH_SWITCH},
+	{"registers threaded", 1, INTERPRETER_MODE_REGISTERS,
+		INTERPRETER_DISPATCH_THREADED},
+	{"jit", 1, INTERPRETER_MODE_JIT, INTERPRETER_DISPATCH_SWITCH}
+};
+
+#define ENGINES_LENGTH (sizeof(engines) / sizeof(engines[0]))
+
+struct outcome {
+	enum interpreter_error error;
+	inttype result;
+	size_t instructions;
+	/* Seconds a run takes, or 0 if it wasn't timed */
+	double time;
+	/* Ran as the engine would, rather than falling back to another */
+	int native;
+};
+
+static uint64_t next_random(struct generator* g);
+static size_t random_below(struct generator* g, size_t n);
+static void add_line(struct generator* g, const char* format, ...);
+static void random_operand(struct generator* g, size_t window, char* out);
+static void generate_function(struct generator* g, size_t index);
+static void generate_statement(struct generator* g, size_t index,
+		size_t window, size_t* call_sites, size_t* labels,
+		size_t* pending, size_t* pending_length);
+static void generate_call(struct generator* g, size_t callee,
+		size_t window, int recursion);
+static void generate_ret(struct generator* g, size_t index, size_t window);
+static void generate_main(struct generator* g);
+
+static int run_program(const struct vector* lines__charptr, int timed,
+		struct outcome* outcomes);
+static int compare_outcomes(uint64_t seed, const struct outcome* outcomes,
+		const struct vector* lines__charptr);
+static void write_failure(const struct vector* lines__charptr);
+static int double_cmp(const void* a, const void* b);
+static void report_speedups(FILE* report, double** speedups,
+		const size_t* lengths, size_t programs);
+
+
+void fuzz_generate(uint64_t seed, struct vector* lines__charptr,
+		struct arena* arena)
+{
+	struct generator g;
+	size_t i;
+
+	/* Zero would stay zero */
+	g.state = seed * 0x9E3779B97F4A7C15ull + 1;
+	g.lines__charptr = lines__charptr;
+	g.arena = arena;
+	g.functions_length = 1 + random_below(&g, FUZZ_MAX_FUNCTIONS);
+	g.typed = random_below(&g, 8) == 0;
+
+	for(i = 0; i < g.functions_length; i++) {
+		struct fuzz_function* function = &g.functions[i];
+
+		function->params = random_below(&g, FUZZ_MAX_PARAMS + 1);
+		function->recursive = function->params > 0 &&
+			random_below(&g, 3) == 0;
+		/* main keeps its loop counter where one value leaves it */
+		function->returns = i == 0 || random_below(&g, 4) != 0 ? 1 : 2;
+	}
+
+	for(i = 0; i < g.functions_length; i++) {
+		generate_function(&g, i);
+	}
+	generate_main(&g);
+}
+
+int fuzz_run(uint64_t seed, size_t programs, FILE* report)
+{
+	struct outcome outcomes[ENGINES_LENGTH];
+	struct vector lines;
+	struct arena arena;
+	double* speedups[ENGINES_LENGTH];
+	size_t lengths[ENGINES_LENGTH];
+	int failed = 0;
+	size_t i, j;
+
+	arena_create(&arena, FUZZ_ARENA_CHUNK_SIZE);
+	vector_create(&lines, sizeof(char*), NULL);
+	for(j = 0; j < ENGINES_LENGTH; j++) {
+		speedups[j] = (double*)malloc((programs + 1) * sizeof(double));
+		assert(speedups[j] != NULL);
+		lengths[j] = 0;
+	}
+
+	for(i = 0; i < programs && !failed; i++) {
+		vector_clear(&lines);
+		arena_clear(&arena);
+		fuzz_generate(seed + i, &lines, &arena);
+
+		failed = run_program(&lines, report != NULL, outcomes) ||
+			compare_outcomes(seed + i, outcomes, &lines);
+
+		/* Only where the engine really ran, and the reference took long
+		   enough to tell anything */
+		for(j = 1; j < ENGINES_LENGTH && !failed && report != NULL; j++) {
+			if(outcomes[j].native && outcomes[j].time > 0.0) {
+				speedups[j][lengths[j]++] = outcomes[0].time /
+					outcomes[j].time;
+			}
+		}
+	}
+
+	if(!failed && report != NULL) {
+		fprintf(report, "%lu programs from seed %llu agree on every "
+				"engine\n\n", (unsigned long)programs,
+				(unsigned long long)seed);
+		report_speedups(report, speedups, lengths, programs);
+	}
+
+	for(j = 0; j < ENGINES_LENGTH; j++) {
+		free(speedups[j]);
+	}
+	vector_release(&lines);
+	arena_release(&arena);
+	return failed;
+}
+
+
+/* xorshift64*, so that a seed gives the same program everywhere */
+static uint64_t next_random(struct generator* g)
+{
+	g->state ^= g->state >> 12;
+	g->state ^= g->state << 25;
+	g->state ^= g->state >> 27;
+	return g->state * 0x2545F4914F6CDD1Dull;
+}
+
+static size_t random_below(struct generator* g, size_t n)
+{
+	return (size_t)((next_random(g) >> 32) % n);
+}
+
+static void add_line(struct generator* g, const char* format, ...)
+{
+	char line[FUZZ_LINE_SIZE];
+	char* copy;
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+
+	copy = arena_strdup(g->arena, line);
+	vector_push_back(g->lines__charptr, &copy);
+}
+
+/* One of the slots below window, or a constant */
+static void random_operand(struct generator* g, size_t window, char* out)
+{
+	if(random_below(g, 3) != 0) {
+		sprintf(out, "s%lu", (unsigned long)random_below(g, window));
+	} else {
+		sprintf(out, "%lu",
+				(unsigned long)random_below(g, FUZZ_MAX_CONSTANT + 1));
+	}
+}
+
+/*
+ * The function pushes until it has window values, then reads the deepest
+ * of them, so that its frame holds them all. Every later read is of one of
+ * the window most recent pushes.
+ */
+static void generate_function(struct generator* g, size_t index)
+{
+	const struct fuzz_function* function = &g->functions[index];
+	size_t window = function->params + 1 + random_below(g, FUZZ_MAX_LOCALS);
+	size_t statements = 1 + random_below(g, FUZZ_MAX_STATEMENTS);
+	size_t pending[FUZZ_MAX_STATEMENTS + 1];
+	size_t pending_length = 0;
+	size_t call_sites = 0;
+	size_t labels = 0;
+	char operand[FUZZ_OPERAND_SIZE];
+	size_t i;
+
+	add_line(g, "f%lu:", (unsigned long)index);
+	for(i = function->params; i < window; i++) {
+		add_line(g, "\tpush %lu",
+				(unsigned long)random_below(g, FUZZ_MAX_CONSTANT + 1));
+	}
+
+	if(function->recursive) {
+		/* The budget is the deepest slot, and the call goes first */
+		add_line(g, "\tequals? s%lu 0", (unsigned long)(window - 1));
+		add_line(g, "\tbranch f%lu_l%lu", (unsigned long)index,
+				(unsigned long)labels);
+		pending[pending_length++] = labels++;
+		add_line(g, "\tsub s%lu 1", (unsigned long)window);
+		generate_call(g, index, window, 1);
+	} else {
+		random_operand(g, window, operand);
+		add_line(g, "\tadd s%lu %s", (unsigned long)(window - 1), operand);
+	}
+
+	for(i = 0; i < statements; i++) {
+		generate_statement(g, index, window, &call_sites, &labels, pending,
+				&pending_length);
+	}
+
+	for(i = 0; i < pending_length; i++) {
+		add_line(g, "f%lu_l%lu:", (unsigned long)index,
+				(unsigned long)pending[i]);
+	}
+	generate_ret(g, index, window);
+}
+
+static void generate_statement(struct generator* g, size_t index,
+		size_t window, size_t* call_sites, size_t* labels,
+		size_t* pending, size_t* pending_length)
+{
+	static const char* const arithmetic[] = {
+		"add", "sub", "mul", "equals?"
+	};
+	static const char* const typed[] = {
+		"add.f", "sub.f", "mul.f", "equals?.f"
+	};
+	char a[FUZZ_OPERAND_SIZE];
+	char b[FUZZ_OPERAND_SIZE];
+	size_t kind = random_below(g, 10);
+
+	random_operand(g, window, a);
+	random_operand(g, window, b);
+
+	/* Places a label branched to before, now and then */
+	if(*pending_length > 0 && random_below(g, 3) == 0) {
+		add_line(g, "f%lu_l%lu:", (unsigned long)index,
+				(unsigned long)pending[--*pending_length]);
+	}
+
+	if(kind < 2) {
+		add_line(g, "\tpush %s", a);
+	} else if(kind < 5) {
+		add_line(g, "\t%s %s %s", arithmetic[random_below(g, 4)], a, b);
+	} else if(kind < 6) {
+		/* Division by a constant, which is never 0 */
+		add_line(g, "\tdiv %s %lu", a,
+				(unsigned long)(1 + random_below(g, FUZZ_MAX_CONSTANT)));
+	} else if(kind < 7 && g->typed) {
+		if(random_below(g, 2) == 0) {
+			add_line(g, "\t%s %s %s", typed[random_below(g, 4)], a, b);
+		} else {
+			add_line(g, "\t%s %s", random_below(g, 2) ? "itof" : "ftoi", a);
+		}
+	} else if(kind < 8) {
+		if(random_below(g, 2) == 0) {
+			add_line(g, "\tequals? %s %s", a, b);
+		}
+		add_line(g, "\tbranch f%lu_l%lu", (unsigned long)index,
+				(unsigned long)*labels);
+		pending[(*pending_length)++] = (*labels)++;
+	} else if(kind < 9 && index + 1 < g->functions_length &&
+			*call_sites < FUZZ_MAX_CALL_SITES) {
+		(*call_sites)++;
+		generate_call(g, index + 1 +
+				random_below(g, g->functions_length - index - 1), window, 0);
+	} else if(*pending_length > 0) {
+		/* Returns early, where a branch past it lands */
+		generate_ret(g, index, window);
+		add_line(g, "f%lu_l%lu:", (unsigned long)index,
+				(unsigned long)pending[--*pending_length]);
+	}
+}
+
+/* The budget of a recursive callee is a constant, but in its own calls,
+   where s0 holds it less one */
+static void generate_call(struct generator* g, size_t callee,
+		size_t window, int recursion)
+{
+	char line[FUZZ_LINE_SIZE];
+	char operand[FUZZ_OPERAND_SIZE];
+	size_t length;
+	size_t i;
+
+	length = (size_t)sprintf(line, "\tf%lu", (unsigned long)callee);
+	for(i = 0; i < g->functions[callee].params; i++) {
+		if(i == 0 && g->functions[callee].recursive && recursion) {
+			strcpy(operand, "s0");
+		} else if(i == 0 && g->functions[callee].recursive) {
+			sprintf(operand, "%lu",
+					(unsigned long)random_below(g, FUZZ_MAX_BUDGET + 1));
+		} else {
+			random_operand(g, window, operand);
+		}
+		length += (size_t)sprintf(line + length, " %s", operand);
+	}
+
+	add_line(g, "%s", line);
+}
+
+static void generate_ret(struct generator* g, size_t index, size_t window)
+{
+	char a[FUZZ_OPERAND_SIZE];
+	char b[FUZZ_OPERAND_SIZE];
+
+	random_operand(g, window, a);
+	if(g->functions[index].returns == 1) {
+		add_line(g, "\tret %s", a);
+	} else {
+		random_operand(g, window, b);
+		add_line(g, "\tret %s %s", a, b);
+	}
+}
+
+/* Calls f0 in a loop, summing what it gives. At the top of every
+   iteration, s2 is the counter, s1 the sum and s0 is 1. */
+static void generate_main(struct generator* g)
+{
+	char line[FUZZ_LINE_SIZE];
+	size_t length;
+	size_t i;
+
+	add_line(g, "main:");
+	add_line(g, "\tpush %lu", (unsigned long)FUZZ_ITERATIONS);
+	add_line(g, "\tpush 0");
+	add_line(g, "\tpush 1");
+	add_line(g, "main_loop:");
+	add_line(g, "\tsub s2 1");
+	add_line(g, "\tequals? s0 0");
+	add_line(g, "\tbranch main_done");
+
+	/* The counter is at s1 for the arguments */
+	length = (size_t)sprintf(line, "\tf0");
+	for(i = 0; i < g->functions[0].params; i++) {
+		if(i == 0 && g->functions[0].recursive) {
+			length += (size_t)sprintf(line + length, " %lu",
+					(unsigned long)random_below(g, FUZZ_MAX_BUDGET + 1));
+		} else {
+			length += (size_t)sprintf(line + length, " s%lu",
+					(unsigned long)(1 + random_below(g, 3)));
+		}
+	}
+	add_line(g, "%s", line);
+
+	add_line(g, "\tadd s0 s4");
+	add_line(g, "\tpush s3");
+	add_line(g, "\tpush s1");
+	add_line(g, "\tpush 1");
+	add_line(g, "\tbranch main_loop");
+	add_line(g, "main_done:");
+	add_line(g, "\tret s3");
+}
+
+
+/* Runs the program on every engine. Returns nonzero if it can't be
+   loaded. */
+static int run_program(const struct vector* lines__charptr, int timed,
+		struct outcome* outcomes)
+{
+	struct interpreter interp;
+	size_t i;
+
+	interpreter_create(&interp, NULL);
+	for(i = 0; i < vector_size(lines__charptr); i++) {
+		interpreter_add_line(&interp,
+				*(const char**)vector_at(lines__charptr, i));
+	}
+
+	for(i = 0; i < ENGINES_LENGTH; i++) {
+		struct outcome* outcome = &outcomes[i];
+		double start;
+		double elapsed;
+		size_t runs = 0;
+		inttype result;
+
+		interpreter_set_optimize(&interp, engines[i].optimize);
+		interpreter_set_mode(&interp, engines[i].mode);
+		interpreter_set_dispatch(&interp, engines[i].dispatch);
+
+		/* Also compiles the program */
+		outcome->result = 0;
+		outcome->error = interpreter_run(&interp, &outcome->result);
+		outcome->instructions = interp.instructions_executed;
+		outcome->time = 0.0;
+		outcome->native = interp.dispatch == engines[i].dispatch &&
+			(engines[i].mode == INTERPRETER_MODE_RING ||
+			 interp.registers >= 0) &&
+			(engines[i].mode != INTERPRETER_MODE_JIT || interp.jitted >= 0);
+
+		if(!timed || outcome->error != INTERPRETER_ERROR_NONE) {
+			continue;
+		}
+		start = timing_get_time();
+		do {
+			interpreter_run(&interp, &result);
+			runs++;
+			elapsed = timing_get_time() - start;
+		} while(elapsed < FUZZ_MIN_TIME);
+		outcome->time = elapsed / (double)runs;
+	}
+
+	interpreter_release(&interp);
+	return 0;
+}
+
+static int compare_outcomes(uint64_t seed, const struct outcome* outcomes,
+		const struct vector* lines__charptr)
+{
+	size_t i, j;
+
+	for(i = 1; i < ENGINES_LENGTH; i++) {
+		const struct outcome* reference = &outcomes[0];
+		const char* what = NULL;
+
+		/* The first engine running the same form counts the same */
+		for(j = 0; engines[j].optimize != engines[i].optimize; j++) {
+		}
+
+		if(outcomes[i].error != reference->error) {
+			what = "error";
+		} else if(reference->error == INTERPRETER_ERROR_NONE &&
+				outcomes[i].result != reference->result) {
+			what = "result";
+		} else if(outcomes[i].instructions != outcomes[j].instructions) {
+			reference = &outcomes[j];
+			what = "instruction count";
+		}
+		if(what == NULL) {
+			continue;
+		}
+
+		fprintf(stderr, "Error: Program of seed %llu gives a different %s "
+				"on the %s engine than on the %s one:\n"
+				"  result %lu, error %d, %lu instructions\n"
+				"  result %lu, error %d, %lu instructions\n"
+				"It's written to " FUZZ_FAILURE_FILE "\n",
+				(unsigned long long)seed, what, engines[i].name,
+				engines[reference == &outcomes[0] ? 0 : j].name,
+				(unsigned long)outcomes[i].result, outcomes[i].error,
+				(unsigned long)outcomes[i].instructions,
+				(unsigned long)reference->result, reference->error,
+				(unsigned long)reference->instructions);
+		write_failure(lines__charptr);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void write_failure(const struct vector* lines__charptr)
+{
+	FILE* file = fopen(FUZZ_FAILURE_FILE, "w");
+	size_t i;
+
+	if(file == NULL) {
+		fprintf(stderr, "Error: " FUZZ_FAILURE_FILE " could not be "
+				"written\n");
+		return;
+	}
+	for(i = 0; i < vector_size(lines__charptr); i++) {
+		fprintf(file, "%s\n", *(const char**)vector_at(lines__charptr, i));
+	}
+	fclose(file);
+}
+
+static int double_cmp(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Percentiles of the speedups of every engine, over the programs it ran
+   on as itself */
+static void report_speedups(FILE* report, double** speedups,
+		const size_t* lengths, size_t programs)
+{
+	size_t i, j;
+
+	fprintf(report, "Speedup over the reference, per program:\n");
+	fprintf(report, "%-20s %8s %8s %8s %8s %8s %8s %9s\n", "engine",
+			"min", "p10", "median", "p90", "max", "geomean", "programs");
+	for(i = 1; i < ENGINES_LENGTH; i++) {
+		const double* values = speedups[i];
+		size_t length = lengths[i];
+		double log_sum = 0.0;
+
+		if(length == 0) {
+			fprintf(report, "%-20s %8s %8s %8s %8s %8s %8s %4lu/%-4lu\n",
+					engines[i].name, "-", "-", "-", "-", "-", "-",
+					(unsigned long)length, (unsigned long)programs);
+			continue;
+		}
+
+		qsort(speedups[i], length, sizeof(double), double_cmp);
+		for(j = 0; j < length; j++) {
+			log_sum += log(values[j]);
+		}
+		fprintf(report, "%-20s %7.2fx %7.2fx %7.2fx %7.2fx %7.2fx %7.2fx "
+				"%4lu/%-4lu\n", engines[i].name, values[0],
+				values[length / 10], values[length / 2],
+				values[length * 9 / 10], values[length - 1],
+				exp(log_sum / (double)length), (unsigned long)length,
+				(unsigned long)programs);
+	}
+}
+
+
+void fuzz_unit_test(void)
+{
+	struct vector first;
+	struct vector second;
+	struct arena arena;
+	size_t i;
+
+	/* A seed always gives the same program */
+	arena_create(&arena, FUZZ_ARENA_CHUNK_SIZE);
+	vector_create(&first, sizeof(char*), NULL);
+	vector_create(&second, sizeof(char*), NULL);
+	fuzz_generate(42, &first, &arena);
+	fuzz_generate(42, &second, &arena);
+	assert(vector_size(&first) == vector_size(&second));
+	for(i = 0; i < vector_size(&first); i++) {
+		assert(!strcmp(*(const char**)vector_at(&first, i),
+					*(const char**)vector_at(&second, i)));
+	}
+	vector_release(&first);
+	vector_release(&second);
+	arena_release(&arena);
+
+	assert(fuzz_run(1, 50, NULL) == 0);
+}
@@ -0,0 +1,49 @@
+#ifndef FUZZ_INCLUDED_H
+#define FUZZ_INCLUDED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "vector.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Where the first program the engines disagree on is written */
+#define FUZZ_FAILURE_FILE "fuzz_failure.asm"
+
+/*
+ * Writes a random valid program into lines (struct vector<char*>), with
+ * the lines allocated from the arena. Functions only call the ones after
+ * them, or themselves with a budget that runs out, and only branch
+ * forwards, apart from the loop in main, so every program ends. Slots are
+ * only read once the frame has pushed to them, and the frame is always
+ * large enough to hold them.
+ */
+void fuzz_generate(uint64_t seed, struct vector* lines__charptr,
+		struct arena* arena);
+
+/*
+ * Runs the programs of seeds seed to seed + programs - 1 on every engine:
+ * the ring buffer as written with switch dispatch, which is the reference,
+ * then threaded dispatch, the optimizer, the register form and native
+ * code. Stops at the first program that gives a different result or error
+ * than the reference, or a different instruction count than an engine
+ * running the same form of it, and writes it to FUZZ_FAILURE_FILE.
+ *
+ * If report isn't NULL, every engine is also timed on every program, and
+ * the distribution of its speedups over the reference is written to it.
+ * Returns nonzero on failure.
+ */
+int fuzz_run(uint64_t seed, size_t programs, FILE* report);
+
+void fuzz_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
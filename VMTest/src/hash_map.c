@@ -0,0 +1,208 @@
+#include "hash_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#define DEFAULT_CAPACITY 16
+
+static size_t hash_pointer(const void* key);
+static size_t hash_map_find_slot(const struct hash_map* self,
+		const void* key);
+static void hash_map_grow(struct hash_map* self);
+
+
+void hash_map_create(struct hash_map* self, size_t value_size)
+{
+	hash_map_create_arena(self, value_size, NULL);
+}
+
+void hash_map_create_arena(struct hash_map* self, size_t value_size,
+		struct arena* arena)
+{
+	assert(value_size > 0);
+	self->value_size = value_size;
+	self->length = 0;
+	self->capacity = DEFAULT_CAPACITY;
+	self->arena = arena;
+	self->keys = (const void**)arena_heap_calloc(arena, self->capacity,
+			sizeof(void*));
+	self->values = arena_heap_alloc(arena, self->capacity * self->value_size);
+
+	assert(self->keys != NULL && self->values != NULL);
+}
+
+void hash_map_release(struct hash_map* self)
+{
+	arena_heap_free(self->arena, (void*)self->keys);
+	arena_heap_free(self->arena, self->values);
+}
+
+size_t hash_map_size(const struct hash_map* self)
+{
+	return self->length;
+}
+
+void* hash_map_at(const struct hash_map* self, const void* key)
+{
+	size_t slot = hash_map_find_slot(self, key);
+
+	if(self->keys[slot] == NULL) {
+		return NULL;
+	}
+
+	return (char*)self->values + slot * self->value_size;
+}
+
+void hash_map_visit(const struct hash_map* self,
+		void* userdata,
+		void(*fn)(void* userdata, void* key, void* value))
+{
+	size_t i;
+
+	for(i = 0; i < self->capacity; i++) {
+		if(self->keys[i] != NULL) {
+			fn(userdata, (void*)&self->keys[i],
+					(char*)self->values + i * self->value_size);
+		}
+	}
+}
+
+void hash_map_insert(struct hash_map* self, const void* key,
+		const void* value)
+{
+	size_t slot;
+
+	assert(key != NULL);
+
+	/* Keep the load factor at or below one half */
+	if((self->length + 1) * 2 > self->capacity) {
+		hash_map_grow(self);
+	}
+
+	slot = hash_map_find_slot(self, key);
+	if(self->keys[slot] == NULL) {
+		self->keys[slot] = key;
+		self->length++;
+	}
+
+	memcpy((char*)self->values + slot * self->value_size, value,
+			self->value_size);
+}
+
+void hash_map_clear(struct hash_map* self)
+{
+	memset(self->keys, 0, self->capacity * sizeof(void*));
+	self->length = 0;
+}
+
+
+static size_t hash_pointer(const void* key)
+{
+	uint64_t h = (uint64_t)(uintptr_t)key;
+
+	/* Finalizer from MurmurHash3, so aligned pointers spread across all of
+	   the low bits */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (size_t)h;
+}
+
+/* Slot holding key, or the empty slot where it would be inserted */
+static size_t hash_map_find_slot(const struct hash_map* self,
+		const void* key)
+{
+	size_t mask = self->capacity - 1;
+	size_t slot = hash_pointer(key) & mask;
+
+	while(self->keys[slot] != NULL && self->keys[slot] != key) {
+		slot = (slot + 1) & mask;
+	}
+
+	return slot;
+}
+
+static void hash_map_grow(struct hash_map* self)
+{
+	const void** old_keys = self->keys;
+	void* old_values = self->values;
+	size_t old_capacity = self->capacity;
+	size_t i;
+
+	self->capacity *= 2;
+	self->keys = (const void**)arena_heap_calloc(self->arena, self->capacity,
+			sizeof(void*));
+	self->values = arena_heap_alloc(self->arena,
+			self->capacity * self->value_size);
+	assert(self->keys != NULL && self->values != NULL);
+
+	for(i = 0; i < old_capacity; i++) {
+		size_t slot;
+
+		if(old_keys[i] == NULL) {
+			continue;
+		}
+
+		slot = hash_map_find_slot(self, old_keys[i]);
+		self->keys[slot] = old_keys[i];
+		memcpy((char*)self->values + slot * self->value_size,
+				(char*)old_values + i * self->value_size, self->value_size);
+	}
+
+	arena_heap_free(self->arena, (void*)old_keys);
+	arena_heap_free(self->arena, old_values);
+}
+
+
+static void visit_sum(void* userdata, void* key, void* value)
+{
+	int* a = *(int**)key;
+	int b = *(int*)value;
+
+	assert(b == (*a * 2));
+	*(int*)userdata += b;
+}
+
+void hash_map_unit_test(void)
+{
+	struct hash_map m;
+	int keys[100];
+	int sum = 0;
+	int b;
+	size_t i;
+
+	hash_map_create(&m, sizeof(int));
+
+	/* Enough keys to make the table grow a few times */
+	for(i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+		keys[i] = (int)i;
+		b = (int)i * 2;
+		hash_map_insert(&m, &keys[i], &b);
+	}
+
+	for(i = 0; i < sizeof(keys)/sizeof(keys[0]); i++) {
+		assert(*(int*)hash_map_at(&m, &keys[i]) == keys[i] * 2);
+	}
+
+	b = 1337;
+	hash_map_insert(&m, &keys[3], &b);
+	assert(*(int*)hash_map_at(&m, &keys[3]) == 1337);
+	assert(hash_map_size(&m) == sizeof(keys)/sizeof(keys[0]));
+	assert(hash_map_at(&m, &sum) == NULL);
+
+	b = 6;
+	hash_map_insert(&m, &keys[3], &b);
+	hash_map_visit(&m, &sum, visit_sum);
+	assert(sum == 99 * 100);
+
+	hash_map_clear(&m);
+	assert(hash_map_size(&m) == 0);
+	assert(hash_map_at(&m, &keys[0]) == NULL);
+
+	hash_map_release(&m);
+}
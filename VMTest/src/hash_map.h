@@ -0,0 +1,53 @@
+#ifndef HASH_MAP_INCLUDED_H
+#define HASH_MAP_INCLUDED_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Open-addressing hash table keyed by pointer identity. Keys are never
+ * dereferenced, so string keys should be interned through a string_table
+ * first; equal strings then compare as equal pointers, and a lookup costs a
+ * hash of the pointer plus a few probes rather than any strcmp calls.
+ *
+ * NULL can't be used as a key.
+ */
+struct hash_map {
+	size_t value_size;
+	size_t length;
+	/* Always a power of two */
+	size_t capacity;
+	const void** keys;
+	void* values;
+	/* Where the tables are allocated, or NULL for the heap */
+	struct arena* arena;
+};
+
+void hash_map_create(struct hash_map* self, size_t value_size);
+void hash_map_create_arena(struct hash_map* self, size_t value_size,
+		struct arena* arena);
+void hash_map_release(struct hash_map* self);
+
+size_t hash_map_size(const struct hash_map* self);
+void* hash_map_at(const struct hash_map* self, const void* key);
+/* The key passed to fn points at the stored key, like map_visit_order */
+void hash_map_visit(const struct hash_map* self,
+		void* userdata,
+		void(*fn)(void* userdata, void* key, void* value));
+
+void hash_map_insert(struct hash_map* self, const void* key,
+		const void* value);
+void hash_map_clear(struct hash_map* self);
+
+void hash_map_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
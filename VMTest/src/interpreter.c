@@ -1,181 +1,329 @@
 #include "interpreter.h"
-#include "ring_buffer.h"
+#include "registers.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
 
 #define STARTUP_FUNCTION "main"
-#define COMMENT_CHAR ';'
+#define COMMENT_CHARS ";"
 #define STACK_CHAR 's'
 #define LABEL_END_CHAR ':'
+#define TOKEN_DELIMITERS " \t\r\n"
+#define ARENA_CHUNK_SIZE (64 * 1024)
+/* Chunks a batch is split into for every worker */
+#define BATCH_CHUNKS 16
 
 #define INTERPRETER_TRY(error, line) \
 	if((error = line) != INTERPRETER_ERROR_NONE) return error
 
 
-struct stack_frame_sizes_userdata {
-	enum interpreter_error error;
+struct label_frame_sizes_userdata {
+	struct interpreter* self;
+	size_t* label_frame_sizes;
+	size_t length;
+};
+
+struct batch_userdata {
+	const struct interpreter* self;
+	/* One per worker */
+	struct interpreter_context* contexts;
+	const inttype* arguments;
+	size_t arguments_length;
+	inttype* results;
+	enum interpreter_error* errors;
+};
+
+struct dump_labels_userdata {
+	struct interpreter* self;
+	const char** label_names;
+};
+
+struct cache_labels_userdata {
 	struct interpreter* self;
+	/* (struct vector<struct program_cache_label>) */
+	struct vector labels__struct_program_cache_label;
+	/* Name of every label, in the same order */
+	/* (struct vector<char*>) */
+	struct vector names__charptr;
+	size_t names_size;
 };
 
 /* Data Structure Functions */
-static int charptr_cmp_fn(const void* a, const void* b);
-static void charptr_free_visit_fn(void* userdata, void* keyIn, void* valIn);
-static void build_stack_frame_sizes_visit_fn(void* userdata, 
-		void* keyIn, void* valIn);
+static void label_frame_sizes_visit_fn(void* userdata, void* keyIn,
+		void* valIn);
+static void dump_labels_visit_fn(void* userdata, void* keyIn, void* valIn);
+static void cache_labels_visit_fn(void* userdata, void* keyIn, void* valIn);
+
+/* Cache Functions */
+static void write_cache(struct interpreter* self, const char* file_name,
+		uint64_t source_hash, size_t source_length);
+static void drop_cache(struct interpreter* self);
 
 /* Internal Stack Functions */
-static void enter_stack_frame(struct interpreter* self, inttype size);
-static void leave_stack_frame(struct interpreter* self);
-static inttype get_stack_val(struct interpreter* self, inttype val);
-static void stack_push(struct interpreter* self, inttype val);
+static struct frame* enter_stack_frame(struct interpreter_context* context,
+		inttype size);
+static void leave_stack_frame(struct interpreter_context* context);
+static inttype get_stack_val(struct interpreter_context* context,
+		inttype val);
+static void reset_stacks(struct interpreter_context* context);
+static inttype get_operand_val(const struct ring_buffer* frame,
+		const struct operand* operand);
+static inttype get_register_val(const size_t* slots,
+		const struct operand* operand);
+static double word_to_f64(inttype word);
+static inttype f64_to_word(double value);
+static int64_t f64_to_i64(double value);
+static void reset_register_code(struct interpreter* self);
+static int prepare_register_code(struct interpreter* self);
+static int prepare_jit(struct interpreter* self);
 
 /* Internal Labeling Functions */
 static void add_label(struct interpreter* self, const char* key);
-static enum interpreter_error goto_label(struct interpreter* self,
-		const char* label);
-static enum interpreter_error call_function(struct interpreter* self,
-		const char* label);
-static void return_function(struct interpreter* self);
+static size_t find_label(struct interpreter* self, const char* label);
+static size_t* find_frame_size(struct interpreter* self, const char* label);
+static size_t map_instruction(struct interpreter* self, size_t index);
+static int contains_label(const struct vector* labels, const char* label);
+static enum interpreter_error call_function(
+		struct interpreter_context* context, const struct instruction* ins,
+		const struct operand* operands, size_t operands_length,
+		int registers);
+static enum interpreter_error tail_call_function(
+		struct interpreter_context* context, const struct instruction* ins,
+		const struct operand* operands, size_t operands_length,
+		int registers);
+static void return_function(struct interpreter_context* context,
+		const struct operand* operands, size_t operands_length,
+		int registers);
 
 /* Parsing Functions */
-static void remove_comments(char* line);
+static void add_file_view(struct interpreter* self,
+		const struct io_file_view* file);
+static void add_source_line(struct interpreter* self, char* line);
 static char string_to_inttype(const char* str, inttype* resultPtr);
-static void strlower(char* str);
-static void instruction_to_tokens(struct vector* tokens, char* line);
+static void instruction_to_tokens(const struct tokenizer_classes* classes,
+		struct vector* tokens, char* line);
+
+/* Compilation Functions */
+static enum interpreter_error compile_line(struct interpreter* self,
+		const struct program_line* line);
+static enum interpreter_error compile_operand(struct interpreter* self,
+		const char* token, enum value_type type);
+static enum interpreter_error decode_lines(struct interpreter* self);
+static size_t function_frame_size(struct interpreter* self,
+		const char* label, int* closed);
+static enum value_type function_result_type(struct interpreter* self,
+		const char* label);
+static int refresh_frame_sizes(struct interpreter* self);
+static const char* site_label(struct interpreter* self, size_t index);
+static enum interpreter_error resolve_site(struct interpreter* self,
+		size_t index);
+static enum interpreter_error link_calls(struct interpreter* self,
+		int labels_added);
+static void copy_vector(struct vector* destination,
+		const struct vector* source);
+static void optimize(struct interpreter* self);
 
 /* Interpretation Functions */
-static enum interpreter_error get_parameters(struct interpreter* self,
-		struct vector* result, struct vector* tokens);
-static enum interpreter_error interpret_line(struct interpreter* self,
-		struct vector* tokens);
-static enum interpreter_error build_stack_frame_sizes(struct interpreter* self);
-
-
-void interpreter_create(struct interpreter* self)
+static void run_batch_fn(void* userdata, size_t begin, size_t end,
+		size_t worker);
+static enum interpreter_error interpret_switch(
+		const struct interpreter* self, struct interpreter_context* context);
+static enum interpreter_error interpret_switch_registers(
+		const struct interpreter* self, struct interpreter_context* context);
+#ifdef INTERPRETER_HAS_THREADED_DISPATCH
+static enum interpreter_error interpret_threaded(
+		const struct interpreter* self, struct interpreter_context* context);
+static enum interpreter_error interpret_threaded_registers(
+		const struct interpreter* self, struct interpreter_context* context);
+#endif
+#ifdef VM_PROFILE
+static enum interpreter_error interpret_profiled(
+		const struct interpreter* self, struct interpreter_context* context);
+#endif
+
+
+void interpreter_create(struct interpreter* self, struct arena* arena)
 {
-	vector_create(&self->instruction_ptrs__size_t, 
-			sizeof(size_t), NULL);
-	vector_create(&self->function_stacks__struct_ring_buffer, 
-			sizeof(struct ring_buffer), NULL);
-	vector_create(&self->program__struct_vector__charptr, 
-			sizeof(struct vector), NULL);
-
-	map_create(&self->labels__charptr__size_t, 
-			sizeof(char*), sizeof(size_t), 
-			charptr_cmp_fn);
-	map_create(&self->stack_frame_sizes__charptr__size_t, 
-			sizeof(char*), sizeof(size_t),
-			charptr_cmp_fn);
-
-	self->instruction_ptr = 0;
+	self->owns_arena = arena == NULL;
+	if(self->owns_arena) {
+		arena_create(&self->owned_arena, ARENA_CHUNK_SIZE);
+		arena = &self->owned_arena;
+	}
+	self->arena = arena;
+
+	/* The frame stack is resized while running, so it stays on the heap */
+	interpreter_context_create(&self->context);
+	vector_create_arena(&self->program__struct_program_line, 
+			sizeof(struct program_line), NULL, arena);
+	vector_create_arena(&self->files__struct_io_file_view,
+			sizeof(struct io_file_view), NULL, arena);
+	vector_create_arena(&self->line_tokens__charptr, sizeof(char*), NULL,
+			arena);
+	tokenizer_classes_create(&self->token_classes, TOKEN_DELIMITERS,
+			COMMENT_CHARS);
+	vector_create_arena(&self->decoded_instructions__struct_instruction,
+			sizeof(struct instruction), NULL, arena);
+	vector_create_arena(&self->decoded_operands__struct_operand,
+			sizeof(struct operand), NULL, arena);
+	vector_create_arena(&self->call_sites__size_t, sizeof(size_t), NULL,
+			arena);
+	vector_create_arena(&self->unresolved_sites__size_t, sizeof(size_t),
+			NULL, arena);
+	vector_create_arena(&self->changed_labels__charptr, sizeof(char*), NULL,
+			arena);
+	vector_create_arena(&self->open_labels__charptr, sizeof(char*), NULL,
+			arena);
+	vector_create_arena(&self->stale_labels__charptr, sizeof(char*), NULL,
+			arena);
+	vector_create_arena(&self->instructions__struct_instruction,
+			sizeof(struct instruction), NULL, arena);
+	vector_create_arena(&self->operands__struct_operand,
+			sizeof(struct operand), NULL, arena);
+	vector_create_arena(&self->threaded_code__voidptr,
+			sizeof(void*), NULL, arena);
+	vector_create_arena(&self->instruction_map__size_t,
+			sizeof(size_t), NULL, arena);
+	vector_create_arena(&self->register_instructions__struct_instruction,
+			sizeof(struct instruction), NULL, arena);
+	vector_create_arena(&self->register_operands__struct_operand,
+			sizeof(struct operand), NULL, arena);
+	vector_create_arena(&self->register_threaded_code__voidptr,
+			sizeof(void*), NULL, arena);
+
+	string_table_create_arena(&self->label_names, arena);
+	hash_map_create_arena(&self->labels__charptr__size_t, sizeof(size_t),
+			arena);
+	hash_map_create_arena(&self->stack_frame_sizes__charptr__size_t, 
+			sizeof(size_t), arena);
+
+	self->code.instructions = NULL;
+	self->code.instructions_length = 0;
+	self->code.operands = NULL;
+	self->code.operands_length = 0;
+	self->code.startup_target = BYTECODE_UNRESOLVED;
+	self->code.startup_frame_size = 1;
+	self->code.result_type = VALUE_TYPE_WORD;
+	self->linked_sites = 0;
+	self->profiler = NULL;
+	self->cache_loaded = 0;
+	self->registers = 0;
+	self->jitted = 0;
+
+	self->arguments_length = 0;
+	self->compiled = 0;
+	self->optimize = 1;
+	memset(&self->optimizer_stats, 0, sizeof(self->optimizer_stats));
+	self->instructions_executed = 0;
+	interpreter_set_dispatch(self, INTERPRETER_DISPATCH_THREADED);
+	self->mode = INTERPRETER_MODE_JIT;
 }
 
 void interpreter_release(struct interpreter* self)
 {
-	size_t i, j;
-
-	/* The keys in this map are the same as the keys in labels, so they
-	   don't need to be freed */
-	map_release(&self->stack_frame_sizes__charptr__size_t);
-
-	map_visit_prefix(&self->labels__charptr__size_t, NULL,
-			charptr_free_visit_fn);
-	map_release(&self->labels__charptr__size_t);
-
-	for(i = 0; i < vector_size(&self->program__struct_vector__charptr); i++) {
-
-		for(j = 0; j < vector_size((struct vector*)
-					vector_at(&self->program__struct_vector__charptr, i));
-				j++) {
+	size_t i;
 
-			free(*(char**)vector_at((struct vector*)
-						vector_at(&self->program__struct_vector__charptr, 
-							i), j));
-		}
-		vector_release((struct vector*)
-				vector_at(&self->program__struct_vector__charptr, i));
+	if(self->cache_loaded) {
+		program_cache_close(&self->cache);
 	}
 
-	vector_release(&self->program__struct_vector__charptr);
+	/* Everything else is in the arena, so releasing it is all that's left */
+	for(i = 0; i < vector_size(&self->files__struct_io_file_view); i++) {
+		io_file_view_close((struct io_file_view*)
+				vector_at(&self->files__struct_io_file_view, i));
+	}
 
-	for(i = 0; i < vector_size(&self->function_stacks__struct_ring_buffer); 
-			i++) {
-		ring_buffer_release(
-				(struct ring_buffer*)vector_at(
-					&self->function_stacks__struct_ring_buffer, i));
+	if(self->jitted > 0) {
+		jit_release(&self->jit);
 	}
+	interpreter_context_release(&self->context);
+	if(self->owns_arena) {
+		arena_release(&self->owned_arena);
+	}
+}
 
-	vector_release(&self->function_stacks__struct_ring_buffer);
-	vector_release(&self->instruction_ptrs__size_t);
+void interpreter_add_line(struct interpreter* self, const char* line)
+{
+	add_source_line(self, arena_strdup(self->arena, line));
 }
 
-void interpreter_add_line(struct interpreter* self, const char* lineIn)
+enum io_error interpreter_add_file(struct interpreter* self,
+		const char* file_name)
 {
-	struct vector tokens;
-	size_t lineLength = strlen(lineIn) + 1;
-	char* line = (char*)malloc(lineLength);
-	char* ins;
-	size_t insEndPos;
+	enum io_error error;
+	struct io_file_view file;
 
-	memcpy(line, lineIn, lineLength);
-	remove_comments(line);
+	drop_cache(self);
 
-	/* Nothing in this line; safe to ignore */
-	if(!line[0]) {
-		goto add_line_cleanup_1;
+	error = io_file_view_open(&file, file_name);
+	if(error != IO_ERROR_NONE) {
+		return error;
 	}
-	
-	vector_create(&tokens, sizeof(char*), NULL);
-	instruction_to_tokens(&tokens, line);
+	vector_push_back(&self->files__struct_io_file_view, &file);
+	add_file_view(self, &file);
 
-	/* No code in this line; safe to ignore */
-	if(vector_size(&tokens) == 0) {
-		goto add_line_cleanup_2;
-	}
+	return IO_ERROR_NONE;
+}
 
-	ins = *(char**)vector_at(&tokens, 0);
-	insEndPos = strlen(ins) - 1;
+enum io_error interpreter_add_file_cached(struct interpreter* self,
+		const char* file_name)
+{
+	enum io_error error;
+	struct io_file_view file;
+	size_t name_length = strlen(file_name);
+	char* cache_name;
+	uint64_t source_hash;
+
+	/* Only a whole program is cached */
+	if(self->cache_loaded ||
+			!vector_empty(&self->program__struct_program_line) ||
+			hash_map_size(&self->labels__charptr__size_t) > 0) {
+		return interpreter_add_file(self, file_name);
+	}
 
-	if(ins[insEndPos] != LABEL_END_CHAR) {
-		/* Line is valid code. Register it, delete string, but keep token data
-		   for later interprettation */
-		vector_push_back(&self->program__struct_vector__charptr, &tokens);
-		self->instruction_ptr++;
-		goto add_line_cleanup_1;
-	} 
-	
-	
-	/* Line is a label. Register it, and delete extra token data */
-	ins[insEndPos] = 0; /* Remove end char; it's just a marker */
-	add_label(self, ins);
-	assert(vector_size(&tokens) == 1);
+	error = io_file_view_open(&file, file_name);
+	if(error != IO_ERROR_NONE) {
+		return error;
+	}
+	vector_push_back(&self->files__struct_io_file_view, &file);
+
+	cache_name = (char*)arena_alloc(self->arena,
+			name_length + sizeof(PROGRAM_CACHE_EXTENSION));
+	memcpy(cache_name, file_name, name_length);
+	memcpy(cache_name + name_length, PROGRAM_CACHE_EXTENSION,
+			sizeof(PROGRAM_CACHE_EXTENSION));
+
+	source_hash = program_cache_hash(file.data, file.length);
+	if(program_cache_open(&self->cache, cache_name, source_hash,
+				file.length, self->optimize ?
+					PROGRAM_CACHE_OPTION_OPTIMIZED : 0) == IO_ERROR_NONE) {
+		vector_clear(&self->threaded_code__voidptr);
+		reset_register_code(self);
+		self->code = self->cache.code;
+		self->cache_loaded = 1;
+		self->compiled = 1;
+		return IO_ERROR_NONE;
+	}
 
-	/* Don't delete the first element; it's kept around as the label */
-	for(size_t i = 1; i < vector_size(&tokens); i++) {
-		free(*(char**)vector_at(&tokens, i));
+	/* Programs that fail to compile are left for interpreter_run to report,
+	   as they would be without the cache. Failing to write the cache only
+	   means it's compiled again next time. */
+	add_file_view(self, &file);
+	if(interpreter_compile(self) == INTERPRETER_ERROR_NONE) {
+		write_cache(self, cache_name, source_hash, file.length);
 	}
 
-add_line_cleanup_2:
-	vector_release(&tokens);
-add_line_cleanup_1:
-	free(line);
+	return IO_ERROR_NONE;
 }
 
-enum io_error interpreter_add_file(struct interpreter* self,
-		const char* file_name)
+enum io_error interpreter_add_stream(struct interpreter* self, FILE* file)
 {
 	enum io_error error;
 	char* line;
 	size_t line_alloc_size;
-	FILE* file;
-
-	file = fopen(file_name, "r");
-	if(file == NULL) {
-		return IO_ERROR_FILE_NOT_FOUND;
-	}
 
 	line_alloc_size = 128;
 	line = (char*)malloc(sizeof(char) * line_alloc_size);
@@ -187,7 +335,6 @@ enum io_error interpreter_add_file(struct interpreter* self,
 	}
 
 	free(line);
-	fclose(file);
 	
 	if(error == IO_ERROR_EOF) {
 		return IO_ERROR_NONE;
@@ -196,228 +343,1029 @@ enum io_error interpreter_add_file(struct interpreter* self,
 	}
 }
 
+enum interpreter_error interpreter_compile(struct interpreter* self)
+{
+	enum interpreter_error error;
+	size_t* startup_frame_size;
+
+	drop_cache(self);
+
+	vector_clear(&self->threaded_code__voidptr);
+	reset_register_code(self);
+	self->compiled = 0;
+	/* Counts are only meaningful for the code they were made on */
+	if(self->profiler != NULL) {
+		profiler_clear(self->profiler);
+	}
+
+	INTERPRETER_TRY(error, decode_lines(self));
+	INTERPRETER_TRY(error, link_calls(self, refresh_frame_sizes(self)));
+
+	/* The optimizer rewrites the program in place, so it gets a copy */
+	copy_vector(&self->instructions__struct_instruction,
+			&self->decoded_instructions__struct_instruction);
+	copy_vector(&self->operands__struct_operand,
+			&self->decoded_operands__struct_operand);
+	optimize(self);
+
+	self->code.instructions = (const struct instruction*)vector_to_array(
+			&self->instructions__struct_instruction);
+	self->code.instructions_length =
+		vector_size(&self->instructions__struct_instruction);
+	self->code.operands = (const struct operand*)vector_to_array(
+			&self->operands__struct_operand);
+	self->code.operands_length = vector_size(&self->operands__struct_operand);
+
+	startup_frame_size = find_frame_size(self, STARTUP_FUNCTION);
+	self->code.startup_target = map_instruction(self,
+			find_label(self, STARTUP_FUNCTION));
+	self->code.startup_frame_size =
+		startup_frame_size != NULL ? *startup_frame_size : 1;
+	self->code.result_type = function_result_type(self, STARTUP_FUNCTION);
+
+	self->compiled = 1;
+	return INTERPRETER_ERROR_NONE;
+}
+
 enum interpreter_error interpreter_run(struct interpreter* self,
 		inttype* result)
 {
 	enum interpreter_error error;
 
-	INTERPRETER_TRY(error, build_stack_frame_sizes(self));
+	INTERPRETER_TRY(error, interpreter_prepare(self, 0));
+
+	/* A bailout leaves nothing behind, so the program is simply run again
+	   by the interpreter */
+	if(self->mode == INTERPRETER_MODE_JIT && self->registers > 0 &&
+			self->profiler == NULL && prepare_jit(self) &&
+			jit_run(&self->jit, result, &self->instructions_executed) ==
+			JIT_ERROR_NONE) {
+		return INTERPRETER_ERROR_NONE;
+	}
+
+	self->context.profiler = self->profiler;
+	error = interpreter_run_context(self, &self->context, NULL, result);
+	self->instructions_executed = self->context.instructions_executed;
+
+	return error;
+}
+
+enum interpreter_error interpreter_prepare(struct interpreter* self,
+		size_t arguments_length)
+{
+	enum interpreter_error error;
+
+	if(!self->compiled) {
+		INTERPRETER_TRY(error, interpreter_compile(self));
+	}
+
+	if(self->arguments_length != arguments_length) {
+		reset_register_code(self);
+		self->arguments_length = arguments_length;
+	}
+
+	/* Profiles are of the program as compiled, so they're made on the
+	   ring */
+	if(self->mode != INTERPRETER_MODE_RING && self->profiler == NULL) {
+		prepare_register_code(self);
+	}
+
+#ifdef INTERPRETER_HAS_THREADED_DISPATCH
+	if(vector_empty(&self->threaded_code__voidptr)) {
+		interpret_threaded(self, NULL);
+	}
+	if(self->registers > 0 &&
+			vector_empty(&self->register_threaded_code__voidptr)) {
+		interpret_threaded_registers(self, NULL);
+	}
+#endif
+
+	return INTERPRETER_ERROR_NONE;
+}
+
+enum interpreter_error interpreter_run_context(const struct interpreter* self,
+		struct interpreter_context* context, const inttype* arguments,
+		inttype* result)
+{
+	enum interpreter_error error;
+	const struct bytecode* code;
+	struct ring_buffer* frame;
+	struct instruction startup;
+	int registers;
+	size_t i;
+
+	assert(self->compiled);
+	registers = self->mode != INTERPRETER_MODE_RING && self->registers > 0 &&
+		context->profiler == NULL;
+	code = registers ? &self->register_code : &self->code;
+
+	/* Clear out anything left over from a previous run */
+	reset_stacks(context);
+	bignum_heap_clear(&context->bignums);
+	context->instructions_executed = 0;
 
 	/* Create a stack frame to hold the main function's result */
-	enter_stack_frame(self, 1);
+	enter_stack_frame(context, 1);
+
+	/* The startup function is entered through a call, returning past the
+	   end of the program */
+	startup.opcode = OPCODE_CALL;
+	startup.operands_begin = 0;
+	startup.operands_length = 0;
+	startup.target = code->startup_target;
+	startup.frame_size = code->startup_frame_size;
+
+	context->instruction_ptr = code->instructions_length;
+	INTERPRETER_TRY(error, call_function(context, &startup, NULL, 0,
+				registers));
+
+	frame = &frame_stack_top(&context->frames)->slots;
+	for(i = 0; i < self->arguments_length; i++) {
+		ring_buffer_add(frame, arguments[i]);
+	}
 
-	
-	INTERPRETER_TRY(error, call_function(self, STARTUP_FUNCTION));
-	self->instruction_ptr++;
-
-	while(self->instruction_ptr < 
-			vector_size(&self->program__struct_vector__charptr)) {
-		INTERPRETER_TRY(error, 
-				interpret_line(self, (struct vector*)vector_at(
-						&self->program__struct_vector__charptr,
-					self->instruction_ptr)));
-		self->instruction_ptr++;
-
-		/* If this is true, then the main function has returned */
-		if(vector_size(&self->function_stacks__struct_ring_buffer) < 2) {
-			break;
+#ifdef VM_PROFILE
+	if(context->profiler != NULL) {
+		profiler_begin(context->profiler, code);
+		error = interpret_profiled(self, context);
+		profiler_end(context->profiler);
+		if(error != INTERPRETER_ERROR_NONE) {
+			return error;
 		}
+	} else
+#endif
+#ifdef INTERPRETER_HAS_THREADED_DISPATCH
+	if(self->dispatch == INTERPRETER_DISPATCH_THREADED) {
+		INTERPRETER_TRY(error, registers ?
+				interpret_threaded_registers(self, context) :
+				interpret_threaded(self, context));
+	} else
+#endif
+	{
+		INTERPRETER_TRY(error, registers ?
+				interpret_switch_registers(self, context) :
+				interpret_switch(self, context));
 	}
-	
-	*result = get_stack_val(self, 0);
-	leave_stack_frame(self);
-	
+
+	*result = get_stack_val(context, 0);
+	leave_stack_frame(context);
+
 	return INTERPRETER_ERROR_NONE;
 }
 
+enum interpreter_error interpreter_run_batch(struct interpreter* self,
+		struct thread_pool* pool, const inttype* arguments,
+		size_t arguments_length, size_t runs, inttype* results,
+		enum interpreter_error* errors)
+{
+	enum interpreter_error error;
+	struct batch_userdata data;
+	size_t workers = thread_pool_workers(pool);
+	size_t i;
+
+	INTERPRETER_TRY(error, interpreter_prepare(self, arguments_length));
+
+	data.self = self;
+	data.contexts = (struct interpreter_context*)malloc(
+			workers * sizeof(struct interpreter_context));
+	data.arguments = arguments;
+	data.arguments_length = arguments_length;
+	data.results = results;
+	/* At least one, as malloc(0) may return NULL */
+	data.errors = errors != NULL ? errors : (enum interpreter_error*)malloc(
+			(runs ? runs : 1) * sizeof(enum interpreter_error));
+	assert(data.contexts != NULL && data.errors != NULL);
+
+	for(i = 0; i < workers; i++) {
+		interpreter_context_create(&data.contexts[i]);
+	}
+
+	/* Small enough chunks for idle workers to find some to steal */
+	thread_pool_for(pool, runs, runs / (workers * BATCH_CHUNKS) + 1,
+			run_batch_fn, &data);
+
+	for(i = 0; i < workers; i++) {
+		interpreter_context_release(&data.contexts[i]);
+	}
+	free(data.contexts);
+
+	error = INTERPRETER_ERROR_NONE;
+	for(i = 0; i < runs && error == INTERPRETER_ERROR_NONE; i++) {
+		error = data.errors[i];
+	}
+	if(errors == NULL) {
+		free(data.errors);
+	}
+
+	return error;
+}
+
+void interpreter_context_create(struct interpreter_context* self)
+{
+	frame_stack_create(&self->frames);
+	self->instruction_ptr = 0;
+	self->instructions_executed = 0;
+	self->profiler = NULL;
+	bignum_heap_create(&self->bignums);
+}
+
+void interpreter_context_release(struct interpreter_context* self)
+{
+	frame_stack_release(&self->frames);
+	bignum_heap_release(&self->bignums);
+}
+
+char* interpreter_result_to_string(const struct interpreter* self,
+		inttype result)
+{
+	char* string;
+
+	if(self->code.result_type == VALUE_TYPE_BIG) {
+		return bignum_to_string(&self->context.bignums, result);
+	}
 
+	/* Enough for any word, or any double with 17 digits */
+	string = (char*)malloc(32);
+	assert(string != NULL);
+	switch(self->code.result_type) {
+	case VALUE_TYPE_I64:
+		sprintf(string, "%lld", (long long)(int64_t)result);
+		break;
+	case VALUE_TYPE_F64:
+		sprintf(string, "%.17g", word_to_f64(result));
+		break;
+	default:
+		sprintf(string, "%lu", (unsigned long)result);
+		break;
+	}
 
+	return string;
+}
 
-static int charptr_cmp_fn(const void* a, const void* b)
+void interpreter_set_dispatch(struct interpreter* self,
+		enum interpreter_dispatch dispatch)
 {
-	char* temp1 = *(char**)a;
-	char* temp2 = *(char**)b;
+#ifndef INTERPRETER_HAS_THREADED_DISPATCH
+	dispatch = INTERPRETER_DISPATCH_SWITCH;
+#endif
+	self->dispatch = dispatch;
+}
 
-	if(temp1 != NULL && temp2 != NULL) {
-		return strcmp(temp1, temp2);
-	} else if(temp1 == NULL && temp2 == NULL) {
-		return 0;
-	} else if(temp1 == NULL) {
-		return -1;
+void interpreter_set_mode(struct interpreter* self, enum interpreter_mode mode)
+{
+	self->mode = mode;
+}
+
+void interpreter_set_optimize(struct interpreter* self, int optimize)
+{
+	optimize = optimize != 0;
+	if(self->optimize == optimize) {
+		return;
+	}
+
+	/* The cache holds code compiled the other way */
+	drop_cache(self);
+	self->optimize = optimize;
+	self->compiled = 0;
+}
+
+int interpreter_set_profiler(struct interpreter* self,
+		struct profiler* profiler)
+{
+#ifdef VM_PROFILE
+	if(profiler != NULL) {
+		profiler_clear(profiler);
+	}
+	self->profiler = profiler;
+	return 1;
+#else
+	(void)self;
+	(void)profiler;
+	return 0;
+#endif
+}
+
+enum interpreter_error interpreter_dump(struct interpreter* self,
+		FILE* file)
+{
+	enum interpreter_error error;
+	const char** label_names;
+
+	if(!self->compiled) {
+		INTERPRETER_TRY(error, interpreter_compile(self));
+	}
+
+	label_names = interpreter_label_names(self);
+	bytecode_dump(&self->code, label_names, file);
+	if(label_names[self->code.instructions_length] != NULL) {
+		fprintf(file, "%s:\n", label_names[self->code.instructions_length]);
+	}
+
+	free((void*)label_names);
+	return INTERPRETER_ERROR_NONE;
+}
+
+const char** interpreter_label_names(struct interpreter* self)
+{
+	struct dump_labels_userdata data;
+	size_t i;
+
+	data.self = self;
+	data.label_names = (const char**)calloc(
+			self->code.instructions_length + 1, sizeof(char*));
+	if(self->cache_loaded) {
+		for(i = 0; i < self->cache.labels_length; i++) {
+			const struct program_cache_label* label = &self->cache.labels[i];
+
+			data.label_names[label->target] =
+				self->cache.names + label->name_offset;
+		}
 	} else {
-		return 1;
+		hash_map_visit(&self->labels__charptr__size_t, &data,
+				dump_labels_visit_fn);
 	}
+
+	return data.label_names;
 }
 
-static void charptr_free_visit_fn(void* userdata, void* keyIn, void* valIn)
+/* Adds the lines, then checks what running gives in every mode */
+static void unit_test_stage(struct interpreter* interp,
+		const char* const* lines, size_t lines_length,
+		enum interpreter_error expected_error, inttype expected)
 {
-	char* key = *(char**)keyIn;
-	(void)userdata;
-	(void)valIn;
+	inttype result;
+	size_t mode;
+	size_t i;
+
+	for(i = 0; i < lines_length; i++) {
+		interpreter_add_line(interp, lines[i]);
+	}
+
+	for(mode = INTERPRETER_MODE_RING; mode <= INTERPRETER_MODE_JIT; mode++) {
+		interpreter_set_mode(interp, (enum interpreter_mode)mode);
+		result = 0;
+		assert(interpreter_run(interp, &result) == expected_error);
+		assert(expected_error != INTERPRETER_ERROR_NONE ||
+				result == expected);
+	}
+}
+
+/* Adds the lines to a new interpreter, then checks what running gives in
+   every mode, written out */
+static void unit_test_typed(const char* const* lines, size_t lines_length,
+		enum interpreter_error expected_error, const char* expected)
+{
+	struct interpreter interp;
+	inttype result;
+	char* string;
+	size_t mode;
+	size_t i;
+
+	interpreter_create(&interp, NULL);
+	for(i = 0; i < lines_length; i++) {
+		interpreter_add_line(&interp, lines[i]);
+	}
+
+	for(mode = INTERPRETER_MODE_RING; mode <= INTERPRETER_MODE_JIT; mode++) {
+		interpreter_set_mode(&interp, (enum interpreter_mode)mode);
+		result = 0;
+		assert(interpreter_run(&interp, &result) == expected_error);
+		if(expected_error == INTERPRETER_ERROR_NONE) {
+			string = interpreter_result_to_string(&interp, result);
+			assert(strcmp(string, expected) == 0);
+			free(string);
+		}
+	}
+	interpreter_release(&interp);
+}
+
+static void unit_test_types(void)
+{
+	static const char* const floats[] = {
+		"main:",
+		"\tpush.f 1.5",
+		"\tmul.f s0 4",
+		"\titof 3",
+		"\tdiv.f s1 s0",
+		"\tret.f s0"
+	};
+	/* Two to the 64th overflows the word, but not .n */
+	static const char* const large[] = {
+		"main:",
+		"\titon 4294967296",
+		"\tmul.n s0 s0",
+		"\tsub.n s0 1",
+		"\tret.n s0"
+	};
+	static const char* const negative[] = {
+		"main:",
+		"\tdiv.i -7 2",
+		"\tret.i s0"
+	};
+	static const char* const by_zero[] = {
+		"main:",
+		"\tdiv.i 1 0",
+		"\tret.i s0"
+	};
+	static const char* const no_type[] = {
+		"main:",
+		"\tbranch.f main"
+	};
+
+	unit_test_typed(floats, sizeof(floats)/sizeof(floats[0]),
+			INTERPRETER_ERROR_NONE, "2");
+	unit_test_typed(large, sizeof(large)/sizeof(large[0]),
+			INTERPRETER_ERROR_NONE, "18446744073709551615");
+	unit_test_typed(negative, sizeof(negative)/sizeof(negative[0]),
+			INTERPRETER_ERROR_NONE, "-3");
+	unit_test_typed(by_zero, sizeof(by_zero)/sizeof(by_zero[0]),
+			INTERPRETER_ERROR_DIVISION_BY_ZERO, NULL);
+	unit_test_typed(no_type, sizeof(no_type)/sizeof(no_type[0]),
+			INTERPRETER_ERROR_INVALID_TYPE, NULL);
+}
+
+/* Runs a - b for many pairs at once */
+static void unit_test_batch(void)
+{
+	static const char* const program[] = {
+		"main:",
+		"\tdiff s1 s0",
+		"\tret s0",
+		"diff:",
+		"\tsub s1 s0",
+		"\tret s0"
+	};
+	const size_t runs = 1000;
+	struct interpreter interp;
+	struct thread_pool pool;
+	inttype arguments[2 * 1000];
+	inttype results[1000];
+	size_t mode;
+	size_t i;
 
-	if(key) {
-		free(key);
+	interpreter_create(&interp, NULL);
+	for(i = 0; i < sizeof(program)/sizeof(program[0]); i++) {
+		interpreter_add_line(&interp, program[i]);
 	}
+	for(i = 0; i < runs; i++) {
+		arguments[2 * i] = (inttype)(i * i);
+		arguments[2 * i + 1] = (inttype)i;
+	}
+
+	thread_pool_create(&pool, 4);
+	for(mode = INTERPRETER_MODE_RING; mode <= INTERPRETER_MODE_JIT; mode++) {
+		interpreter_set_mode(&interp, (enum interpreter_mode)mode);
+		memset(results, 0, sizeof(results));
+		assert(interpreter_run_batch(&interp, &pool, arguments, 2, runs,
+					results, NULL) == INTERPRETER_ERROR_NONE);
+		for(i = 0; i < runs; i++) {
+			assert(results[i] == (inttype)(i * i - i));
+		}
+	}
+	thread_pool_release(&pool);
+	interpreter_release(&interp);
 }
 
-static void build_stack_frame_sizes_visit_fn(void* userdata, 
-		void* keyIn, void* valIn)
+/* Both dispatches count the same instructions, even for a program that runs
+   off its end rather than returning */
+static void unit_test_counts(void)
 {
-	struct stack_frame_sizes_userdata* data = 
-		(struct stack_frame_sizes_userdata*)(userdata);
-	struct interpreter* self = data->self;
-	char* key = *(char**)keyIn;
-	inttype max_frame_size = 1;
+	static const char* const no_ret[] = {
+		"main:",
+		"\tpush 3",
+		"\tadd s0 1"
+	};
+	struct interpreter interp;
+	inttype result;
+	size_t mode;
+	size_t switch_count;
+	size_t i;
+
+	interpreter_create(&interp, NULL);
+	for(i = 0; i < sizeof(no_ret)/sizeof(no_ret[0]); i++) {
+		interpreter_add_line(&interp, no_ret[i]);
+	}
 
-	if(data->error != INTERPRETER_ERROR_NONE) {
+	for(mode = INTERPRETER_MODE_RING; mode <= INTERPRETER_MODE_REGISTERS;
+			mode++) {
+		interpreter_set_mode(&interp, (enum interpreter_mode)mode);
+		interpreter_set_dispatch(&interp, INTERPRETER_DISPATCH_SWITCH);
+		assert(interpreter_run(&interp, &result) == INTERPRETER_ERROR_NONE);
+		switch_count = interp.instructions_executed;
+		assert(mode != INTERPRETER_MODE_RING || switch_count == 2);
+
+		interpreter_set_dispatch(&interp, INTERPRETER_DISPATCH_THREADED);
+		assert(interpreter_run(&interp, &result) == INTERPRETER_ERROR_NONE);
+		assert(interp.instructions_executed == switch_count);
+	}
+	interpreter_release(&interp);
+}
+
+void interpreter_unit_test(void)
+{
+	/* Calls a function that isn't defined yet */
+	static const char* const calling[] = {
+		"main:",
+		"\tlater 4",
+		"\tret s0"
+	};
+	static const char* const defining[] = {
+		"later:",
+		"\tmul s0 2",
+		"\tret s0"
+	};
+	/* Moves the function, and gives it a larger frame */
+	static const char* const redefining[] = {
+		"later:",
+		"\tpush 7",
+		"\tpush 8",
+		"\tadd s2 s1",
+		"\tret s0"
+	};
+	/* Moves it again, keeping the frame size */
+	static const char* const moving[] = {
+		"later:",
+		"\tpush 1",
+		"\tpush 2",
+		"\tadd s2 s1",
+		"\tret s0"
+	};
+	struct interpreter interp;
+
+	interpreter_create(&interp, NULL);
+	unit_test_stage(&interp, calling, sizeof(calling)/sizeof(calling[0]),
+			INTERPRETER_ERROR_INVALID_LABEL, 0);
+	unit_test_stage(&interp, defining, sizeof(defining)/sizeof(defining[0]),
+			INTERPRETER_ERROR_NONE, 8);
+	unit_test_stage(&interp, redefining,
+			sizeof(redefining)/sizeof(redefining[0]),
+			INTERPRETER_ERROR_NONE, 11);
+	unit_test_stage(&interp, moving, sizeof(moving)/sizeof(moving[0]),
+			INTERPRETER_ERROR_NONE, 5);
+
+	/* The one call site is no longer waiting on its label */
+	assert(vector_size(&interp.decoded_instructions__struct_instruction) ==
+			vector_size(&interp.program__struct_program_line));
+	assert(interp.linked_sites == 1);
+	assert(vector_empty(&interp.unresolved_sites__size_t));
+	interpreter_release(&interp);
+	unit_test_types();
+	unit_test_batch();
+	unit_test_counts();
+}
+
+
+
+
+static void label_frame_sizes_visit_fn(void* userdata, void* keyIn,
+		void* valIn)
+{
+	struct label_frame_sizes_userdata* data =
+		(struct label_frame_sizes_userdata*)userdata;
+	size_t* frame_size;
+	/* Labels store the index of the instruction before them */
+	size_t target = *(size_t*)valIn + 1;
+
+	if(target >= data->length) {
 		return;
 	}
 
-	(void)userdata;
-	(void)valIn;
+	frame_size = (size_t*)hash_map_at(
+			&data->self->stack_frame_sizes__charptr__size_t, *(char**)keyIn);
+	data->label_frame_sizes[target] = frame_size != NULL ? *frame_size : 1;
+}
+
+static void dump_labels_visit_fn(void* userdata, void* keyIn, void* valIn)
+{
+	struct dump_labels_userdata* data = (struct dump_labels_userdata*)userdata;
+
+	data->label_names[map_instruction(data->self, *(size_t*)valIn + 1)] =
+		*(const char**)keyIn;
+}
+
+static void cache_labels_visit_fn(void* userdata, void* keyIn, void* valIn)
+{
+	struct cache_labels_userdata* data =
+		(struct cache_labels_userdata*)userdata;
+	char* name = *(char**)keyIn;
+	size_t* frame_size;
+	struct program_cache_label label;
+
+	frame_size = (size_t*)hash_map_at(
+			&data->self->stack_frame_sizes__charptr__size_t, name);
+
+	/* Labels store the index of the instruction before them */
+	label.name_offset = data->names_size;
+	label.target = map_instruction(data->self, *(size_t*)valIn + 1);
+	label.frame_size = frame_size != NULL ? *frame_size : 1;
+
+	vector_push_back(&data->labels__struct_program_cache_label, &label);
+	vector_push_back(&data->names__charptr, &name);
+	data->names_size += strlen(name) + 1;
+}
+
+static void write_cache(struct interpreter* self, const char* file_name,
+		uint64_t source_hash, size_t source_length)
+{
+	struct cache_labels_userdata data;
+	struct program_cache cache;
+	char* names;
+	size_t offset = 0;
+	size_t i;
+
+	data.self = self;
+	data.names_size = 0;
+	vector_create_arena(&data.labels__struct_program_cache_label,
+			sizeof(struct program_cache_label), NULL, self->arena);
+	vector_create_arena(&data.names__charptr, sizeof(char*), NULL,
+			self->arena);
+	hash_map_visit(&self->labels__charptr__size_t, &data,
+			cache_labels_visit_fn);
+
+	names = (char*)arena_alloc(self->arena, data.names_size);
+	for(i = 0; i < vector_size(&data.names__charptr); i++) {
+		const char* name = *(char**)vector_at(&data.names__charptr, i);
+		size_t length = strlen(name) + 1;
+
+		memcpy(names + offset, name, length);
+		offset += length;
+	}
+
+	cache.code = self->code;
+	cache.labels = (const struct program_cache_label*)vector_to_array(
+			&data.labels__struct_program_cache_label);
+	cache.labels_length = vector_size(&data.labels__struct_program_cache_label);
+	cache.names = names;
+	cache.names_size = data.names_size;
+	cache.source_hash = source_hash;
+	cache.source_length = source_length;
+	cache.options = self->optimize ? PROGRAM_CACHE_OPTION_OPTIMIZED : 0;
+	program_cache_write(&cache, file_name);
+
+	vector_release(&data.labels__struct_program_cache_label);
+	vector_release(&data.names__charptr);
+}
+
+/*
+ * Goes back to running from the source, which is needed as soon as the
+ * program changes. The file the cache came from is always the last one.
+ */
+static void drop_cache(struct interpreter* self)
+{
+	struct io_file_view source;
 
-	data->error = goto_label(self, key);
-	if(data->error != INTERPRETER_ERROR_NONE) {
+	if(!self->cache_loaded) {
 		return;
 	}
-	self->instruction_ptr++;
 
-	while(self->instruction_ptr < 
-			vector_size(&self->program__struct_vector__charptr)) {
-		struct vector* tokens = 
-			(struct vector*)vector_at(&self->program__struct_vector__charptr,
-				self->instruction_ptr);
+	self->cache_loaded = 0;
+	self->compiled = 0;
+	program_cache_close(&self->cache);
 
-		for(size_t i = 1; i < vector_size(tokens); i++) {
-			char* current = *(char**)vector_at(tokens, i);
-			if(current[0] != 's') {
-				continue;
-			}
-			
-			/* Ignore first char */
-			current++;
-			inttype val = 0;
-
-			if(!string_to_inttype(current, &val)) {
-				data->error = INTERPRETER_ERROR_NUMBER_PARSE_FAIL;
-				return;
-			}
+	source = *(struct io_file_view*)vector_back(
+			&self->files__struct_io_file_view);
+	add_file_view(self, &source);
+}
 
-			/* Increment by 1, since index is 0 based. */
-			val++;
-			if(val > max_frame_size) {
-				max_frame_size = val;
-			}
-		}
 
-		if(!strcmp(*(char**)vector_at(tokens, 0), "ret")) {
-			break;
-		}
+static struct frame* enter_stack_frame(struct interpreter_context* context,
+		inttype size)
+{
+	return frame_stack_push(&context->frames, size, context->instruction_ptr);
+}
+
+static void leave_stack_frame(struct interpreter_context* context)
+{
+	frame_stack_pop(&context->frames);
+}
+
+static inttype get_stack_val(struct interpreter_context* context,
+		inttype val)
+{
+	return ring_buffer_get(&frame_stack_top(&context->frames)->slots, val);
+}
+
+static void reset_stacks(struct interpreter_context* context)
+{
+	frame_stack_clear(&context->frames);
+}
+
+static inttype get_operand_val(const struct ring_buffer* frame,
+		const struct operand* operand)
+{
+	if(operand->is_stack) {
+		return ring_buffer_get(frame, operand->value);
+	}
+
+	return operand->value;
+}
 
-		self->instruction_ptr++;
+/* Stack operands of register code are slot indices into the frame */
+static inttype get_register_val(const size_t* slots,
+		const struct operand* operand)
+{
+	if(operand->is_stack) {
+		return slots[operand->value];
 	}
 
-	map_insert(&self->stack_frame_sizes__charptr__size_t,
-			&key, &max_frame_size);
+	return operand->value;
 }
 
+static double word_to_f64(inttype word)
+{
+	double value;
+
+	memcpy(&value, &word, sizeof(value));
+	return value;
+}
 
-static void enter_stack_frame(struct interpreter* self, inttype size)
+static inttype f64_to_word(double value)
 {
-	struct ring_buffer buffer;
-	ring_buffer_create(&buffer, size);
+	inttype word;
 
-	vector_push_back(&self->function_stacks__struct_ring_buffer, &buffer);
+	memcpy(&word, &value, sizeof(word));
+	return word;
 }
 
-static void leave_stack_frame(struct interpreter* self)
+/* Truncates, clamping to the range of the type, with NaN as 0 */
+static int64_t f64_to_i64(double value)
 {
-	ring_buffer_release(
-			(struct ring_buffer*)vector_back(
-				&self->function_stacks__struct_ring_buffer));
-	vector_pop_back(&self->function_stacks__struct_ring_buffer);
+	if(value != value) {
+		return 0;
+	}
+	if(value >= 9223372036854775808.0) {
+		return INT64_MAX;
+	}
+	if(value < -9223372036854775808.0) {
+		return INT64_MIN;
+	}
+
+	return (int64_t)value;
 }
 
-static inttype get_stack_val(struct interpreter* self, inttype val)
+/* Needed whenever code changes */
+static void reset_register_code(struct interpreter* self)
 {
-	struct ring_buffer* buffer;
-	buffer = (struct ring_buffer*)vector_back(
-			&self->function_stacks__struct_ring_buffer);
-	
-	return ring_buffer_get(buffer, val);
+	vector_clear(&self->register_threaded_code__voidptr);
+	self->registers = 0;
+	if(self->jitted > 0) {
+		jit_release(&self->jit);
+	}
+	self->jitted = 0;
 }
 
-static void stack_push(struct interpreter* self, inttype val)
+/* Returns whether the program has a register form, making it if needed */
+static int prepare_register_code(struct interpreter* self)
 {
-	struct ring_buffer* buffer;
+	if(self->registers != 0) {
+		return self->registers > 0;
+	}
+
+	self->registers = -1;
+	if(registers_assign(&self->code,
+				&self->register_instructions__struct_instruction,
+				&self->register_operands__struct_operand,
+				self->arguments_length,
+				&self->register_code.startup_target)) {
+		self->register_code.startup_frame_size = self->code.startup_frame_size;
+		self->register_code.result_type = self->code.result_type;
+		self->register_code.instructions = (const struct instruction*)
+			vector_to_array(&self->register_instructions__struct_instruction);
+		self->register_code.instructions_length =
+			vector_size(&self->register_instructions__struct_instruction);
+		self->register_code.operands = (const struct operand*)vector_to_array(
+				&self->register_operands__struct_operand);
+		self->register_code.operands_length =
+			vector_size(&self->register_operands__struct_operand);
+		self->registers = 1;
+	}
 
-	buffer = (struct ring_buffer*)vector_back(
-			&self->function_stacks__struct_ring_buffer);
+	return self->registers > 0;
+}
+
+/* Returns whether the register code has been compiled to native code,
+   compiling it if needed */
+static int prepare_jit(struct interpreter* self)
+{
+	if(self->jitted == 0) {
+		self->jitted = jit_create(&self->jit, &self->register_code) ==
+			JIT_ERROR_NONE ? 1 : -1;
+	}
 
-	ring_buffer_add(buffer, val);
+	return self->jitted > 0;
 }
 
 static void add_label(struct interpreter* self, const char* key)
 {
 	assert(key != NULL);
-	size_t value = self->instruction_ptr - 1;
-	map_insert(&self->labels__charptr__size_t, 
-			&key, &value);
+	/* Counted from the program rather than instruction_ptr, which a run
+	   leaves pointing anywhere */
+	size_t value = vector_size(&self->program__struct_program_line) - 1;
+	const char* name = string_table_intern(&self->label_names, key);
+
+	/* Call sites that resolved the label before have to follow it */
+	if(hash_map_at(&self->labels__charptr__size_t, name) != NULL) {
+		vector_push_back(&self->stale_labels__charptr, &name);
+	}
+
+	hash_map_insert(&self->labels__charptr__size_t, name, &value);
+	vector_push_back(&self->changed_labels__charptr, &name);
 }
 
-static enum interpreter_error goto_label(struct interpreter* self,
-		const char* label)
+static size_t find_label(struct interpreter* self, const char* label)
+{
+	const char* name = string_table_find(&self->label_names, label);
+	size_t* label_ptr;
 
+	if(name == NULL) {
+		return BYTECODE_UNRESOLVED;
+	}
+
+	label_ptr = (size_t*)hash_map_at(&self->labels__charptr__size_t, name);
+	if(label_ptr == NULL) {
+		return BYTECODE_UNRESOLVED;
+	}
+
+	/* Labels store the index of the instruction before them */
+	return *label_ptr + 1;
+}
+
+static size_t* find_frame_size(struct interpreter* self, const char* label)
+{
+	const char* name = string_table_find(&self->label_names, label);
+
+	if(name == NULL) {
+		return NULL;
+	}
+
+	return (size_t*)hash_map_at(&self->stack_frame_sizes__charptr__size_t,
+			name);
+}
+
+/* Where an instruction index from before optimizing ended up */
+static size_t map_instruction(struct interpreter* self, size_t index)
+{
+	if(index == BYTECODE_UNRESOLVED) {
+		return index;
+	}
+
+	return *(size_t*)vector_at(&self->instruction_map__size_t, index);
+}
+
+static int contains_label(const struct vector* labels, const char* label)
 {
-	size_t* new_ip = (size_t*)map_at(&self->labels__charptr__size_t, &label);
+	size_t i;
+
+	for(i = 0; i < vector_size(labels); i++) {
+		if(!strcmp(*(const char**)vector_at(labels, i), label)) {
+			return 1;
+		}
+	}
 
-	assert(self != NULL);
+	return 0;
+}
+
+/* Operands are passed separately, since superinstructions pass only some
+   of theirs. With registers set, they're read as register code. */
+static enum interpreter_error call_function(
+		struct interpreter_context* context, const struct instruction* ins,
+		const struct operand* operands, size_t operands_length,
+		int registers)
+{
+	struct ring_buffer* caller;
+	struct ring_buffer* callee;
+	size_t i;
 
-	if(new_ip == NULL) {
+	if(ins->target == BYTECODE_UNRESOLVED) {
 		return INTERPRETER_ERROR_INVALID_LABEL;
 	}
 
-	self->instruction_ptr = *new_ip;
+	/* Parameters are read from the caller's frame once the callee's frame
+	   exists, so they can be pushed without any temporary storage */
+	callee = &enter_stack_frame(context, ins->frame_size)->slots;
+	caller = &frame_stack_caller(&context->frames)->slots;
+	context->instruction_ptr = ins->target;
+
+	for(i = 0; i < operands_length; i++) {
+		ring_buffer_add(callee, registers ?
+				get_register_val(caller->data, &operands[i]) :
+				get_operand_val(caller, &operands[i]));
+	}
+
 	return INTERPRETER_ERROR_NONE;
 }
 
-static enum interpreter_error call_function(struct interpreter* self,
-		const char* label)
+/* Like call_function, but the callee's frame replaces the current one and
+   returns to where the current one would have */
+static enum interpreter_error tail_call_function(
+		struct interpreter_context* context, const struct instruction* ins,
+		const struct operand* operands, size_t operands_length,
+		int registers)
 {
 	enum interpreter_error error;
-	size_t* frame_size;
-	vector_push_back(&self->instruction_ptrs__size_t, &self->instruction_ptr);
 
-	INTERPRETER_TRY(error, goto_label(self, label));
+	context->instruction_ptr = frame_stack_top(&context->frames)->return_ptr;
+	INTERPRETER_TRY(error, call_function(context, ins, operands,
+				operands_length, registers));
+	frame_stack_drop_caller(&context->frames);
 
-	frame_size = (size_t*)map_at(&self->stack_frame_sizes__charptr__size_t,
-			&label);
-	if(frame_size == NULL) {
-		return INTERPRETER_ERROR_INVALID_LABEL;
+	return INTERPRETER_ERROR_NONE;
+}
+
+/* Results go to the caller's ring position, which register code sets
+   before every call */
+static void return_function(struct interpreter_context* context,
+		const struct operand* operands, size_t operands_length,
+		int registers)
+{
+	struct ring_buffer* caller;
+	struct ring_buffer* callee;
+	size_t i;
+
+	caller = &frame_stack_caller(&context->frames)->slots;
+	callee = &frame_stack_top(&context->frames)->slots;
+
+	for(i = 0; i < operands_length; i++) {
+		ring_buffer_add(caller, registers ?
+				get_register_val(callee->data, &operands[i]) :
+				get_operand_val(callee, &operands[i]));
 	}
 
-	enter_stack_frame(self, *frame_size);
-	return INTERPRETER_ERROR_NONE;
+	context->instruction_ptr = frame_stack_top(&context->frames)->return_ptr;
+	leave_stack_frame(context);
 }
 
-static void return_function(struct interpreter* self)
+/* Tokenizes every line of the file in place */
+static void add_file_view(struct interpreter* self,
+		const struct io_file_view* file)
 {
-	leave_stack_frame(self);
-	self->instruction_ptr = 
-		*(size_t*)vector_back(&self->instruction_ptrs__size_t);
-	vector_pop_back(&self->instruction_ptrs__size_t);
+	char* line;
+	char* line_end;
+
+	/* The view ends in a NUL, so the last line needs no newline */
+	line = file->data;
+	while(line < file->data + file->length) {
+		line_end = (char*)memchr(line, '\n', 
+				(size_t)(file->data + file->length - line));
+		if(line_end == NULL) {
+			line_end = file->data + file->length;
+		}
+
+		*line_end = 0;
+		add_source_line(self, line);
+		line = line_end + 1;
+	}
 }
 
-static void remove_comments(char* line)
+/*
+ * Tokenizes the line in place. The line must stay alive as long as the
+ * interpreter does, since the program keeps pointers to its tokens.
+ */
+static void add_source_line(struct interpreter* self, char* line)
 {
+	struct program_line program_line;
+	char* ins;
+	size_t insEndPos;
+
+	drop_cache(self);
+	self->compiled = 0;
+
+	/* Nothing in this line; safe to ignore */
 	if(!line[0]) {
 		return;
 	}
-	line = strchr(line, COMMENT_CHAR);
+	
+	vector_clear(&self->line_tokens__charptr);
+	instruction_to_tokens(&self->token_classes, &self->line_tokens__charptr,
+			line);
 
-	if(line != NULL) {
-		*line = 0;
+	/* No code in this line; safe to ignore */
+	if(vector_size(&self->line_tokens__charptr) == 0) {
+		return;
 	}
+
+	ins = *(char**)vector_at(&self->line_tokens__charptr, 0);
+	insEndPos = strlen(ins) - 1;
+
+	if(ins[insEndPos] != LABEL_END_CHAR) {
+		/* Line is valid code. Register it, keeping the token data for later
+		   interprettation */
+		program_line.tokens_length = vector_size(&self->line_tokens__charptr);
+		program_line.tokens = (const char**)arena_alloc(self->arena,
+				program_line.tokens_length * sizeof(char*));
+		memcpy((void*)program_line.tokens,
+				vector_to_array(&self->line_tokens__charptr),
+				program_line.tokens_length * sizeof(char*));
+
+		vector_push_back(&self->program__struct_program_line, &program_line);
+		return;
+	} 
+	
+	/* Line is a label. Register it; the label keeps its own interned copy
+	   of the name */
+	ins[insEndPos] = 0; /* Remove end char; it's just a marker */
+	add_label(self, ins);
+	assert(vector_size(&self->line_tokens__charptr) == 1);
 }
 
 static char string_to_inttype(const char* str, inttype* resultPtr)
@@ -441,134 +1389,489 @@ static char string_to_inttype(const char* str, inttype* resultPtr)
 	return i >= str_length;
 }
 
-static void strlower(char* str)
+/*
+ * Splits the line at delimiters by writing NULs into it, and lowers the case
+ * of every token, all in place. A comment ends the line.
+ */
+static void instruction_to_tokens(const struct tokenizer_classes* classes,
+		struct vector* tokens, char* line)
 {
-	for(; *str; ++str) {
-		*str = (char)tolower(*str);
+	char* token;
+	char* token_end;
+	int line_end;
+
+	for(;;) {
+		line = (char*)tokenizer_skip_ignored(classes, line);
+		if(!line[0] || classes->m_classes[(unsigned char)line[0]] ==
+				TOKENIZER_CLASS_TOKEN) {
+			return;
+		}
+
+		token = line;
+		token_end = (char*)tokenizer_find_delimiter(classes, line);
+		for(; line < token_end; line++) {
+			*line = (char)tolower(*line);
+		}
+
+		vector_push_back(tokens, &token);
+		line_end = !line[0] || classes->m_classes[(unsigned char)line[0]] ==
+			TOKENIZER_CLASS_TOKEN;
+		*line++ = 0;
+		if(line_end) {
+			return;
+		}
 	}
 }
 
-static void instruction_to_tokens(struct vector* tokens, char* line)
+static enum interpreter_error compile_line(struct interpreter* self,
+		const struct program_line* line)
 {
-	const char* delim = " \t\r\n";
-	char* token_out;
+	enum interpreter_error error;
+	struct instruction ins;
+	const char* mnemonic;
+	size_t site = vector_size(&self->decoded_instructions__struct_instruction);
+	size_t i;
 
-	line = strtok(line, delim);
-	while(line != NULL) {
-		if(!line[0]) {
-			continue;
+	mnemonic = line->tokens[0];
+
+	ins.opcode = opcode_from_mnemonic(mnemonic, &ins.type);
+	ins.operands_begin = vector_size(&self->decoded_operands__struct_operand);
+	ins.operands_length = 0;
+	ins.target = BYTECODE_UNRESOLVED;
+	ins.frame_size = 0;
+
+	switch(ins.opcode) {
+	case OPCODE_COUNT:
+		return INTERPRETER_ERROR_INVALID_TYPE;
+	case OPCODE_BRANCH:
+		/* The only parameter is the label, which is resolved by link_calls
+		   like the label of a call */
+		if(line->tokens_length < 2) {
+			return INTERPRETER_ERROR_INVALID_OPERANDS;
 		}
+		vector_push_back(&self->decoded_instructions__struct_instruction,
+				&ins);
+		vector_push_back(&self->call_sites__size_t, &site);
+		return INTERPRETER_ERROR_NONE;
+	case OPCODE_PUSH:
+	case OPCODE_I_TO_F:
+	case OPCODE_F_TO_I:
+	case OPCODE_I_TO_N:
+	case OPCODE_N_TO_I:
+		if(line->tokens_length < 2) {
+			return INTERPRETER_ERROR_INVALID_OPERANDS;
+		}
+		break;
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_MUL:
+	case OPCODE_DIV:
+	case OPCODE_EQUALS:
+	case OPCODE_DIV_I:
+	case OPCODE_ADD_F:
+	case OPCODE_SUB_F:
+	case OPCODE_MUL_F:
+	case OPCODE_DIV_F:
+	case OPCODE_EQUALS_F:
+	case OPCODE_ADD_N:
+	case OPCODE_SUB_N:
+	case OPCODE_MUL_N:
+	case OPCODE_DIV_N:
+	case OPCODE_EQUALS_N:
+		if(line->tokens_length < 3) {
+			return INTERPRETER_ERROR_INVALID_OPERANDS;
+		}
+		break;
+	default:
+		break;
+	}
 
-		strlower(line);
+	for(i = 1; i < line->tokens_length; i++) {
+		INTERPRETER_TRY(error, compile_operand(self, line->tokens[i],
+					ins.type));
+		ins.operands_length++;
+	}
+
+	vector_push_back(&self->decoded_instructions__struct_instruction, &ins);
+	if(ins.opcode == OPCODE_CALL) {
+		vector_push_back(&self->call_sites__size_t, &site);
+	}
+	return INTERPRETER_ERROR_NONE;
+}
+
+/* Immediates are stored as the word a value of the type is in a frame */
+static enum interpreter_error compile_operand(struct interpreter* self,
+		const char* token, enum value_type type)
+{
+	struct operand operand;
+	char* end;
+
+	operand.is_stack = token[0] == STACK_CHAR;
+	if(operand.is_stack) {
+		/* Ignore the first character. */
+		token++;
+		type = VALUE_TYPE_WORD;
+	}
 
-		token_out = (char*)malloc((strlen(line) + 1) * sizeof(char));
-		strcpy(token_out, line);
+	if(type == VALUE_TYPE_F64) {
+		double value = strtod(token, &end);
 
-		vector_push_back(tokens, &token_out);
-		line = strtok(NULL, delim);
+		if(end == token || *end) {
+			return INTERPRETER_ERROR_NUMBER_PARSE_FAIL;
+		}
+		operand.value = f64_to_word(value);
+	} else if(type == VALUE_TYPE_BIG) {
+		long long value;
+
+		/* Only small values can be immediates, since large ones live in
+		   the heap of a run */
+		errno = 0;
+		value = strtoll(token, &end, 10);
+		if(end == token || *end || errno == ERANGE ||
+				value < BIGNUM_SMALL_MIN || value > BIGNUM_SMALL_MAX) {
+			return INTERPRETER_ERROR_NUMBER_PARSE_FAIL;
+		}
+		operand.value = BIGNUM_SMALL(value);
+	} else if(!string_to_inttype(token, &operand.value)) {
+		return INTERPRETER_ERROR_NUMBER_PARSE_FAIL;
 	}
+
+	vector_push_back(&self->decoded_operands__struct_operand, &operand);
+	return INTERPRETER_ERROR_NONE;
 }
 
-static enum interpreter_error get_parameters(struct interpreter* self,
-		struct vector* result, struct vector* tokens)
+/* Decodes the lines added since the last compile */
+static enum interpreter_error decode_lines(struct interpreter* self)
 {
+	enum interpreter_error error;
 	size_t i;
 
-	for(i = 1; i < vector_size(tokens); i++) {
-		char* current = *(char**)vector_at(tokens, i);
-		inttype val;
-		char is_stack_val = current[0] == STACK_CHAR;
+	vector_reserve(&self->decoded_instructions__struct_instruction,
+			vector_size(&self->program__struct_program_line));
+	for(i = vector_size(&self->decoded_instructions__struct_instruction);
+			i < vector_size(&self->program__struct_program_line); i++) {
+		size_t operands = vector_size(&self->decoded_operands__struct_operand);
+
+		error = compile_line(self, (struct program_line*)
+				vector_at(&self->program__struct_program_line, i));
+		if(error != INTERPRETER_ERROR_NONE) {
+			/* Nothing of the line is kept, so the next compile starts from
+			   it again */
+			while(vector_size(&self->decoded_operands__struct_operand) >
+					operands) {
+				vector_pop_back(&self->decoded_operands__struct_operand);
+			}
+			return error;
+		}
+	}
+
+	return INTERPRETER_ERROR_NONE;
+}
+
+/* Slots used from the label up to the first ret, which closed is set by
+   finding */
+static size_t function_frame_size(struct interpreter* self,
+		const char* label, int* closed)
+{
+	const struct instruction* instructions;
+	const struct operand* operands;
+	size_t length;
+	size_t max_frame_size = 1;
+	size_t i, j;
+
+	instructions = (const struct instruction*)vector_to_array(
+			&self->decoded_instructions__struct_instruction);
+	operands = (const struct operand*)vector_to_array(
+			&self->decoded_operands__struct_operand);
+	length = vector_size(&self->decoded_instructions__struct_instruction);
 
-		if(is_stack_val) {
-			/* Ignore the first character. */
-			current++;
+	*closed = 0;
+	for(i = find_label(self, label); i < length; i++) {
+		const struct instruction* ins = &instructions[i];
+
+		for(j = 0; j < ins->operands_length; j++) {
+			const struct operand* current = &operands[ins->operands_begin + j];
+
+			/* Increment by 1, since index is 0 based. */
+			if(current->is_stack && current->value + 1 > max_frame_size) {
+				max_frame_size = current->value + 1;
+			}
 		}
 
-		if(!string_to_inttype(current, &val)) {
-			return INTERPRETER_ERROR_NUMBER_PARSE_FAIL;
+		if(ins->opcode == OPCODE_RET) {
+			*closed = 1;
+			break;
 		}
+	}
+
+	return max_frame_size;
+}
+
+/* Type of the first ret after the label */
+static enum value_type function_result_type(struct interpreter* self,
+		const char* label)
+{
+	const struct instruction* instructions;
+	size_t length;
+	size_t i;
+
+	instructions = (const struct instruction*)vector_to_array(
+			&self->decoded_instructions__struct_instruction);
+	length = vector_size(&self->decoded_instructions__struct_instruction);
 
-		if(is_stack_val) {
-			val = get_stack_val(self, val);
+	for(i = find_label(self, label); i < length; i++) {
+		if(instructions[i].opcode == OPCODE_RET) {
+			return instructions[i].type;
 		}
+	}
+
+	return VALUE_TYPE_WORD;
+}
 
-		vector_push_back(result, &val);
+/*
+ * Works out the frame size of every label defined or moved since the last
+ * compile, and of every label whose function had no ret yet, since lines
+ * were only added after it. Labels whose frame size changed are marked
+ * stale. Returns whether any label was defined for the first time.
+ */
+static int refresh_frame_sizes(struct interpreter* self)
+{
+	struct vector* changed = &self->changed_labels__charptr;
+	struct vector* open = &self->open_labels__charptr;
+	int added = 0;
+	size_t i;
+
+	for(i = 0; i < vector_size(open); i++) {
+		vector_push_back(changed, vector_at(open, i));
+	}
+	vector_clear(open);
+
+	for(i = 0; i < vector_size(changed); i++) {
+		const char* name = *(const char**)vector_at(changed, i);
+		size_t* previous = (size_t*)hash_map_at(
+				&self->stack_frame_sizes__charptr__size_t, name);
+		size_t frame_size;
+		int closed;
+
+		frame_size = function_frame_size(self, name, &closed);
+		if(previous == NULL) {
+			added = 1;
+		} else if(*previous != frame_size) {
+			vector_push_back(&self->stale_labels__charptr, &name);
+		}
+
+		hash_map_insert(&self->stack_frame_sizes__charptr__size_t, name,
+				&frame_size);
+		if(!closed && !contains_label(open, name)) {
+			vector_push_back(open, &name);
+		}
+	}
+	vector_clear(changed);
+
+	return added;
+}
+
+/* Name of the label a call or branch goes to */
+static const char* site_label(struct interpreter* self, size_t index)
+{
+	const struct instruction* ins = (const struct instruction*)vector_at(
+			&self->decoded_instructions__struct_instruction, index);
+	const struct program_line* line = (const struct program_line*)
+		vector_at(&self->program__struct_program_line, index);
+
+	return line->tokens[ins->opcode == OPCODE_BRANCH ? 1 : 0];
+}
+
+/* Looks up the label of the call or branch, and caches what it resolves to
+   in the instruction */
+static enum interpreter_error resolve_site(struct interpreter* self,
+		size_t index)
+{
+	struct instruction* ins = (struct instruction*)vector_at(
+			&self->decoded_instructions__struct_instruction, index);
+	const char* label = site_label(self, index);
+	size_t* frame_size;
+
+	ins->target = find_label(self, label);
+	if(ins->opcode != OPCODE_CALL || ins->target == BYTECODE_UNRESOLVED) {
+		return INTERPRETER_ERROR_NONE;
+	}
+
+	frame_size = find_frame_size(self, label);
+	if(frame_size == NULL) {
+		return INTERPRETER_ERROR_INVALID_LABEL;
 	}
 
+	ins->frame_size = *frame_size;
 	return INTERPRETER_ERROR_NONE;
 }
 
-static enum interpreter_error interpret_line(struct interpreter* self,
-		struct vector* tokens)
+/*
+ * Resolves the call sites that are new, whose label has been defined since,
+ * or whose label is stale. Every other call site keeps the target and frame
+ * size it resolved to, so labels are only looked up again when they change.
+ */
+static enum interpreter_error link_calls(struct interpreter* self,
+		int labels_added)
 {
 	enum interpreter_error error;
-	const char* ins;
-	struct vector parms_list;
-	inttype* parms;
-	size_t parms_length;
+	struct vector* unresolved = &self->unresolved_sites__size_t;
+	const size_t* sites;
+	size_t kept;
 	size_t i;
 
-	ins = *(const char**)vector_at(tokens, 0);
-
-	if(!strcmp(ins, "branch")) {
-		if(get_stack_val(self, 0) == 1) {
-			return goto_label(self, *(char**)vector_at(tokens, 1));
+	if(labels_added) {
+		kept = 0;
+		for(i = 0; i < vector_size(unresolved); i++) {
+			size_t site = *(size_t*)vector_at(unresolved, i);
+			const struct instruction* ins = (const struct instruction*)
+				vector_at(&self->decoded_instructions__struct_instruction,
+						site);
+
+			INTERPRETER_TRY(error, resolve_site(self, site));
+			if(ins->target == BYTECODE_UNRESOLVED) {
+				vector_set(unresolved, kept++, &site);
+			}
+		}
+		while(vector_size(unresolved) > kept) {
+			vector_pop_back(unresolved);
 		}
-		return INTERPRETER_ERROR_NONE;
 	}
-	
-	vector_create(&parms_list, sizeof(inttype), NULL);
-	INTERPRETER_TRY(error, get_parameters(self, &parms_list, tokens));
-	
-	parms = (inttype*)vector_to_array(&parms_list);
-	parms_length = vector_size(&parms_list);
-
-	if(!strcmp(ins, "push")) {
-		stack_push(self, parms[0]);
-	} else if(!strcmp(ins, "add")) {
-		stack_push(self, parms[0] + parms[1]);
-	} else if(!strcmp(ins, "sub")) {
-		stack_push(self, parms[0] - parms[1]);
-	} else if(!strcmp(ins, "mul")) {
-		stack_push(self, parms[0] * parms[1]);
-	} else if(!strcmp(ins, "div")) {
-		stack_push(self, parms[0] % parms[1]);
-		stack_push(self, parms[0] / parms[1]);
-	}
-
-	else if(!strcmp(ins, "equals?")) {
-		stack_push(self, parms[0] == parms[1]);
-	}
-
-	/* Function calling instructions */
-	else if(!strcmp(ins, "ret")) {
-		return_function(self);
-		for(i = 0; i < parms_length; i++) {
-			stack_push(self, parms[i]);
+
+	sites = (const size_t*)vector_to_array(&self->call_sites__size_t);
+	if(!vector_empty(&self->stale_labels__charptr)) {
+		for(i = 0; i < self->linked_sites; i++) {
+			if(contains_label(&self->stale_labels__charptr,
+						site_label(self, sites[i]))) {
+				INTERPRETER_TRY(error, resolve_site(self, sites[i]));
+			}
 		}
-	} else {
-		INTERPRETER_TRY(error, call_function(self, ins));
-		for(i = 0; i < parms_length; i++) {
-			stack_push(self, parms[i]);
+		vector_clear(&self->stale_labels__charptr);
+	}
+
+	for(i = self->linked_sites; i < vector_size(&self->call_sites__size_t);
+			i++) {
+		const struct instruction* ins = (const struct instruction*)vector_at(
+				&self->decoded_instructions__struct_instruction, sites[i]);
+
+		INTERPRETER_TRY(error, resolve_site(self, sites[i]));
+		if(ins->target == BYTECODE_UNRESOLVED) {
+			vector_push_back(unresolved, (void*)&sites[i]);
 		}
 	}
+	self->linked_sites = vector_size(&self->call_sites__size_t);
 
-	vector_release(&parms_list);
 	return INTERPRETER_ERROR_NONE;
 }
 
-static enum interpreter_error build_stack_frame_sizes(struct interpreter* self)
+static void copy_vector(struct vector* destination,
+		const struct vector* source)
 {
-	enum interpreter_error result = INTERPRETER_ERROR_NONE;
+	size_t i;
+
+	vector_clear(destination);
+	vector_reserve(destination, vector_size(source));
+	for(i = 0; i < vector_size(source); i++) {
+		vector_push_back(destination, vector_at(source, i));
+	}
+}
+
+/* Leaves an identity instruction map when not optimizing */
+static void optimize(struct interpreter* self)
+{
+	struct label_frame_sizes_userdata data;
+	size_t length = vector_size(&self->instructions__struct_instruction);
+	size_t i;
+
+	if(!self->optimize) {
+		vector_clear(&self->instruction_map__size_t);
+		for(i = 0; i <= length; i++) {
+			vector_push_back(&self->instruction_map__size_t, &i);
+		}
+
+		memset(&self->optimizer_stats, 0, sizeof(self->optimizer_stats));
+		self->optimizer_stats.instructions_before = length;
+		self->optimizer_stats.instructions_after = length;
+		return;
+	}
 
-	struct stack_frame_sizes_userdata data;
 	data.self = self;
-	data.error = result;
+	data.length = length;
+	data.label_frame_sizes = (size_t*)calloc(length + 1, sizeof(size_t));
+	hash_map_visit(&self->labels__charptr__size_t, &data,
+			label_frame_sizes_visit_fn);
 
-	self->instruction_ptr = 0;
-	map_visit_prefix(&self->labels__charptr__size_t, 
-			&data, build_stack_frame_sizes_visit_fn);
+	optimizer_run(&self->instructions__struct_instruction,
+			&self->operands__struct_operand, data.label_frame_sizes,
+			&self->instruction_map__size_t, &self->optimizer_stats);
 
-	return result;
+	free(data.label_frame_sizes);
+}
+
+static void run_batch_fn(void* userdata, size_t begin, size_t end,
+		size_t worker)
+{
+	struct batch_userdata* data = (struct batch_userdata*)userdata;
+	size_t i;
+
+	for(i = begin; i < end; i++) {
+		data->errors[i] = interpreter_run_context(data->self,
+				&data->contexts[worker],
+				data->arguments + i * data->arguments_length,
+				&data->results[i]);
+	}
 }
 
+#define LOOP_NAME interpret_switch
+#define LOOP_THREADED 0
+#define LOOP_REGISTERS 0
+#define LOOP_PROFILE 0
+#include "interpreter_loop.h"
+#undef LOOP_NAME
+#undef LOOP_THREADED
+#undef LOOP_REGISTERS
+#undef LOOP_PROFILE
+
+#define LOOP_NAME interpret_switch_registers
+#define LOOP_THREADED 0
+#define LOOP_REGISTERS 1
+#define LOOP_PROFILE 0
+#include "interpreter_loop.h"
+#undef LOOP_NAME
+#undef LOOP_THREADED
+#undef LOOP_REGISTERS
+#undef LOOP_PROFILE
+
+#ifdef INTERPRETER_HAS_THREADED_DISPATCH
+#define LOOP_NAME interpret_threaded
+#define LOOP_THREADED 1
+#define LOOP_REGISTERS 0
+#define LOOP_PROFILE 0
+#include "interpreter_loop.h"
+#undef LOOP_NAME
+#undef LOOP_THREADED
+#undef LOOP_REGISTERS
+#undef LOOP_PROFILE
+
+#define LOOP_NAME interpret_threaded_registers
+#define LOOP_THREADED 1
+#define LOOP_REGISTERS 1
+#define LOOP_PROFILE 0
+#include "interpreter_loop.h"
+#undef LOOP_NAME
+#undef LOOP_THREADED
+#undef LOOP_REGISTERS
+#undef LOOP_PROFILE
+#endif
+
+#ifdef VM_PROFILE
+#define LOOP_NAME interpret_profiled
+#define LOOP_THREADED 0
+#define LOOP_REGISTERS 0
+#define LOOP_PROFILE 1
+#include "interpreter_loop.h"
+#undef LOOP_NAME
+#undef LOOP_THREADED
+#undef LOOP_REGISTERS
+#undef LOOP_PROFILE
+#endif
@@ -1,9 +1,20 @@
 #ifndef INTERPRETER_INCLUDED_H
 #define INTERPRETER_INCLUDED_H
 
+#include "arena.h"
 #include "vector.h"
-#include "map.h"
+#include "hash_map.h"
+#include "string_table.h"
 #include "io.h"
+#include "bytecode.h"
+#include "frame_stack.h"
+#include "program_cache.h"
+#include "optimizer.h"
+#include "jit.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include "bignum.h"
+#include "tokenizer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,36 +24,254 @@ enum interpreter_error {
 	INTERPRETER_ERROR_NONE,
 	INTERPRETER_ERROR_INVALID_LABEL,
 	INTERPRETER_ERROR_NUMBER_PARSE_FAIL,
-	INTERPRETER_ERROR_FILE_NOT_FOUND
+	INTERPRETER_ERROR_FILE_NOT_FOUND,
+	INTERPRETER_ERROR_INVALID_OPERANDS,
+	/* Only reported by differential checks, when the frame models give
+	   different results */
+	INTERPRETER_ERROR_MODE_MISMATCH,
+	/* A type suffix on an instruction that has no form for it */
+	INTERPRETER_ERROR_INVALID_TYPE,
+	/* Only checked by the typed integer divisions */
+	INTERPRETER_ERROR_DIVISION_BY_ZERO
 };
 #define INTERPRETER_TRY(error, line) \
 	if((error = line) != INTERPRETER_ERROR_NONE) return error
 
-typedef size_t inttype;
+/* Direct-threaded dispatch relies on the labels-as-values extension */
+#if defined(__GNUC__) || defined(__clang__)
+	#define INTERPRETER_HAS_THREADED_DISPATCH
+#endif
+
+enum interpreter_dispatch {
+	INTERPRETER_DISPATCH_SWITCH,
+	INTERPRETER_DISPATCH_THREADED
+};
+
+/* How frame slots are addressed. The ring is the reference model, where
+   every read counts back from the latest push; registers are fixed slots
+   worked out when compiling (see registers.h). The JIT runs the register
+   form as native code (see jit.h), and falls back to interpreting it. */
+enum interpreter_mode {
+	INTERPRETER_MODE_RING,
+	INTERPRETER_MODE_REGISTERS,
+	INTERPRETER_MODE_JIT
+};
+
+/* Tokens of one line of code, which point into the interpreter's source
+   storage */
+struct program_line {
+	const char** tokens;
+	size_t tokens_length;
+};
+
+/*
+ * State of one run of a program: its call frames and where it is. Any
+ * number of contexts can run an interpreter's program at once, on
+ * different threads, once it's been prepared (see interpreter_prepare).
+ */
+struct interpreter_context {
+	/* Call frames, each holding its return address */
+	struct frame_stack frames;
+	size_t instruction_ptr;
+	/* Number of instructions executed by the last run */
+	size_t instructions_executed;
+	/* Where the run is profiled, if anywhere */
+	struct profiler* profiler;
+	/* Large values of .n instructions, which last until the next run */
+	struct bignum_heap bignums;
+};
 
 struct interpreter {
-	/* (struct vector<struct vector<char*>>) */
-	struct vector program__struct_vector__charptr;
-	/* (struct map<char*, size_t>) */
-	struct map labels__charptr__size_t;
-	/* (struct map<char*, size_t>) */
-	struct map stack_frame_sizes__charptr__size_t;
-	
-	/* (struct vector<struct ring_buffer>) */
-	struct vector function_stacks__struct_ring_buffer;
+	/* (struct vector<struct program_line>) */
+	struct vector program__struct_program_line;
+	/* Holds the source lines and tokens, and the storage of every container
+	   below other than the frame stack */
+	struct arena* arena;
+	struct arena owned_arena;
+	int owns_arena;
+	/* Loaded files, which are tokenized in place */
+	/* (struct vector<struct io_file_view>) */
+	struct vector files__struct_io_file_view;
+	/* Scratch space for tokenizing a line */
+	/* (struct vector<char*>) */
+	struct vector line_tokens__charptr;
+	/* Delimiters of the tokens of a line, and the character starting a
+	   comment, which ends it */
+	struct tokenizer_classes token_classes;
+	/* Interned label names, which key the maps below */
+	struct string_table label_names;
+	/* (struct hash_map<char*, size_t>) */
+	struct hash_map labels__charptr__size_t;
+	/* (struct hash_map<char*, size_t>) */
+	struct hash_map stack_frame_sizes__charptr__size_t;
+
+	/* Every program line decoded once, so a compile only decodes the lines
+	   added since the last one. Instruction i is decoded from program line
+	   i. Each call and branch caches the target and frame size its label
+	   resolved to, which are only looked up again when the label is
+	   defined or moved, or its function's frame grows. */
+	/* (struct vector<struct instruction>) */
+	struct vector decoded_instructions__struct_instruction;
+	/* (struct vector<struct operand>) */
+	struct vector decoded_operands__struct_operand;
+	/* Index of every decoded call and branch, the first linked_sites of
+	   which have been resolved */
 	/* (struct vector<size_t>) */
-	struct vector instruction_ptrs__size_t;
-	size_t instruction_ptr;
+	struct vector call_sites__size_t;
+	size_t linked_sites;
+	/* Call sites whose label isn't defined yet */
+	/* (struct vector<size_t>) */
+	struct vector unresolved_sites__size_t;
+	/* Labels defined or moved since the last compile */
+	/* (struct vector<char*>) */
+	struct vector changed_labels__charptr;
+	/* Labels whose function had no ret yet, so that lines added after
+	   them can still grow its frame */
+	/* (struct vector<char*>) */
+	struct vector open_labels__charptr;
+	/* Labels whose call sites are resolved again by the next link */
+	/* (struct vector<char*>) */
+	struct vector stale_labels__charptr;
+
+	/* The decoded program as optimized by interpreter_compile */
+	/* (struct vector<struct instruction>) */
+	struct vector instructions__struct_instruction;
+	/* (struct vector<struct operand>) */
+	struct vector operands__struct_operand;
+	/* Handler address of every instruction, for threaded dispatch */
+	/* (struct vector<void*>) */
+	struct vector threaded_code__voidptr;
+	/* Index of the instruction each program line ended up as, and of the
+	   end of the program after the last one */
+	/* (struct vector<size_t>) */
+	struct vector instruction_map__size_t;
+	/* The program that runs, which points either into the vectors above or
+	   into the cache */
+	struct bytecode code;
+	int compiled;
+
+	/* Register form of code, made when preparing in register mode after
+	   the code changes. registers is 1 once it's made, -1 if the program
+	   has none and runs on the ring instead, and 0 until then. */
+	/* (struct vector<struct instruction>) */
+	struct vector register_instructions__struct_instruction;
+	/* (struct vector<struct operand>) */
+	struct vector register_operands__struct_operand;
+	/* (struct vector<void*>) */
+	struct vector register_threaded_code__voidptr;
+	struct bytecode register_code;
+	int registers;
+	/* Native code for register_code, made by the first run in JIT mode
+	   after that. jitted is 1 once it's made, -1 if it couldn't be, and 0
+	   until then. */
+	struct jit jit;
+	int jitted;
+	/* Whether interpreter_compile runs the peephole optimizer, on by
+	   default, and what it did the last time */
+	int optimize;
+	struct optimizer_stats optimizer_stats;
+
+	/* Set while code comes from the cache, and the last loaded file hasn't
+	   been tokenized yet */
+	struct program_cache cache;
+	int cache_loaded;
+
+	/* Where interpreter_run runs the program */
+	struct interpreter_context context;
+	/* Number of values runs pass to the startup function, which the
+	   register form is made for */
+	size_t arguments_length;
+
+	enum interpreter_dispatch dispatch;
+	enum interpreter_mode mode;
+	/* Number of instructions executed by the last interpreter_run */
+	size_t instructions_executed;
+	/* Where runs are profiled, if anywhere */
+	struct profiler* profiler;
 };
 
-void interpreter_create(struct interpreter* self);
+/* Allocates from the given arena, which must outlive the interpreter, or
+   from an arena of its own if NULL */
+void interpreter_create(struct interpreter* self, struct arena* arena);
 void interpreter_release(struct interpreter* self);
 
 void interpreter_add_line(struct interpreter* self, const char* line);
+/* Maps the file into memory, and keeps it until the interpreter is
+   released */
 enum io_error interpreter_add_file(struct interpreter* self,
 		const char* file_name);
+/* Like interpreter_add_file, but if the interpreter is empty, the compiled
+   program is taken from the file's cache when it's up to date, and the
+   cache is written otherwise. The source is only tokenized if the program
+   is changed later on. */
+enum io_error interpreter_add_file_cached(struct interpreter* self,
+		const char* file_name);
+/* Reads the stream line by line, copying each line */
+enum io_error interpreter_add_stream(struct interpreter* self, FILE* file);
+enum interpreter_error interpreter_compile(struct interpreter* self);
 enum interpreter_error interpreter_run(struct interpreter* self,
 		inttype* result);
+/* Compiles if needed, and makes everything runs share for runs passing
+   the given number of arguments: the register form, unless in ring mode,
+   and the handlers for threaded dispatch. From then on until the program
+   or a setting is changed, interpreter_run_context can be called from any
+   number of threads at once. */
+enum interpreter_error interpreter_prepare(struct interpreter* self,
+		size_t arguments_length);
+/* Runs the prepared program in the context, with arguments_length values
+   from arguments, which are pushed into the startup function's frame like
+   the arguments of a call. Programs run on the ring or in registers; only
+   interpreter_run compiles to native code, which has one stack per
+   interpreter. */
+enum interpreter_error interpreter_run_context(const struct interpreter* self,
+		struct interpreter_context* context, const inttype* arguments,
+		inttype* result);
+/*
+ * Runs the program once for every set of arguments_length values in
+ * arguments, spread over the pool's threads, filling results and errors, if
+ * not NULL, in the same order. Every thread runs in a context of its own,
+ * and they all share the program. Returns the error of the first run that
+ * failed, if any. The contexts are gone by then, so large .n results can't
+ * be read.
+ */
+enum interpreter_error interpreter_run_batch(struct interpreter* self,
+		struct thread_pool* pool, const inttype* arguments,
+		size_t arguments_length, size_t runs, inttype* results,
+		enum interpreter_error* errors);
+/* The result of interpreter_run in decimal, read as the type the program
+   returns it as (see bytecode.result_type). The string is released with
+   free. */
+char* interpreter_result_to_string(const struct interpreter* self,
+		inttype result);
+/* Compiles if needed, and prints the program that would run */
+enum interpreter_error interpreter_dump(struct interpreter* self,
+		FILE* file);
+/* Name of the label at every instruction index of the compiled program and
+   at its end, or NULL, as bytecode_dump takes them. The array is released
+   with free. */
+const char** interpreter_label_names(struct interpreter* self);
+
+/* Falls back to INTERPRETER_DISPATCH_SWITCH if threaded dispatch isn't
+   supported by the compiler */
+void interpreter_set_dispatch(struct interpreter* self,
+		enum interpreter_dispatch dispatch);
+/* Programs without a register form run on the ring regardless, and
+   programs the JIT can't compile or finish run in registers */
+void interpreter_set_mode(struct interpreter* self, enum interpreter_mode mode);
+/* Takes effect on the next compile */
+void interpreter_set_optimize(struct interpreter* self, int optimize);
+/* Profiles every run from now on, or none with NULL, clearing the profiler
+   first. Profiled runs interpret the ring form, so that the counts are of
+   the program as compiled. Calls into the profiler are only compiled in
+   with VM_PROFILE defined, so that other builds don't pay for any of it;
+   returns 0 without doing anything otherwise. */
+int interpreter_set_profiler(struct interpreter* self,
+		struct profiler* profiler);
+
+void interpreter_context_create(struct interpreter_context* self);
+void interpreter_context_release(struct interpreter_context* self);
+
+void interpreter_unit_test(void);
 
 
 #ifdef __cplusplus
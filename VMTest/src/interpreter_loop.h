@@ -0,0 +1,414 @@
+/*
+ * Body of the interpreter's main loop. This file is included by
+ * interpreter.c once per dispatch strategy and frame model, with these
+ * macros defined:
+ *
+ * LOOP_NAME      - Name of the generated function
+ * LOOP_THREADED  - 1 to generate direct-threaded dispatch through computed
+ *                  goto (GCC/Clang only), 0 to generate a portable switch
+ * LOOP_REGISTERS - 1 to run self->register_code, whose operands are fixed
+ *                  slots of the frame (see registers.h), 0 to run
+ *                  self->code on the ring
+ * LOOP_PROFILE   - 1 to count every instruction, and report calls and
+ *                  returns, to context->profiler (see profiler.h). Only for
+ *                  switch dispatch, since threaded code is shared by the
+ *                  other loops.
+ *
+ * The generated function runs the interpreter's program in the context,
+ * from context->instruction_ptr until the startup function returns or the
+ * end of the program is reached. It only reads the interpreter, so many
+ * contexts can run at once.
+ */
+
+#if LOOP_PROFILE
+	#if LOOP_THREADED
+		#error "Profiling needs switch dispatch"
+	#endif
+	#define LOOP_PROFILE_COUNT(index) (profiler->counts[index]++)
+	#define LOOP_PROFILE_ENTER() profiler_enter(profiler, ip)
+	#define LOOP_PROFILE_LEAVE() profiler_leave(profiler)
+	#define LOOP_PROFILE_TAIL_CALL() profiler_tail_call(profiler, ip)
+#else
+	#define LOOP_PROFILE_COUNT(index) ((void)0)
+	#define LOOP_PROFILE_ENTER() ((void)0)
+	#define LOOP_PROFILE_LEAVE() ((void)0)
+	#define LOOP_PROFILE_TAIL_CALL() ((void)0)
+#endif
+
+#if LOOP_THREADED
+	#define LOOP_CASE(op) label_##op
+	#define LOOP_DISPATCH() \
+		do { count++; ins = &instructions[ip]; goto *code[ip++]; } while(0)
+#else
+	#define LOOP_CASE(op) case op
+	#define LOOP_DISPATCH() continue
+#endif
+
+#if LOOP_REGISTERS
+	#define LOOP_CODE register_code
+	#define LOOP_THREADED_CODE register_threaded_code__voidptr
+	/* The instruction's own operands come after its destination */
+	#define LOOP_OPERANDS(index) \
+		(&operand_pool[ins->operands_begin + 1 + (index)])
+	#define LOOP_OPERAND(index) get_register_val(slots, LOOP_OPERANDS(index))
+	#define LOOP_DESTINATION() (operand_pool[ins->operands_begin].value)
+	#define LOOP_PUSH(value) (slots[LOOP_DESTINATION()] = (value))
+	#define LOOP_TOP() (slots[LOOP_DESTINATION()])
+	/* Divisions push two values, the second into the slot after */
+	#define LOOP_PUSH_PAIR(first, second) \
+		do { \
+			size_t next = LOOP_DESTINATION() + 1; \
+			\
+			slots[LOOP_DESTINATION()] = (first); \
+			slots[next == frame->length ? 0 : next] = (second); \
+		} while(0)
+	/* Results of a call are returned at the ring's position */
+	#define LOOP_BEFORE_CALL() (frame->pos = LOOP_DESTINATION())
+#else
+	#define LOOP_CODE code
+	#define LOOP_THREADED_CODE threaded_code__voidptr
+	#define LOOP_OPERANDS(index) (&operand_pool[ins->operands_begin + (index)])
+	#define LOOP_OPERAND(index) get_operand_val(frame, LOOP_OPERANDS(index))
+	#define LOOP_PUSH(value) ring_buffer_add(frame, (value))
+	#define LOOP_TOP() ring_buffer_get(frame, 0)
+	#define LOOP_PUSH_PAIR(first, second) \
+		do { \
+			ring_buffer_add(frame, (first)); \
+			ring_buffer_add(frame, (second)); \
+		} while(0)
+	#define LOOP_BEFORE_CALL() ((void)0)
+#endif
+
+#define LOOP_ENTER_FRAME() \
+	do { \
+		frame = &frame_stack_top(&context->frames)->slots; \
+		slots = frame->data; \
+	} while(0)
+#define LOOP_FAIL(code) \
+	do { error = code; goto loop_exit; } while(0)
+
+static enum interpreter_error LOOP_NAME(const struct interpreter* self,
+		struct interpreter_context* context)
+{
+	const struct instruction* instructions;
+	const struct operand* operand_pool;
+	const struct instruction* ins;
+	struct ring_buffer* frame;
+	size_t* slots;
+	size_t length;
+	size_t ip;
+	size_t count = 0;
+	enum interpreter_error error = INTERPRETER_ERROR_NONE;
+	inttype a;
+	inttype b;
+	inttype quotient;
+	inttype remainder;
+	double x;
+	double y;
+	int64_t converted;
+#if LOOP_PROFILE
+	struct profiler* profiler = context->profiler;
+#endif
+#if LOOP_THREADED
+	static void* const labels[OPCODE_COUNT] = {
+		&&label_OPCODE_PUSH,
+		&&label_OPCODE_ADD,
+		&&label_OPCODE_SUB,
+		&&label_OPCODE_MUL,
+		&&label_OPCODE_DIV,
+		&&label_OPCODE_EQUALS,
+		&&label_OPCODE_BRANCH,
+		&&label_OPCODE_RET,
+		&&label_OPCODE_DIV_I,
+		&&label_OPCODE_ADD_F,
+		&&label_OPCODE_SUB_F,
+		&&label_OPCODE_MUL_F,
+		&&label_OPCODE_DIV_F,
+		&&label_OPCODE_EQUALS_F,
+		&&label_OPCODE_ADD_N,
+		&&label_OPCODE_SUB_N,
+		&&label_OPCODE_MUL_N,
+		&&label_OPCODE_DIV_N,
+		&&label_OPCODE_EQUALS_N,
+		&&label_OPCODE_I_TO_F,
+		&&label_OPCODE_F_TO_I,
+		&&label_OPCODE_I_TO_N,
+		&&label_OPCODE_N_TO_I,
+		&&label_OPCODE_CALL,
+		&&label_OPCODE_EQUALS_BRANCH,
+		&&label_OPCODE_SUB_CALL,
+		&&label_OPCODE_TAIL_CALL
+	};
+	void** code;
+#endif
+
+	instructions = self->LOOP_CODE.instructions;
+	operand_pool = self->LOOP_CODE.operands;
+	length = self->LOOP_CODE.instructions_length;
+
+#if LOOP_THREADED
+	/* The handler of every instruction is resolved once per compile, by
+	   interpreter_prepare calling this without a context, which is the
+	   only time it writes to the interpreter. The extra entry past the end
+	   stops the loop when execution runs off the end of the program. */
+	if(context == NULL) {
+		struct vector* handlers = (struct vector*)&self->LOOP_THREADED_CODE;
+		void* end = &&loop_exit;
+		size_t i;
+
+		vector_clear(handlers);
+		for(i = 0; i < length; i++) {
+			vector_push_back(handlers,
+					(void*)&labels[instructions[i].opcode]);
+		}
+		vector_push_back(handlers, &end);
+		return INTERPRETER_ERROR_NONE;
+	}
+	code = (void**)vector_to_array(&self->LOOP_THREADED_CODE);
+#endif
+
+	ip = context->instruction_ptr;
+	LOOP_ENTER_FRAME();
+	(void)slots;
+
+#if LOOP_THREADED
+	LOOP_DISPATCH();
+	{
+		{
+#else
+	for(;;) {
+		if(ip >= length) {
+			goto loop_exit;
+		}
+
+		count++;
+		LOOP_PROFILE_COUNT(ip);
+		ins = &instructions[ip++];
+		switch(ins->opcode) {
+#endif
+		LOOP_CASE(OPCODE_PUSH):
+			LOOP_PUSH(LOOP_OPERAND(0));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_ADD):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(a + b);
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_SUB):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(a - b);
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_MUL):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(a * b);
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_DIV):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH_PAIR(a % b, a / b);
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_EQUALS):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(a == b);
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_BRANCH):
+			if(LOOP_TOP() == 1) {
+				if(ins->target == BYTECODE_UNRESOLVED) {
+					LOOP_FAIL(INTERPRETER_ERROR_INVALID_LABEL);
+				}
+				ip = ins->target;
+			}
+			LOOP_DISPATCH();
+
+		/* Typed arithmetic */
+		LOOP_CASE(OPCODE_DIV_I):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			if(b == 0) {
+				LOOP_FAIL(INTERPRETER_ERROR_DIVISION_BY_ZERO);
+			}
+			/* The one quotient that overflows wraps, rather than trap */
+			if(b == (inttype)-1) {
+				LOOP_PUSH_PAIR(0, 0 - a);
+			} else {
+				LOOP_PUSH_PAIR((inttype)((int64_t)a % (int64_t)b),
+						(inttype)((int64_t)a / (int64_t)b));
+			}
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_ADD_F):
+			x = word_to_f64(LOOP_OPERAND(0));
+			y = word_to_f64(LOOP_OPERAND(1));
+			LOOP_PUSH(f64_to_word(x + y));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_SUB_F):
+			x = word_to_f64(LOOP_OPERAND(0));
+			y = word_to_f64(LOOP_OPERAND(1));
+			LOOP_PUSH(f64_to_word(x - y));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_MUL_F):
+			x = word_to_f64(LOOP_OPERAND(0));
+			y = word_to_f64(LOOP_OPERAND(1));
+			LOOP_PUSH(f64_to_word(x * y));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_DIV_F):
+			x = word_to_f64(LOOP_OPERAND(0));
+			y = word_to_f64(LOOP_OPERAND(1));
+			LOOP_PUSH_PAIR(f64_to_word(fmod(x, y)), f64_to_word(x / y));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_EQUALS_F):
+			x = word_to_f64(LOOP_OPERAND(0));
+			y = word_to_f64(LOOP_OPERAND(1));
+			LOOP_PUSH(x == y);
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_ADD_N):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(bignum_add(&context->bignums, a, b));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_SUB_N):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(bignum_sub(&context->bignums, a, b));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_MUL_N):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(bignum_mul(&context->bignums, a, b));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_DIV_N):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			if(!bignum_div(&context->bignums, a, b, &quotient, &remainder)) {
+				LOOP_FAIL(INTERPRETER_ERROR_DIVISION_BY_ZERO);
+			}
+			LOOP_PUSH_PAIR(remainder, quotient);
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_EQUALS_N):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(bignum_equals(&context->bignums, a, b));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_I_TO_F):
+			LOOP_PUSH(f64_to_word((double)(int64_t)LOOP_OPERAND(0)));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_F_TO_I):
+			LOOP_PUSH((inttype)f64_to_i64(word_to_f64(LOOP_OPERAND(0))));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_I_TO_N):
+			a = LOOP_OPERAND(0);
+			LOOP_PUSH(bignum_from_int(&context->bignums, (int64_t)a));
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_N_TO_I):
+			bignum_to_int(&context->bignums, LOOP_OPERAND(0), &converted);
+			LOOP_PUSH((inttype)converted);
+			LOOP_DISPATCH();
+
+		/* Function calling instructions */
+		LOOP_CASE(OPCODE_RET):
+			LOOP_PROFILE_LEAVE();
+			context->instruction_ptr = ip;
+			return_function(context, LOOP_OPERANDS(0), ins->operands_length,
+					LOOP_REGISTERS);
+			ip = context->instruction_ptr;
+
+			/* Only a return can leave the startup function, so this is the
+			   only place that needs to check for it */
+			if(frame_stack_depth(&context->frames) < 2) {
+				goto loop_exit;
+			}
+			LOOP_ENTER_FRAME();
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_CALL):
+			context->instruction_ptr = ip;
+			LOOP_BEFORE_CALL();
+			error = call_function(context, ins, LOOP_OPERANDS(0),
+					ins->operands_length, LOOP_REGISTERS);
+			if(error != INTERPRETER_ERROR_NONE) {
+				goto loop_exit;
+			}
+			ip = context->instruction_ptr;
+			LOOP_PROFILE_ENTER();
+			LOOP_ENTER_FRAME();
+			LOOP_DISPATCH();
+
+		/* Superinstructions */
+		LOOP_CASE(OPCODE_EQUALS_BRANCH):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_PUSH(a == b);
+			if(a == b) {
+				if(ins->target == BYTECODE_UNRESOLVED) {
+					LOOP_FAIL(INTERPRETER_ERROR_INVALID_LABEL);
+				}
+				ip = ins->target;
+			}
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_SUB_CALL):
+			a = LOOP_OPERAND(0);
+			b = LOOP_OPERAND(1);
+			LOOP_BEFORE_CALL();
+			ring_buffer_add(frame, a - b);
+			context->instruction_ptr = ip;
+			error = call_function(context, ins, LOOP_OPERANDS(2),
+					ins->operands_length - 2, LOOP_REGISTERS);
+			if(error != INTERPRETER_ERROR_NONE) {
+				goto loop_exit;
+			}
+			ip = context->instruction_ptr;
+			LOOP_PROFILE_ENTER();
+			LOOP_ENTER_FRAME();
+			LOOP_DISPATCH();
+		LOOP_CASE(OPCODE_TAIL_CALL):
+			/* The frame stack stays as deep as it was, so this can't leave
+			   the startup function */
+			error = tail_call_function(context, ins, LOOP_OPERANDS(0),
+					ins->operands_length, LOOP_REGISTERS);
+			if(error != INTERPRETER_ERROR_NONE) {
+				goto loop_exit;
+			}
+			ip = context->instruction_ptr;
+			LOOP_PROFILE_TAIL_CALL();
+			LOOP_ENTER_FRAME();
+			LOOP_DISPATCH();
+#if !LOOP_THREADED
+		default:
+			assert(0);
+			LOOP_DISPATCH();
+#endif
+		}
+	}
+
+loop_exit:
+#if LOOP_THREADED
+	/* Running off the end dispatched to the entry past it, which isn't an
+	   instruction, so it's taken back to match switch dispatch */
+	if(ip > length) {
+		ip = length;
+		count--;
+	}
+#endif
+	context->instruction_ptr = ip;
+	context->instructions_executed += count;
+	return error;
+}
+
+#undef LOOP_PROFILE_COUNT
+#undef LOOP_PROFILE_ENTER
+#undef LOOP_PROFILE_LEAVE
+#undef LOOP_PROFILE_TAIL_CALL
+#undef LOOP_CASE
+#undef LOOP_DISPATCH
+#undef LOOP_CODE
+#undef LOOP_THREADED_CODE
+#undef LOOP_OPERANDS
+#undef LOOP_OPERAND
+#undef LOOP_DESTINATION
+#undef LOOP_PUSH
+#undef LOOP_TOP
+#undef LOOP_PUSH_PAIR
+#undef LOOP_BEFORE_CALL
+#undef LOOP_ENTER_FRAME
+#undef LOOP_FAIL
@@ -1,13 +1,28 @@
+#if defined(__unix__) || defined(__APPLE__)
+	/* For MAP_ANONYMOUS */
+	#define _DEFAULT_SOURCE
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#define IO_HAS_MMAP
+#endif
+
 #include "io.h"
 
 #include <stdlib.h>
 
+#ifndef IO_HAS_MMAP
+static enum io_error io_file_view_read(struct io_file_view* self,
+		FILE* file);
+#endif
+
 enum io_error read_line(char** result, size_t* result_alloc_size, FILE* file)
 {
 	char* line = *result;
 	size_t line_alloc_size = *result_alloc_size;
 	size_t char_read_count = 0;
-	char ch;
+	int ch;
 
 	if(file == NULL) {
 		return IO_ERROR_NULL_FILE;
@@ -17,7 +32,7 @@ enum io_error read_line(char** result, size_t* result_alloc_size, FILE* file)
 		return IO_ERROR_EOF;
 	}
 
-	ch = (char)getc(file);
+	ch = getc(file);
 	
 	if(line_alloc_size == 0) {
 		line_alloc_size = 128;
@@ -28,17 +43,18 @@ enum io_error read_line(char** result, size_t* result_alloc_size, FILE* file)
 	}
 
 	while((ch != '\n') && (ch != EOF)) {
-		if(char_read_count == line_alloc_size) {
+		/* Leaves room for the terminator */
+		if(char_read_count + 1 == line_alloc_size) {
 			line_alloc_size *= 2;
-			line = (char*)realloc(result, line_alloc_size);
+			line = (char*)realloc(line, line_alloc_size);
 			if(line == NULL) {
 				return IO_ERROR_OUT_OF_MEMORY;
 			}
 		}
-		line[char_read_count] = ch;
+		line[char_read_count] = (char)ch;
 		char_read_count++;
 
-		ch = (char)getc(file);
+		ch = getc(file);
 	}
 
 	line[char_read_count] = 0;
@@ -47,3 +63,118 @@ enum io_error read_line(char** result, size_t* result_alloc_size, FILE* file)
 	return IO_ERROR_NONE;
 }
 
+enum io_error io_file_view_open(struct io_file_view* self,
+		const char* file_name)
+{
+#ifdef IO_HAS_MMAP
+	struct stat info;
+	size_t page_size;
+	char* data;
+	int fd;
+
+	fd = open(file_name, O_RDONLY);
+	if(fd < 0) {
+		return IO_ERROR_FILE_NOT_FOUND;
+	}
+
+	if(fstat(fd, &info) != 0 || info.st_size < 0) {
+		close(fd);
+		return IO_ERROR_READ_FAIL;
+	}
+
+	/* One byte more than the file is reserved for the terminator. When the
+	   file ends on a page boundary, that byte is on a page past its end,
+	   which the file can't be mapped over, so an anonymous mapping is made
+	   first and the file is mapped over the start of it. */
+	page_size = (size_t)sysconf(_SC_PAGESIZE);
+	self->length = (size_t)info.st_size;
+	self->mapped_length = (self->length + 1 + page_size - 1) &
+		~(page_size - 1);
+
+	data = (char*)mmap(NULL, self->mapped_length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(data == MAP_FAILED) {
+		close(fd);
+		return IO_ERROR_OUT_OF_MEMORY;
+	}
+
+	if(self->length > 0 && mmap(data, self->length, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(data, self->mapped_length);
+		close(fd);
+		return IO_ERROR_READ_FAIL;
+	}
+
+	close(fd);
+	self->data = data;
+	self->data[self->length] = 0;
+	return IO_ERROR_NONE;
+#else
+	enum io_error error;
+	FILE* file;
+
+	file = fopen(file_name, "rb");
+	if(file == NULL) {
+		return IO_ERROR_FILE_NOT_FOUND;
+	}
+
+	error = io_file_view_read(self, file);
+	fclose(file);
+	return error;
+#endif
+}
+
+void io_file_view_close(struct io_file_view* self)
+{
+#ifdef IO_HAS_MMAP
+	if(self->mapped_length > 0) {
+		munmap(self->data, self->mapped_length);
+		return;
+	}
+#endif
+	free(self->data);
+}
+
+
+#ifndef IO_HAS_MMAP
+static enum io_error io_file_view_read(struct io_file_view* self,
+		FILE* file)
+{
+	size_t capacity = 4096;
+	size_t count;
+
+	self->length = 0;
+	self->mapped_length = 0;
+	self->data = (char*)malloc(capacity);
+	if(self->data == NULL) {
+		return IO_ERROR_OUT_OF_MEMORY;
+	}
+
+	for(;;) {
+		char* data;
+
+		count = fread(self->data + self->length, 1,
+				capacity - self->length - 1, file);
+		self->length += count;
+		if(self->length + 1 < capacity) {
+			break;
+		}
+
+		capacity *= 2;
+		data = (char*)realloc(self->data, capacity);
+		if(data == NULL) {
+			free(self->data);
+			return IO_ERROR_OUT_OF_MEMORY;
+		}
+		self->data = data;
+	}
+
+	if(ferror(file)) {
+		free(self->data);
+		return IO_ERROR_READ_FAIL;
+	}
+
+	self->data[self->length] = 0;
+	return IO_ERROR_NONE;
+}
+#endif
@@ -12,11 +12,32 @@ enum io_error {
 	IO_ERROR_OUT_OF_MEMORY,
 	IO_ERROR_EOF,
 	IO_ERROR_NULL_FILE,
-	IO_ERROR_FILE_NOT_FOUND
+	IO_ERROR_FILE_NOT_FOUND,
+	IO_ERROR_READ_FAIL,
+	IO_ERROR_WRITE_FAIL,
+	IO_ERROR_INVALID_FORMAT,
+	/* Derived data, such as a cache, no longer matches its source */
+	IO_ERROR_STALE
+};
+
+/*
+ * A whole file in memory, followed by a NUL. The data is a private copy, so
+ * it can be modified in place without changing the file.
+ */
+struct io_file_view {
+	char* data;
+	size_t length;
+	/* Size of the memory mapping, or 0 if the file was read into a buffer */
+	size_t mapped_length;
 };
 
 enum io_error read_line(char** result, size_t* result_alloc_size, FILE* file);
 
+/* Memory-maps the file where that's supported, and reads it otherwise */
+enum io_error io_file_view_open(struct io_file_view* self,
+		const char* file_name);
+void io_file_view_close(struct io_file_view* self);
+
 #ifdef __cplusplus
 }
 #endif
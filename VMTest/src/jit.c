@@ -0,0 +1,787 @@
+#if defined(__unix__)
+	/* For MAP_ANONYMOUS and MAP_NORESERVE */
+	#define _DEFAULT_SOURCE
+	#include <sys/mman.h>
+#endif
+
+#include "jit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+
+#include "vector.h"
+
+#ifdef JIT_SUPPORTED
+
+/* Reserved address space; only what's touched is ever committed. Every
+   frame takes at least three values and one return address, so the
+   machine stack can't run out before the value stack does. */
+#define VALUES_SIZE ((size_t)1 << 30)
+#define STACK_SIZE ((size_t)1 << 29)
+/* Words in front of every frame's slots: its caller's slots, and where in
+   them its results go */
+#define FRAME_HEADER 2
+#define TARGET_BAILOUT ((size_t)-1)
+
+enum reg {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+/* Registers holding the VM's state in generated code */
+#define REG_SLOTS RBX
+#define REG_SLOTS_END R13
+#define REG_VALUES_END R12
+#define REG_CONTEXT R14
+#define REG_COUNT R15
+
+/* Two-operand instructions taking a register and a register or memory
+   operand, by their opcode bytes */
+#define OP_ADD 0x03
+#define OP_SUB 0x2B
+#define OP_CMP 0x3B
+#define OP_MOV_LOAD 0x8B
+#define OP_MOV_STORE 0x89
+#define OP_LEA 0x8D
+#define OP_IMUL 0x0FAF
+#define OP_CMOVE 0x0F44
+
+#define COND_E 0x84
+#define COND_A 0x87
+
+struct fixup {
+	/* Offset of a rel32 field in the code */
+	size_t offset;
+	/* Instruction it jumps to, or TARGET_BAILOUT */
+	size_t target;
+};
+
+struct emitter {
+	/* (struct vector<unsigned char>) */
+	struct vector code__uchar;
+	/* (struct vector<struct fixup>) */
+	struct vector fixups__struct_fixup;
+	/* Number of instructions run since the count was last updated */
+	size_t pending;
+	/* Offset of the code that returns to the interpreter */
+	size_t bailout;
+};
+
+typedef int (*jit_entry)(struct jit_context* context);
+
+static void emit_byte(struct emitter* e, unsigned char byte);
+static void emit_u32(struct emitter* e, size_t value);
+static void emit_u64(struct emitter* e, size_t value);
+static void emit_opcode(struct emitter* e, int reg, int base, int opcode);
+static void emit_mem(struct emitter* e, int opcode, int reg, int base,
+		ptrdiff_t displacement);
+static void emit_reg(struct emitter* e, int opcode, int reg, int rm);
+static void emit_mov_imm(struct emitter* e, int reg, size_t value);
+static void emit_jump(struct emitter* e, int opcode, size_t target);
+static void emit_push_pop(struct emitter* e, int opcode, int reg);
+static void emit_count(struct emitter* e, size_t extra);
+static void emit_load(struct emitter* e, int reg,
+		const struct operand* operand);
+static void emit_arithmetic(struct emitter* e, int opcode, int reg,
+		const struct operand* operand);
+static void emit_wrap(struct emitter* e, int reg);
+static void emit_call(struct emitter* e, const struct operand* arguments,
+		size_t arguments_length, size_t frame_size, size_t target);
+static void emit_instruction(struct emitter* e, const struct bytecode* code,
+		const struct instruction* ins);
+static void emit_entry(struct emitter* e, const struct bytecode* code);
+static int fits(const struct bytecode* code);
+static int has_templates(const struct bytecode* code);
+static void* map_memory(size_t length);
+
+
+enum jit_error jit_create(struct jit* self, const struct bytecode* code)
+{
+	struct emitter e;
+	size_t* labels;
+	unsigned char* targets;
+	const struct fixup* fixups;
+	size_t i;
+
+	memset(self, 0, sizeof(*self));
+	if(!fits(code) || !has_templates(code)) {
+		return JIT_ERROR_UNSUPPORTED;
+	}
+
+	vector_create(&e.code__uchar, sizeof(unsigned char), NULL);
+	vector_create(&e.fixups__struct_fixup, sizeof(struct fixup), NULL);
+	e.pending = 0;
+	labels = (size_t*)malloc((code->instructions_length + 1) *
+			sizeof(size_t));
+	targets = (unsigned char*)calloc(code->instructions_length + 1, 1);
+	assert(labels != NULL && targets != NULL);
+
+	/* The count is brought up to date wherever control can arrive from
+	   somewhere else, so that it's only added to once per block */
+	if(code->startup_target != BYTECODE_UNRESOLVED) {
+		targets[code->startup_target] = 1;
+	}
+	for(i = 0; i < code->instructions_length; i++) {
+		if(code->instructions[i].target != BYTECODE_UNRESOLVED) {
+			targets[code->instructions[i].target] = 1;
+		}
+	}
+
+	emit_entry(&e, code);
+	for(i = 0; i < code->instructions_length; i++) {
+		if(targets[i]) {
+			emit_count(&e, 0);
+		}
+		labels[i] = vector_size(&e.code__uchar);
+		emit_instruction(&e, code, &code->instructions[i]);
+	}
+	/* Running off the end never happens in register code */
+	emit_count(&e, 0);
+	emit_jump(&e, 0xE9, TARGET_BAILOUT);
+
+	fixups = (const struct fixup*)vector_to_array(&e.fixups__struct_fixup);
+	for(i = 0; i < vector_size(&e.fixups__struct_fixup); i++) {
+		unsigned char* field = (unsigned char*)vector_at(&e.code__uchar,
+				fixups[i].offset);
+		size_t destination = fixups[i].target == TARGET_BAILOUT ?
+			e.bailout : labels[fixups[i].target];
+		size_t relative = destination - (fixups[i].offset + 4);
+
+		field[0] = (unsigned char)relative;
+		field[1] = (unsigned char)(relative >> 8);
+		field[2] = (unsigned char)(relative >> 16);
+		field[3] = (unsigned char)(relative >> 24);
+	}
+
+	self->code_length = vector_size(&e.code__uchar);
+	self->code = (unsigned char*)map_memory(self->code_length);
+	self->stack_length = STACK_SIZE;
+	self->stack = map_memory(self->stack_length);
+	self->values_length = VALUES_SIZE / sizeof(size_t);
+	self->values = (size_t*)map_memory(VALUES_SIZE);
+
+	if(self->code != NULL) {
+		memcpy(self->code, vector_to_array(&e.code__uchar), self->code_length);
+		if(mprotect(self->code, self->code_length, PROT_READ | PROT_EXEC)) {
+			munmap(self->code, self->code_length);
+			self->code = NULL;
+		}
+	}
+
+	vector_release(&e.code__uchar);
+	vector_release(&e.fixups__struct_fixup);
+	free(labels);
+	free(targets);
+
+	if(self->code == NULL || self->stack == NULL || self->values == NULL) {
+		jit_release(self);
+		return JIT_ERROR_OUT_OF_MEMORY;
+	}
+
+	self->context.stack_top = (char*)self->stack + self->stack_length;
+	self->context.values = self->values;
+	self->context.values_end = self->values + self->values_length;
+	return JIT_ERROR_NONE;
+}
+
+void jit_release(struct jit* self)
+{
+	if(self->code != NULL) {
+		munmap(self->code, self->code_length);
+	}
+	if(self->stack != NULL) {
+		munmap(self->stack, self->stack_length);
+	}
+	if(self->values != NULL) {
+		munmap(self->values, self->values_length * sizeof(size_t));
+	}
+	memset(self, 0, sizeof(*self));
+}
+
+enum jit_error jit_run(struct jit* self, inttype* result,
+		size_t* instructions)
+{
+	jit_entry entry = (jit_entry)(void*)self->code;
+
+	if(entry(&self->context)) {
+		return JIT_ERROR_BAILOUT;
+	}
+
+	*result = self->context.result;
+	*instructions = self->context.instructions;
+	return JIT_ERROR_NONE;
+}
+
+
+static void emit_byte(struct emitter* e, unsigned char byte)
+{
+	vector_push_back(&e->code__uchar, &byte);
+}
+
+static void emit_u32(struct emitter* e, size_t value)
+{
+	size_t i;
+
+	for(i = 0; i < 4; i++) {
+		emit_byte(e, (unsigned char)(value >> (i * 8)));
+	}
+}
+
+static void emit_u64(struct emitter* e, size_t value)
+{
+	size_t i;
+
+	for(i = 0; i < 8; i++) {
+		emit_byte(e, (unsigned char)(value >> (i * 8)));
+	}
+}
+
+/* REX.W prefix and the opcode, which may be two bytes */
+static void emit_opcode(struct emitter* e, int reg, int base, int opcode)
+{
+	emit_byte(e, (unsigned char)(0x48 | ((reg >> 3) << 2) | (base >> 3)));
+	if(opcode > 0xFF) {
+		emit_byte(e, (unsigned char)(opcode >> 8));
+	}
+	emit_byte(e, (unsigned char)opcode);
+}
+
+/* 64-bit instruction on reg and [base + displacement] */
+static void emit_mem(struct emitter* e, int opcode, int reg, int base,
+		ptrdiff_t displacement)
+{
+	int mod = 2;
+
+	if(displacement == 0 && (base & 7) != RBP) {
+		mod = 0;
+	} else if(displacement >= -128 && displacement <= 127) {
+		mod = 1;
+	}
+
+	emit_opcode(e, reg, base, opcode);
+	emit_byte(e, (unsigned char)((mod << 6) | ((reg & 7) << 3) | (base & 7)));
+	/* rsp and r12 as a base need a SIB byte */
+	if((base & 7) == RSP) {
+		emit_byte(e, 0x24);
+	}
+	if(mod == 1) {
+		emit_byte(e, (unsigned char)displacement);
+	} else if(mod == 2) {
+		emit_u32(e, (size_t)displacement);
+	}
+}
+
+/* 64-bit instruction on reg and rm, both registers */
+static void emit_reg(struct emitter* e, int opcode, int reg, int rm)
+{
+	emit_opcode(e, reg, rm, opcode);
+	emit_byte(e, (unsigned char)(0xC0 | ((reg & 7) << 3) | (rm & 7)));
+}
+
+static void emit_mov_imm(struct emitter* e, int reg, size_t value)
+{
+	if(value <= 0x7FFFFFFF || value >= (size_t)-0x80000000) {
+		/* mov r64, imm32, sign-extended */
+		emit_reg(e, 0xC7, 0, reg);
+		emit_u32(e, value);
+	} else {
+		/* mov r64, imm64 */
+		emit_opcode(e, 0, reg, 0xB8 + (reg & 7));
+		emit_u64(e, value);
+	}
+}
+
+/* jmp or call with rel32 (0xE9, 0xE8), or a jcc with its condition */
+static void emit_jump(struct emitter* e, int opcode, size_t target)
+{
+	struct fixup fixup;
+
+	if(opcode == 0xE9 || opcode == 0xE8) {
+		emit_byte(e, (unsigned char)opcode);
+	} else {
+		emit_byte(e, 0x0F);
+		emit_byte(e, (unsigned char)opcode);
+	}
+
+	fixup.offset = vector_size(&e->code__uchar);
+	fixup.target = target;
+	vector_push_back(&e->fixups__struct_fixup, &fixup);
+	emit_u32(e, 0);
+}
+
+/* push (0x50) or pop (0x58) */
+static void emit_push_pop(struct emitter* e, int opcode, int reg)
+{
+	if(reg >= R8) {
+		emit_byte(e, 0x41);
+	}
+	emit_byte(e, (unsigned char)(opcode + (reg & 7)));
+}
+
+/* Adds the pending instructions, and extra more, to the count. This
+   changes the flags, so it goes before any comparison. */
+static void emit_count(struct emitter* e, size_t extra)
+{
+	size_t count = e->pending + extra;
+
+	e->pending = 0;
+	if(count > 0) {
+		/* add r15, imm32 */
+		emit_reg(e, 0x81, 0, REG_COUNT);
+		emit_u32(e, count);
+	}
+}
+
+static void emit_load(struct emitter* e, int reg,
+		const struct operand* operand)
+{
+	if(operand->is_stack) {
+		emit_mem(e, OP_MOV_LOAD, reg, REG_SLOTS,
+				(ptrdiff_t)(operand->value * sizeof(size_t)));
+	} else {
+		emit_mov_imm(e, reg, operand->value);
+	}
+}
+
+/* reg = reg op operand, reading slots straight from memory and taking
+   constants that fit as 32-bit immediates */
+static void emit_arithmetic(struct emitter* e, int opcode, int reg,
+		const struct operand* operand)
+{
+	size_t value = operand->value;
+
+	if(operand->is_stack) {
+		emit_mem(e, opcode, reg, REG_SLOTS,
+				(ptrdiff_t)(value * sizeof(size_t)));
+	} else if(value <= 0x7FFFFFFF || value >= (size_t)-0x80000000) {
+		if(opcode == OP_IMUL) {
+			/* imul reg, reg, imm32 */
+			emit_reg(e, 0x69, reg, reg);
+		} else {
+			/* add, sub or cmp reg, imm32 */
+			emit_reg(e, 0x81, opcode == OP_ADD ? 0 : opcode == OP_SUB ? 5 : 7,
+					reg);
+		}
+		emit_u32(e, value);
+	} else {
+		emit_mov_imm(e, RCX, value);
+		emit_reg(e, opcode, reg, RCX);
+	}
+}
+
+/* Wraps a pointer that has moved past the frame's slots back to the first,
+   as the ring would */
+static void emit_wrap(struct emitter* e, int reg)
+{
+	emit_reg(e, OP_CMP, reg, REG_SLOTS_END);
+	emit_reg(e, OP_CMOVE, reg, REG_SLOTS);
+}
+
+/*
+ * Enters a frame for target after the running one and calls it, with rcx
+ * pointing at where its results go. Arguments are pushed from position 0,
+ * as call_function does. Falls back to the interpreter if the value stack
+ * is full.
+ */
+static void emit_call(struct emitter* e, const struct operand* arguments,
+		size_t arguments_length, size_t frame_size, size_t target)
+{
+	size_t i;
+
+	emit_mem(e, OP_LEA, RAX, REG_SLOTS_END,
+			FRAME_HEADER * sizeof(size_t));
+	emit_mem(e, OP_LEA, RDX, RAX, (ptrdiff_t)(frame_size * sizeof(size_t)));
+	emit_reg(e, OP_CMP, RDX, REG_VALUES_END);
+	emit_jump(e, COND_A, TARGET_BAILOUT);
+
+	for(i = 0; i < arguments_length; i++) {
+		emit_load(e, RSI, &arguments[i]);
+		emit_mem(e, OP_MOV_STORE, RSI, RAX,
+				(ptrdiff_t)(i % frame_size * sizeof(size_t)));
+	}
+
+	emit_mem(e, OP_MOV_STORE, REG_SLOTS, RAX, -2 * (ptrdiff_t)sizeof(size_t));
+	emit_mem(e, OP_MOV_STORE, RCX, RAX, -(ptrdiff_t)sizeof(size_t));
+	emit_reg(e, OP_MOV_STORE, RAX, REG_SLOTS);
+	emit_reg(e, OP_MOV_STORE, RDX, REG_SLOTS_END);
+	emit_jump(e, 0xE8, target);
+}
+
+static void emit_instruction(struct emitter* e, const struct bytecode* code,
+		const struct instruction* ins)
+{
+	const struct operand* operands = &code->operands[ins->operands_begin];
+	/* The slot or ring position register code puts before the operands */
+	ptrdiff_t destination = (ptrdiff_t)(operands[0].value * sizeof(size_t));
+	size_t i;
+
+	operands++;
+	switch(ins->opcode) {
+	case OPCODE_PUSH:
+		emit_load(e, RAX, &operands[0]);
+		emit_mem(e, OP_MOV_STORE, RAX, REG_SLOTS, destination);
+		e->pending++;
+		return;
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_MUL:
+		emit_load(e, RAX, &operands[0]);
+		emit_arithmetic(e, ins->opcode == OPCODE_ADD ? OP_ADD :
+				ins->opcode == OPCODE_SUB ? OP_SUB : OP_IMUL,
+				RAX, &operands[1]);
+		emit_mem(e, OP_MOV_STORE, RAX, REG_SLOTS, destination);
+		e->pending++;
+		return;
+	case OPCODE_DIV:
+		/* The remainder goes first, then the quotient in the next slot */
+		emit_load(e, RAX, &operands[0]);
+		emit_load(e, RCX, &operands[1]);
+		emit_byte(e, 0x31); /* xor edx, edx */
+		emit_byte(e, 0xD2);
+		emit_reg(e, 0xF7, 6, RCX); /* div rcx */
+		emit_mem(e, OP_MOV_STORE, RDX, REG_SLOTS, destination);
+		emit_mem(e, OP_LEA, RSI, REG_SLOTS,
+				destination + (ptrdiff_t)sizeof(size_t));
+		emit_wrap(e, RSI);
+		emit_mem(e, OP_MOV_STORE, RAX, RSI, 0);
+		e->pending++;
+		return;
+	case OPCODE_EQUALS:
+	case OPCODE_EQUALS_BRANCH:
+		if(ins->opcode == OPCODE_EQUALS_BRANCH) {
+			emit_count(e, 1);
+		} else {
+			e->pending++;
+		}
+		emit_load(e, RAX, &operands[0]);
+		emit_arithmetic(e, OP_CMP, RAX, &operands[1]);
+		emit_byte(e, 0x0F); /* sete cl */
+		emit_byte(e, 0x94);
+		emit_byte(e, 0xC1);
+		emit_byte(e, 0x0F); /* movzx ecx, cl */
+		emit_byte(e, 0xB6);
+		emit_byte(e, 0xC9);
+		emit_mem(e, OP_MOV_STORE, RCX, REG_SLOTS, destination);
+		if(ins->opcode == OPCODE_EQUALS_BRANCH) {
+			emit_jump(e, COND_E, ins->target == BYTECODE_UNRESOLVED ?
+					TARGET_BAILOUT : ins->target);
+		}
+		return;
+	case OPCODE_BRANCH:
+		emit_count(e, 1);
+		/* cmp qword [slot], 1 */
+		emit_mem(e, 0x83, 7, REG_SLOTS, destination);
+		emit_byte(e, 1);
+		emit_jump(e, COND_E, ins->target == BYTECODE_UNRESOLVED ?
+				TARGET_BAILOUT : ins->target);
+		return;
+	case OPCODE_RET:
+		emit_count(e, 1);
+		if(ins->operands_length > JIT_MAX_VALUES) {
+			break;
+		}
+
+		/* Every value is read before the frame is left */
+		for(i = 0; i < ins->operands_length && ins->operands_length > 1;
+				i++) {
+			emit_load(e, RAX, &operands[i]);
+			emit_mem(e, OP_MOV_STORE, RAX, REG_CONTEXT,
+					(ptrdiff_t)(offsetof(struct jit_context, scratch) +
+						i * sizeof(size_t)));
+		}
+		if(ins->operands_length == 1) {
+			emit_load(e, RAX, &operands[0]);
+		}
+
+		emit_mem(e, OP_MOV_LOAD, RDI, REG_SLOTS, -(ptrdiff_t)sizeof(size_t));
+		emit_mem(e, OP_LEA, REG_SLOTS_END, REG_SLOTS,
+				-FRAME_HEADER * (ptrdiff_t)sizeof(size_t));
+		emit_mem(e, OP_MOV_LOAD, REG_SLOTS, REG_SLOTS,
+				-FRAME_HEADER * (ptrdiff_t)sizeof(size_t));
+		for(i = 0; i < ins->operands_length; i++) {
+			if(ins->operands_length > 1) {
+				emit_mem(e, OP_MOV_LOAD, RAX, REG_CONTEXT,
+						(ptrdiff_t)(offsetof(struct jit_context, scratch) +
+							i * sizeof(size_t)));
+			}
+			emit_mem(e, OP_MOV_STORE, RAX, RDI, 0);
+			emit_mem(e, OP_LEA, RDI, RDI, sizeof(size_t));
+			emit_wrap(e, RDI);
+		}
+		emit_byte(e, 0xC3); /* ret */
+		return;
+	case OPCODE_CALL:
+		emit_count(e, 1);
+		if(ins->target == BYTECODE_UNRESOLVED) {
+			break;
+		}
+		emit_mem(e, OP_LEA, RCX, REG_SLOTS, destination);
+		emit_call(e, operands, ins->operands_length, ins->frame_size,
+				ins->target);
+		return;
+	case OPCODE_SUB_CALL:
+		emit_count(e, 1);
+		if(ins->target == BYTECODE_UNRESOLVED) {
+			break;
+		}
+		emit_load(e, RAX, &operands[0]);
+		emit_arithmetic(e, OP_SUB, RAX, &operands[1]);
+		emit_mem(e, OP_MOV_STORE, RAX, REG_SLOTS, destination);
+		emit_mem(e, OP_LEA, RCX, REG_SLOTS,
+				destination + (ptrdiff_t)sizeof(size_t));
+		emit_wrap(e, RCX);
+		emit_call(e, operands + 2, ins->operands_length - 2, ins->frame_size,
+				ins->target);
+		return;
+	case OPCODE_TAIL_CALL:
+		emit_count(e, 1);
+		if(ins->target == BYTECODE_UNRESOLVED ||
+				ins->operands_length > JIT_MAX_VALUES) {
+			break;
+		}
+
+		/* The callee's frame takes the place of this one, keeping its
+		   header, once the arguments have been read out of it */
+		for(i = 0; i < ins->operands_length; i++) {
+			emit_load(e, RAX, &operands[i]);
+			emit_mem(e, OP_MOV_STORE, RAX, REG_CONTEXT,
+					(ptrdiff_t)(offsetof(struct jit_context, scratch) +
+						i * sizeof(size_t)));
+		}
+		emit_mem(e, OP_LEA, RDX, REG_SLOTS,
+				(ptrdiff_t)(ins->frame_size * sizeof(size_t)));
+		emit_reg(e, OP_CMP, RDX, REG_VALUES_END);
+		emit_jump(e, COND_A, TARGET_BAILOUT);
+		for(i = 0; i < ins->operands_length; i++) {
+			emit_mem(e, OP_MOV_LOAD, RAX, REG_CONTEXT,
+					(ptrdiff_t)(offsetof(struct jit_context, scratch) +
+						i * sizeof(size_t)));
+			emit_mem(e, OP_MOV_STORE, RAX, REG_SLOTS,
+					(ptrdiff_t)(i % ins->frame_size * sizeof(size_t)));
+		}
+		emit_reg(e, OP_MOV_STORE, RDX, REG_SLOTS_END);
+		emit_jump(e, 0xE9, ins->target);
+		return;
+	default:
+		emit_count(e, 1);
+		break;
+	}
+
+	/* Anything else is left to the interpreter */
+	emit_jump(e, 0xE9, TARGET_BAILOUT);
+}
+
+/*
+ * int entry(struct jit_context* context), which switches to the JIT's own
+ * stack and calls the startup function from a frame of one value for its
+ * result, the same way interpreter_run does. It's followed by the code
+ * every bailout jumps to.
+ */
+static void emit_entry(struct emitter* e, const struct bytecode* code)
+{
+	static const int saved[] = {RBX, RBP, R12, R13, R14, R15};
+	size_t exit;
+	size_t i;
+
+	for(i = 0; i < sizeof(saved) / sizeof(saved[0]); i++) {
+		emit_push_pop(e, 0x50, saved[i]);
+	}
+	emit_reg(e, OP_MOV_STORE, RDI, REG_CONTEXT);
+	emit_mem(e, OP_MOV_STORE, RSP, REG_CONTEXT,
+			offsetof(struct jit_context, saved_stack));
+	emit_mem(e, OP_MOV_LOAD, RSP, REG_CONTEXT,
+			offsetof(struct jit_context, stack_top));
+	emit_mem(e, OP_MOV_LOAD, REG_VALUES_END, REG_CONTEXT,
+			offsetof(struct jit_context, values_end));
+	emit_mem(e, OP_MOV_LOAD, REG_SLOTS, REG_CONTEXT,
+			offsetof(struct jit_context, values));
+	emit_mem(e, OP_LEA, REG_SLOTS, REG_SLOTS, FRAME_HEADER * sizeof(size_t));
+	emit_mem(e, OP_LEA, REG_SLOTS_END, REG_SLOTS, sizeof(size_t));
+	emit_mov_imm(e, REG_COUNT, 0);
+
+	if(code->startup_target == BYTECODE_UNRESOLVED) {
+		emit_jump(e, 0xE9, TARGET_BAILOUT);
+	} else {
+		emit_reg(e, OP_MOV_STORE, REG_SLOTS, RCX);
+		emit_call(e, NULL, 0, code->startup_frame_size,
+				code->startup_target);
+	}
+
+	emit_mem(e, OP_MOV_LOAD, RAX, REG_SLOTS, 0);
+	emit_mem(e, OP_MOV_STORE, RAX, REG_CONTEXT,
+			offsetof(struct jit_context, result));
+	emit_mem(e, OP_MOV_STORE, REG_COUNT, REG_CONTEXT,
+			offsetof(struct jit_context, instructions));
+	emit_mov_imm(e, RAX, 0);
+
+	exit = vector_size(&e->code__uchar);
+	emit_mem(e, OP_MOV_LOAD, RSP, REG_CONTEXT,
+			offsetof(struct jit_context, saved_stack));
+	for(i = sizeof(saved) / sizeof(saved[0]); i > 0; i--) {
+		emit_push_pop(e, 0x58, saved[i - 1]);
+	}
+	emit_byte(e, 0xC3); /* ret */
+
+	/* Bailing out can happen at any depth, but the stack is thrown away */
+	e->bailout = vector_size(&e->code__uchar);
+	emit_mov_imm(e, RAX, 1);
+	emit_byte(e, 0xE9);
+	emit_u32(e, exit - (vector_size(&e->code__uchar) + 4));
+}
+
+/* Whether every slot and frame can be addressed with 32-bit displacements,
+   counting the slot or position in front of every instruction's operands */
+static int fits(const struct bytecode* code)
+{
+	const size_t limit = 0x7FFFFFFF / sizeof(size_t) - FRAME_HEADER;
+	size_t i, j;
+
+	if(code->startup_frame_size > limit) {
+		return 0;
+	}
+	for(i = 0; i < code->instructions_length; i++) {
+		const struct instruction* ins = &code->instructions[i];
+		const struct operand* operands = &code->operands[ins->operands_begin];
+
+		if(ins->frame_size > limit || operands[0].value > limit) {
+			return 0;
+		}
+		for(j = 1; j <= ins->operands_length; j++) {
+			if(operands[j].is_stack && operands[j].value > limit) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* Typed arithmetic has no templates. A program using it would bail out
+   once it got there, only to run again from the start, so it's left to
+   the interpreter entirely. */
+static int has_templates(const struct bytecode* code)
+{
+	size_t i;
+
+	for(i = 0; i < code->instructions_length; i++) {
+		switch(code->instructions[i].opcode) {
+		case OPCODE_DIV_I:
+		case OPCODE_ADD_F:
+		case OPCODE_SUB_F:
+		case OPCODE_MUL_F:
+		case OPCODE_DIV_F:
+		case OPCODE_EQUALS_F:
+		case OPCODE_ADD_N:
+		case OPCODE_SUB_N:
+		case OPCODE_MUL_N:
+		case OPCODE_DIV_N:
+		case OPCODE_EQUALS_N:
+		case OPCODE_I_TO_F:
+		case OPCODE_F_TO_I:
+		case OPCODE_I_TO_N:
+		case OPCODE_N_TO_I:
+			return 0;
+		default:
+			break;
+		}
+	}
+
+	return 1;
+}
+
+static void* map_memory(size_t length)
+{
+	void* memory = mmap(NULL, length, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	return memory == MAP_FAILED ? NULL : memory;
+}
+
+#else
+
+enum jit_error jit_create(struct jit* self, const struct bytecode* code)
+{
+	(void)code;
+	memset(self, 0, sizeof(*self));
+	return JIT_ERROR_UNSUPPORTED;
+}
+
+void jit_release(struct jit* self)
+{
+	(void)self;
+}
+
+enum jit_error jit_run(struct jit* self, inttype* result,
+		size_t* instructions)
+{
+	(void)self;
+	(void)result;
+	(void)instructions;
+	return JIT_ERROR_UNSUPPORTED;
+}
+
+#endif
+
+
+
+void jit_unit_test(void)
+{
+#ifdef JIT_SUPPORTED
+	/* Register code for a main calling add10 5, and a branch to nowhere */
+	static struct instruction instructions[] = {
+		/* main: call 5 -> add10, results from slot 0 */
+		{OPCODE_CALL, 0, 1, 3, 2, VALUE_TYPE_WORD},
+		/* ret slot 0 */
+		{OPCODE_RET, 2, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* Unreachable */
+		{OPCODE_RET, 2, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* add10: add slot 0 10 to slot 1 */
+		{OPCODE_ADD, 4, 2, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* div slot 1 6 to slot 1, and the quotient to slot 0 */
+		{OPCODE_DIV, 7, 2, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* ret slot 0 */
+		{OPCODE_RET, 10, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* branch on slot 1 to nowhere */
+		{OPCODE_BRANCH, 12, 0, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD}
+	};
+	static const struct operand operands[] = {
+		{0, 0}, {5, 0},
+		{0, 0}, {0, 1},
+		{1, 0}, {0, 1}, {10, 0},
+		{1, 0}, {1, 1}, {6, 0},
+		{0, 0}, {0, 1},
+		{1, 0}
+	};
+	struct bytecode code;
+	struct jit jit;
+	inttype result = 0;
+	size_t count = 0;
+
+	code.instructions = instructions;
+	code.instructions_length = sizeof(instructions) / sizeof(instructions[0]);
+	code.operands = operands;
+	code.operands_length = sizeof(operands) / sizeof(operands[0]);
+	code.startup_target = 0;
+	code.startup_frame_size = 1;
+
+	/* 15 % 6 goes to slot 1, and 15 / 6 wraps around to slot 0 */
+	assert(jit_create(&jit, &code) == JIT_ERROR_NONE);
+	assert(jit_run(&jit, &result, &count) == JIT_ERROR_NONE);
+	assert(result == 2);
+	assert(count == 5);
+	/* Runs again from scratch */
+	assert(jit_run(&jit, &result, &count) == JIT_ERROR_NONE);
+	assert(result == 2 && count == 5);
+	jit_release(&jit);
+
+	/* Running off the end, like a branch that can't go anywhere, is left
+	   to the interpreter */
+	code.startup_target = 6;
+	code.startup_frame_size = 2;
+	assert(jit_create(&jit, &code) == JIT_ERROR_NONE);
+	assert(jit_run(&jit, &result, &count) == JIT_ERROR_BAILOUT);
+	jit_release(&jit);
+#endif
+}
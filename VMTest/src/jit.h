@@ -0,0 +1,83 @@
+#ifndef JIT_INCLUDED_H
+#define JIT_INCLUDED_H
+
+#include <stddef.h>
+
+#include "bytecode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Native code is only generated for x86-64 with the System V calling
+   convention, on systems where memory can be mapped executable */
+#if defined(__x86_64__) && defined(__linux__)
+	#define JIT_SUPPORTED
+#endif
+
+/* Most values a ret or tail-call can pass, beyond which it falls back to
+   the interpreter */
+#define JIT_MAX_VALUES 64
+
+enum jit_error {
+	JIT_ERROR_NONE,
+	/* Not built for this platform */
+	JIT_ERROR_UNSUPPORTED,
+	JIT_ERROR_OUT_OF_MEMORY,
+	/* The program reached something native code doesn't handle, such as
+	   an unresolved label, an unknown opcode or the end of the value stack.
+	   Programs have no side effects, so it can simply be run again by the
+	   interpreter, which reports or handles it. */
+	JIT_ERROR_BAILOUT
+};
+
+/* Where the native code keeps its state while running, at offsets known to
+   the generated code */
+struct jit_context {
+	void* saved_stack;
+	void* stack_top;
+	size_t* values;
+	size_t* values_end;
+	inttype result;
+	size_t instructions;
+	inttype scratch[JIT_MAX_VALUES];
+};
+
+/*
+ * Native code for the register form of a program (see registers.h), one
+ * template per instruction.
+ *
+ * Frames live in a value stack of their own, each one's slots preceded by
+ * its caller's frame and the slot its results are written from. rbx points
+ * at the slots of the running frame and r13 just past them, so every stack
+ * operand is a fixed offset from rbx. Calls and returns are native calls
+ * and returns, on a machine stack of its own so that deep recursion can't
+ * overflow the thread's stack.
+ */
+struct jit {
+	unsigned char* code;
+	size_t code_length;
+	/* Reserved up front and committed by the system as it's touched */
+	void* stack;
+	size_t stack_length;
+	size_t* values;
+	size_t values_length;
+	struct jit_context context;
+};
+
+/* Compiles register code, which must have come from registers_assign */
+enum jit_error jit_create(struct jit* self, const struct bytecode* code);
+void jit_release(struct jit* self);
+
+/* Runs the program, filling result and the number of instructions it
+   executed, as the interpreter would have counted them */
+enum jit_error jit_run(struct jit* self, inttype* result,
+		size_t* instructions);
+
+void jit_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,12 +1,234 @@
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include "interpreter.h"
-
-/*
- * TODO: Good way of handling different data types/sizes
- * TODO: Possibly variable-size integer types
- */
+#include "benchmark.h"
+#include "scheme.h"
+#include "fuzz.h"
 
 #define PROGRAM_FILE_NAME "./res/test.asm"
+#define PROFILE_STACKS_EXTENSION ".stacks"
+#define FUZZ_PROGRAMS 500
+
+static enum interpreter_error dump_program(struct interpreter* interp)
+{
+	const struct optimizer_stats* stats = &interp->optimizer_stats;
+	enum interpreter_error error;
+	int optimize = interp->optimize;
+
+	interpreter_set_optimize(interp, 0);
+	printf("Before optimizing:\n");
+	INTERPRETER_TRY(error, interpreter_dump(interp, stdout));
+
+	if(!optimize) {
+		return INTERPRETER_ERROR_NONE;
+	}
+
+	interpreter_set_optimize(interp, 1);
+	printf("\nAfter optimizing:\n");
+	INTERPRETER_TRY(error, interpreter_dump(interp, stdout));
+	printf("\n%lu instructions before, %lu after: %lu operands propagated, "
+			"%lu folded, %lu dead pushes, %lu fused, %lu tail calls\n\n",
+			stats->instructions_before, stats->instructions_after,
+			stats->propagated, stats->folded, stats->dead_pushes,
+			stats->fused, stats->tail_calls);
+
+	return INTERPRETER_ERROR_NONE;
+}
+
+/* Runs the program in every mode, with the ring as the reference */
+static enum interpreter_error compare_modes(struct interpreter* interp,
+		inttype* result)
+{
+	static const char* const names[] = {
+		"Ring:     ",
+		"Registers:",
+		"JIT:      "
+	};
+	enum interpreter_error error;
+	char* ring_result = NULL;
+	size_t ring_instructions = 0;
+	int mismatch = 0;
+	size_t mode;
+
+	/* Compared as text, as large .n values are handles into a heap that
+	   each run starts over */
+	for(mode = INTERPRETER_MODE_RING; mode <= INTERPRETER_MODE_JIT; mode++) {
+		const char* note = "";
+		char* string;
+
+		interpreter_set_mode(interp, (enum interpreter_mode)mode);
+		error = interpreter_run(interp, result);
+		if(error != INTERPRETER_ERROR_NONE) {
+			free(ring_result);
+			return error;
+		}
+
+		if(mode != INTERPRETER_MODE_RING && interp->registers < 0) {
+			note = " (no register form, ran on the ring)";
+		} else if(mode == INTERPRETER_MODE_JIT && interp->jitted < 0) {
+			note = " (not compiled, ran in registers)";
+		}
+		string = interpreter_result_to_string(interp, *result);
+		printf("%s %s in %lu instructions%s\n", names[mode], string,
+				interp->instructions_executed, note);
+
+		if(mode == INTERPRETER_MODE_RING) {
+			ring_result = string;
+			ring_instructions = interp->instructions_executed;
+		} else {
+			if(strcmp(string, ring_result) != 0 ||
+					interp->instructions_executed != ring_instructions) {
+				mismatch = 1;
+			}
+			free(string);
+		}
+	}
+
+	free(ring_result);
+	if(mismatch) {
+		fprintf(stderr, "Error: The modes disagree\n");
+		return INTERPRETER_ERROR_MODE_MISMATCH;
+	}
+
+	return INTERPRETER_ERROR_NONE;
+}
+
+/* Prints the report, and writes the folded stacks next to the program */
+static int write_profile(struct interpreter* interp,
+		const struct profiler* profiler, const char* file_name)
+{
+	const char** label_names = interpreter_label_names(interp);
+	char stacks_name[1024];
+	FILE* stacks;
+
+	printf("\n");
+	profiler_report(profiler, &interp->code, label_names, stdout);
+
+	snprintf(stacks_name, sizeof(stacks_name), "%s" PROFILE_STACKS_EXTENSION,
+			file_name);
+	stacks = fopen(stacks_name, "w");
+	if(stacks == NULL) {
+		fprintf(stderr, "Error: Could not write %s\n", stacks_name);
+		free((void*)label_names);
+		return 1;
+	}
+	profiler_write_stacks(profiler, label_names, stacks);
+	fclose(stacks);
+	printf("\nStacks written to %s\n", stacks_name);
+
+	free((void*)label_names);
+	return 0;
+}
+
+/* Compiles the Scheme program, and adds the assembly it gives */
+static int add_scheme_file(struct interpreter* interp, const char* file_name,
+		int dump)
+{
+	struct scheme_compiler compiler;
+	struct io_file_view file;
+	enum scheme_error error;
+	enum io_error ioerror;
+	size_t i;
+
+	ioerror = io_file_view_open(&file, file_name);
+	if(ioerror != IO_ERROR_NONE) {
+		fprintf(stderr,
+				"Error: File %s could not be loaded, due to error code: %d\n",
+				file_name, ioerror);
+		return 1;
+	}
+
+	scheme_compiler_create(&compiler);
+	error = scheme_compile(&compiler, file.data);
+	io_file_view_close(&file);
+	if(error != SCHEME_ERROR_NONE) {
+		fprintf(stderr, "Error: %s:%lu: Compilation failed with error "
+				"code: %d\n", file_name, compiler.error_line, error);
+		scheme_compiler_release(&compiler);
+		return 1;
+	}
+
+	if(dump) {
+		printf("Compiled from Scheme:\n");
+	}
+	for(i = 0; i < scheme_lines_length(&compiler); i++) {
+		interpreter_add_line(interp, scheme_line(&compiler, i));
+		if(dump) {
+			printf("%s\n", scheme_line(&compiler, i));
+		}
+	}
+	if(dump) {
+		printf("\n");
+	}
+
+	scheme_compiler_release(&compiler);
+	return 0;
+}
+
+static int is_scheme_file(const char* file_name)
+{
+	size_t length = strlen(file_name);
+	size_t extension_length = strlen(SCHEME_EXTENSION);
+
+	return length > extension_length &&
+		!strcmp(file_name + length - extension_length, SCHEME_EXTENSION);
+}
+
+/* Takes the optional program count and seed following --fuzz */
+static int run_fuzz(int argc, char** argv)
+{
+	unsigned long long programs = FUZZ_PROGRAMS;
+	unsigned long long seed = 1;
+
+	if((argc > 0 && sscanf(argv[0], "%llu", &programs) != 1) ||
+			(argc > 1 && sscanf(argv[1], "%llu", &seed) != 1)) {
+		fprintf(stderr, "Error: --fuzz takes a program count and a seed\n");
+		return 1;
+	}
+
+	return fuzz_run((uint64_t)seed, (size_t)programs, stdout);
+}
+
+static void print_usage(const char* program_name)
+{
+	fprintf(stderr,
+			"Usage: %s [options] [file]\n"
+			"  file       Assembly, or Scheme if it ends in " SCHEME_EXTENSION
+			"\n"
+			"  --bench    Report instructions per second of every dispatch\n"
+			"             strategy, instead of running the program\n"
+			"  --bench-map\n"
+			"             Compare the map modes on different key orders\n"
+			"  --bench-load\n"
+			"             Time loading a large generated program\n"
+			"  --bench-batch\n"
+			"             Time a batch of scripts on a thread pool\n"
+			"  --fuzz [programs [seed]]\n"
+			"             Run random programs (500 from seed 1) on every\n"
+			"             engine, fail on the first they disagree on, and\n"
+			"             report the speedups over the plain ring buffer\n"
+			"  --no-cache Neither read nor write the compiled program cache\n"
+			"             (file" PROGRAM_CACHE_EXTENSION ")\n"
+			"  --no-optimize\n"
+			"             Run the program as written, without the peephole\n"
+			"             optimizer\n"
+			"  --dump     Print the compiled program before and after\n"
+			"             optimizing, then run it\n"
+			"  --ring     Address frame slots through the ring buffer, even\n"
+			"             if the program has a register form\n"
+			"  --no-jit   Interpret the register form instead of compiling it\n"
+			"             to native code\n"
+			"  --compare-modes\n"
+			"             Run on the ring, in registers and compiled, and\n"
+			"             fail if the results differ\n"
+			"  --profile  Count executions of every instruction and time\n"
+			"             every function, then print a report and write the\n"
+			"             call stacks for flame graphs to file"
+			PROFILE_STACKS_EXTENSION "\n"
+			"             Needs a build with VM_PROFILE (make PROFILE=1)\n",
+			program_name);
+}
 
 int main(int argc, char** argv)
 {
@@ -14,28 +236,103 @@ int main(int argc, char** argv)
 	enum interpreter_error error;
 	enum io_error ioerror;
 	inttype result = 0;
+	char* result_string;
+	const char* file_name = PROGRAM_FILE_NAME;
+	int bench = 0;
+	int cache = 1;
+	int optimize = 1;
+	int dump = 0;
+	int compare = 0;
+	int profile = 0;
+	struct profiler profiler;
+	enum interpreter_mode mode = INTERPRETER_MODE_JIT;
+	int i;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "--bench")) {
+			bench = 1;
+		} else if(!strcmp(argv[i], "--bench-map")) {
+			return benchmark_map();
+		} else if(!strcmp(argv[i], "--bench-load")) {
+			return benchmark_load();
+		} else if(!strcmp(argv[i], "--bench-batch")) {
+			return benchmark_batch();
+		} else if(!strcmp(argv[i], "--fuzz")) {
+			return run_fuzz(argc - i - 1, argv + i + 1);
+		} else if(!strcmp(argv[i], "--no-cache")) {
+			cache = 0;
+		} else if(!strcmp(argv[i], "--no-optimize")) {
+			optimize = 0;
+		} else if(!strcmp(argv[i], "--dump")) {
+			dump = 1;
+		} else if(!strcmp(argv[i], "--ring")) {
+			mode = INTERPRETER_MODE_RING;
+		} else if(!strcmp(argv[i], "--no-jit")) {
+			mode = INTERPRETER_MODE_REGISTERS;
+		} else if(!strcmp(argv[i], "--compare-modes")) {
+			compare = 1;
+		} else if(!strcmp(argv[i], "--profile")) {
+			profile = 1;
+		} else if(argv[i][0] == '-') {
+			print_usage(argv[0]);
+			return 1;
+		} else {
+			file_name = argv[i];
+		}
+	}
 
-	(void)argc;
-	(void)argv;
+	if(bench) {
+		return benchmark_dispatch(file_name);
+	}
 
-	interpreter_create(&interp);
+	interpreter_create(&interp, NULL);
+	interpreter_set_optimize(&interp, optimize);
+	interpreter_set_mode(&interp, mode);
+	profiler_create(&profiler);
+	if(profile && !interpreter_set_profiler(&interp, &profiler)) {
+		fprintf(stderr, "Error: Profiling needs a build with VM_PROFILE\n");
+		return 1;
+	}
 
-	ioerror = interpreter_add_file(&interp, PROGRAM_FILE_NAME);
+	if(is_scheme_file(file_name)) {
+		if(add_scheme_file(&interp, file_name, dump)) {
+			return 1;
+		}
+		ioerror = IO_ERROR_NONE;
+	} else if(cache) {
+		ioerror = interpreter_add_file_cached(&interp, file_name);
+	} else {
+		ioerror = interpreter_add_file(&interp, file_name);
+	}
 	if(ioerror != IO_ERROR_NONE) {
-		fprintf(stderr, 
+		fprintf(stderr,
 				"Error: File %s could not be loaded, due to error code: %d\n",
-				PROGRAM_FILE_NAME, ioerror);
+				file_name, ioerror);
 		return 1;
 	}
 
-	error = interpreter_run(&interp, &result);
+	error = INTERPRETER_ERROR_NONE;
+	if(dump) {
+		error = dump_program(&interp);
+	}
+	if(error == INTERPRETER_ERROR_NONE && compare) {
+		error = compare_modes(&interp, &result);
+	} else if(error == INTERPRETER_ERROR_NONE) {
+		error = interpreter_run(&interp, &result);
+	}
 	if(error != INTERPRETER_ERROR_NONE) {
 		fprintf(stderr, "Error: Interpretation failed with error code: %d\n", error);
 		return 1;
 	}
 
-	printf("Result: %lu\n", result);
+	result_string = interpreter_result_to_string(&interp, result);
+	printf("Result: %s\n", result_string);
+	free(result_string);
+	if(profile && write_profile(&interp, &profiler, file_name)) {
+		return 1;
+	}
 
 	interpreter_release(&interp);
+	profiler_release(&profiler);
 	return 0;
 }
@@ -4,9 +4,29 @@
 #include <string.h>
 #include <assert.h>
 
+/* An AVL tree of n nodes is less than 1.45 * log2(n + 2) high, so this
+   covers any tree that fits in memory */
+#define MAP_MAX_HEIGHT 96
+
+/* Keys and values stored inline in a node start on this boundary */
+#define MAP_ALIGNMENT 16
+#define MAP_ALIGN(size) (((size) + MAP_ALIGNMENT - 1) & ~(size_t)(MAP_ALIGNMENT - 1))
+
 static void map_node_create(struct map_node* self, void* key, void* value,
 		const struct map* base);
-static void map_node_release(struct map_node* self);
+static void map_node_release(struct map_node* self, const struct map* base);
+
+static struct map_node* map_node_create_inline(void* key, void* value,
+		const struct map* base);
+static size_t map_node_height(const struct map_node* self);
+static void map_node_update_height(struct map_node* self);
+static void map_node_rotate_left(struct map_node** link);
+static void map_node_rotate_right(struct map_node** link);
+static void map_node_rebalance(struct map_node** link);
+
+static void map_balanced_insert(struct map* self, void* key, void* value);
+static struct map_node* map_balanced_find(const struct map* self,
+		const void* key);
 
 static void map_node_insert(struct map_node* self, void* key, void* value,
 		const struct map* base);
@@ -25,11 +45,26 @@ static void map_node_visit_order(struct map_node* self,
 
 void map_create(struct map* self, size_t key_size, size_t value_size,
 		int(*cmp_fn)(const void* a, const void*b))
+{
+	map_create_mode(self, key_size, value_size, cmp_fn, MAP_MODE_BALANCED);
+}
+
+void map_create_mode(struct map* self, size_t key_size, size_t value_size,
+		int(*cmp_fn)(const void* a, const void*b), enum map_mode mode)
 {
 	self->key_size = key_size;
 	self->value_size = value_size;
 	self->cmp_fn = cmp_fn;
 	self->root = NULL;
+	self->mode = mode;
+	self->arena = NULL;
+}
+
+void map_create_arena(struct map* self, size_t key_size, size_t value_size,
+		int(*cmp_fn)(const void* a, const void*b), struct arena* arena)
+{
+	map_create_mode(self, key_size, value_size, cmp_fn, MAP_MODE_BALANCED);
+	self->arena = arena;
 }
 
 void map_release(struct map* self)
@@ -39,7 +74,9 @@ void map_release(struct map* self)
 
 void map_insert(struct map* self, void* key, void* value)
 {
-	if(self->root == NULL) {
+	if(self->mode == MAP_MODE_BALANCED) {
+		map_balanced_insert(self, key, value);
+	} else if(self->root == NULL) {
 		self->root = (struct map_node*)malloc(sizeof(struct map_node));
 		map_node_create(self->root, key, value, self);
 	} else {
@@ -51,7 +88,11 @@ void* map_at(const struct map* self, const void* key)
 {
 	struct map_node* node;
 	
-	node = map_node_find(self->root, key, self);
+	if(self->mode == MAP_MODE_BALANCED) {
+		node = map_balanced_find(self, key);
+	} else {
+		node = map_node_find(self->root, key, self);
+	}
 	if(node == NULL) {
 		return NULL;
 	} else {
@@ -75,11 +116,13 @@ void map_visit_order(const struct map* self,
 
 void map_clear(struct map* self)
 {
-	if(self->root == NULL) {
+	/* Nodes in an arena go away with the arena */
+	if(self->root == NULL || self->arena != NULL) {
+		self->root = NULL;
 		return;
 	}
 
-	map_node_release(self->root);
+	map_node_release(self->root, self);
 	free(self->root);
 	
 	self->root = NULL;
@@ -98,18 +141,21 @@ static void map_node_create(struct map_node* self, void* key, void* value,
 	memcpy(self->value, value, base->value_size);
 }
 
-static void map_node_release(struct map_node* self)
+static void map_node_release(struct map_node* self, const struct map* base)
 {
-	free(self->key);
-	free(self->value);
+	/* Inline keys and values go away with the node itself */
+	if(base->mode == MAP_MODE_UNBALANCED) {
+		free(self->key);
+		free(self->value);
+	}
 
 	if(self->left != NULL) {
-		map_node_release(self->left);
+		map_node_release(self->left, base);
 		free(self->left);
 	}
 	
 	if(self->right != NULL) {
-		map_node_release(self->right);
+		map_node_release(self->right, base);
 		free(self->right);
 	}
 }
@@ -136,7 +182,7 @@ static void map_node_insert(struct map_node* self, void* key, void* value,
 			map_node_insert(self->left, key, value, base);
 		}
 	} else {
-		self->value = value;
+		memcpy(self->value, value, base->value_size);
 	}
 }
 
@@ -187,12 +233,165 @@ static void map_node_visit_order(struct map_node* self,
 }
 
 
+static struct map_node* map_node_create_inline(void* key, void* value,
+		const struct map* base)
+{
+	struct map_node* self;
+	char* storage;
+
+	storage = (char*)arena_heap_alloc(base->arena,
+			MAP_ALIGN(sizeof(struct map_node)) +
+			MAP_ALIGN(base->key_size) + base->value_size);
+	self = (struct map_node*)storage;
+	self->key = storage + MAP_ALIGN(sizeof(struct map_node));
+	self->value = (char*)self->key + MAP_ALIGN(base->key_size);
+	self->left = NULL;
+	self->right = NULL;
+	self->height = 1;
+
+	memcpy(self->key, key, base->key_size);
+	memcpy(self->value, value, base->value_size);
+	return self;
+}
+
+static size_t map_node_height(const struct map_node* self)
+{
+	return self == NULL ? 0 : self->height;
+}
+
+static void map_node_update_height(struct map_node* self)
+{
+	size_t left = map_node_height(self->left);
+	size_t right = map_node_height(self->right);
+
+	self->height = (left > right ? left : right) + 1;
+}
+
+/*
+ * The rotations replace the subtree at *link, so they take the pointer that
+ * refers to it, be it the parent's child pointer or the map's root.
+ */
+static void map_node_rotate_left(struct map_node** link)
+{
+	struct map_node* node = *link;
+	struct map_node* right = node->right;
+
+	node->right = right->left;
+	right->left = node;
+	map_node_update_height(node);
+	map_node_update_height(right);
+	*link = right;
+}
+
+static void map_node_rotate_right(struct map_node** link)
+{
+	struct map_node* node = *link;
+	struct map_node* left = node->left;
+
+	node->left = left->right;
+	left->right = node;
+	map_node_update_height(node);
+	map_node_update_height(left);
+	*link = left;
+}
+
+static void map_node_rebalance(struct map_node** link)
+{
+	struct map_node* node = *link;
+	size_t left = map_node_height(node->left);
+	size_t right = map_node_height(node->right);
+
+	if(left > right + 1) {
+		if(map_node_height(node->left->left) <
+				map_node_height(node->left->right)) {
+			map_node_rotate_left(&node->left);
+		}
+		map_node_rotate_right(link);
+	} else if(right > left + 1) {
+		if(map_node_height(node->right->right) <
+				map_node_height(node->right->left)) {
+			map_node_rotate_right(&node->right);
+		}
+		map_node_rotate_left(link);
+	} else {
+		map_node_update_height(node);
+	}
+}
+
+static void map_balanced_insert(struct map* self, void* key, void* value)
+{
+	struct map_node** path[MAP_MAX_HEIGHT];
+	struct map_node** link = &self->root;
+	size_t depth = 0;
+	int cmp;
+
+	while(*link != NULL) {
+		cmp = self->cmp_fn(key, (*link)->key);
+		if(cmp == 0) {
+			memcpy((*link)->value, value, self->value_size);
+			return;
+		}
+
+		assert(depth < MAP_MAX_HEIGHT);
+		path[depth++] = link;
+		link = cmp > 0 ? &(*link)->right : &(*link)->left;
+	}
+
+	*link = map_node_create_inline(key, value, self);
+
+	/* Walk back up, until a subtree turns out not to have grown */
+	while(depth > 0) {
+		size_t height;
+
+		link = path[--depth];
+		height = (*link)->height;
+		map_node_rebalance(link);
+		if((*link)->height == height) {
+			break;
+		}
+	}
+}
+
+static struct map_node* map_balanced_find(const struct map* self,
+		const void* key)
+{
+	struct map_node* node = self->root;
+	int cmp;
+
+	while(node != NULL) {
+		cmp = self->cmp_fn(key, node->key);
+		if(cmp == 0) {
+			return node;
+		}
+		node = cmp > 0 ? node->right : node->left;
+	}
+
+	return NULL;
+}
+
+
 
 static int int_cmp(const void* a, const void* b)
 {
 	return *(int*)a - *(int*)b;
 }
 
+static int check_balanced(const struct map_node* node)
+{
+	size_t left;
+	size_t right;
+
+	if(node == NULL) {
+		return 1;
+	}
+
+	left = map_node_height(node->left);
+	right = map_node_height(node->right);
+	return node->height == (left > right ? left : right) + 1 &&
+		left <= right + 1 && right <= left + 1 &&
+		check_balanced(node->left) && check_balanced(node->right);
+}
+
 static void visit_print(void* userdata, void* key, void* value)
 {
 	int a = *(int*)key;
@@ -208,6 +407,7 @@ static void visit_print(void* userdata, void* key, void* value)
 void map_unit_test()
 {
 	struct map m;
+	struct arena arena;
 	int a;
 	int b;
 
@@ -239,5 +439,37 @@ void map_unit_test()
 	assert(b == 6);
 	map_visit_order(&m, NULL, &visit_print);
 	map_release(&m);
+
+	/* Sorted inserts stay balanced, and inserting a key again replaces its
+	   value */
+	map_create(&m, sizeof(int), sizeof(int), int_cmp);
+	for(a = 0; a < 1000; a++) {
+		b = a;
+		map_insert(&m, &a, &b);
+	}
+	for(a = 0; a < 1000; a++) {
+		b = a * 2;
+		map_insert(&m, &a, &b);
+	}
+
+	assert(check_balanced(m.root));
+	assert(m.root->height <= 11);
+	map_visit_order(&m, NULL, &visit_print);
+
+	a = 1000;
+	assert(map_at(&m, &a) == NULL);
+	map_release(&m);
+
+	arena_create(&arena, 256);
+	map_create_arena(&m, sizeof(int), sizeof(int), int_cmp, &arena);
+	for(a = 0; a < 100; a++) {
+		b = a * 2;
+		map_insert(&m, &a, &b);
+	}
+	assert(check_balanced(m.root));
+	map_visit_order(&m, NULL, &visit_print);
+	assert(arena.allocation_count == 100);
+	map_release(&m);
+	arena_release(&arena);
 }
 
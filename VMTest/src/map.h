@@ -3,15 +3,27 @@
 
 #include <stddef.h>
 
+#include "arena.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+enum map_mode {
+	/* AVL tree. Nodes hold their key and value inline, in one allocation,
+	   and neither find nor insert recurse. */
+	MAP_MODE_BALANCED,
+	/* Plain binary search tree, whose shape depends on insertion order */
+	MAP_MODE_UNBALANCED
+};
+
 struct map_node {
 	void* key;
 	void* value;
 	struct map_node* left;
 	struct map_node* right;
+	/* Height of the subtree rooted here, in MAP_MODE_BALANCED */
+	size_t height;
 };
 
 struct map {
@@ -19,10 +31,20 @@ struct map {
 	size_t value_size;
 	struct map_node* root;
 	int(*cmp_fn)(const void* a, const void* b);
+	enum map_mode mode;
+	/* Where the nodes are allocated, or NULL for the heap. Only used in
+	   MAP_MODE_BALANCED. */
+	struct arena* arena;
 };
 
+/* Creates a map in MAP_MODE_BALANCED */
 void map_create(struct map* self, size_t key_size, size_t value_size,
 		int(*cmp_fn)(const void* a, const void*b));
+void map_create_mode(struct map* self, size_t key_size, size_t value_size,
+		int(*cmp_fn)(const void* a, const void*b), enum map_mode mode);
+/* Creates a map in MAP_MODE_BALANCED, with its nodes in the arena */
+void map_create_arena(struct map* self, size_t key_size, size_t value_size,
+		int(*cmp_fn)(const void* a, const void*b), struct arena* arena);
 void map_release(struct map* self);
 
 void* map_at(const struct map* self, const void* key);
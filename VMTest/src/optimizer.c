@@ -0,0 +1,613 @@
+#include "optimizer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* How far back a stack operand is traced to the push that produced it */
+#define PEEPHOLE_WINDOW 16
+#define NO_LIMIT ((size_t)-1)
+
+struct program {
+	struct instruction* instructions;
+	struct operand* operands;
+	size_t length;
+	const size_t* label_frame_sizes;
+	/* Smallest frame any label reaching an instruction creates */
+	size_t* slot_limits;
+	char* removed;
+};
+
+static void compute_slot_limits(struct program* program);
+static int returns_one_value(const struct program* program, size_t entry,
+		size_t* visited, size_t* stack);
+static void find_tail_calls(struct program* program,
+		struct optimizer_stats* stats);
+static int pushes_of(enum opcode opcode);
+static int find_constant(const struct program* program, size_t index,
+		inttype slot, inttype* value);
+static void propagate_and_fold(struct program* program,
+		struct optimizer_stats* stats);
+static void remove_dead_pushes(struct program* program,
+		struct optimizer_stats* stats);
+static void fuse(struct program* program, struct optimizer_stats* stats);
+static void compact(struct program* program,
+		struct vector* instructions__struct_instruction,
+		struct vector* instruction_map__size_t);
+
+
+void optimizer_run(struct vector* instructions__struct_instruction,
+		struct vector* operands__struct_operand,
+		const size_t* label_frame_sizes,
+		struct vector* instruction_map__size_t,
+		struct optimizer_stats* stats)
+{
+	struct program program;
+
+	memset(stats, 0, sizeof(*stats));
+	program.instructions = (struct instruction*)vector_to_array(
+			instructions__struct_instruction);
+	program.operands = (struct operand*)vector_to_array(
+			operands__struct_operand);
+	program.length = vector_size(instructions__struct_instruction);
+	program.label_frame_sizes = label_frame_sizes;
+	program.slot_limits = (size_t*)malloc(
+			(program.length + 1) * sizeof(size_t));
+	program.removed = (char*)calloc(program.length + 1, 1);
+	assert(program.slot_limits != NULL && program.removed != NULL);
+
+	stats->instructions_before = program.length;
+
+	compute_slot_limits(&program);
+	find_tail_calls(&program, stats);
+	propagate_and_fold(&program, stats);
+	remove_dead_pushes(&program, stats);
+	fuse(&program, stats);
+	compact(&program, instructions__struct_instruction,
+			instruction_map__size_t);
+
+	stats->instructions_after = vector_size(instructions__struct_instruction);
+
+	free(program.slot_limits);
+	free(program.removed);
+}
+
+
+/*
+ * Follows control flow from every label up to the rets, keeping the
+ * smallest frame size seen at each instruction. A walk stops wherever an
+ * earlier walk with a frame no larger got to first, since that one has
+ * already been everywhere from there on.
+ */
+static void compute_slot_limits(struct program* program)
+{
+	size_t* stack;
+	size_t stack_length;
+	size_t i;
+
+	for(i = 0; i < program->length; i++) {
+		program->slot_limits[i] = NO_LIMIT;
+	}
+
+	/* Every instruction is pushed at most twice per walk */
+	stack = (size_t*)malloc((program->length * 2 + 1) * sizeof(size_t));
+	assert(stack != NULL);
+
+	for(i = 0; i < program->length; i++) {
+		size_t frame_size = program->label_frame_sizes[i];
+
+		if(frame_size == 0) {
+			continue;
+		}
+
+		stack_length = 0;
+		stack[stack_length++] = i;
+		while(stack_length > 0) {
+			size_t current = stack[--stack_length];
+			const struct instruction* ins;
+
+			if(current >= program->length ||
+					program->slot_limits[current] <= frame_size) {
+				continue;
+			}
+
+			program->slot_limits[current] = frame_size;
+			ins = &program->instructions[current];
+			if(ins->opcode == OPCODE_RET) {
+				continue;
+			}
+
+			stack[stack_length++] = current + 1;
+			if(ins->opcode == OPCODE_BRANCH &&
+					ins->target != BYTECODE_UNRESOLVED) {
+				stack[stack_length++] = ins->target;
+			}
+		}
+	}
+
+	free(stack);
+}
+
+/*
+ * Whether every ret the function at entry can reach returns exactly one
+ * value. Running off the end of the program counts as not returning one.
+ * visited must hold no entry + 1 from before.
+ */
+static int returns_one_value(const struct program* program, size_t entry,
+		size_t* visited, size_t* stack)
+{
+	size_t stack_length = 0;
+
+	stack[stack_length++] = entry;
+	while(stack_length > 0) {
+		size_t current = stack[--stack_length];
+		const struct instruction* ins;
+
+		if(current >= program->length) {
+			return 0;
+		}
+		if(visited[current] == entry + 1) {
+			continue;
+		}
+
+		visited[current] = entry + 1;
+		ins = &program->instructions[current];
+		if(ins->opcode == OPCODE_RET) {
+			if(ins->operands_length != 1) {
+				return 0;
+			}
+			continue;
+		}
+
+		stack[stack_length++] = current + 1;
+		if(ins->opcode == OPCODE_BRANCH &&
+				ins->target != BYTECODE_UNRESOLVED) {
+			stack[stack_length++] = ins->target;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * A call followed by ret s0 hands the callee's result straight on, so if
+ * that result is always a single value, the callee can return to the
+ * caller's caller itself. The ret stays if it can be jumped to.
+ */
+static void find_tail_calls(struct program* program,
+		struct optimizer_stats* stats)
+{
+	/* Per call target: 0 if not checked yet, 1 if it returns one value,
+	   and 2 if not */
+	char* returns_one;
+	size_t* visited;
+	size_t* stack;
+	size_t i;
+
+	returns_one = (char*)calloc(program->length + 1, 1);
+	visited = (size_t*)calloc(program->length + 1, sizeof(size_t));
+	stack = (size_t*)malloc((program->length * 2 + 1) * sizeof(size_t));
+	assert(returns_one != NULL && visited != NULL && stack != NULL);
+
+	for(i = 0; i + 1 < program->length; i++) {
+		struct instruction* call = &program->instructions[i];
+		const struct instruction* ret = &program->instructions[i + 1];
+		const struct operand* result = &program->operands[ret->operands_begin];
+
+		if(call->opcode != OPCODE_CALL || call->target == BYTECODE_UNRESOLVED ||
+				ret->opcode != OPCODE_RET || ret->operands_length != 1 ||
+				!result->is_stack || result->value != 0) {
+			continue;
+		}
+
+		if(returns_one[call->target] == 0) {
+			returns_one[call->target] = returns_one_value(program,
+					call->target, visited, stack) ? 1 : 2;
+		}
+		if(returns_one[call->target] != 1) {
+			continue;
+		}
+
+		call->opcode = OPCODE_TAIL_CALL;
+		if(program->label_frame_sizes[i + 1] == 0) {
+			program->removed[i + 1] = 1;
+		}
+		stats->tail_calls++;
+	}
+
+	free(returns_one);
+	free(visited);
+	free(stack);
+}
+
+/* Number of values pushed to the current frame, or -1 if not known */
+static int pushes_of(enum opcode opcode)
+{
+	switch(opcode) {
+	case OPCODE_PUSH:
+	case OPCODE_ADD:
+	case OPCODE_SUB:
+	case OPCODE_MUL:
+	case OPCODE_EQUALS:
+	case OPCODE_ADD_F:
+	case OPCODE_SUB_F:
+	case OPCODE_MUL_F:
+	case OPCODE_EQUALS_F:
+	case OPCODE_ADD_N:
+	case OPCODE_SUB_N:
+	case OPCODE_MUL_N:
+	case OPCODE_EQUALS_N:
+	case OPCODE_I_TO_F:
+	case OPCODE_F_TO_I:
+	case OPCODE_I_TO_N:
+	case OPCODE_N_TO_I:
+		return 1;
+	case OPCODE_DIV:
+	case OPCODE_DIV_I:
+	case OPCODE_DIV_F:
+	case OPCODE_DIV_N:
+		return 2;
+	case OPCODE_BRANCH:
+		return 0;
+	default:
+		/* Calls push however many values the callee returns */
+		return -1;
+	}
+}
+
+/*
+ * Walks back from the instruction at index to the push that produced the
+ * given slot, within the window and without crossing a label.
+ */
+static int find_constant(const struct program* program, size_t index,
+		inttype slot, inttype* value)
+{
+	size_t remaining = slot;
+	size_t steps;
+
+	if(slot >= program->slot_limits[index]) {
+		return 0;
+	}
+
+	for(steps = 0; steps < PEEPHOLE_WINDOW && index > 0 &&
+			program->label_frame_sizes[index] == 0; steps++) {
+		const struct instruction* prev = &program->instructions[--index];
+		int pushes = pushes_of(prev->opcode);
+
+		if(pushes < 0) {
+			return 0;
+		}
+
+		if(remaining < (size_t)pushes) {
+			const struct operand* operand =
+				&program->operands[prev->operands_begin];
+
+			if(prev->opcode != OPCODE_PUSH || operand->is_stack) {
+				return 0;
+			}
+
+			*value = operand->value;
+			return 1;
+		}
+
+		remaining -= (size_t)pushes;
+	}
+
+	return 0;
+}
+
+static void propagate_and_fold(struct program* program,
+		struct optimizer_stats* stats)
+{
+	size_t i, j;
+
+	for(i = 0; i < program->length; i++) {
+		struct instruction* ins = &program->instructions[i];
+		struct operand* operands = &program->operands[ins->operands_begin];
+		inttype a;
+		inttype b;
+
+		for(j = 0; j < ins->operands_length; j++) {
+			if(operands[j].is_stack &&
+					find_constant(program, i, operands[j].value, &a)) {
+				operands[j].value = a;
+				operands[j].is_stack = 0;
+				stats->propagated++;
+			}
+		}
+
+		if(ins->operands_length != 2 || operands[0].is_stack ||
+				operands[1].is_stack) {
+			continue;
+		}
+
+		a = operands[0].value;
+		b = operands[1].value;
+		switch(ins->opcode) {
+		case OPCODE_ADD:
+			operands[0].value = a + b;
+			break;
+		case OPCODE_SUB:
+			operands[0].value = a - b;
+			break;
+		case OPCODE_MUL:
+			operands[0].value = a * b;
+			break;
+		case OPCODE_EQUALS:
+			operands[0].value = a == b;
+			break;
+		default:
+			continue;
+		}
+
+		ins->opcode = OPCODE_PUSH;
+		ins->operands_length = 1;
+		stats->folded++;
+	}
+}
+
+/*
+ * A push right before a ret is dead if the ret doesn't read it. Removing it
+ * moves every older value one slot closer, so the ret's slots are
+ * renumbered, which is only valid if nothing else reaches the ret.
+ */
+static void remove_dead_pushes(struct program* program,
+		struct optimizer_stats* stats)
+{
+	size_t i, j;
+
+	for(i = 1; i < program->length; i++) {
+		struct instruction* ret = &program->instructions[i];
+		struct operand* operands = &program->operands[ret->operands_begin];
+		size_t prev = i;
+
+		if(ret->opcode != OPCODE_RET || program->removed[i] ||
+				program->label_frame_sizes[i] != 0) {
+			continue;
+		}
+
+		while(prev > 0) {
+			const struct instruction* push = &program->instructions[prev - 1];
+			int reads_top = 0;
+
+			if(pushes_of(push->opcode) != 1) {
+				break;
+			}
+
+			for(j = 0; j < ret->operands_length; j++) {
+				if(operands[j].is_stack && (operands[j].value == 0 ||
+							operands[j].value >= program->slot_limits[i])) {
+					reads_top = 1;
+				}
+			}
+			if(reads_top) {
+				break;
+			}
+
+			for(j = 0; j < ret->operands_length; j++) {
+				if(operands[j].is_stack) {
+					operands[j].value--;
+				}
+			}
+
+			prev--;
+			program->removed[prev] = 1;
+			stats->dead_pushes++;
+
+			/* Anything jumping here never ran the pushes before it */
+			if(program->label_frame_sizes[prev] != 0) {
+				break;
+			}
+		}
+	}
+}
+
+static void fuse(struct program* program, struct optimizer_stats* stats)
+{
+	size_t i;
+
+	for(i = 0; i + 1 < program->length; i++) {
+		struct instruction* first = &program->instructions[i];
+		struct instruction* second = &program->instructions[i + 1];
+
+		if(program->removed[i] || program->removed[i + 1] ||
+				program->label_frame_sizes[i + 1] != 0 ||
+				first->operands_length != 2) {
+			continue;
+		}
+
+		if(first->opcode == OPCODE_EQUALS &&
+				second->opcode == OPCODE_BRANCH) {
+			first->opcode = OPCODE_EQUALS_BRANCH;
+			first->target = second->target;
+		} else if(first->opcode == OPCODE_SUB &&
+				second->opcode == OPCODE_CALL &&
+				second->operands_begin == first->operands_begin + 2) {
+			first->opcode = OPCODE_SUB_CALL;
+			first->operands_length += second->operands_length;
+			first->target = second->target;
+			first->frame_size = second->frame_size;
+		} else {
+			continue;
+		}
+
+		program->removed[i + 1] = 1;
+		stats->fused++;
+		i++;
+	}
+}
+
+static void compact(struct program* program,
+		struct vector* instructions__struct_instruction,
+		struct vector* instruction_map__size_t)
+{
+	size_t* map;
+	size_t kept = 0;
+	size_t i;
+
+	vector_clear(instruction_map__size_t);
+	for(i = 0; i <= program->length; i++) {
+		vector_push_back(instruction_map__size_t, &kept);
+		if(i < program->length && !program->removed[i]) {
+			program->instructions[kept++] = program->instructions[i];
+		}
+	}
+
+	map = (size_t*)vector_to_array(instruction_map__size_t);
+	for(i = 0; i < kept; i++) {
+		struct instruction* ins = &program->instructions[i];
+
+		if(ins->target != BYTECODE_UNRESOLVED) {
+			ins->target = map[ins->target];
+		}
+	}
+
+	while(vector_size(instructions__struct_instruction) > kept) {
+		vector_pop_back(instructions__struct_instruction);
+	}
+}
+
+
+
+/* One instruction of a test program, with at most two operands */
+struct test_instruction {
+	enum opcode opcode;
+	size_t target;
+	size_t operands_length;
+	struct operand operands[2];
+};
+
+#define TEST_NONE BYTECODE_UNRESOLVED
+#define TEST_S(slot) {(slot), 1}
+#define TEST_I(value) {(value), 0}
+
+static void load_test_program(const struct test_instruction* program,
+		size_t length, struct vector* instructions, struct vector* operands)
+{
+	size_t i, j;
+
+	vector_create(instructions, sizeof(struct instruction), NULL);
+	vector_create(operands, sizeof(struct operand), NULL);
+
+	for(i = 0; i < length; i++) {
+		struct instruction ins;
+
+		ins.opcode = program[i].opcode;
+		ins.operands_begin = vector_size(operands);
+		ins.operands_length = program[i].operands_length;
+		ins.target = program[i].target;
+		ins.frame_size = 2;
+		ins.type = VALUE_TYPE_WORD;
+		for(j = 0; j < ins.operands_length; j++) {
+			vector_push_back(operands, (void*)&program[i].operands[j]);
+		}
+		vector_push_back(instructions, &ins);
+	}
+}
+
+
+void optimizer_unit_test(void)
+{
+	/* The unoptimized sum from res/compilation-example.scm, with n + sum
+	   in place of n * fact */
+	static const struct test_instruction program[] = {
+		{OPCODE_PUSH, TEST_NONE, 1, {TEST_S(0)}},
+		{OPCODE_PUSH, TEST_NONE, 1, {TEST_I(1)}},
+		{OPCODE_EQUALS, TEST_NONE, 2, {TEST_S(0), TEST_S(1)}},
+		{OPCODE_BRANCH, 11, 0, {TEST_I(0)}},
+		{OPCODE_PUSH, TEST_NONE, 1, {TEST_S(3)}},
+		{OPCODE_PUSH, TEST_NONE, 1, {TEST_S(4)}},
+		{OPCODE_PUSH, TEST_NONE, 1, {TEST_I(1)}},
+		{OPCODE_SUB, TEST_NONE, 2, {TEST_S(1), TEST_S(0)}},
+		{OPCODE_CALL, 0, 1, {TEST_S(0)}},
+		{OPCODE_ADD, TEST_NONE, 2, {TEST_S(8), TEST_S(0)}},
+		{OPCODE_RET, TEST_NONE, 1, {TEST_S(0)}},
+		/* sum_one: */
+		{OPCODE_PUSH, TEST_NONE, 1, {TEST_I(1)}},
+		{OPCODE_RET, TEST_NONE, 1, {TEST_S(0)}}
+	};
+	/* Counts down in tail position, where the ret is also a label */
+	static const struct test_instruction tail_program[] = {
+		{OPCODE_EQUALS, TEST_NONE, 2, {TEST_S(0), TEST_I(0)}},
+		{OPCODE_BRANCH, 5, 0, {TEST_I(0)}},
+		{OPCODE_SUB, TEST_NONE, 2, {TEST_S(1), TEST_I(1)}},
+		{OPCODE_CALL, 0, 1, {TEST_S(0)}},
+		{OPCODE_RET, TEST_NONE, 1, {TEST_S(0)}},
+		{OPCODE_RET, TEST_NONE, 1, {TEST_S(1)}},
+		/* main: */
+		{OPCODE_CALL, 0, 1, {TEST_I(3)}},
+		{OPCODE_RET, TEST_NONE, 1, {TEST_S(0)}},
+		{OPCODE_CALL, 10, 0, {TEST_I(0)}},
+		{OPCODE_RET, TEST_NONE, 1, {TEST_S(0)}},
+		/* Returns two values */
+		{OPCODE_RET, TEST_NONE, 2, {TEST_I(1), TEST_I(2)}}
+	};
+	const size_t length = sizeof(program) / sizeof(program[0]);
+	const size_t tail_length = sizeof(tail_program) / sizeof(tail_program[0]);
+	struct vector instructions;
+	struct vector operands;
+	struct vector map;
+	struct optimizer_stats stats;
+	size_t label_frame_sizes[sizeof(program) / sizeof(program[0])] = {0};
+	const struct instruction* result;
+	const struct operand* pool;
+
+	load_test_program(program, length, &instructions, &operands);
+	vector_create(&map, sizeof(size_t), NULL);
+
+	label_frame_sizes[0] = 9;
+	label_frame_sizes[11] = 1;
+
+	optimizer_run(&instructions, &operands, label_frame_sizes, &map, &stats);
+	result = (const struct instruction*)vector_to_array(&instructions);
+	pool = (const struct operand*)vector_to_array(&operands);
+
+	/* push s0; push 1; equals?+branch 1 s1; push s3; push s4; push 1;
+	   sub+call s1 1 s0; add s8 s0; ret s0; sum_one: ret 1 */
+	assert(stats.instructions_before == 13);
+	assert(vector_size(&instructions) == 10);
+	assert(result[2].opcode == OPCODE_EQUALS_BRANCH);
+	assert(!pool[result[2].operands_begin].is_stack);
+	assert(result[2].target == 9);
+	assert(result[6].opcode == OPCODE_SUB_CALL);
+	assert(result[6].operands_length == 3 && result[6].target == 0);
+	assert(!pool[result[6].operands_begin + 1].is_stack);
+	assert(result[8].opcode == OPCODE_RET);
+	assert(pool[result[8].operands_begin].is_stack);
+	assert(result[9].opcode == OPCODE_RET);
+	assert(!pool[result[9].operands_begin].is_stack);
+	assert(*(size_t*)vector_at(&map, 11) == 9);
+	assert(*(size_t*)vector_at(&map, 13) == 10);
+
+	/* The sub's argument is still pushed, since later slots count it */
+	assert(result[5].opcode == OPCODE_PUSH);
+
+	vector_release(&instructions);
+	vector_release(&operands);
+
+	/* Only calls to functions that always return one value are tail calls,
+	   and a ret that can be jumped to is kept */
+	load_test_program(tail_program, tail_length, &instructions, &operands);
+	memset(label_frame_sizes, 0, sizeof(label_frame_sizes));
+	label_frame_sizes[0] = 2;
+	label_frame_sizes[4] = 2;
+	label_frame_sizes[5] = 2;
+	label_frame_sizes[6] = 1;
+	label_frame_sizes[10] = 1;
+
+	optimizer_run(&instructions, &operands, label_frame_sizes, &map, &stats);
+	result = (const struct instruction*)vector_to_array(&instructions);
+
+	/* equals?+branch s0 0; sub s1 1; tail-call s0; ret s0; ret s1;
+	   tail-call 3; call; ret s0; ret 1 2 */
+	assert(stats.tail_calls == 2);
+	assert(vector_size(&instructions) == 9);
+	assert(result[2].opcode == OPCODE_TAIL_CALL && result[2].target == 0);
+	assert(result[3].opcode == OPCODE_RET);
+	assert(result[5].opcode == OPCODE_TAIL_CALL);
+	assert(result[6].opcode == OPCODE_CALL && result[6].target == 8);
+
+	vector_release(&instructions);
+	vector_release(&operands);
+	vector_release(&map);
+}
@@ -0,0 +1,55 @@
+#ifndef OPTIMIZER_INCLUDED_H
+#define OPTIMIZER_INCLUDED_H
+
+#include <stddef.h>
+
+#include "vector.h"
+#include "bytecode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct optimizer_stats {
+	/* Stack operands replaced by the constant they refer to */
+	size_t propagated;
+	/* Arithmetic on constants turned into a push of the result */
+	size_t folded;
+	/* Pushes removed because the following ret never reads them */
+	size_t dead_pushes;
+	/* Instruction pairs turned into a superinstruction */
+	size_t fused;
+	/* Calls in tail position that reuse the caller's frame */
+	size_t tail_calls;
+	size_t instructions_before;
+	size_t instructions_after;
+};
+
+/*
+ * Peephole pass over decoded instructions, which rewrites them in place.
+ *
+ * label_frame_sizes has an entry for every instruction: the frame size of
+ * the label there, or 0 if there is none. Any label may be jumped to or
+ * called, so nothing is moved or combined across one, and a slot is only
+ * treated as the Nth most recent push where every frame that can reach it
+ * is larger than N; beyond that, the ring wraps.
+ *
+ * instruction_map receives, for every original instruction index and one
+ * past the end, the index it has afterwards. Removed instructions map to
+ * whatever follows them. Branch and call targets are remapped already.
+ *
+ * Operands of removed instructions are left unused in the pool.
+ */
+void optimizer_run(struct vector* instructions__struct_instruction,
+		struct vector* operands__struct_operand,
+		const size_t* label_frame_sizes,
+		struct vector* instruction_map__size_t,
+		struct optimizer_stats* stats);
+
+void optimizer_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,512 @@
+#include "profiler.h"
+#include "timing.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* Node 0 is the root of the call tree, which every stack starts from */
+#define ROOT_NODE 0
+#define NAME_SIZE 32
+#define TRUNCATED_NAME "..."
+
+struct sort_entry {
+	size_t index;
+	uint64_t key;
+};
+
+/* Node to continue from in the folded stacks, and the length of its path */
+struct stack_entry {
+	size_t node;
+	size_t path_length;
+};
+
+static size_t find_function(struct profiler* self, size_t target);
+static size_t find_node(struct profiler* self, size_t parent,
+		size_t function);
+static void add_root(struct profiler* self);
+static const char* function_name(const char* const* label_names,
+		size_t target, char* buffer);
+static int sort_entry_cmp(const void* a, const void* b);
+static void sort_entries(struct sort_entry* entries, size_t length);
+
+
+void profiler_create(struct profiler* self)
+{
+	vector_create(&self->counts__size_t, sizeof(size_t), NULL);
+	vector_create(&self->function_at__size_t, sizeof(size_t), NULL);
+	vector_create(&self->functions__struct_profiler_function,
+			sizeof(struct profiler_function), NULL);
+	vector_create(&self->nodes__struct_profiler_node,
+			sizeof(struct profiler_node), NULL);
+	vector_create(&self->frames__struct_profiler_frame,
+			sizeof(struct profiler_frame), NULL);
+	self->counts = NULL;
+	add_root(self);
+}
+
+void profiler_release(struct profiler* self)
+{
+	vector_release(&self->counts__size_t);
+	vector_release(&self->function_at__size_t);
+	vector_release(&self->functions__struct_profiler_function);
+	vector_release(&self->nodes__struct_profiler_node);
+	vector_release(&self->frames__struct_profiler_frame);
+}
+
+void profiler_clear(struct profiler* self)
+{
+	vector_clear(&self->counts__size_t);
+	vector_clear(&self->function_at__size_t);
+	vector_clear(&self->functions__struct_profiler_function);
+	vector_clear(&self->nodes__struct_profiler_node);
+	vector_clear(&self->frames__struct_profiler_frame);
+	self->counts = NULL;
+	add_root(self);
+}
+
+void profiler_begin(struct profiler* self, const struct bytecode* code)
+{
+	size_t zero = 0;
+	size_t none = BYTECODE_UNRESOLVED;
+
+	while(vector_size(&self->counts__size_t) < code->instructions_length) {
+		vector_push_back(&self->counts__size_t, &zero);
+	}
+	/* Calls can target the end of the program */
+	while(vector_size(&self->function_at__size_t) <
+			code->instructions_length + 1) {
+		vector_push_back(&self->function_at__size_t, &none);
+	}
+	self->counts = (size_t*)vector_to_array(&self->counts__size_t);
+
+	vector_clear(&self->frames__struct_profiler_frame);
+	if(code->startup_target != BYTECODE_UNRESOLVED) {
+		profiler_enter(self, code->startup_target);
+	}
+}
+
+void profiler_end(struct profiler* self)
+{
+	while(!vector_empty(&self->frames__struct_profiler_frame)) {
+		profiler_leave(self);
+	}
+}
+
+void profiler_enter(struct profiler* self, size_t target)
+{
+	struct profiler_function* function;
+	struct profiler_frame frame;
+	size_t parent = ROOT_NODE;
+	size_t index;
+
+	if(!vector_empty(&self->frames__struct_profiler_frame)) {
+		parent = ((struct profiler_frame*)vector_back(
+					&self->frames__struct_profiler_frame))->node;
+	}
+
+	index = find_function(self, target);
+	function = (struct profiler_function*)vector_at(
+			&self->functions__struct_profiler_function, index);
+	function->calls++;
+	function->active++;
+
+	frame.node = find_node(self, parent, index);
+	frame.function = index;
+	frame.callees = 0;
+	/* Read last, so the profiler's own work isn't timed */
+	frame.entered = timing_get_ticks();
+	vector_push_back(&self->frames__struct_profiler_frame, &frame);
+}
+
+void profiler_leave(struct profiler* self)
+{
+	uint64_t now = timing_get_ticks();
+	struct profiler_frame frame;
+	struct profiler_node* node;
+	struct profiler_function* function;
+	uint64_t elapsed;
+
+	assert(!vector_empty(&self->frames__struct_profiler_frame));
+	frame = *(struct profiler_frame*)vector_back(
+			&self->frames__struct_profiler_frame);
+	vector_pop_back(&self->frames__struct_profiler_frame);
+
+	elapsed = now - frame.entered;
+	node = (struct profiler_node*)vector_at(&self->nodes__struct_profiler_node,
+			frame.node);
+	node->exclusive += elapsed - frame.callees;
+
+	function = (struct profiler_function*)vector_at(
+			&self->functions__struct_profiler_function, frame.function);
+	function->exclusive += elapsed - frame.callees;
+	if(--function->active == 0) {
+		function->inclusive += elapsed;
+	}
+
+	if(!vector_empty(&self->frames__struct_profiler_frame)) {
+		((struct profiler_frame*)vector_back(
+				&self->frames__struct_profiler_frame))->callees += elapsed;
+	}
+}
+
+void profiler_tail_call(struct profiler* self, size_t target)
+{
+	profiler_leave(self);
+	profiler_enter(self, target);
+}
+
+void profiler_report(const struct profiler* self, const struct bytecode* code,
+		const char* const* label_names, FILE* file)
+{
+	const struct profiler_function* functions;
+	size_t functions_length;
+	struct sort_entry* entries;
+	size_t* label_of;
+	size_t length = vector_size(&self->counts__size_t);
+	size_t label = BYTECODE_UNRESOLVED;
+	size_t entries_length;
+	uint64_t total_ticks = 0;
+	size_t total = 0;
+	char name[NAME_SIZE];
+	size_t i;
+
+	functions = (const struct profiler_function*)vector_to_array(
+			&self->functions__struct_profiler_function);
+	functions_length = vector_size(&self->functions__struct_profiler_function);
+	entries = (struct sort_entry*)malloc(
+			(length > functions_length ? length : functions_length) *
+			sizeof(struct sort_entry) + 1);
+	label_of = (size_t*)malloc(length * sizeof(size_t) + 1);
+
+	for(i = 0; i < functions_length; i++) {
+		entries[i].index = i;
+		entries[i].key = functions[i].exclusive;
+		total_ticks += functions[i].exclusive;
+	}
+	sort_entries(entries, functions_length);
+
+	fprintf(file, "Functions by exclusive ticks:\n");
+	fprintf(file, "%12s %18s %18s %7s  %s\n", "calls", "inclusive",
+			"exclusive", "%", "function");
+	for(i = 0; i < functions_length && i < PROFILER_REPORT_ROWS; i++) {
+		const struct profiler_function* function =
+			&functions[entries[i].index];
+
+		fprintf(file, "%12lu %18lu %18lu %6.2f%%  %s\n", function->calls,
+				(unsigned long)function->inclusive,
+				(unsigned long)function->exclusive,
+				total_ticks > 0 ?
+					100.0 * (double)function->exclusive / (double)total_ticks :
+					0.0,
+				function_name(label_names, function->target, name));
+	}
+
+	/* Every instruction counts towards the label before it */
+	entries_length = 0;
+	for(i = 0; i < length; i++) {
+		if(label_names != NULL && label_names[i] != NULL) {
+			label = i;
+			entries[entries_length].index = i;
+			entries[entries_length].key = 0;
+			entries_length++;
+		}
+		if(label != BYTECODE_UNRESOLVED) {
+			entries[entries_length - 1].key += self->counts[i];
+		}
+		label_of[i] = label;
+		total += self->counts[i];
+	}
+	sort_entries(entries, entries_length);
+
+	fprintf(file, "\nLabels by instructions executed, of %lu:\n", total);
+	fprintf(file, "%18s %7s  %s\n", "instructions", "%", "label");
+	for(i = 0; i < entries_length && i < PROFILER_REPORT_ROWS; i++) {
+		fprintf(file, "%18lu %6.2f%%  %s\n", (unsigned long)entries[i].key,
+				total > 0 ? 100.0 * (double)entries[i].key / (double)total :
+					0.0,
+				label_names[entries[i].index]);
+	}
+
+	for(i = 0; i < length; i++) {
+		entries[i].index = i;
+		entries[i].key = self->counts[i];
+	}
+	sort_entries(entries, length);
+
+	fprintf(file, "\nInstructions by executions:\n");
+	fprintf(file, "%18s %7s  %s\n", "executions", "%", "instruction");
+	for(i = 0; i < length && i < PROFILER_REPORT_ROWS &&
+			entries[i].key > 0; i++) {
+		size_t index = entries[i].index;
+
+		fprintf(file, "%18lu %6.2f%%  %6lu  %-15s", (unsigned long)
+				entries[i].key, 100.0 * (double)entries[i].key / (double)total,
+				index, index < code->instructions_length ?
+					opcode_to_mnemonic(code->instructions[index].opcode) : "?");
+		if(label_of[index] != BYTECODE_UNRESOLVED) {
+			fprintf(file, " %s+%lu", label_names[label_of[index]],
+					index - label_of[index]);
+		}
+		fprintf(file, "\n");
+	}
+
+	free(label_of);
+	free(entries);
+}
+
+void profiler_write_stacks(const struct profiler* self,
+		const char* const* label_names, FILE* file)
+{
+	const struct profiler_node* nodes;
+	const struct profiler_function* functions;
+	struct vector pending;
+	char* path = NULL;
+	size_t path_capacity = 0;
+	char name[NAME_SIZE];
+
+	nodes = (const struct profiler_node*)vector_to_array(
+			&self->nodes__struct_profiler_node);
+	functions = (const struct profiler_function*)vector_to_array(
+			&self->functions__struct_profiler_function);
+
+	/* Depth first, so each path extends the one of the node it came from */
+	vector_create(&pending, sizeof(struct stack_entry), NULL);
+	if(nodes[ROOT_NODE].first_child != BYTECODE_UNRESOLVED) {
+		struct stack_entry entry;
+
+		entry.node = nodes[ROOT_NODE].first_child;
+		entry.path_length = 0;
+		vector_push_back(&pending, &entry);
+	}
+
+	while(!vector_empty(&pending)) {
+		struct stack_entry entry = *(struct stack_entry*)vector_back(&pending);
+		const struct profiler_node* node = &nodes[entry.node];
+		const char* function = node->function == BYTECODE_UNRESOLVED ?
+			TRUNCATED_NAME :
+			function_name(label_names, functions[node->function].target, name);
+		size_t function_length = strlen(function);
+		size_t path_length = entry.path_length + function_length +
+			(entry.path_length > 0);
+
+		vector_pop_back(&pending);
+		if(path_length + 1 > path_capacity) {
+			path_capacity = (path_length + 1) * 2;
+			path = (char*)realloc(path, path_capacity);
+		}
+
+		if(entry.path_length > 0) {
+			path[entry.path_length] = ';';
+		}
+		memcpy(path + path_length - function_length, function,
+				function_length);
+		path[path_length] = 0;
+
+		if(node->exclusive > 0) {
+			fprintf(file, "%s %lu\n", path, (unsigned long)node->exclusive);
+		}
+
+		if(node->next_sibling != BYTECODE_UNRESOLVED) {
+			struct stack_entry sibling;
+
+			sibling.node = node->next_sibling;
+			sibling.path_length = entry.path_length;
+			vector_push_back(&pending, &sibling);
+		}
+		if(node->first_child != BYTECODE_UNRESOLVED) {
+			struct stack_entry child;
+
+			child.node = node->first_child;
+			child.path_length = path_length;
+			vector_push_back(&pending, &child);
+		}
+	}
+
+	free(path);
+	vector_release(&pending);
+}
+
+
+static size_t find_function(struct profiler* self, size_t target)
+{
+	size_t* index = (size_t*)vector_at(&self->function_at__size_t, target);
+
+	if(*index == BYTECODE_UNRESOLVED) {
+		struct profiler_function function;
+
+		memset(&function, 0, sizeof(function));
+		function.target = target;
+		*index = vector_size(&self->functions__struct_profiler_function);
+		vector_push_back(&self->functions__struct_profiler_function,
+				&function);
+	}
+
+	return *index;
+}
+
+/* Child of parent for the function, or the node of the function already on
+   the stack if it's being called recursively */
+static size_t find_node(struct profiler* self, size_t parent,
+		size_t function)
+{
+	struct profiler_node* nodes = (struct profiler_node*)vector_to_array(
+			&self->nodes__struct_profiler_node);
+	struct profiler_node node;
+	size_t i;
+
+	if(nodes[parent].function == BYTECODE_UNRESOLVED && parent != ROOT_NODE) {
+		return parent;
+	}
+	if(nodes[parent].depth == PROFILER_MAX_DEPTH) {
+		function = BYTECODE_UNRESOLVED;
+	}
+
+	for(i = parent; i != ROOT_NODE; i = nodes[i].parent) {
+		if(nodes[i].function == function) {
+			return i;
+		}
+	}
+
+	for(i = nodes[parent].first_child; i != BYTECODE_UNRESOLVED;
+			i = nodes[i].next_sibling) {
+		if(nodes[i].function == function) {
+			return i;
+		}
+	}
+
+	node.function = function;
+	node.depth = nodes[parent].depth + 1;
+	node.parent = parent;
+	node.first_child = BYTECODE_UNRESOLVED;
+	node.next_sibling = nodes[parent].first_child;
+	node.exclusive = 0;
+
+	i = vector_size(&self->nodes__struct_profiler_node);
+	nodes[parent].first_child = i;
+	vector_push_back(&self->nodes__struct_profiler_node, &node);
+	return i;
+}
+
+static void add_root(struct profiler* self)
+{
+	struct profiler_node root;
+
+	root.function = BYTECODE_UNRESOLVED;
+	root.depth = 0;
+	root.parent = BYTECODE_UNRESOLVED;
+	root.first_child = BYTECODE_UNRESOLVED;
+	root.next_sibling = BYTECODE_UNRESOLVED;
+	root.exclusive = 0;
+	vector_push_back(&self->nodes__struct_profiler_node, &root);
+}
+
+/* Functions without a label are named by where they start */
+static const char* function_name(const char* const* label_names,
+		size_t target, char* buffer)
+{
+	if(label_names != NULL && label_names[target] != NULL) {
+		return label_names[target];
+	}
+
+	snprintf(buffer, NAME_SIZE, "@%lu", target);
+	return buffer;
+}
+
+/* Largest first, and by index among equals */
+static int sort_entry_cmp(const void* a, const void* b)
+{
+	const struct sort_entry* left = (const struct sort_entry*)a;
+	const struct sort_entry* right = (const struct sort_entry*)b;
+
+	if(left->key != right->key) {
+		return left->key < right->key ? 1 : -1;
+	}
+
+	return left->index < right->index ? -1 : left->index > right->index;
+}
+
+static void sort_entries(struct sort_entry* entries, size_t length)
+{
+	qsort(entries, length, sizeof(struct sort_entry), sort_entry_cmp);
+}
+
+void profiler_unit_test(void)
+{
+	static const char* const names[] = {
+		"main", NULL, "f", NULL, "g", NULL, NULL
+	};
+	struct bytecode code;
+	struct profiler test;
+	const struct profiler_function* functions;
+	uint64_t exclusive = 0;
+	FILE* file;
+	char line[128];
+	size_t lines = 0;
+	size_t i;
+
+	memset(&code, 0, sizeof(code));
+	code.instructions_length = 6;
+	code.startup_target = 0;
+
+	profiler_create(&test);
+	profiler_begin(&test, &code);
+	test.counts[0]++;
+
+	/* main -> f -> g -> f, which folds back into the first f */
+	profiler_enter(&test, 2);
+	profiler_enter(&test, 4);
+	profiler_enter(&test, 2);
+	profiler_leave(&test);
+	profiler_leave(&test);
+	/* f jumps to g, which returns straight to main */
+	profiler_tail_call(&test, 4);
+	profiler_leave(&test);
+	/* Leaves main */
+	profiler_end(&test);
+
+	functions = (const struct profiler_function*)vector_to_array(
+			&test.functions__struct_profiler_function);
+	assert(vector_size(&test.functions__struct_profiler_function) == 3);
+	assert(functions[0].target == 0 && functions[0].calls == 1);
+	assert(functions[1].target == 2 && functions[1].calls == 2);
+	assert(functions[2].target == 4 && functions[2].calls == 2);
+	for(i = 0; i < 3; i++) {
+		assert(functions[i].active == 0);
+		assert(functions[i].inclusive >= functions[i].exclusive);
+		exclusive += functions[i].exclusive;
+	}
+	/* Every tick is spent in exactly one function */
+	assert(exclusive == functions[0].inclusive);
+
+	/* root, main, main;f, main;f;g, main;g */
+	assert(vector_size(&test.nodes__struct_profiler_node) == 5);
+
+	file = tmpfile();
+	if(file != NULL) {
+		profiler_write_stacks(&test, names, file);
+		rewind(file);
+		while(fgets(line, sizeof(line), file) != NULL) {
+			assert(!strncmp(line, "main", 4));
+			lines++;
+		}
+		assert(lines <= 4);
+		fclose(file);
+	}
+
+	profiler_clear(&test);
+	assert(vector_size(&test.nodes__struct_profiler_node) == 1);
+
+	/* Calls deeper than the limit share one node */
+	code.instructions_length = PROFILER_MAX_DEPTH * 2;
+	profiler_begin(&test, &code);
+	for(i = 1; i < PROFILER_MAX_DEPTH + 10; i++) {
+		profiler_enter(&test, i);
+	}
+	profiler_end(&test);
+	assert(vector_size(&test.nodes__struct_profiler_node) ==
+			PROFILER_MAX_DEPTH + 2);
+	assert(vector_size(&test.functions__struct_profiler_function) ==
+			PROFILER_MAX_DEPTH + 10);
+	profiler_release(&test);
+}
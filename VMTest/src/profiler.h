@@ -0,0 +1,117 @@
+#ifndef PROFILER_INCLUDED_H
+#define PROFILER_INCLUDED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vector.h"
+#include "bytecode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Rows of each table in profiler_report */
+#define PROFILER_REPORT_ROWS 20
+/* Deepest call stack kept apart in the call tree. Deeper calls all count
+   towards one node below it, since every stack is written out in full. */
+#define PROFILER_MAX_DEPTH 128
+
+struct profiler_function {
+	/* Instruction index the function starts at */
+	size_t target;
+	size_t calls;
+	/* Ticks from entering to leaving the outermost call, and of those,
+	   the ones not spent in its callees */
+	uint64_t inclusive;
+	uint64_t exclusive;
+	/* Calls that haven't returned yet, so that recursion counts inclusive
+	   ticks once */
+	size_t active;
+};
+
+/*
+ * Node of the call tree, which is the collapsed stack a flame graph is
+ * drawn from. A function called again while it's already on the stack,
+ * directly or not, goes back to the node it has there, which keeps deep
+ * recursion to one node per function.
+ */
+struct profiler_node {
+	/* BYTECODE_UNRESOLVED for the node past PROFILER_MAX_DEPTH */
+	size_t function;
+	size_t depth;
+	size_t parent;
+	size_t first_child;
+	size_t next_sibling;
+	uint64_t exclusive;
+};
+
+struct profiler_frame {
+	size_t node;
+	size_t function;
+	uint64_t entered;
+	/* Ticks spent in calls made from this frame */
+	uint64_t callees;
+};
+
+/*
+ * Counts executions of every instruction, and times every function from
+ * the calls and returns the interpreter reports. Interpreters only report
+ * them when built with VM_PROFILE (see interpreter_set_profiler), so that
+ * there's nothing to pay for otherwise.
+ *
+ * Counts add up over every run until the profiler is cleared.
+ */
+struct profiler {
+	/* (struct vector<size_t>) */
+	struct vector counts__size_t;
+	/* Index into functions of the function starting at each instruction,
+	   or BYTECODE_UNRESOLVED */
+	/* (struct vector<size_t>) */
+	struct vector function_at__size_t;
+	/* (struct vector<struct profiler_function>) */
+	struct vector functions__struct_profiler_function;
+	/* (struct vector<struct profiler_node>) */
+	struct vector nodes__struct_profiler_node;
+	/* (struct vector<struct profiler_frame>) */
+	struct vector frames__struct_profiler_frame;
+	/* Array of counts__size_t, which is only resized by profiler_begin.
+	   Interpreters count every instruction through it directly. */
+	size_t* counts;
+};
+
+void profiler_create(struct profiler* self);
+void profiler_release(struct profiler* self);
+void profiler_clear(struct profiler* self);
+
+/* Starts a run of the program by calling its startup function */
+void profiler_begin(struct profiler* self, const struct bytecode* code);
+/* Returns from whatever calls a run that failed left open */
+void profiler_end(struct profiler* self);
+
+void profiler_enter(struct profiler* self, size_t target);
+void profiler_leave(struct profiler* self);
+/* Leaves the running function and enters the one it jumps to */
+void profiler_tail_call(struct profiler* self, size_t target);
+
+/*
+ * Prints the functions by exclusive ticks, the labels by instructions
+ * executed after them, and the instructions executed most. label_names
+ * holds the name of the label at every instruction index or NULL, like for
+ * bytecode_dump.
+ */
+void profiler_report(const struct profiler* self, const struct bytecode* code,
+		const char* const* label_names, FILE* file);
+/* Writes one line per call stack with its exclusive ticks, in the folded
+   format flame graph tools read */
+void profiler_write_stacks(const struct profiler* self,
+		const char* const* label_names, FILE* file);
+
+void profiler_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
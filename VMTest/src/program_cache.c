@@ -0,0 +1,422 @@
+#include "program_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define CACHE_ALIGN(size) (((size) + PROGRAM_CACHE_ALIGNMENT - 1) & \
+		~(uint64_t)(PROGRAM_CACHE_ALIGNMENT - 1))
+#define TEMP_SUFFIX ".tmp"
+
+static int section_fits(const struct io_file_view* file, uint64_t offset,
+		uint64_t length, size_t element_size);
+static int target_fits(uint64_t target, uint64_t instructions_length);
+static int is_call(enum opcode opcode);
+static int frame_size_fits(uint64_t frame_size);
+static int code_fits(const struct program_cache_header* header,
+		const char* data);
+static int write_section(FILE* file, const void* data, uint64_t size);
+
+
+/*
+ * FNV-1a over 64-bit words, with the remaining bytes one at a time. Hashing
+ * a word per step keeps this far cheaper than parsing, even for sources of
+ * tens of megabytes.
+ */
+uint64_t program_cache_hash(const char* data, size_t length)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	uint64_t word;
+	size_t i;
+
+	for(i = 0; i + sizeof(word) <= length; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ULL;
+	}
+
+	for(; i < length; i++) {
+		hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+enum io_error program_cache_open(struct program_cache* self,
+		const char* file_name, uint64_t source_hash, size_t source_length,
+		uint64_t options)
+{
+	const struct program_cache_header* header;
+	enum io_error error;
+
+	error = io_file_view_open(&self->file, file_name);
+	if(error != IO_ERROR_NONE) {
+		return error;
+	}
+
+	header = (const struct program_cache_header*)self->file.data;
+	if(self->file.length < sizeof(*header) ||
+			header->magic != PROGRAM_CACHE_MAGIC ||
+			header->version != PROGRAM_CACHE_VERSION ||
+			header->instruction_size != sizeof(struct instruction) ||
+			header->operand_size != sizeof(struct operand) ||
+			header->result_type >= VALUE_TYPE_COUNT) {
+		error = IO_ERROR_INVALID_FORMAT;
+	} else if(header->source_hash != source_hash ||
+			header->source_length != source_length ||
+			header->options != options) {
+		error = IO_ERROR_STALE;
+	} else if(!section_fits(&self->file, header->instructions_offset,
+				header->instructions_length, sizeof(struct instruction)) ||
+			!section_fits(&self->file, header->operands_offset,
+				header->operands_length, sizeof(struct operand)) ||
+			!section_fits(&self->file, header->labels_offset,
+				header->labels_length, sizeof(struct program_cache_label)) ||
+			!section_fits(&self->file, header->names_offset,
+				header->names_size, 1) ||
+			(header->names_size > 0 && self->file.data[
+				header->names_offset + header->names_size - 1] != 0) ||
+			!code_fits(header, self->file.data)) {
+		error = IO_ERROR_INVALID_FORMAT;
+	}
+
+	if(error != IO_ERROR_NONE) {
+		io_file_view_close(&self->file);
+		return error;
+	}
+
+	self->code.instructions = (const struct instruction*)
+		(self->file.data + header->instructions_offset);
+	self->code.instructions_length = (size_t)header->instructions_length;
+	self->code.operands = (const struct operand*)
+		(self->file.data + header->operands_offset);
+	self->code.operands_length = (size_t)header->operands_length;
+	self->code.startup_target = (size_t)header->startup_target;
+	self->code.startup_frame_size = (size_t)header->startup_frame_size;
+	self->code.result_type = (enum value_type)header->result_type;
+	self->labels = (const struct program_cache_label*)
+		(self->file.data + header->labels_offset);
+	self->labels_length = (size_t)header->labels_length;
+	self->names = self->file.data + header->names_offset;
+	self->names_size = (size_t)header->names_size;
+	self->source_hash = source_hash;
+	self->source_length = source_length;
+	self->options = options;
+
+	return IO_ERROR_NONE;
+}
+
+void program_cache_close(struct program_cache* self)
+{
+	io_file_view_close(&self->file);
+}
+
+enum io_error program_cache_write(const struct program_cache* self,
+		const char* file_name)
+{
+	struct program_cache_header header;
+	size_t name_length = strlen(file_name);
+	char* temp_name;
+	FILE* file;
+	int failed;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = PROGRAM_CACHE_MAGIC;
+	header.version = PROGRAM_CACHE_VERSION;
+	header.instruction_size = sizeof(struct instruction);
+	header.operand_size = sizeof(struct operand);
+	header.source_hash = self->source_hash;
+	header.source_length = self->source_length;
+	header.options = self->options;
+	header.startup_target = self->code.startup_target;
+	header.startup_frame_size = self->code.startup_frame_size;
+	header.result_type = self->code.result_type;
+
+	header.instructions_offset = CACHE_ALIGN(sizeof(header));
+	header.instructions_length = self->code.instructions_length;
+	header.operands_offset = header.instructions_offset + CACHE_ALIGN(
+			header.instructions_length * sizeof(struct instruction));
+	header.operands_length = self->code.operands_length;
+	header.labels_offset = header.operands_offset + CACHE_ALIGN(
+			header.operands_length * sizeof(struct operand));
+	header.labels_length = self->labels_length;
+	header.names_offset = header.labels_offset + CACHE_ALIGN(
+			header.labels_length * sizeof(struct program_cache_label));
+	header.names_size = self->names_size;
+
+	temp_name = (char*)malloc(name_length + sizeof(TEMP_SUFFIX));
+	if(temp_name == NULL) {
+		return IO_ERROR_OUT_OF_MEMORY;
+	}
+	memcpy(temp_name, file_name, name_length);
+	memcpy(temp_name + name_length, TEMP_SUFFIX, sizeof(TEMP_SUFFIX));
+
+	file = fopen(temp_name, "wb");
+	if(file == NULL) {
+		free(temp_name);
+		return IO_ERROR_WRITE_FAIL;
+	}
+
+	failed = write_section(file, &header, sizeof(header)) ||
+		write_section(file, self->code.instructions,
+				header.instructions_length * sizeof(struct instruction)) ||
+		write_section(file, self->code.operands,
+				header.operands_length * sizeof(struct operand)) ||
+		write_section(file, self->labels,
+				header.labels_length * sizeof(struct program_cache_label)) ||
+		write_section(file, self->names, header.names_size);
+	failed |= fclose(file) != 0;
+
+	/* Some platforms won't rename over an existing file */
+	if(!failed && rename(temp_name, file_name) != 0) {
+		remove(file_name);
+		failed = rename(temp_name, file_name) != 0;
+	}
+
+	if(failed) {
+		remove(temp_name);
+	}
+
+	free(temp_name);
+	return failed ? IO_ERROR_WRITE_FAIL : IO_ERROR_NONE;
+}
+
+
+static int section_fits(const struct io_file_view* file, uint64_t offset,
+		uint64_t length, size_t element_size)
+{
+	return offset % PROGRAM_CACHE_ALIGNMENT == 0 &&
+		offset <= file->length &&
+		length <= (file->length - offset) / element_size;
+}
+
+static int target_fits(uint64_t target, uint64_t instructions_length)
+{
+	return target == (uint64_t)BYTECODE_UNRESOLVED ||
+		target <= instructions_length;
+}
+
+static int is_call(enum opcode opcode)
+{
+	return opcode == OPCODE_CALL || opcode == OPCODE_SUB_CALL ||
+		opcode == OPCODE_TAIL_CALL;
+}
+
+static int frame_size_fits(uint64_t frame_size)
+{
+	return frame_size > 0 && frame_size <= PROGRAM_CACHE_MAX_FRAME_SIZE;
+}
+
+/*
+ * The code is run straight from the mapping, so every index in it has to be
+ * checked before it's trusted, or a corrupt cache, or one from a build whose
+ * opcodes changed without a version bump, would crash rather than be
+ * compiled again.
+ */
+static int code_fits(const struct program_cache_header* header,
+		const char* data)
+{
+	const struct instruction* instructions = (const struct instruction*)
+		(data + header->instructions_offset);
+	const struct operand* operands = (const struct operand*)
+		(data + header->operands_offset);
+	const struct program_cache_label* labels =
+		(const struct program_cache_label*)(data + header->labels_offset);
+	uint64_t length = header->instructions_length;
+	uint64_t* label_frame_sizes;
+	uint64_t frame_size;
+	uint64_t i, j;
+	int fits = 1;
+
+	if(!target_fits(header->startup_target, length) ||
+			!frame_size_fits(header->startup_frame_size)) {
+		return 0;
+	}
+
+	/* Frame size of the label at each instruction, or 0 where there's none */
+	label_frame_sizes = (uint64_t*)calloc((size_t)length + 1,
+			sizeof(uint64_t));
+	if(label_frame_sizes == NULL) {
+		return 0;
+	}
+
+	for(i = 0; i < header->labels_length && fits; i++) {
+		const struct program_cache_label* label = &labels[i];
+		fits = label->name_offset < header->names_size &&
+			target_fits(label->target, length) &&
+			frame_size_fits(label->frame_size);
+		if(fits && label->target != (uint64_t)BYTECODE_UNRESOLVED) {
+			label_frame_sizes[label->target] = label->frame_size;
+		}
+	}
+
+	/* Calls and the startup function make frames the size of the label
+	   they go to */
+	if(fits && header->startup_target != (uint64_t)BYTECODE_UNRESOLVED &&
+			label_frame_sizes[header->startup_target] !=
+				header->startup_frame_size) {
+		fits = 0;
+	}
+
+	/* Each instruction runs in the frame of the nearest label before it,
+	   as that frame is sized for every slot used up to the next ret. The
+	   optimizer only ever lowers slot indices, so this holds for optimized
+	   code too. Code before any label can't be reached. */
+	frame_size = 0;
+	for(i = 0; i < length && fits; i++) {
+		const struct instruction* instruction = &instructions[i];
+		if(label_frame_sizes[i] != 0) {
+			frame_size = label_frame_sizes[i];
+		}
+
+		fits = (unsigned int)instruction->opcode < OPCODE_COUNT &&
+			instruction->operands_begin <= header->operands_length &&
+			instruction->operands_length <=
+				header->operands_length - instruction->operands_begin &&
+			target_fits(instruction->target, length);
+
+		/* Calls still waiting on their label fail before making a frame */
+		if(fits && is_call(instruction->opcode) &&
+				instruction->target != (uint64_t)BYTECODE_UNRESOLVED) {
+			fits = instruction->frame_size ==
+				label_frame_sizes[instruction->target];
+		}
+
+		for(j = 0; j < instruction->operands_length && fits; j++) {
+			const struct operand* operand =
+				&operands[instruction->operands_begin + j];
+			fits = !operand->is_stack || operand->value < frame_size;
+		}
+	}
+
+	free(label_frame_sizes);
+	return fits;
+}
+
+/* Pads the section up to the alignment of the next one */
+static int write_section(FILE* file, const void* data, uint64_t size)
+{
+	static const char padding[PROGRAM_CACHE_ALIGNMENT] = {0};
+
+	if(size > 0 && fwrite(data, 1, (size_t)size, file) != size) {
+		return 1;
+	}
+
+	size = CACHE_ALIGN(size) - size;
+	return size > 0 && fwrite(padding, 1, (size_t)size, file) != size;
+}
+
+
+
+static void unit_test_rejected(const struct program_cache* written,
+		const char* file_name)
+{
+	struct program_cache read;
+
+	assert(program_cache_write(written, file_name) == IO_ERROR_NONE);
+	assert(program_cache_open(&read, file_name, written->source_hash,
+				written->source_length, written->options) ==
+			IO_ERROR_INVALID_FORMAT);
+}
+
+void program_cache_unit_test(void)
+{
+	const char* file_name = "program_cache_unit_test" PROGRAM_CACHE_EXTENSION;
+	struct program_cache written;
+	struct program_cache read;
+	struct instruction instructions[2];
+	struct operand operands[3];
+	struct program_cache_label label;
+	const char names[] = "main";
+
+	memset(instructions, 0, sizeof(instructions));
+	instructions[0].opcode = OPCODE_PUSH;
+	instructions[0].operands_length = 1;
+	instructions[1].opcode = OPCODE_RET;
+	instructions[1].operands_begin = 1;
+	instructions[1].operands_length = 2;
+	operands[0].value = 42;
+	operands[0].is_stack = 0;
+	operands[1].value = 0;
+	operands[1].is_stack = 1;
+	operands[2].value = 7;
+	operands[2].is_stack = 0;
+	label.name_offset = 0;
+	label.target = 0;
+	label.frame_size = 1;
+
+	written.code.instructions = instructions;
+	written.code.instructions_length = 2;
+	written.code.operands = operands;
+	written.code.operands_length = 3;
+	written.code.startup_target = 0;
+	written.code.startup_frame_size = 1;
+	written.code.result_type = VALUE_TYPE_F64;
+	written.labels = &label;
+	written.labels_length = 1;
+	written.names = names;
+	written.names_size = sizeof(names);
+	written.source_hash = program_cache_hash("main:", 5);
+	written.source_length = 5;
+	written.options = PROGRAM_CACHE_OPTION_OPTIMIZED;
+
+	assert(program_cache_write(&written, file_name) == IO_ERROR_NONE);
+
+	assert(program_cache_open(&read, file_name,
+				program_cache_hash("main:\n", 6), 6,
+				written.options) == IO_ERROR_STALE);
+	assert(program_cache_open(&read, file_name, written.source_hash, 5,
+				0) == IO_ERROR_STALE);
+	assert(program_cache_open(&read, file_name, written.source_hash, 5,
+				written.options) == IO_ERROR_NONE);
+	assert(read.code.instructions_length == 2);
+	assert(read.code.instructions[1].opcode == OPCODE_RET);
+	assert(read.code.operands_length == 3);
+	assert(read.code.operands[2].value == 7);
+	assert(read.code.result_type == VALUE_TYPE_F64);
+	assert(read.labels_length == 1);
+	assert(!strcmp(read.names + read.labels[0].name_offset, "main"));
+	program_cache_close(&read);
+
+	/* A cache whose code can't be trusted is rejected, not run */
+	instructions[1].opcode = (enum opcode)OPCODE_COUNT;
+	unit_test_rejected(&written, file_name);
+	instructions[1].opcode = OPCODE_RET;
+
+	written.code.startup_frame_size = 0;
+	unit_test_rejected(&written, file_name);
+	written.code.startup_frame_size = PROGRAM_CACHE_MAX_FRAME_SIZE + 1;
+	unit_test_rejected(&written, file_name);
+	written.code.startup_frame_size = 2;
+	unit_test_rejected(&written, file_name);
+	written.code.startup_frame_size = 1;
+
+	label.frame_size = 0;
+	unit_test_rejected(&written, file_name);
+	label.frame_size = PROGRAM_CACHE_MAX_FRAME_SIZE + 1;
+	unit_test_rejected(&written, file_name);
+	label.frame_size = 1;
+
+	instructions[0].opcode = OPCODE_CALL;
+	instructions[0].target = 0;
+	instructions[0].frame_size = 0;
+	unit_test_rejected(&written, file_name);
+	instructions[0].frame_size = 1;
+	assert(program_cache_write(&written, file_name) == IO_ERROR_NONE);
+	assert(program_cache_open(&read, file_name, written.source_hash, 5,
+				written.options) == IO_ERROR_NONE);
+	program_cache_close(&read);
+
+	/* s1 is past the end of main's frame of 1 */
+	operands[1].value = 1;
+	unit_test_rejected(&written, file_name);
+	operands[1].value = 0;
+
+	/* Hashes differ on any single changed byte, even within a word */
+	assert(program_cache_hash("abcdefgh", 8) !=
+			program_cache_hash("abcdefgi", 8));
+	assert(program_cache_hash("abcdefghi", 9) !=
+			program_cache_hash("abcdefghj", 9));
+
+	remove(file_name);
+}
@@ -0,0 +1,111 @@
+#ifndef PROGRAM_CACHE_INCLUDED_H
+#define PROGRAM_CACHE_INCLUDED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bytecode.h"
+#include "io.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Binary file holding a compiled program, so that later runs can map it
+ * instead of parsing the source again. Instructions and operands are stored
+ * exactly as they are in memory and used straight from the mapping, so a
+ * cache is only valid on the kind of machine that wrote it; the magic
+ * number and structure sizes in the header catch any mismatch.
+ *
+ * Layout, with every section aligned to PROGRAM_CACHE_ALIGNMENT:
+ *   struct program_cache_header
+ *   struct instruction[instructions_length]
+ *   struct operand[operands_length]
+ *   struct program_cache_label[labels_length]
+ *   char names[names_size], NUL-terminated label names
+ */
+#define PROGRAM_CACHE_MAGIC 0x4548434143544d56ULL /* "VMTCACHE" */
+/* Bump whenever the layout or the meaning of any instruction changes */
+#define PROGRAM_CACHE_VERSION 4
+#define PROGRAM_CACHE_ALIGNMENT 16
+#define PROGRAM_CACHE_EXTENSION ".vmc"
+/* Frames are sized by the largest slot a function uses, so one this large
+   can only come from a corrupt cache */
+#define PROGRAM_CACHE_MAX_FRAME_SIZE ((uint64_t)1 << 24)
+
+/* Flags for how the program was compiled, which must match for a cache to
+   be used */
+#define PROGRAM_CACHE_OPTION_OPTIMIZED 0x1
+
+struct program_cache_header {
+	uint64_t magic;
+	uint32_t version;
+	uint16_t instruction_size;
+	uint16_t operand_size;
+
+	/* Source the program was compiled from */
+	uint64_t source_hash;
+	uint64_t source_length;
+	uint64_t options;
+
+	uint64_t startup_target;
+	uint64_t startup_frame_size;
+	uint64_t result_type;
+
+	/* Offsets are in bytes from the start of the file */
+	uint64_t instructions_offset;
+	uint64_t instructions_length;
+	uint64_t operands_offset;
+	uint64_t operands_length;
+	uint64_t labels_offset;
+	uint64_t labels_length;
+	uint64_t names_offset;
+	uint64_t names_size;
+};
+
+struct program_cache_label {
+	/* Offset of the name in the names section */
+	uint64_t name_offset;
+	/* Instruction index the label refers to */
+	uint64_t target;
+	uint64_t frame_size;
+};
+
+/*
+ * Either a cache opened from a file, whose arrays point into the mapping,
+ * or the contents of one to be written, whose arrays belong to the caller.
+ */
+struct program_cache {
+	struct io_file_view file;
+	struct bytecode code;
+	const struct program_cache_label* labels;
+	size_t labels_length;
+	const char* names;
+	size_t names_size;
+	uint64_t source_hash;
+	size_t source_length;
+	uint64_t options;
+};
+
+uint64_t program_cache_hash(const char* data, size_t length);
+
+/* Fails with IO_ERROR_STALE if the cache was compiled from a different
+   source or with different options, and with IO_ERROR_INVALID_FORMAT if it
+   can't be used at all */
+enum io_error program_cache_open(struct program_cache* self,
+		const char* file_name, uint64_t source_hash, size_t source_length,
+		uint64_t options);
+void program_cache_close(struct program_cache* self);
+
+/* Writes to a temporary file first, so readers never see a partial cache */
+enum io_error program_cache_write(const struct program_cache* self,
+		const char* file_name);
+
+void program_cache_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,739 @@
+#include "registers.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* Return and argument counts that haven't been seen yet, or disagree */
+#define COUNT_UNKNOWN ((size_t)-1)
+#define COUNT_MIXED ((size_t)-2)
+#define COPY_NONE ((size_t)-1)
+/* How many times over the program may be copied before giving up on it */
+#define MAX_GROWTH 4
+
+/*
+ * A copy of a segment for one ring position. A segment is a run of
+ * instructions that only ever falls through to the next, up to a ret or
+ * tail-call, or a call that nothing can come back from. Only its start
+ * position then decides the layout of all of its instructions.
+ */
+struct segment_copy {
+	size_t segment;
+	/* Ring position at the start of the segment */
+	size_t shift;
+	size_t frame_size;
+	/* First instruction that can be reached in this copy */
+	size_t from;
+	/* Where the copy is emitted, and the next copy of the segment */
+	size_t begin;
+	size_t next;
+};
+
+struct layout_state {
+	const struct bytecode* code;
+	/* Per instruction, its segment and the number of values pushed between
+	   the start of the segment and the instruction */
+	size_t* segments;
+	size_t* offsets;
+	/* Per segment */
+	size_t* segment_begins;
+	size_t* first_copies;
+	size_t segments_length;
+	/* (struct vector<struct segment_copy>) */
+	struct vector copies__struct_segment_copy;
+	/* Copies left to walk, with the instruction to walk them from
+	   (struct vector<size_t>) */
+	struct vector work__size_t;
+	size_t emitted_length;
+	/* Per call target */
+	size_t* argument_counts;
+	size_t* entry_frame_sizes;
+	size_t* return_counts;
+	/* Scratch space for finding return counts */
+	size_t* visited;
+	size_t* return_stack;
+};
+
+static int record_entry(struct layout_state* state, size_t target,
+		size_t argument_count, size_t frame_size);
+static size_t return_count(struct layout_state* state, size_t entry);
+static int find_segments(struct layout_state* state);
+static size_t reach(struct layout_state* state, size_t target,
+		size_t position, size_t frame_size);
+static int walk_copy(struct layout_state* state, size_t copy, size_t from);
+static int ends_segment(const struct instruction* ins);
+static int operands_fit(const struct bytecode* code,
+		const struct instruction* ins, size_t frame_size);
+static size_t slot_register(size_t position, size_t slot, size_t frame_size);
+static size_t copy_position(const struct layout_state* state,
+		const struct segment_copy* copy, size_t index);
+static size_t entry_index(struct layout_state* state, size_t target);
+static size_t copied_index(const struct layout_state* state, size_t copy,
+		size_t index);
+static void emit(struct layout_state* state,
+		struct vector* instructions__struct_instruction,
+		struct vector* operands__struct_operand);
+static void emit_instruction(struct layout_state* state, size_t index,
+		const struct segment_copy* copy,
+		struct vector* instructions__struct_instruction,
+		struct vector* operands__struct_operand);
+
+
+int registers_assign(const struct bytecode* code,
+		struct vector* instructions__struct_instruction,
+		struct vector* operands__struct_operand, size_t startup_arguments,
+		size_t* startup_target)
+{
+	struct layout_state state;
+	size_t length = code->instructions_length;
+	int ok = 1;
+	size_t i;
+
+	state.code = code;
+	state.segments = (size_t*)malloc((length + 1) * sizeof(size_t));
+	state.offsets = (size_t*)malloc((length + 1) * sizeof(size_t));
+	state.segment_begins = (size_t*)malloc((length + 1) * sizeof(size_t));
+	state.first_copies = (size_t*)malloc((length + 1) * sizeof(size_t));
+	state.argument_counts = (size_t*)malloc((length + 1) * sizeof(size_t));
+	state.entry_frame_sizes = (size_t*)calloc(length + 1, sizeof(size_t));
+	state.return_counts = (size_t*)malloc((length + 1) * sizeof(size_t));
+	state.visited = (size_t*)calloc(length + 1, sizeof(size_t));
+	state.return_stack = (size_t*)malloc((length * 2 + 1) * sizeof(size_t));
+	assert(state.segments != NULL && state.offsets != NULL &&
+			state.segment_begins != NULL && state.first_copies != NULL &&
+			state.argument_counts != NULL && state.entry_frame_sizes != NULL &&
+			state.return_counts != NULL && state.visited != NULL &&
+			state.return_stack != NULL);
+	vector_create(&state.copies__struct_segment_copy,
+			sizeof(struct segment_copy), NULL);
+	vector_create(&state.work__size_t, sizeof(size_t), NULL);
+	state.emitted_length = length;
+
+	for(i = 0; i <= length; i++) {
+		state.argument_counts[i] = COUNT_UNKNOWN;
+		state.return_counts[i] = COUNT_UNKNOWN;
+		state.first_copies[i] = COPY_NONE;
+	}
+
+	/* Every function must be entered the same way from everywhere */
+	if(code->startup_target != BYTECODE_UNRESOLVED) {
+		ok = record_entry(&state, code->startup_target, startup_arguments,
+				code->startup_frame_size);
+	}
+	for(i = 0; i < length && ok; i++) {
+		const struct instruction* ins = &code->instructions[i];
+
+		if(ins->target == BYTECODE_UNRESOLVED) {
+			continue;
+		}
+
+		if(ins->opcode == OPCODE_CALL || ins->opcode == OPCODE_TAIL_CALL) {
+			ok = record_entry(&state, ins->target, ins->operands_length,
+					ins->frame_size);
+		} else if(ins->opcode == OPCODE_SUB_CALL) {
+			ok = record_entry(&state, ins->target, ins->operands_length - 2,
+					ins->frame_size);
+		}
+	}
+
+	ok = ok && find_segments(&state);
+
+	/* Functions are entered with their arguments pushed from position 0 */
+	for(i = 0; i <= length && ok; i++) {
+		if(state.entry_frame_sizes[i] != 0) {
+			ok = reach(&state, i,
+					state.argument_counts[i] % state.entry_frame_sizes[i],
+					state.entry_frame_sizes[i]) != COPY_NONE;
+		}
+	}
+
+	while(ok && !vector_empty(&state.work__size_t)) {
+		size_t from = *(size_t*)vector_back(&state.work__size_t);
+		size_t copy;
+
+		vector_pop_back(&state.work__size_t);
+		copy = *(size_t*)vector_back(&state.work__size_t);
+		vector_pop_back(&state.work__size_t);
+		ok = walk_copy(&state, copy, from);
+	}
+
+	if(ok) {
+		emit(&state, instructions__struct_instruction,
+				operands__struct_operand);
+		*startup_target = code->startup_target == BYTECODE_UNRESOLVED ?
+			BYTECODE_UNRESOLVED : entry_index(&state, code->startup_target);
+	}
+
+	vector_release(&state.copies__struct_segment_copy);
+	vector_release(&state.work__size_t);
+	free(state.segments);
+	free(state.offsets);
+	free(state.segment_begins);
+	free(state.first_copies);
+	free(state.argument_counts);
+	free(state.entry_frame_sizes);
+	free(state.return_counts);
+	free(state.visited);
+	free(state.return_stack);
+	return ok;
+}
+
+
+static int record_entry(struct layout_state* state, size_t target,
+		size_t argument_count, size_t frame_size)
+{
+	if(target >= state->code->instructions_length) {
+		return 0;
+	}
+
+	if(state->entry_frame_sizes[target] == 0) {
+		state->entry_frame_sizes[target] = frame_size;
+		state->argument_counts[target] = argument_count;
+		return 1;
+	}
+
+	return state->entry_frame_sizes[target] == frame_size &&
+		state->argument_counts[target] == argument_count;
+}
+
+/*
+ * Number of values the function at entry returns, the same on every path,
+ * or COUNT_MIXED. Tail calls are only made to functions returning a single
+ * value. Running off the end of the program counts as mixed.
+ */
+static size_t return_count(struct layout_state* state, size_t entry)
+{
+	const struct bytecode* code = state->code;
+	size_t stack_length = 0;
+	size_t count = COUNT_UNKNOWN;
+
+	if(state->return_counts[entry] != COUNT_UNKNOWN) {
+		return state->return_counts[entry];
+	}
+
+	state->return_stack[stack_length++] = entry;
+	while(stack_length > 0 && count != COUNT_MIXED) {
+		size_t current = state->return_stack[--stack_length];
+		const struct instruction* ins;
+		size_t returned;
+
+		if(current >= code->instructions_length) {
+			count = COUNT_MIXED;
+			break;
+		}
+		if(state->visited[current] == entry + 1) {
+			continue;
+		}
+
+		state->visited[current] = entry + 1;
+		ins = &code->instructions[current];
+		switch(ins->opcode) {
+		case OPCODE_RET:
+		case OPCODE_TAIL_CALL:
+			returned = ins->opcode == OPCODE_RET ? ins->operands_length : 1;
+			count = count == COUNT_UNKNOWN || count == returned ?
+				returned : COUNT_MIXED;
+			continue;
+		case OPCODE_BRANCH:
+		case OPCODE_EQUALS_BRANCH:
+			if(ins->target != BYTECODE_UNRESOLVED) {
+				state->return_stack[stack_length++] = ins->target;
+			}
+			break;
+		default:
+			break;
+		}
+
+		state->return_stack[stack_length++] = current + 1;
+	}
+
+	/* A function that never returns has nothing to disagree on */
+	if(count == COUNT_UNKNOWN) {
+		count = 0;
+	}
+
+	state->return_counts[entry] = count;
+	return count;
+}
+
+/* Splits the program into segments and finds the offset of every
+   instruction in its own. Fails on a call to a function that doesn't
+   always return the same number of values. */
+static int find_segments(struct layout_state* state)
+{
+	const struct bytecode* code = state->code;
+	size_t offset = 0;
+	int starts = 1;
+	size_t i;
+
+	state->segments_length = 0;
+	for(i = 0; i < code->instructions_length; i++) {
+		const struct instruction* ins = &code->instructions[i];
+		size_t returned;
+
+		if(starts) {
+			state->segment_begins[state->segments_length++] = i;
+			offset = 0;
+			starts = 0;
+		}
+		state->segments[i] = state->segments_length - 1;
+		state->offsets[i] = offset;
+
+		switch(ins->opcode) {
+		case OPCODE_PUSH:
+		case OPCODE_ADD:
+		case OPCODE_SUB:
+		case OPCODE_MUL:
+		case OPCODE_EQUALS:
+		case OPCODE_EQUALS_BRANCH:
+		case OPCODE_ADD_F:
+		case OPCODE_SUB_F:
+		case OPCODE_MUL_F:
+		case OPCODE_EQUALS_F:
+		case OPCODE_ADD_N:
+		case OPCODE_SUB_N:
+		case OPCODE_MUL_N:
+		case OPCODE_EQUALS_N:
+		case OPCODE_I_TO_F:
+		case OPCODE_F_TO_I:
+		case OPCODE_I_TO_N:
+		case OPCODE_N_TO_I:
+			offset++;
+			break;
+		case OPCODE_DIV:
+		case OPCODE_DIV_I:
+		case OPCODE_DIV_F:
+		case OPCODE_DIV_N:
+			offset += 2;
+			break;
+		case OPCODE_BRANCH:
+			break;
+		case OPCODE_CALL:
+		case OPCODE_SUB_CALL:
+			if(ins->target == BYTECODE_UNRESOLVED) {
+				break;
+			}
+
+			returned = return_count(state, ins->target);
+			if(returned == COUNT_MIXED) {
+				return 0;
+			}
+			offset += returned + (ins->opcode == OPCODE_SUB_CALL);
+			break;
+		case OPCODE_RET:
+		case OPCODE_TAIL_CALL:
+			break;
+		default:
+			return 0;
+		}
+		starts = ends_segment(ins);
+	}
+	state->segments[i] = state->segments_length;
+	state->segment_begins[state->segments_length] = i;
+
+	return 1;
+}
+
+/*
+ * Index of the copy that runs the target at the given ring position,
+ * queuing it to be walked from the target. Fails if the target lies past
+ * the end, or its segment is also reached with another frame size.
+ */
+static size_t reach(struct layout_state* state, size_t target,
+		size_t position, size_t frame_size)
+{
+	const struct segment_copy* existing;
+	struct segment_copy copy;
+	size_t segment;
+	size_t index;
+
+	if(target >= state->code->instructions_length) {
+		return COPY_NONE;
+	}
+
+	segment = state->segments[target];
+	copy.shift = (position + frame_size - state->offsets[target] % frame_size)
+		% frame_size;
+
+	for(index = state->first_copies[segment]; index != COPY_NONE;
+			index = existing->next) {
+		existing = (const struct segment_copy*)vector_at(
+				&state->copies__struct_segment_copy, index);
+
+		if(existing->frame_size != frame_size) {
+			return COPY_NONE;
+		}
+		if(existing->shift == copy.shift) {
+			break;
+		}
+	}
+
+	if(index == COPY_NONE) {
+		size_t segment_length = state->segment_begins[segment + 1] -
+			state->segment_begins[segment];
+
+		copy.segment = segment;
+		copy.frame_size = frame_size;
+		copy.from = state->segment_begins[segment + 1];
+		copy.next = state->first_copies[segment];
+		/* The first copy keeps the segment's place in the program, and
+		   the rest go after the end */
+		if(copy.next == COPY_NONE) {
+			copy.begin = state->segment_begins[segment];
+		} else {
+			if(state->emitted_length + segment_length >
+					state->code->instructions_length * MAX_GROWTH) {
+				return COPY_NONE;
+			}
+			copy.begin = state->emitted_length;
+			state->emitted_length += segment_length;
+		}
+
+		index = vector_size(&state->copies__struct_segment_copy);
+		vector_push_back(&state->copies__struct_segment_copy, &copy);
+		state->first_copies[segment] = index;
+	}
+
+	vector_push_back(&state->work__size_t, &index);
+	vector_push_back(&state->work__size_t, &target);
+	return index;
+}
+
+/*
+ * Follows the copy from the given instruction to the end of its segment,
+ * reaching the copies that its branches go to. Stops early if that part
+ * has already been walked.
+ */
+static int walk_copy(struct layout_state* state, size_t copy, size_t from)
+{
+	const struct bytecode* code = state->code;
+	struct segment_copy walked = *(struct segment_copy*)vector_at(
+			&state->copies__struct_segment_copy, copy);
+	size_t end = state->segment_begins[walked.segment + 1];
+	size_t i;
+
+	if(from >= walked.from) {
+		return 1;
+	}
+	((struct segment_copy*)vector_at(&state->copies__struct_segment_copy,
+			copy))->from = from;
+
+	/* Only the last segment can end without an instruction ending it, by
+	   running off the end of the program */
+	if(!ends_segment(&code->instructions[end - 1])) {
+		return 0;
+	}
+
+	for(i = from; i < walked.from; i++) {
+		const struct instruction* ins = &code->instructions[i];
+
+		if(!operands_fit(code, ins, walked.frame_size)) {
+			return 0;
+		}
+
+		if((ins->opcode == OPCODE_BRANCH ||
+				ins->opcode == OPCODE_EQUALS_BRANCH) &&
+				ins->target != BYTECODE_UNRESOLVED) {
+			size_t position = copy_position(state, &walked, i) +
+				(ins->opcode == OPCODE_EQUALS_BRANCH);
+
+			if(reach(state, ins->target, position % walked.frame_size,
+						walked.frame_size) == COPY_NONE) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* Whether nothing can fall through from the instruction to the next */
+static int ends_segment(const struct instruction* ins)
+{
+	switch(ins->opcode) {
+	case OPCODE_RET:
+	case OPCODE_TAIL_CALL:
+		return 1;
+	case OPCODE_CALL:
+	case OPCODE_SUB_CALL:
+		/* An unresolved call fails when it runs */
+		return ins->target == BYTECODE_UNRESOLVED;
+	default:
+		return 0;
+	}
+}
+
+/* Slots past the frame are rejected by the ring too, when they're read */
+static int operands_fit(const struct bytecode* code,
+		const struct instruction* ins, size_t frame_size)
+{
+	size_t i;
+
+	for(i = 0; i < ins->operands_length; i++) {
+		const struct operand* operand =
+			&code->operands[ins->operands_begin + i];
+
+		if(operand->is_stack && operand->value >= frame_size) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Where the ring keeps the given slot, as ring_buffer_get finds it */
+static size_t slot_register(size_t position, size_t slot, size_t frame_size)
+{
+	return (position + frame_size - 1 - slot) % frame_size;
+}
+
+/* Ring position the instruction runs at in the copy */
+static size_t copy_position(const struct layout_state* state,
+		const struct segment_copy* copy, size_t index)
+{
+	return (copy->shift + state->offsets[index]) % copy->frame_size;
+}
+
+/* Where the function at target starts in the register form */
+static size_t entry_index(struct layout_state* state, size_t target)
+{
+	size_t copy = reach(state, target,
+			state->argument_counts[target] % state->entry_frame_sizes[target],
+			state->entry_frame_sizes[target]);
+
+	assert(copy != COPY_NONE);
+	vector_clear(&state->work__size_t);
+	return copied_index(state, copy, target);
+}
+
+/* Where the instruction is in the copy, as emitted */
+static size_t copied_index(const struct layout_state* state, size_t copy,
+		size_t index)
+{
+	return ((const struct segment_copy*)vector_at(
+				&state->copies__struct_segment_copy, copy))->begin +
+		index - state->segment_begins[state->segments[index]];
+}
+
+static void emit(struct layout_state* state,
+		struct vector* instructions__struct_instruction,
+		struct vector* operands__struct_operand)
+{
+	const struct bytecode* code = state->code;
+	size_t copies_length = vector_size(&state->copies__struct_segment_copy);
+	size_t segment;
+	size_t i, j;
+
+	vector_clear(instructions__struct_instruction);
+	vector_clear(operands__struct_operand);
+
+	/* Segments in their places, then the extra copies in the order they
+	   were made */
+	for(segment = 0; segment < state->segments_length; segment++) {
+		const struct segment_copy* copy = NULL;
+
+		for(j = state->first_copies[segment]; j != COPY_NONE;
+				j = copy->next) {
+			copy = (const struct segment_copy*)vector_at(
+					&state->copies__struct_segment_copy, j);
+			if(copy->begin == state->segment_begins[segment]) {
+				break;
+			}
+		}
+		for(i = state->segment_begins[segment];
+				i < state->segment_begins[segment + 1]; i++) {
+			emit_instruction(state, i, copy,
+					instructions__struct_instruction, operands__struct_operand);
+		}
+	}
+	for(j = 0; j < copies_length; j++) {
+		const struct segment_copy* copy = (const struct segment_copy*)
+			vector_at(&state->copies__struct_segment_copy, j);
+
+		if(copy->begin < code->instructions_length) {
+			continue;
+		}
+		for(i = state->segment_begins[copy->segment];
+				i < state->segment_begins[copy->segment + 1]; i++) {
+			emit_instruction(state, i, copy,
+					instructions__struct_instruction, operands__struct_operand);
+		}
+	}
+}
+
+/* Appends the copy of the instruction, or the instruction as it is if the
+   copy is NULL or can't reach it */
+static void emit_instruction(struct layout_state* state, size_t index,
+		const struct segment_copy* copy,
+		struct vector* instructions__struct_instruction,
+		struct vector* operands__struct_operand)
+{
+	const struct bytecode* code = state->code;
+	struct instruction ins = code->instructions[index];
+	size_t frame_size = 0;
+	size_t position = 0;
+	struct operand extra;
+	size_t j;
+
+	if(copy != NULL && index >= copy->from) {
+		frame_size = copy->frame_size;
+		position = copy_position(state, copy, index);
+	}
+
+	extra.value = 0;
+	extra.is_stack = 0;
+	if(frame_size != 0 && ins.opcode == OPCODE_BRANCH) {
+		extra.value = slot_register(position, 0, frame_size);
+	} else if(frame_size != 0) {
+		extra.value = position;
+	}
+
+	/* Branches go to the copy for the position they leave the ring at, and
+	   calls to wherever their function starts */
+	if(frame_size != 0 && ins.target != BYTECODE_UNRESOLVED) {
+		if(ins.opcode == OPCODE_BRANCH || ins.opcode == OPCODE_EQUALS_BRANCH) {
+			size_t target_copy = reach(state, ins.target,
+					(position + (ins.opcode == OPCODE_EQUALS_BRANCH)) %
+					frame_size, frame_size);
+
+			assert(target_copy != COPY_NONE);
+			vector_clear(&state->work__size_t);
+			ins.target = copied_index(state, target_copy, ins.target);
+		} else {
+			ins.target = entry_index(state, ins.target);
+		}
+	}
+
+	ins.operands_begin = vector_size(operands__struct_operand);
+	vector_push_back(operands__struct_operand, &extra);
+
+	for(j = 0; j < ins.operands_length; j++) {
+		struct operand operand =
+			code->operands[code->instructions[index].operands_begin + j];
+
+		/* Unreachable instructions keep their slots; they never run */
+		if(operand.is_stack && frame_size != 0) {
+			/* The call part of sub+call runs after the sub's push */
+			size_t at = ins.opcode == OPCODE_SUB_CALL && j >= 2 ?
+				(position + 1) % frame_size : position;
+
+			operand.value = slot_register(at, operand.value, frame_size);
+		}
+		vector_push_back(operands__struct_operand, &operand);
+	}
+
+	vector_push_back(instructions__struct_instruction, &ins);
+}
+
+
+
+void registers_unit_test(void)
+{
+	/* fact from res/test.asm, and a main calling it, after optimizing */
+	static struct instruction fact[] = {
+		/* fact: equals?+branch s0 1 -> fact_one */
+		{OPCODE_EQUALS_BRANCH, 0, 2, 4, 0, VALUE_TYPE_WORD},
+		/* sub+call s1 1 s0 -> fact */
+		{OPCODE_SUB_CALL, 2, 3, 0, 4, VALUE_TYPE_WORD},
+		/* mul s0 s3 */
+		{OPCODE_MUL, 5, 2, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* ret s0 */
+		{OPCODE_RET, 7, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* fact_one: ret 1 */
+		{OPCODE_RET, 8, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* main: call 10 -> fact */
+		{OPCODE_CALL, 9, 1, 0, 4, VALUE_TYPE_WORD},
+		/* ret s0 */
+		{OPCODE_RET, 10, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD}
+	};
+	static const struct operand operands[] = {
+		{0, 1}, {1, 0},
+		{1, 1}, {1, 0}, {0, 1},
+		{0, 1}, {3, 1},
+		{0, 1},
+		{1, 0},
+		{10, 0},
+		{0, 1}
+	};
+	static const struct instruction loop[] = {
+		/* main: push 1 */
+		{OPCODE_PUSH, 0, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* main_loop: push s0 */
+		{OPCODE_PUSH, 1, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD},
+		/* branch main_loop */
+		{OPCODE_BRANCH, 2, 0, 1, 0, VALUE_TYPE_WORD},
+		/* ret s1 */
+		{OPCODE_RET, 2, 1, BYTECODE_UNRESOLVED, 0, VALUE_TYPE_WORD}
+	};
+	static const struct operand loop_operands[] = {
+		{1, 0},
+		{0, 1},
+		{1, 1}
+	};
+	struct bytecode code;
+	struct vector instructions;
+	struct vector pool;
+	const struct instruction* result;
+	const struct operand* result_operands;
+	size_t startup_target;
+
+	code.instructions = fact;
+	code.instructions_length = sizeof(fact) / sizeof(fact[0]);
+	code.operands = operands;
+	code.operands_length = sizeof(operands) / sizeof(operands[0]);
+	code.startup_target = 5;
+	code.startup_frame_size = 1;
+
+	vector_create(&instructions, sizeof(struct instruction), NULL);
+	vector_create(&pool, sizeof(struct operand), NULL);
+
+	assert(registers_assign(&code, &instructions, &pool, 0, &startup_target));
+	result = (const struct instruction*)vector_to_array(&instructions);
+	result_operands = (const struct operand*)vector_to_array(&pool);
+	assert(vector_size(&instructions) == code.instructions_length);
+	assert(startup_target == 5);
+
+	/* fact has one argument in a frame of 4, so it starts at position 1,
+	   where s0 is slot 0 */
+	assert(result_operands[result[0].operands_begin].value == 1);
+	assert(result_operands[result[0].operands_begin + 1].value == 0);
+	/* The sub writes slot 2, and the call's s0 is that */
+	assert(result_operands[result[1].operands_begin].value == 2);
+	assert(result_operands[result[1].operands_begin + 1].value == 0);
+	assert(result_operands[result[1].operands_begin + 3].value == 2);
+	/* The result comes back to slot 3, and s3 is the argument in slot 0 */
+	assert(result_operands[result[2].operands_begin + 1].value == 3);
+	assert(result_operands[result[2].operands_begin + 2].value == 0);
+	assert(result[2].target == BYTECODE_UNRESOLVED);
+
+	/* A function returning different numbers of values has no layout for
+	   whatever comes after the call */
+	fact[4].operands_length = 2;
+	assert(!registers_assign(&code, &instructions, &pool, 0, &startup_target));
+	fact[4].operands_length = 1;
+
+	/* A loop pushing one value into a frame of two runs at both positions,
+	   so it's copied, and the copies branch to each other */
+	code.instructions = loop;
+	code.instructions_length = sizeof(loop) / sizeof(loop[0]);
+	code.operands = loop_operands;
+	code.operands_length = sizeof(loop_operands) / sizeof(loop_operands[0]);
+	code.startup_target = 0;
+	code.startup_frame_size = 2;
+
+	assert(registers_assign(&code, &instructions, &pool, 0, &startup_target));
+	result = (const struct instruction*)vector_to_array(&instructions);
+	result_operands = (const struct operand*)vector_to_array(&pool);
+	assert(vector_size(&instructions) == code.instructions_length * 2);
+	assert(startup_target == 0);
+	assert(result[2].target == 5);
+	assert(result[6].target == 1);
+	/* push s0 writes slot 1 and reads slot 0, then the other way around */
+	assert(result_operands[result[1].operands_begin].value == 1);
+	assert(result_operands[result[1].operands_begin + 1].value == 0);
+	assert(result_operands[result[5].operands_begin].value == 0);
+	assert(result_operands[result[5].operands_begin + 1].value == 1);
+
+	vector_release(&instructions);
+	vector_release(&pool);
+}
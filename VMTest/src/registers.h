@@ -0,0 +1,59 @@
+#ifndef REGISTERS_INCLUDED_H
+#define REGISTERS_INCLUDED_H
+
+#include <stddef.h>
+
+#include "vector.h"
+#include "bytecode.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Register form of a program, where operands name fixed slots of the frame
+ * instead of counting back from the latest push.
+ *
+ * A frame is a ring of frame_size values, written at the ring's position,
+ * which starts at 0 and moves on with every push. If every frame that can
+ * reach an instruction has the same size and has moved its position to
+ * the same place by then, then where each of the instruction's slots and
+ * results lives in the frame is known ahead of time. That is the case for
+ * most programs, where each function is called with a fixed number of
+ * arguments and always returns the same number of values. A loop that
+ * leaves the ring somewhere else each time around is copied for every
+ * position it runs at, with its branches going between the copies. The
+ * ring's position then only matters when values cross from one frame to
+ * another, on calls and returns.
+ *
+ * Every instruction gets one operand in front of its own:
+ *   push, arithmetic, equals?+branch - the slot its result is written to;
+ *                                      div writes the slot after that too
+ *   branch                           - the slot of s0
+ *   call, sub+call                   - the ring position to set before the
+ *                                      call, so that the results land in
+ *                                      the right slots
+ *   ret, tail-call                   - unused
+ * Stack operands are slot indices into the frame. The instructions are
+ * otherwise copied, with operands_begin pointing at the extra operand.
+ * Every instruction keeps its index, followed by the extra copies.
+ */
+
+/* Fills the vectors with the register form of code, and startup_target
+   with where the startup function starts in it when entered with the given
+   number of arguments, and returns 1. Returns 0 if some function is
+   entered or returns in different ways, or copying the program's loops
+   would make it too large, in which case the program can only run on the
+   ring. */
+int registers_assign(const struct bytecode* code,
+		struct vector* instructions__struct_instruction,
+		struct vector* operands__struct_operand, size_t startup_arguments,
+		size_t* startup_target);
+
+void registers_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
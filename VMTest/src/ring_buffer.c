@@ -14,6 +14,15 @@ void ring_buffer_create(struct ring_buffer* self, size_t size)
 	self->data = (size_t*)malloc(size * sizeof(size_t));
 }
 
+void ring_buffer_create_at(struct ring_buffer* self, size_t* data,
+		size_t size)
+{
+	assert(size > 0);
+	self->pos = 0;
+	self->length = size;
+	self->data = data;
+}
+
 void ring_buffer_release(struct ring_buffer* self)
 {
 	free(self->data);
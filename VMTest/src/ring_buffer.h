@@ -14,6 +14,10 @@ struct ring_buffer {
 };
 
 void ring_buffer_create(struct ring_buffer* self, size_t size);
+/* Uses existing storage for at least size values instead of allocating.
+   The ring buffer doesn't own it, so it must not be released. */
+void ring_buffer_create_at(struct ring_buffer* self, size_t* data,
+		size_t size);
 void ring_buffer_release(struct ring_buffer* self);
 
 void ring_buffer_add(struct ring_buffer* self, size_t val);
@@ -0,0 +1,1294 @@
+#include "scheme.h"
+#include "bytecode.h"
+#include "interpreter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+
+#define SCHEME_ARENA_CHUNK_SIZE 4096
+#define STARTUP_FUNCTION "main"
+#define COMMENT_CHAR ';'
+#define ATOM_DELIMITERS " \t\r\n();"
+/* Characters of Scheme that the subset has no use for, and that would
+   confuse the assembler in a name */
+#define UNSUPPORTED_CHARS "#\"'`,:[]{}|\\"
+/* Items of a list kept on the stack while parsing it, which is all of them
+   in most lists */
+#define SCHEME_INLINE_ITEMS 8
+/* No slot is read */
+#define REACH_NONE (LONG_MIN / 4)
+
+#define SCHEME_TRY(error, expr) \
+	if((error = (expr)) != SCHEME_ERROR_NONE) { \
+		return error; \
+	}
+
+/* Parsed source, before any name is looked up */
+enum node_type {
+	NODE_NUMBER,
+	NODE_SYMBOL,
+	NODE_LIST
+};
+
+struct node {
+	enum node_type type;
+	size_t line;
+	int64_t number;
+	/* Interned */
+	const char* symbol;
+	struct node** items;
+	size_t items_length;
+};
+
+enum expr_type {
+	EXPR_CONSTANT,
+	EXPR_VARIABLE,
+	EXPR_INSTRUCTION,
+	EXPR_IF
+};
+
+struct expr {
+	enum expr_type type;
+	int64_t constant;
+	/* Of a variable, the push in the frame it was, the first parameter
+	   being 1. Of an instruction, the same for its result, once emitted. */
+	size_t position;
+
+	/* A mnemonic, or the label of the function called */
+	const char* mnemonic;
+	struct expr** operands;
+	size_t operands_length;
+	/* Values the instruction pushes, and which of them is the result,
+	   counted back from the last one */
+	size_t pushed;
+	size_t result_offset;
+	/* The operands' own code is emitted last to first */
+	int reverse;
+
+	/* Both arms are in tail position. The condition is an equals?, which
+	   gives 1 for the else arm if inverted. */
+	struct expr* condition;
+	int inverted;
+	struct expr* then;
+	struct expr* otherwise;
+
+	/* Pushes made by an instruction and the code of its operands, and the
+	   deepest slot any of them reads. Slots of values from before are
+	   relative to the depth the code starts at, and those of values pushed
+	   within are not. */
+	size_t pushes;
+	long outer_reach;
+	long inner_reach;
+};
+
+struct function {
+	const char* name;
+	/* For the comment after the label */
+	const char** params;
+	size_t params_length;
+	const struct node* definition;
+	struct expr* body;
+	/* Labels generated from its name so far */
+	size_t labels;
+};
+
+enum definition_type {
+	DEFINITION_FUNCTION,
+	DEFINITION_CONSTANT,
+	DEFINITION_LABEL
+};
+
+struct definition {
+	enum definition_type type;
+	size_t function;
+	int64_t constant;
+};
+
+/* Builtins that are one instruction */
+struct builtin {
+	const char* name;
+	const char* mnemonic;
+	size_t pushed;
+	size_t result_offset;
+	/* Operands, or 0 for any number */
+	size_t arity;
+};
+
+static const struct builtin builtins[] = {
+	{"+", "add", 1, 0, 0},
+	{"-", "sub", 1, 0, 0},
+	{"*", "mul", 1, 0, 0},
+	/* div.i pushes the remainder, then the quotient */
+	{"quotient", "div.i", 2, 0, 2},
+	{"remainder", "div.i", 2, 1, 2},
+	{"=", "equals?", 1, 0, 2}
+};
+
+static const char* const special_forms[] = {
+	"define",
+	"if",
+	"not",
+	"zero?"
+};
+
+/* The user function being built, for names and variables */
+struct scope {
+	struct scheme_compiler* self;
+	size_t function;
+};
+
+/* Parsing Functions */
+static enum scheme_error parse_node(struct scheme_compiler* self,
+		const char** cursor, size_t* line, struct node** result);
+static enum scheme_error parse_atom(struct scheme_compiler* self,
+		const char* atom, size_t length, struct node* node);
+static void skip_space(const char** cursor, size_t* line);
+
+/* Definition Functions */
+static enum scheme_error define(struct scheme_compiler* self,
+		const struct node* form);
+static enum scheme_error check_name(struct scheme_compiler* self,
+		const struct node* name);
+static size_t add_function(struct scheme_compiler* self, const char* name,
+		const char** params, size_t params_length,
+		const struct node* definition);
+static struct function* function_at(struct scheme_compiler* self,
+		size_t index);
+static const char* new_label(struct scheme_compiler* self,
+		size_t function, const char* kind);
+
+/* Building Functions */
+static enum scheme_error build(struct scope* scope, const struct node* node,
+		int tail, struct expr** result);
+static enum scheme_error build_list(struct scope* scope,
+		const struct node* node, struct expr** result);
+static enum scheme_error build_if(struct scope* scope,
+		const struct node* node, int tail, struct expr** result);
+static enum scheme_error build_condition(struct scope* scope,
+		const struct node* node, struct expr** result, int* inverted);
+static enum scheme_error build_operands(struct scope* scope,
+		const struct node* node, struct expr*** result);
+static struct expr* new_expr(struct scheme_compiler* self,
+		enum expr_type type);
+static struct expr* new_instruction(struct scheme_compiler* self,
+		const char* mnemonic, size_t pushed, struct expr** operands,
+		size_t operands_length);
+static struct expr* new_binary(struct scheme_compiler* self,
+		const char* mnemonic, struct expr* a, struct expr* b);
+static struct expr* new_constant(struct scheme_compiler* self,
+		int64_t value);
+static struct expr* lift(struct scope* scope, struct expr* body);
+static void mark_variables(const struct expr* expr, char* used);
+static void remap_variables(struct expr* expr, const size_t* positions);
+
+/* Emitting Functions */
+static void analyze(struct expr* expr, size_t depth);
+static void measure(const struct expr* expr, int reverse, size_t* pushes,
+		long* outer_reach, long* inner_reach);
+static const struct expr* operand_at(const struct expr* expr, size_t index,
+		int reverse);
+static long reach(const struct expr* expr, size_t depth);
+static long tail_reach(const struct expr* expr, size_t depth);
+static int layout_if(const struct expr* expr, size_t depth,
+		const struct expr** fall_through, const struct expr** taken);
+static void emit(struct scheme_compiler* self, const char* format, ...);
+static void emit_function(struct scheme_compiler* self, size_t index);
+static void emit_tail(struct scheme_compiler* self, size_t function,
+		const struct expr* expr, size_t depth);
+static void emit_instruction(struct scheme_compiler* self,
+		struct expr* expr, size_t* depth);
+
+static long max_long(long a, long b);
+
+
+void scheme_compiler_create(struct scheme_compiler* self)
+{
+	arena_create(&self->arena, SCHEME_ARENA_CHUNK_SIZE);
+	string_table_create_arena(&self->names, &self->arena);
+	hash_map_create_arena(&self->definitions__charptr__struct_definition,
+			sizeof(struct definition), &self->arena);
+	vector_create(&self->functions__struct_function,
+			sizeof(struct function), NULL);
+	vector_create(&self->lines__charptr, sizeof(char*), NULL);
+	self->error_line = 0;
+}
+
+void scheme_compiler_release(struct scheme_compiler* self)
+{
+	vector_release(&self->lines__charptr);
+	vector_release(&self->functions__struct_function);
+	hash_map_release(&self->definitions__charptr__struct_definition);
+	string_table_release(&self->names);
+	arena_release(&self->arena);
+}
+
+enum scheme_error scheme_compile(struct scheme_compiler* self,
+		const char* source)
+{
+	enum scheme_error error;
+	struct scope scope;
+	const struct node* entry = NULL;
+	const char* main_name;
+	size_t user_functions;
+	size_t line = 1;
+	size_t i;
+
+	main_name = string_table_intern(&self->names, STARTUP_FUNCTION);
+	for(;;) {
+		struct node* form;
+
+		skip_space(&source, &line);
+		if(!source[0]) {
+			break;
+		}
+		SCHEME_TRY(error, parse_node(self, &source, &line, &form));
+
+		self->error_line = form->line;
+		if(form->type == NODE_LIST && form->items_length > 0 &&
+				form->items[0]->type == NODE_SYMBOL &&
+				!strcmp(form->items[0]->symbol, "define")) {
+			SCHEME_TRY(error, define(self, form));
+		} else if(entry == NULL) {
+			entry = form;
+		} else {
+			return SCHEME_ERROR_NO_ENTRY;
+		}
+	}
+
+	/* The expression is the body of main */
+	if(entry != NULL) {
+		self->error_line = entry->line;
+		if(hash_map_at(&self->definitions__charptr__struct_definition,
+					main_name) != NULL) {
+			return SCHEME_ERROR_NO_ENTRY;
+		}
+		add_function(self, main_name, NULL, 0, entry);
+	} else if(hash_map_at(&self->definitions__charptr__struct_definition,
+				main_name) == NULL) {
+		self->error_line = line;
+		return SCHEME_ERROR_NO_ENTRY;
+	}
+
+	/* Functions lifted out of these are added as they're built */
+	user_functions = vector_size(&self->functions__struct_function);
+	scope.self = self;
+	for(i = 0; i < user_functions; i++) {
+		const struct node* definition = function_at(self, i)->definition;
+		const struct node* body = definition;
+		struct expr* expr;
+
+		/* Whole (define (name params...) body) forms, but for main */
+		if(body->type == NODE_LIST && body != entry) {
+			body = body->items[2];
+		}
+		scope.function = i;
+		SCHEME_TRY(error, build(&scope, body, 1, &expr));
+		function_at(self, i)->body = expr;
+	}
+
+	for(i = 0; i < vector_size(&self->functions__struct_function); i++) {
+		emit_function(self, i);
+	}
+
+	return SCHEME_ERROR_NONE;
+}
+
+size_t scheme_lines_length(const struct scheme_compiler* self)
+{
+	return vector_size(&self->lines__charptr);
+}
+
+const char* scheme_line(const struct scheme_compiler* self, size_t index)
+{
+	return *(const char**)vector_at(&self->lines__charptr, index);
+}
+
+
+static enum scheme_error parse_node(struct scheme_compiler* self,
+		const char** cursor, size_t* line, struct node** result)
+{
+	enum scheme_error error;
+	struct node* node;
+	struct vector items;
+	struct node* items_inline[SCHEME_INLINE_ITEMS];
+	const char* atom;
+
+	skip_space(cursor, line);
+	self->error_line = *line;
+	if(!**cursor || **cursor == ')') {
+		return SCHEME_ERROR_SYNTAX;
+	}
+
+	node = (struct node*)arena_alloc(&self->arena, sizeof(struct node));
+	node->line = *line;
+	node->items = NULL;
+	node->items_length = 0;
+
+	if(**cursor != '(') {
+		atom = *cursor;
+		*cursor += strcspn(atom, ATOM_DELIMITERS);
+		*result = node;
+		return parse_atom(self, atom, (size_t)(*cursor - atom), node);
+	}
+
+	(*cursor)++;
+	vector_create_inline(&items, sizeof(struct node*), NULL, items_inline,
+			SCHEME_INLINE_ITEMS);
+	for(;;) {
+		struct node* item;
+
+		skip_space(cursor, line);
+		if(**cursor == ')') {
+			(*cursor)++;
+			break;
+		}
+		if(!**cursor) {
+			vector_release(&items);
+			self->error_line = node->line;
+			return SCHEME_ERROR_SYNTAX;
+		}
+
+		error = parse_node(self, cursor, line, &item);
+		if(error != SCHEME_ERROR_NONE) {
+			vector_release(&items);
+			return error;
+		}
+		vector_push_back(&items, &item);
+	}
+
+	node->type = NODE_LIST;
+	node->items_length = vector_size(&items);
+	if(node->items_length > 0) {
+		node->items = (struct node**)arena_alloc(&self->arena,
+				node->items_length * sizeof(struct node*));
+		memcpy(node->items, vector_to_array(&items),
+				node->items_length * sizeof(struct node*));
+	}
+	vector_release(&items);
+
+	*result = node;
+	return SCHEME_ERROR_NONE;
+}
+
+static enum scheme_error parse_atom(struct scheme_compiler* self,
+		const char* atom, size_t length, struct node* node)
+{
+	char* text = (char*)arena_alloc(&self->arena, length + 1);
+	size_t digits;
+	size_t i;
+
+	memcpy(text, atom, length);
+	text[length] = 0;
+
+	if(!strcmp(text, "#t") || !strcmp(text, "#f")) {
+		node->type = NODE_NUMBER;
+		node->number = text[1] == 't';
+		return SCHEME_ERROR_NONE;
+	}
+
+	/* An optional sign, then nothing but digits */
+	digits = text[0] == '-' || text[0] == '+';
+	if(digits < length && strspn(text + digits, "0123456789") ==
+			length - digits) {
+		char* end;
+
+		errno = 0;
+		node->type = NODE_NUMBER;
+		node->number = strtoll(text, &end, 10);
+		return errno == ERANGE ?
+			SCHEME_ERROR_INVALID_NUMBER : SCHEME_ERROR_NONE;
+	}
+	if(text[strcspn(text, UNSUPPORTED_CHARS)]) {
+		return SCHEME_ERROR_SYNTAX;
+	}
+
+	/* The assembler lowers the case of every token, as Scheme doesn't
+	   tell them apart either */
+	for(i = 0; i < length; i++) {
+		text[i] = (char)tolower((unsigned char)text[i]);
+	}
+	node->type = NODE_SYMBOL;
+	node->symbol = string_table_intern(&self->names, text);
+	return SCHEME_ERROR_NONE;
+}
+
+static void skip_space(const char** cursor, size_t* line)
+{
+	const char* c = *cursor;
+
+	for(; *c; c++) {
+		if(*c == COMMENT_CHAR) {
+			c += strcspn(c, "\n");
+			if(!*c) {
+				break;
+			}
+		}
+		if(*c == '\n') {
+			(*line)++;
+		} else if(!isspace((unsigned char)*c)) {
+			break;
+		}
+	}
+
+	*cursor = c;
+}
+
+
+static enum scheme_error define(struct scheme_compiler* self,
+		const struct node* form)
+{
+	enum scheme_error error;
+	struct definition definition;
+	const struct node* signature;
+	const char** params;
+	size_t i, j;
+
+	if(form->items_length != 3) {
+		return SCHEME_ERROR_SYNTAX;
+	}
+	signature = form->items[1];
+
+	/* (define name 42) */
+	if(signature->type == NODE_SYMBOL) {
+		SCHEME_TRY(error, check_name(self, signature));
+		if(form->items[2]->type != NODE_NUMBER) {
+			return SCHEME_ERROR_SYNTAX;
+		}
+		definition.type = DEFINITION_CONSTANT;
+		definition.function = 0;
+		definition.constant = form->items[2]->number;
+		hash_map_insert(&self->definitions__charptr__struct_definition,
+				signature->symbol, &definition);
+		return SCHEME_ERROR_NONE;
+	}
+
+	if(signature->type != NODE_LIST || signature->items_length == 0) {
+		return SCHEME_ERROR_SYNTAX;
+	}
+	SCHEME_TRY(error, check_name(self, signature->items[0]));
+
+	params = (const char**)arena_alloc(&self->arena,
+			signature->items_length * sizeof(const char*));
+	for(i = 1; i < signature->items_length; i++) {
+		if(signature->items[i]->type != NODE_SYMBOL) {
+			return SCHEME_ERROR_SYNTAX;
+		}
+		params[i - 1] = signature->items[i]->symbol;
+		for(j = 0; j + 1 < i; j++) {
+			if(params[j] == params[i - 1]) {
+				return SCHEME_ERROR_SYNTAX;
+			}
+		}
+	}
+
+	add_function(self, signature->items[0]->symbol, params,
+			signature->items_length - 1, form);
+	return SCHEME_ERROR_NONE;
+}
+
+static enum scheme_error check_name(struct scheme_compiler* self,
+		const struct node* name)
+{
+	enum value_type type;
+	size_t i;
+
+	if(name->type != NODE_SYMBOL) {
+		return SCHEME_ERROR_SYNTAX;
+	}
+	if(hash_map_at(&self->definitions__charptr__struct_definition,
+				name->symbol) != NULL) {
+		return SCHEME_ERROR_REDEFINITION;
+	}
+
+	/* A call to a function named like an instruction would be one */
+	if(opcode_from_mnemonic(name->symbol, &type) != OPCODE_CALL) {
+		return SCHEME_ERROR_RESERVED_NAME;
+	}
+	for(i = 0; i < sizeof(builtins)/sizeof(builtins[0]); i++) {
+		if(!strcmp(name->symbol, builtins[i].name)) {
+			return SCHEME_ERROR_RESERVED_NAME;
+		}
+	}
+	for(i = 0; i < sizeof(special_forms)/sizeof(special_forms[0]); i++) {
+		if(!strcmp(name->symbol, special_forms[i])) {
+			return SCHEME_ERROR_RESERVED_NAME;
+		}
+	}
+
+	return SCHEME_ERROR_NONE;
+}
+
+static size_t add_function(struct scheme_compiler* self, const char* name,
+		const char** params, size_t params_length,
+		const struct node* definition)
+{
+	struct function function;
+	struct definition entry;
+
+	function.name = name;
+	function.params = params;
+	function.params_length = params_length;
+	function.definition = definition;
+	function.body = NULL;
+	function.labels = 0;
+	vector_push_back(&self->functions__struct_function, &function);
+
+	entry.type = DEFINITION_FUNCTION;
+	entry.function = vector_size(&self->functions__struct_function) - 1;
+	entry.constant = 0;
+	hash_map_insert(&self->definitions__charptr__struct_definition, name,
+			&entry);
+
+	return entry.function;
+}
+
+static struct function* function_at(struct scheme_compiler* self,
+		size_t index)
+{
+	return (struct function*)vector_at(&self->functions__struct_function,
+			index);
+}
+
+/* The function's name, the kind and a number, made unique */
+static const char* new_label(struct scheme_compiler* self,
+		size_t function, const char* kind)
+{
+	struct definition definition;
+	const char* label;
+	char* buffer;
+	size_t length;
+
+	length = strlen(function_at(self, function)->name) + strlen(kind) + 24;
+	buffer = (char*)malloc(length);
+	assert(buffer != NULL);
+
+	do {
+		snprintf(buffer, length, "%s-%s%lu",
+				function_at(self, function)->name, kind,
+				(unsigned long)++function_at(self, function)->labels);
+		label = string_table_intern(&self->names, buffer);
+	} while(hash_map_at(&self->definitions__charptr__struct_definition,
+				label) != NULL);
+	free(buffer);
+
+	definition.type = DEFINITION_LABEL;
+	definition.function = function;
+	definition.constant = 0;
+	hash_map_insert(&self->definitions__charptr__struct_definition, label,
+			&definition);
+
+	return label;
+}
+
+
+static enum scheme_error build(struct scope* scope, const struct node* node,
+		int tail, struct expr** result)
+{
+	struct scheme_compiler* self = scope->self;
+	const struct function* function = function_at(self, scope->function);
+	const struct definition* definition;
+	enum scheme_error error;
+	struct expr* expr = NULL;
+	size_t i;
+
+	self->error_line = node->line;
+	if(node->type == NODE_LIST && node->items_length > 0 &&
+			node->items[0]->type == NODE_SYMBOL &&
+			!strcmp(node->items[0]->symbol, "if")) {
+		return build_if(scope, node, tail, result);
+	}
+
+	switch(node->type) {
+	case NODE_NUMBER:
+		expr = new_constant(self, node->number);
+		break;
+	case NODE_SYMBOL:
+		for(i = 0; i < function->params_length; i++) {
+			if(function->params[i] == node->symbol) {
+				expr = new_expr(self, EXPR_VARIABLE);
+				expr->position = i + 1;
+				break;
+			}
+		}
+		if(expr != NULL) {
+			break;
+		}
+
+		definition = (const struct definition*)hash_map_at(
+				&self->definitions__charptr__struct_definition,
+				node->symbol);
+		if(definition == NULL || definition->type != DEFINITION_CONSTANT) {
+			return SCHEME_ERROR_UNBOUND_VARIABLE;
+		}
+		expr = new_constant(self, definition->constant);
+		break;
+	case NODE_LIST:
+		SCHEME_TRY(error, build_list(scope, node, &expr));
+		break;
+	}
+
+	if(tail) {
+		*result = new_instruction(self, "ret", 0, NULL, 1);
+		(*result)->operands[0] = expr;
+	} else {
+		*result = expr;
+	}
+	return SCHEME_ERROR_NONE;
+}
+
+static enum scheme_error build_list(struct scope* scope,
+		const struct node* node, struct expr** result)
+{
+	struct scheme_compiler* self = scope->self;
+	const struct definition* definition;
+	const struct builtin* builtin = NULL;
+	enum scheme_error error;
+	struct expr** operands;
+	const char* head;
+	size_t length = node->items_length - 1;
+	size_t i;
+
+	if(node->items_length == 0 || node->items[0]->type != NODE_SYMBOL) {
+		return SCHEME_ERROR_SYNTAX;
+	}
+	head = node->items[0]->symbol;
+
+	if(!strcmp(head, "define")) {
+		return SCHEME_ERROR_SYNTAX;
+	}
+	if(!strcmp(head, "not") || !strcmp(head, "zero?")) {
+		if(length != 1) {
+			return SCHEME_ERROR_ARGUMENT_COUNT;
+		}
+		SCHEME_TRY(error, build_operands(scope, node, &operands));
+		*result = new_binary(self, "equals?", operands[0],
+				new_constant(self, 0));
+		return SCHEME_ERROR_NONE;
+	}
+
+	for(i = 0; i < sizeof(builtins)/sizeof(builtins[0]); i++) {
+		if(!strcmp(head, builtins[i].name)) {
+			builtin = &builtins[i];
+		}
+	}
+	if(builtin != NULL) {
+		if(builtin->arity != 0 && length != builtin->arity) {
+			return SCHEME_ERROR_ARGUMENT_COUNT;
+		}
+		SCHEME_TRY(error, build_operands(scope, node, &operands));
+
+		if(builtin->arity != 0) {
+			*result = new_binary(self, builtin->mnemonic, operands[0],
+					operands[1]);
+			(*result)->pushed = builtin->pushed;
+			(*result)->result_offset = builtin->result_offset;
+			return SCHEME_ERROR_NONE;
+		}
+
+		/* Left to right, from the identity; (- a) is 0 - a */
+		if(length == 0) {
+			if(!strcmp(head, "-")) {
+				return SCHEME_ERROR_ARGUMENT_COUNT;
+			}
+			*result = new_constant(self, !strcmp(head, "*"));
+			return SCHEME_ERROR_NONE;
+		}
+		*result = operands[0];
+		if(length == 1 && !strcmp(head, "-")) {
+			*result = new_binary(self, "sub", new_constant(self, 0),
+					operands[0]);
+		}
+		for(i = 1; i < length; i++) {
+			*result = new_binary(self, builtin->mnemonic, *result,
+					operands[i]);
+		}
+		return SCHEME_ERROR_NONE;
+	}
+
+	definition = (const struct definition*)hash_map_at(
+			&self->definitions__charptr__struct_definition, head);
+	if(definition == NULL || definition->type != DEFINITION_FUNCTION) {
+		return SCHEME_ERROR_UNDEFINED_FUNCTION;
+	}
+	if(function_at(self, definition->function)->params_length != length) {
+		return SCHEME_ERROR_ARGUMENT_COUNT;
+	}
+
+	SCHEME_TRY(error, build_operands(scope, node, &operands));
+	*result = new_instruction(self, head, 1, operands, length);
+	return SCHEME_ERROR_NONE;
+}
+
+static enum scheme_error build_if(struct scope* scope,
+		const struct node* node, int tail, struct expr** result)
+{
+	struct scheme_compiler* self = scope->self;
+	enum scheme_error error;
+	struct expr* expr;
+
+	if(node->items_length != 4) {
+		return SCHEME_ERROR_SYNTAX;
+	}
+
+	expr = new_expr(self, EXPR_IF);
+	SCHEME_TRY(error, build_condition(scope, node->items[1],
+				&expr->condition, &expr->inverted));
+	SCHEME_TRY(error, build(scope, node->items[2], 1, &expr->then));
+	SCHEME_TRY(error, build(scope, node->items[3], 1, &expr->otherwise));
+
+	*result = tail ? expr : lift(scope, expr);
+	return SCHEME_ERROR_NONE;
+}
+
+/* An equals?, with whether it gives 1 for false instead of true */
+static enum scheme_error build_condition(struct scope* scope,
+		const struct node* node, struct expr** result, int* inverted)
+{
+	enum scheme_error error;
+	struct expr* value;
+	const char* head = NULL;
+
+	if(node->type == NODE_LIST && node->items_length > 0 &&
+			node->items[0]->type == NODE_SYMBOL) {
+		head = node->items[0]->symbol;
+	}
+
+	if(head != NULL && !strcmp(head, "not") && node->items_length == 2) {
+		SCHEME_TRY(error, build_condition(scope, node->items[1], result,
+					inverted));
+		*inverted = !*inverted;
+		return SCHEME_ERROR_NONE;
+	}
+
+	SCHEME_TRY(error, build(scope, node, 0, &value));
+	*inverted = 0;
+	if(head != NULL && (!strcmp(head, "=") || !strcmp(head, "zero?"))) {
+		*result = value;
+		return SCHEME_ERROR_NONE;
+	}
+
+	*inverted = 1;
+	*result = new_binary(scope->self, "equals?", value,
+			new_constant(scope->self, 0));
+	return SCHEME_ERROR_NONE;
+}
+
+/* Every item after the head */
+static enum scheme_error build_operands(struct scope* scope,
+		const struct node* node, struct expr*** result)
+{
+	enum scheme_error error;
+	size_t i;
+
+	*result = (struct expr**)arena_alloc(&scope->self->arena,
+			node->items_length * sizeof(struct expr*));
+	for(i = 1; i < node->items_length; i++) {
+		SCHEME_TRY(error, build(scope, node->items[i], 0,
+					&(*result)[i - 1]));
+	}
+
+	return SCHEME_ERROR_NONE;
+}
+
+static struct expr* new_expr(struct scheme_compiler* self,
+		enum expr_type type)
+{
+	struct expr* expr = (struct expr*)arena_alloc(&self->arena,
+			sizeof(struct expr));
+
+	memset(expr, 0, sizeof(*expr));
+	expr->type = type;
+	return expr;
+}
+
+/* With room for the operands, if they're not given */
+static struct expr* new_instruction(struct scheme_compiler* self,
+		const char* mnemonic, size_t pushed, struct expr** operands,
+		size_t operands_length)
+{
+	struct expr* expr = new_expr(self, EXPR_INSTRUCTION);
+
+	if(operands == NULL) {
+		operands = (struct expr**)arena_alloc(&self->arena,
+				operands_length * sizeof(struct expr*));
+	}
+	expr->mnemonic = mnemonic;
+	expr->operands = operands;
+	expr->operands_length = operands_length;
+	expr->pushed = pushed;
+	return expr;
+}
+
+static struct expr* new_binary(struct scheme_compiler* self,
+		const char* mnemonic, struct expr* a, struct expr* b)
+{
+	struct expr* expr = new_instruction(self, mnemonic, 1, NULL, 2);
+
+	expr->operands[0] = a;
+	expr->operands[1] = b;
+	return expr;
+}
+
+static struct expr* new_constant(struct scheme_compiler* self,
+		int64_t value)
+{
+	struct expr* expr = new_expr(self, EXPR_CONSTANT);
+
+	expr->constant = value;
+	return expr;
+}
+
+/* Moves the if into a function taking the variables it uses, and gives a
+   call to it */
+static struct expr* lift(struct scope* scope, struct expr* body)
+{
+	struct scheme_compiler* self = scope->self;
+	const struct function* function = function_at(self, scope->function);
+	size_t params_length = function->params_length;
+	const char** params;
+	struct expr* call;
+	const char* name;
+	size_t* positions;
+	char* used;
+	size_t count = 0;
+	size_t i;
+
+	used = (char*)calloc(params_length + 1, 1);
+	positions = (size_t*)calloc(params_length + 1, sizeof(size_t));
+	assert(used != NULL && positions != NULL);
+
+	mark_variables(body, used);
+	params = (const char**)arena_alloc(&self->arena,
+			(params_length + 1) * sizeof(const char*));
+	for(i = 1; i <= params_length; i++) {
+		if(used[i]) {
+			params[count] = function->params[i - 1];
+			positions[i] = ++count;
+		}
+	}
+
+	name = new_label(self, scope->function, "if");
+	call = new_instruction(self, name, 1, NULL, count);
+	for(i = 1; i <= params_length; i++) {
+		if(used[i]) {
+			call->operands[positions[i] - 1] = new_expr(self,
+					EXPR_VARIABLE);
+			call->operands[positions[i] - 1]->position = i;
+		}
+	}
+
+	remap_variables(body, positions);
+	add_function(self, name, params, count, NULL);
+	function_at(self, vector_size(&self->functions__struct_function) -
+			1)->body = body;
+
+	free(used);
+	free(positions);
+	return call;
+}
+
+static void mark_variables(const struct expr* expr, char* used)
+{
+	size_t i;
+
+	switch(expr->type) {
+	case EXPR_CONSTANT:
+		break;
+	case EXPR_VARIABLE:
+		used[expr->position] = 1;
+		break;
+	case EXPR_INSTRUCTION:
+		for(i = 0; i < expr->operands_length; i++) {
+			mark_variables(expr->operands[i], used);
+		}
+		break;
+	case EXPR_IF:
+		mark_variables(expr->condition, used);
+		mark_variables(expr->then, used);
+		mark_variables(expr->otherwise, used);
+		break;
+	}
+}
+
+static void remap_variables(struct expr* expr, const size_t* positions)
+{
+	size_t i;
+
+	switch(expr->type) {
+	case EXPR_CONSTANT:
+		break;
+	case EXPR_VARIABLE:
+		expr->position = positions[expr->position];
+		break;
+	case EXPR_INSTRUCTION:
+		for(i = 0; i < expr->operands_length; i++) {
+			remap_variables(expr->operands[i], positions);
+		}
+		break;
+	case EXPR_IF:
+		remap_variables(expr->condition, positions);
+		remap_variables(expr->then, positions);
+		remap_variables(expr->otherwise, positions);
+		break;
+	}
+}
+
+
+/*
+ * Picks the order of every instruction's operands, bottom up. The choice
+ * can't depend on the depth the code ends up at, or reaches of arms of ifs
+ * couldn't be compared, so it's made for the depth the function starts at.
+ */
+static void analyze(struct expr* expr, size_t depth)
+{
+	size_t forward_pushes, backward_pushes;
+	long forward_outer, backward_outer;
+	long forward_inner, backward_inner;
+	size_t i;
+
+	if(expr->type == EXPR_IF) {
+		analyze(expr->condition, depth);
+		analyze(expr->then, depth);
+		analyze(expr->otherwise, depth);
+		return;
+	}
+	if(expr->type != EXPR_INSTRUCTION) {
+		return;
+	}
+
+	for(i = 0; i < expr->operands_length; i++) {
+		analyze(expr->operands[i], depth);
+	}
+
+	measure(expr, 0, &forward_pushes, &forward_outer, &forward_inner);
+	measure(expr, 1, &backward_pushes, &backward_outer, &backward_inner);
+	expr->reverse = max_long((long)depth + backward_outer, backward_inner) <
+		max_long((long)depth + forward_outer, forward_inner);
+
+	expr->pushes = forward_pushes;
+	expr->outer_reach = expr->reverse ? backward_outer : forward_outer;
+	expr->inner_reach = expr->reverse ? backward_inner : forward_inner;
+}
+
+static void measure(const struct expr* expr, int reverse, size_t* pushes,
+		long* outer_reach, long* inner_reach)
+{
+	size_t before = 0;
+	size_t after = 0;
+	long outer = REACH_NONE;
+	long inner = REACH_NONE;
+	size_t i;
+
+	/* The operands' own code runs first, one after the other */
+	for(i = 0; i < expr->operands_length; i++) {
+		const struct expr* operand = operand_at(expr, i, reverse);
+
+		if(operand->type == EXPR_INSTRUCTION) {
+			outer = max_long(outer, (long)before + operand->outer_reach);
+			inner = max_long(inner, operand->inner_reach);
+			before += operand->pushes;
+		}
+	}
+
+	/* Then the instruction, which reads all of them */
+	for(i = 0; i < expr->operands_length; i++) {
+		const struct expr* operand = operand_at(expr, i, reverse);
+
+		if(operand->type == EXPR_VARIABLE) {
+			outer = max_long(outer, (long)before - (long)operand->position);
+		} else if(operand->type == EXPR_INSTRUCTION) {
+			after += operand->pushes;
+			inner = max_long(inner, (long)(before - after +
+						operand->result_offset));
+		}
+	}
+
+	*pushes = before + expr->pushed;
+	*outer_reach = outer;
+	*inner_reach = inner;
+}
+
+static const struct expr* operand_at(const struct expr* expr, size_t index,
+		int reverse)
+{
+	return expr->operands[reverse ? expr->operands_length - 1 - index :
+		index];
+}
+
+/* Deepest slot the code of an instruction reads, starting at depth */
+static long reach(const struct expr* expr, size_t depth)
+{
+	return max_long(max_long((long)depth + expr->outer_reach,
+				expr->inner_reach), 0);
+}
+
+static long tail_reach(const struct expr* expr, size_t depth)
+{
+	const struct expr* fall_through;
+	const struct expr* taken;
+	size_t arms_depth;
+
+	if(expr->type != EXPR_IF) {
+		return reach(expr, depth);
+	}
+
+	arms_depth = depth + expr->condition->pushes +
+		(size_t)layout_if(expr, depth, &fall_through, &taken);
+	return max_long(reach(expr->condition, depth),
+			max_long(tail_reach(fall_through, arms_depth),
+				tail_reach(taken, arms_depth)));
+}
+
+/*
+ * Chooses the arm to fall through to, which is the one reaching deeper, so
+ * that the frame size covers both. Returns whether the condition has to be
+ * turned around for that, which takes another push.
+ */
+static int layout_if(const struct expr* expr, size_t depth,
+		const struct expr** fall_through, const struct expr** taken)
+{
+	size_t arms_depth = depth + expr->condition->pushes;
+
+	*taken = expr->inverted ? expr->otherwise : expr->then;
+	*fall_through = expr->inverted ? expr->then : expr->otherwise;
+	if(tail_reach(*fall_through, arms_depth) >=
+			tail_reach(*taken, arms_depth)) {
+		return 0;
+	}
+
+	/* One deeper, the taken arm still reaches at least as far */
+	*taken = expr->inverted ? expr->then : expr->otherwise;
+	*fall_through = expr->inverted ? expr->otherwise : expr->then;
+	return 1;
+}
+
+static void emit(struct scheme_compiler* self, const char* format, ...)
+{
+	va_list args;
+	char* line;
+	int length;
+
+	va_start(args, format);
+	length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	assert(length >= 0);
+
+	line = (char*)arena_alloc(&self->arena, (size_t)length + 1);
+	va_start(args, format);
+	vsnprintf(line, (size_t)length + 1, format, args);
+	va_end(args);
+
+	vector_push_back(&self->lines__charptr, &line);
+}
+
+static void emit_function(struct scheme_compiler* self, size_t index)
+{
+	struct function* function = function_at(self, index);
+	char* params;
+	size_t length = 1;
+	size_t i;
+
+	for(i = 0; i < function->params_length; i++) {
+		length += strlen(function->params[i]) + 1;
+	}
+	params = (char*)malloc(length);
+	assert(params != NULL);
+	params[0] = 0;
+	for(i = 0; i < function->params_length; i++) {
+		if(i > 0) {
+			strcat(params, " ");
+		}
+		strcat(params, function->params[i]);
+	}
+
+	if(index > 0) {
+		emit(self, "");
+	}
+	emit(self, "%s:;(%s)", function->name, params);
+	free(params);
+
+	analyze(function->body, function->params_length);
+	emit_tail(self, index, function->body, function->params_length);
+}
+
+static void emit_tail(struct scheme_compiler* self, size_t function,
+		const struct expr* expr, size_t depth)
+{
+	const struct expr* fall_through;
+	const struct expr* taken;
+	const char* label;
+	size_t start = depth;
+
+	if(expr->type != EXPR_IF) {
+		emit_instruction(self, (struct expr*)expr, &depth);
+		return;
+	}
+
+	emit_instruction(self, expr->condition, &depth);
+	if(layout_if(expr, start, &fall_through, &taken)) {
+		emit(self, "\tequals? s0 0");
+		depth++;
+	}
+
+	label = new_label(self, function, "");
+	emit(self, "\tbranch %s", label);
+	emit_tail(self, function, fall_through, depth);
+	emit(self, "%s:", label);
+	emit_tail(self, function, taken, depth);
+}
+
+static void emit_instruction(struct scheme_compiler* self,
+		struct expr* expr, size_t* depth)
+{
+	char* line;
+	char* out;
+	size_t i;
+
+	for(i = 0; i < expr->operands_length; i++) {
+		struct expr* operand = (struct expr*)operand_at(expr, i,
+				expr->reverse);
+
+		if(operand->type == EXPR_INSTRUCTION) {
+			emit_instruction(self, operand, depth);
+		}
+	}
+
+	/* A tab, and a space and at most 21 characters for every operand */
+	line = (char*)malloc(strlen(expr->mnemonic) + 2 +
+			expr->operands_length * 22);
+	assert(line != NULL);
+	out = line + sprintf(line, "\t%s", expr->mnemonic);
+	for(i = 0; i < expr->operands_length; i++) {
+		const struct expr* operand = expr->operands[i];
+
+		if(operand->type == EXPR_CONSTANT) {
+			out += sprintf(out, " %lld", (long long)operand->constant);
+		} else {
+			out += sprintf(out, " s%lu",
+					(unsigned long)(*depth - operand->position));
+		}
+	}
+	emit(self, "%s", line);
+	free(line);
+
+	*depth += expr->pushed;
+	expr->position = *depth - expr->result_offset;
+}
+
+static long max_long(long a, long b)
+{
+	return a > b ? a : b;
+}
+
+
+/* Compiles the source, then checks what running gives in every mode */
+static void unit_test_run(const char* source, inttype expected)
+{
+	struct scheme_compiler compiler;
+	struct interpreter interp;
+	inttype result;
+	size_t mode;
+	size_t i;
+
+	scheme_compiler_create(&compiler);
+	assert(scheme_compile(&compiler, source) == SCHEME_ERROR_NONE);
+	interpreter_create(&interp, NULL);
+	for(i = 0; i < scheme_lines_length(&compiler); i++) {
+		interpreter_add_line(&interp, scheme_line(&compiler, i));
+	}
+
+	for(mode = INTERPRETER_MODE_RING; mode <= INTERPRETER_MODE_JIT; mode++) {
+		interpreter_set_mode(&interp, (enum interpreter_mode)mode);
+		result = 0;
+		assert(interpreter_run(&interp, &result) == INTERPRETER_ERROR_NONE);
+		assert(result == expected);
+	}
+
+	interpreter_release(&interp);
+	scheme_compiler_release(&compiler);
+}
+
+static void unit_test_error(const char* source, enum scheme_error expected,
+		size_t line)
+{
+	struct scheme_compiler compiler;
+
+	scheme_compiler_create(&compiler);
+	assert(scheme_compile(&compiler, source) == expected);
+	assert(compiler.error_line == line);
+	scheme_compiler_release(&compiler);
+}
+
+void scheme_unit_test(void)
+{
+	/* As res/compilation-example.scm works it out by hand */
+	static const char* const fact_lines[] = {
+		"fact:;(n)",
+		"\tequals? s0 1",
+		"\tbranch fact-1",
+		"\tsub s1 1",
+		"\tfact s0",
+		"\tmul s3 s0",
+		"\tret s0",
+		"fact-1:",
+		"\tret 1"
+	};
+	const char* fact =
+		"(define (fact n)\n"
+		"  (if (= n 1)\n"
+		"    1\n"
+		"    (* n (fact (- n 1)))))\n"
+		"(fact 10)\n";
+	struct scheme_compiler compiler;
+	size_t i;
+
+	scheme_compiler_create(&compiler);
+	assert(scheme_compile(&compiler, fact) == SCHEME_ERROR_NONE);
+	for(i = 0; i < sizeof(fact_lines)/sizeof(fact_lines[0]); i++) {
+		assert(!strcmp(scheme_line(&compiler, i), fact_lines[i]));
+	}
+	scheme_compiler_release(&compiler);
+	unit_test_run(fact, 3628800);
+
+	unit_test_run(
+		"(define (fib n)\n"
+		"  (if (zero? n) 0 (if (= n 1) 1\n"
+		"    (+ (fib (- n 1)) (fib (- n 2))))))\n"
+		"(fib 15)", 610);
+	/* The deeper arm has to come first, by turning the condition around */
+	unit_test_run(
+		"(define (f a b c d) (if (= a 0) (+ a (* b (+ c d))) 7))\n"
+		"(f 0 2 3 4)", 14);
+	unit_test_run(
+		"(define (f a b c d) (if (= a 0) (+ a (* b (+ c d))) 7))\n"
+		"(f 1 2 3 4)", 7);
+	/* Not in tail position, so it's lifted into a function */
+	unit_test_run(
+		"(define (f x y) (* y (if (not (zero? x)) x 21)))\n"
+		"(+ (f 0 2) (f 5 1))", 47);
+	unit_test_run(
+		"(define ten 10) ; A constant\n"
+		"(define (main) (- (remainder -7 2) (quotient ten 4) (- 1)))",
+		(inttype)-2);
+	unit_test_run("(if 0 1 (if #t (*) 3))", 1);
+
+	unit_test_error("(define (f x) x)\n(f)", SCHEME_ERROR_ARGUMENT_COUNT, 2);
+	unit_test_error("(define (f x)\n y)\n(f 1)",
+			SCHEME_ERROR_UNBOUND_VARIABLE, 2);
+	unit_test_error("(g 1)", SCHEME_ERROR_UNDEFINED_FUNCTION, 1);
+	unit_test_error("(define (add x) x)", SCHEME_ERROR_RESERVED_NAME, 1);
+	unit_test_error("(define x 1)\n(define (x) 2)",
+			SCHEME_ERROR_REDEFINITION, 2);
+	unit_test_error("(+ 1\n 2", SCHEME_ERROR_SYNTAX, 1);
+	unit_test_error("'(1 2)", SCHEME_ERROR_SYNTAX, 1);
+	unit_test_error("99999999999999999999", SCHEME_ERROR_INVALID_NUMBER, 1);
+	unit_test_error("(define x 1)\n", SCHEME_ERROR_NO_ENTRY, 2);
+	unit_test_error("1\n2", SCHEME_ERROR_NO_ENTRY, 2);
+}
@@ -0,0 +1,78 @@
+#ifndef SCHEME_INCLUDED_H
+#define SCHEME_INCLUDED_H
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "vector.h"
+#include "hash_map.h"
+#include "string_table.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SCHEME_EXTENSION ".scm"
+
+enum scheme_error {
+	SCHEME_ERROR_NONE,
+	/* Unbalanced parentheses, or a form outside the subset */
+	SCHEME_ERROR_SYNTAX,
+	SCHEME_ERROR_INVALID_NUMBER,
+	SCHEME_ERROR_UNBOUND_VARIABLE,
+	SCHEME_ERROR_UNDEFINED_FUNCTION,
+	SCHEME_ERROR_ARGUMENT_COUNT,
+	SCHEME_ERROR_REDEFINITION,
+	/* A definition named like a special form, a builtin or an instruction */
+	SCHEME_ERROR_RESERVED_NAME,
+	/* There must be either a main function or one top-level expression */
+	SCHEME_ERROR_NO_ENTRY
+};
+
+/*
+ * Compiles a subset of Scheme into the assembly interpreter_add_line takes.
+ * Programs are made of
+ *   (define (name params...) body)  functions
+ *   (define name 42)                integer constants
+ *   expression                      at most one, which becomes main
+ * and expressions of integers, #t and #f (1 and 0), variables, if, calls,
+ * +, -, *, quotient, remainder, =, zero? and not. Everything but 0 is true.
+ *
+ * Values are never copied: an operand names the slot its value was pushed
+ * to, or is a constant. Operands that need code of their own are run in
+ * whichever order keeps the deepest slot closer, and of the two arms of an
+ * if, the one reaching deeper is placed before the other, as the frame size
+ * only counts the code up to a function's first ret. An if that isn't in
+ * tail position becomes a function of its own, taking the variables it
+ * uses, since a branch can't join back up.
+ */
+struct scheme_compiler {
+	struct arena arena;
+	struct string_table names;
+	/* Every name defined at the top level, and every label generated */
+	struct hash_map definitions__charptr__struct_definition;
+	/* (struct vector<struct function>) User functions, then the ones lifted
+	   out of them */
+	struct vector functions__struct_function;
+	/* (struct vector<char*>) The assembly, a line each */
+	struct vector lines__charptr;
+	/* Source line the error was found on */
+	size_t error_line;
+};
+
+void scheme_compiler_create(struct scheme_compiler* self);
+void scheme_compiler_release(struct scheme_compiler* self);
+
+/* Compiles a whole program, once per compiler */
+enum scheme_error scheme_compile(struct scheme_compiler* self,
+		const char* source);
+size_t scheme_lines_length(const struct scheme_compiler* self);
+const char* scheme_line(const struct scheme_compiler* self, size_t index);
+
+void scheme_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,191 @@
+#include "string_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define DEFAULT_CAPACITY 64
+
+static size_t hash_string(const char* str, size_t length);
+static size_t string_table_find_slot(const struct string_table* self,
+		const char* str, size_t length, size_t hash);
+static void string_table_grow(struct string_table* self);
+
+
+void string_table_create(struct string_table* self)
+{
+	string_table_create_arena(self, NULL);
+}
+
+void string_table_create_arena(struct string_table* self,
+		struct arena* arena)
+{
+	self->length = 0;
+	self->capacity = DEFAULT_CAPACITY;
+	self->arena = arena;
+	self->strings = (char**)arena_heap_calloc(arena, self->capacity,
+			sizeof(char*));
+	self->hashes = (size_t*)arena_heap_alloc(arena,
+			self->capacity * sizeof(size_t));
+
+	assert(self->strings != NULL && self->hashes != NULL);
+}
+
+void string_table_release(struct string_table* self)
+{
+	size_t i;
+
+	if(self->arena != NULL) {
+		return;
+	}
+
+	for(i = 0; i < self->capacity; i++) {
+		free(self->strings[i]);
+	}
+
+	free(self->strings);
+	free(self->hashes);
+}
+
+const char* string_table_intern(struct string_table* self, const char* str)
+{
+	return string_table_intern_length(self, str, strlen(str));
+}
+
+const char* string_table_intern_length(struct string_table* self,
+		const char* str, size_t length)
+{
+	size_t hash = hash_string(str, length);
+	size_t slot;
+	char* copy;
+
+	/* Keep the load factor at or below one half */
+	if((self->length + 1) * 2 > self->capacity) {
+		string_table_grow(self);
+	}
+
+	slot = string_table_find_slot(self, str, length, hash);
+	if(self->strings[slot] != NULL) {
+		return self->strings[slot];
+	}
+
+	copy = (char*)arena_heap_alloc(self->arena, length + 1);
+	assert(copy != NULL);
+	memcpy(copy, str, length);
+	copy[length] = 0;
+
+	self->strings[slot] = copy;
+	self->hashes[slot] = hash;
+	self->length++;
+	return copy;
+}
+
+const char* string_table_find(const struct string_table* self,
+		const char* str)
+{
+	size_t length = strlen(str);
+
+	return self->strings[string_table_find_slot(self, str, length,
+			hash_string(str, length))];
+}
+
+
+/* 64-bit FNV-1a */
+static size_t hash_string(const char* str, size_t length)
+{
+	size_t hash = (size_t)14695981039346656037ULL;
+	size_t i;
+
+	for(i = 0; i < length; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= (size_t)1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static size_t string_table_find_slot(const struct string_table* self,
+		const char* str, size_t length, size_t hash)
+{
+	size_t mask = self->capacity - 1;
+	size_t slot = hash & mask;
+
+	/* The stored hash rules out almost every mismatch before comparing */
+	while(self->strings[slot] != NULL) {
+		if(self->hashes[slot] == hash &&
+				!strncmp(self->strings[slot], str, length) &&
+				self->strings[slot][length] == 0) {
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return slot;
+}
+
+static void string_table_grow(struct string_table* self)
+{
+	char** old_strings = self->strings;
+	size_t* old_hashes = self->hashes;
+	size_t old_capacity = self->capacity;
+	size_t i;
+
+	self->capacity *= 2;
+	self->strings = (char**)arena_heap_calloc(self->arena, self->capacity,
+			sizeof(char*));
+	self->hashes = (size_t*)arena_heap_alloc(self->arena,
+			self->capacity * sizeof(size_t));
+	assert(self->strings != NULL && self->hashes != NULL);
+
+	for(i = 0; i < old_capacity; i++) {
+		size_t mask = self->capacity - 1;
+		size_t slot;
+
+		if(old_strings[i] == NULL) {
+			continue;
+		}
+
+		slot = old_hashes[i] & mask;
+		while(self->strings[slot] != NULL) {
+			slot = (slot + 1) & mask;
+		}
+
+		self->strings[slot] = old_strings[i];
+		self->hashes[slot] = old_hashes[i];
+	}
+
+	arena_heap_free(self->arena, old_strings);
+	arena_heap_free(self->arena, old_hashes);
+}
+
+void string_table_unit_test(void)
+{
+	struct string_table table;
+	char name[16];
+	const char* first;
+	const char* second;
+	size_t i;
+
+	string_table_create(&table);
+
+	first = string_table_intern(&table, "fact");
+	second = string_table_intern_length(&table, "fact_one", 4);
+	assert(first == second);
+	assert(!strcmp(first, "fact"));
+	assert(string_table_find(&table, "fact") == first);
+	assert(string_table_find(&table, "fac") == NULL);
+	assert(string_table_find(&table, "fact_one") == NULL);
+
+	/* Enough strings to make the table grow a few times */
+	for(i = 0; i < 1000; i++) {
+		sprintf(name, "label%lu", (unsigned long)i);
+		string_table_intern(&table, name);
+	}
+
+	assert(table.length == 1001);
+	assert(string_table_find(&table, "fact") == first);
+	assert(!strcmp(string_table_find(&table, "label999"), "label999"));
+
+	string_table_release(&table);
+}
@@ -0,0 +1,46 @@
+#ifndef STRING_TABLE_INCLUDED_H
+#define STRING_TABLE_INCLUDED_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Interns strings, so that every distinct string has exactly one copy and
+ * equal strings can be compared by pointer. The copies are owned by the
+ * table and live until it's released.
+ */
+struct string_table {
+	/* Open-addressing slots; NULL marks an empty slot */
+	char** strings;
+	size_t* hashes;
+	size_t length;
+	/* Always a power of two */
+	size_t capacity;
+	/* Where the table and the copies are allocated, or NULL for the heap */
+	struct arena* arena;
+};
+
+void string_table_create(struct string_table* self);
+void string_table_create_arena(struct string_table* self,
+		struct arena* arena);
+void string_table_release(struct string_table* self);
+
+const char* string_table_intern(struct string_table* self, const char* str);
+const char* string_table_intern_length(struct string_table* self,
+		const char* str, size_t length);
+/* Interned copy of str, or NULL if it has never been interned */
+const char* string_table_find(const struct string_table* self,
+		const char* str);
+
+void string_table_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,279 @@
+#if defined(__unix__)
+	/* For sysconf(_SC_NPROCESSORS_ONLN) */
+	#define _DEFAULT_SOURCE
+	#include <unistd.h>
+#endif
+
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+#define CHUNK_NONE ((size_t)-1)
+
+struct worker_start {
+	struct thread_pool* pool;
+	size_t worker;
+};
+
+static void* worker_main(void* data);
+static void work(struct thread_pool* self, size_t worker);
+static size_t take_chunk(struct thread_pool* self, size_t worker);
+static size_t processor_count(void);
+
+
+void thread_pool_create(struct thread_pool* self, size_t workers)
+{
+	size_t i;
+
+	if(workers == 0) {
+		workers = processor_count();
+	}
+
+	self->workers = workers;
+	self->threads = (pthread_t*)malloc(workers * sizeof(pthread_t));
+	self->queues = (struct thread_pool_queue*)malloc(
+			workers * sizeof(struct thread_pool_queue));
+	assert(self->threads != NULL && self->queues != NULL);
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->start, NULL);
+	pthread_cond_init(&self->finished, NULL);
+	self->generation = 0;
+	self->busy = 0;
+	self->stopping = 0;
+
+	for(i = 0; i < workers; i++) {
+		pthread_mutex_init(&self->queues[i].lock, NULL);
+		self->queues[i].front = 0;
+		self->queues[i].back = 0;
+	}
+
+	/* Worker 0 is whichever thread starts a job */
+	for(i = 1; i < workers; i++) {
+		struct worker_start* start = (struct worker_start*)malloc(
+				sizeof(struct worker_start));
+
+		assert(start != NULL);
+		start->pool = self;
+		start->worker = i;
+		if(pthread_create(&self->threads[i], NULL, worker_main, start)) {
+			/* Runs with the workers it got */
+			free(start);
+			self->workers = i;
+			break;
+		}
+	}
+}
+
+void thread_pool_release(struct thread_pool* self)
+{
+	size_t i;
+
+	pthread_mutex_lock(&self->lock);
+	self->stopping = 1;
+	pthread_cond_broadcast(&self->start);
+	pthread_mutex_unlock(&self->lock);
+
+	for(i = 1; i < self->workers; i++) {
+		pthread_join(self->threads[i], NULL);
+	}
+	for(i = 0; i < self->workers; i++) {
+		pthread_mutex_destroy(&self->queues[i].lock);
+	}
+
+	pthread_mutex_destroy(&self->lock);
+	pthread_cond_destroy(&self->start);
+	pthread_cond_destroy(&self->finished);
+	free(self->threads);
+	free(self->queues);
+}
+
+size_t thread_pool_workers(const struct thread_pool* self)
+{
+	return self->workers;
+}
+
+void thread_pool_for(struct thread_pool* self, size_t count, size_t chunk,
+		thread_pool_fn fn, void* userdata)
+{
+	size_t chunks;
+	size_t i;
+
+	if(chunk == 0) {
+		chunk = 1;
+	}
+	chunks = (count + chunk - 1) / chunk;
+
+	pthread_mutex_lock(&self->lock);
+	self->fn = fn;
+	self->userdata = userdata;
+	self->count = count;
+	self->chunk = chunk;
+
+	/* Every worker starts with an even share of the chunks, in order */
+	for(i = 0; i < self->workers; i++) {
+		struct thread_pool_queue* queue = &self->queues[i];
+
+		pthread_mutex_lock(&queue->lock);
+		queue->front = chunks * i / self->workers;
+		queue->back = chunks * (i + 1) / self->workers;
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	self->generation++;
+	self->busy = self->workers - 1;
+	pthread_cond_broadcast(&self->start);
+	pthread_mutex_unlock(&self->lock);
+
+	work(self, 0);
+
+	/* Once a worker finds nothing left to take, the rest of the chunks are
+	   being run by others, so the job is done when every worker is */
+	pthread_mutex_lock(&self->lock);
+	while(self->busy > 0) {
+		pthread_cond_wait(&self->finished, &self->lock);
+	}
+	pthread_mutex_unlock(&self->lock);
+}
+
+
+static void* worker_main(void* data)
+{
+	struct worker_start start = *(struct worker_start*)data;
+	struct thread_pool* self = start.pool;
+	size_t generation = 0;
+
+	free(data);
+
+	pthread_mutex_lock(&self->lock);
+	for(;;) {
+		while(self->generation == generation && !self->stopping) {
+			pthread_cond_wait(&self->start, &self->lock);
+		}
+		if(self->stopping) {
+			break;
+		}
+		generation = self->generation;
+		pthread_mutex_unlock(&self->lock);
+
+		work(self, start.worker);
+
+		pthread_mutex_lock(&self->lock);
+		if(--self->busy == 0) {
+			pthread_cond_signal(&self->finished);
+		}
+	}
+	pthread_mutex_unlock(&self->lock);
+
+	return NULL;
+}
+
+static void work(struct thread_pool* self, size_t worker)
+{
+	size_t chunk;
+
+	while((chunk = take_chunk(self, worker)) != CHUNK_NONE) {
+		size_t begin = chunk * self->chunk;
+		size_t end = begin + self->chunk;
+
+		self->fn(self->userdata, begin, end < self->count ? end : self->count,
+				worker);
+	}
+}
+
+/* The next chunk of the worker's own, or one stolen from the next worker
+   that has any left */
+static size_t take_chunk(struct thread_pool* self, size_t worker)
+{
+	struct thread_pool_queue* queue = &self->queues[worker];
+	size_t chunk = CHUNK_NONE;
+	size_t i;
+
+	pthread_mutex_lock(&queue->lock);
+	if(queue->front < queue->back) {
+		chunk = --queue->back;
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	for(i = 1; i < self->workers && chunk == CHUNK_NONE; i++) {
+		queue = &self->queues[(worker + i) % self->workers];
+
+		pthread_mutex_lock(&queue->lock);
+		if(queue->front < queue->back) {
+			chunk = queue->front++;
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	return chunk;
+}
+
+static size_t processor_count(void)
+{
+#if defined(__unix__)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if(count > 0) {
+		return (size_t)count;
+	}
+#endif
+
+	return 1;
+}
+
+
+struct unit_test_job {
+	unsigned char* visits;
+	/* Per worker, so that no two threads write the same one */
+	size_t* sums;
+};
+
+static void unit_test_fn(void* userdata, size_t begin, size_t end,
+		size_t worker)
+{
+	struct unit_test_job* job = (struct unit_test_job*)userdata;
+	size_t i;
+
+	for(i = begin; i < end; i++) {
+		job->visits[i]++;
+		job->sums[worker] += i;
+	}
+}
+
+void thread_pool_unit_test(void)
+{
+	const size_t count = 100003;
+	struct thread_pool pool;
+	struct unit_test_job job;
+	size_t sum;
+	size_t round;
+	size_t i;
+
+	thread_pool_create(&pool, 4);
+	assert(thread_pool_workers(&pool) >= 1);
+	job.visits = (unsigned char*)calloc(count, 1);
+	job.sums = (size_t*)calloc(thread_pool_workers(&pool), sizeof(size_t));
+	assert(job.visits != NULL && job.sums != NULL);
+
+	/* The pool is reused from job to job */
+	for(round = 1; round <= 3; round++) {
+		thread_pool_for(&pool, count, round * 7, unit_test_fn, &job);
+
+		sum = 0;
+		for(i = 0; i < thread_pool_workers(&pool); i++) {
+			sum += job.sums[i];
+		}
+		assert(sum == round * (count * (count - 1) / 2));
+		for(i = 0; i < count; i++) {
+			assert(job.visits[i] == round);
+		}
+	}
+
+	/* Nothing to do at all */
+	thread_pool_for(&pool, 0, 16, unit_test_fn, &job);
+
+	free(job.visits);
+	free(job.sums);
+	thread_pool_release(&pool);
+}
@@ -0,0 +1,67 @@
+#ifndef THREAD_POOL_INCLUDED_H
+#define THREAD_POOL_INCLUDED_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Runs indices begin to end of a job, on the given worker */
+typedef void (*thread_pool_fn)(void* userdata, size_t begin, size_t end,
+		size_t worker);
+
+/* Chunks of the running job that are left for one worker. The worker takes
+   them from the back, and idle workers steal them from the front. */
+struct thread_pool_queue {
+	pthread_mutex_t lock;
+	size_t front;
+	size_t back;
+};
+
+/*
+ * Fixed set of threads running one job at a time, split into chunks. Each
+ * worker starts out with a share of the chunks, and steals from the others
+ * once it runs out, so that a few slow chunks don't hold everything up.
+ *
+ * The thread starting a job works on it too, as worker 0.
+ */
+struct thread_pool {
+	size_t workers;
+	/* Threads of workers 1 and up */
+	pthread_t* threads;
+	struct thread_pool_queue* queues;
+
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t finished;
+	/* Counts jobs, so that waiting workers can tell a new one has come */
+	size_t generation;
+	/* Threads still working on the job */
+	size_t busy;
+	int stopping;
+
+	thread_pool_fn fn;
+	void* userdata;
+	size_t count;
+	size_t chunk;
+};
+
+/* With 0 workers, there is one for every processor */
+void thread_pool_create(struct thread_pool* self, size_t workers);
+void thread_pool_release(struct thread_pool* self);
+
+size_t thread_pool_workers(const struct thread_pool* self);
+/* Calls fn on every index up to count, chunk indices at a time, and
+   returns once all of them are done. Not to be called from within fn. */
+void thread_pool_for(struct thread_pool* self, size_t count, size_t chunk,
+		thread_pool_fn fn, void* userdata);
+
+void thread_pool_unit_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
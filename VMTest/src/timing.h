@@ -0,0 +1,20 @@
+#ifndef TIMING_INCLUDED_H
+#define TIMING_INCLUDED_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Monotonic time in seconds, for measuring intervals */
+double timing_get_time(void);
+/* Cheapest monotonic counter there is, for timing short intervals many
+   times over: the time stamp counter on x86, nanoseconds elsewhere */
+uint64_t timing_get_ticks(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,14 +1,123 @@
 #include "tokenizer.h"
 
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define TOKENIZER_CHUNK_SIZE 32
+#define TOKENIZER_CHUNK_BITS 0xFFFFFFFFu
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define TOKENIZER_CHUNK_SIZE 16
+#define TOKENIZER_CHUNK_BITS 0xFFFFu
+#endif
+
+/* Most runs are shorter than this, and end sooner looking a character at
+   a time in the table than setting up the vectors */
+#define TOKENIZER_SHORT_RUN 8
+
+/* Whole chunks are read even where the input starts or ends inside one.
+   Being aligned, they never cross into another page, but the sanitizer
+   can't tell. */
+#if defined(TOKENIZER_CHUNK_SIZE) && defined(__GNUC__)
+#define TOKENIZER_NO_SANITIZE __attribute__((no_sanitize_address))
+#else
+#define TOKENIZER_NO_SANITIZE
+#endif
+
+static void add_char(char* chars, size_t* length, int* vector, char c);
+#ifdef TOKENIZER_CHUNK_SIZE
+static unsigned int chunk_matches(const char* chunk, const char* chars,
+		size_t length);
+static const char* scan(const char* input, const char* chars, size_t length,
+		int ignored);
+#endif
+
+void tokenizer_classes_create(struct tokenizer_classes* classes,
+		const char* charsToIgnore, const char* tokenChars)
+{
+	const unsigned char* c;
+	size_t i;
+
+	memset(classes->m_classes, 0, sizeof(classes->m_classes));
+	for(c = (const unsigned char*)charsToIgnore; *c; c++) {
+		classes->m_classes[*c] |= TOKENIZER_CLASS_IGNORE;
+	}
+	for(c = (const unsigned char*)tokenChars; *c; c++) {
+		classes->m_classes[*c] = TOKENIZER_CLASS_TOKEN;
+	}
+
+	classes->m_ignoreLength = 0;
+	classes->m_delimiterLength = 0;
+	classes->m_vector = 1;
+	for(i = 1; i < sizeof(classes->m_classes); i++) {
+		if(classes->m_classes[i] == TOKENIZER_CLASS_IGNORE) {
+			add_char(classes->m_ignoreChars, &classes->m_ignoreLength,
+					&classes->m_vector, (char)i);
+		}
+		if(classes->m_classes[i] != 0) {
+			add_char(classes->m_delimiterChars, &classes->m_delimiterLength,
+					&classes->m_vector, (char)i);
+		}
+	}
+}
+
+const char* tokenizer_skip_ignored(const struct tokenizer_classes* classes,
+		const char* input)
+{
+	const char* shortEnd = input + TOKENIZER_SHORT_RUN;
+
+	for(; input != shortEnd; input++) {
+		if(classes->m_classes[(unsigned char)*input] !=
+				TOKENIZER_CLASS_IGNORE) {
+			return input;
+		}
+	}
+#ifdef TOKENIZER_CHUNK_SIZE
+	if(classes->m_vector) {
+		return scan(input, classes->m_ignoreChars, classes->m_ignoreLength,
+				1);
+	}
+#endif
+	while(classes->m_classes[(unsigned char)*input] ==
+			TOKENIZER_CLASS_IGNORE) {
+		input++;
+	}
+	return input;
+}
+
+const char* tokenizer_find_delimiter(const struct tokenizer_classes* classes,
+		const char* input)
+{
+	const char* shortEnd = input + TOKENIZER_SHORT_RUN;
+
+	for(; input != shortEnd; input++) {
+		if(*input == 0 || classes->m_classes[(unsigned char)*input] != 0) {
+			return input;
+		}
+	}
+#ifdef TOKENIZER_CHUNK_SIZE
+	if(classes->m_vector) {
+		return scan(input, classes->m_delimiterChars,
+				classes->m_delimiterLength, 0);
+	}
+#endif
+	while(*input != 0 && classes->m_classes[(unsigned char)*input] == 0) {
+		input++;
+	}
+	return input;
+}
+
 void tokenizer_create(struct tokenizer* tokenizer, const char* input,
 		const char* charsToIgnore, const char* tokenChars)
 {
 	tokenizer->m_input = input;
 	tokenizer->m_charsToIgnore = charsToIgnore;
 	tokenizer->m_tokenChars = tokenChars;
+	tokenizer_classes_create(&tokenizer->m_classes, charsToIgnore,
+			tokenChars);
 }
 
 void tokenizer_release(struct tokenizer* tokenizer)
@@ -22,38 +131,26 @@ int tokenizer_next_token(struct tokenizer* tokenizer, char* result,
 	const char* tokenStart;
 	unsigned long tokenLength;
 
-	while(*tokenizer->m_input != 0) {
-		if(strchr(tokenizer->m_tokenChars, *tokenizer->m_input) != NULL) {
-			assert(maxResultLength >= 1);
-			result[0] = *tokenizer->m_input;
-			result[1] = 0;
-			
-			tokenizer->m_input++;
-			return 1;
-		}
-		
-		if(strchr(tokenizer->m_charsToIgnore, *tokenizer->m_input) == NULL) {
-			break;
-		}
-		
-		tokenizer->m_input++;
-	}
-
+	tokenizer->m_input = tokenizer_skip_ignored(&tokenizer->m_classes,
+			tokenizer->m_input);
 	if(*tokenizer->m_input == 0) {
 		return 0;
 	}
-	
-	tokenStart = tokenizer->m_input;
-	
-	while(*tokenizer->m_input != 0) {
-		if(strchr(tokenizer->m_charsToIgnore, *tokenizer->m_input) != NULL ||
-			   	strchr(tokenizer->m_tokenChars, *tokenizer->m_input) != NULL) {
-			break;
-		}
-	
+
+	if(tokenizer->m_classes.m_classes[(unsigned char)*tokenizer->m_input] ==
+			TOKENIZER_CLASS_TOKEN) {
+		assert(maxResultLength >= 1);
+		result[0] = *tokenizer->m_input;
+		result[1] = 0;
+
 		tokenizer->m_input++;
+		return 1;
 	}
-	
+
+	tokenStart = tokenizer->m_input;
+	tokenizer->m_input = tokenizer_find_delimiter(&tokenizer->m_classes,
+			tokenizer->m_input);
+
 	tokenLength = (unsigned long)(tokenizer->m_input - tokenStart);
 	assert(maxResultLength >= tokenLength);
 
@@ -63,13 +160,87 @@ int tokenizer_next_token(struct tokenizer* tokenizer, char* result,
 	return 1;
 }
 
+
+/* Sets that don't fit the list are left to the table */
+static void add_char(char* chars, size_t* length, int* vector, char c)
+{
+	if(*length == TOKENIZER_VECTOR_CHARS) {
+		*vector = 0;
+		return;
+	}
+	chars[(*length)++] = c;
+}
+
+#ifdef TOKENIZER_CHUNK_SIZE
+/* Bits of the bytes of the aligned chunk that are one of the chars */
+TOKENIZER_NO_SANITIZE
+static unsigned int chunk_matches(const char* chunk, const char* chars,
+		size_t length)
+{
+	size_t i;
+#if defined(__AVX2__)
+	__m256i data = _mm256_load_si256((const __m256i*)chunk);
+	__m256i found = _mm256_setzero_si256();
+
+	for(i = 0; i < length; i++) {
+		found = _mm256_or_si256(found,
+				_mm256_cmpeq_epi8(data, _mm256_set1_epi8(chars[i])));
+	}
+	return (unsigned int)_mm256_movemask_epi8(found);
+#else
+	__m128i data = _mm_load_si128((const __m128i*)chunk);
+	__m128i found = _mm_setzero_si128();
+
+	for(i = 0; i < length; i++) {
+		found = _mm_or_si128(found,
+				_mm_cmpeq_epi8(data, _mm_set1_epi8(chars[i])));
+	}
+	return (unsigned int)_mm_movemask_epi8(found);
+#endif
+}
+
+/*
+ * Finds the first byte from input on that is one of the chars or the NUL,
+ * or, if ignored, the first that is none of them. Starts at the chunk
+ * holding input, with the bytes before it masked off.
+ */
+TOKENIZER_NO_SANITIZE
+static const char* scan(const char* input, const char* chars, size_t length,
+		int ignored)
+{
+	size_t offset = (uintptr_t)input % TOKENIZER_CHUNK_SIZE;
+	const char* chunk = input - offset;
+	unsigned int matches;
+
+	for(;;) {
+		matches = chunk_matches(chunk, chars, length);
+		if(ignored) {
+			/* The NUL is never ignored */
+			matches = ~matches & TOKENIZER_CHUNK_BITS;
+		} else {
+			matches |= chunk_matches(chunk, "", 1);
+		}
+		matches &= TOKENIZER_CHUNK_BITS << offset;
+		if(matches != 0) {
+			return chunk + __builtin_ctz(matches);
+		}
+		chunk += TOKENIZER_CHUNK_SIZE;
+		offset = 0;
+	}
+}
+#endif
+
+
 void tokenizer_unit_test()
 {
 	struct tokenizer test;
+	struct tokenizer_classes classes;
 	char token[6];
-	
+	char long_input[100];
+	size_t i;
+
 	tokenizer_create(&test, "Hello, World!", ", ", "!");
-    
+
     assert(tokenizer_next_token(&test, token, sizeof(token)));
     assert(strcmp(token, "Hello\n"));
     assert(tokenizer_next_token(&test, token, sizeof(token)));
@@ -77,6 +248,47 @@ void tokenizer_unit_test()
 	assert(tokenizer_next_token(&test, token, sizeof(token)));
 	assert(strcmp(token, "!\n"));
 	assert(!tokenizer_next_token(&test, token, sizeof(token)));
-	
+
 	tokenizer_release(&test);
+
+	/* Tokens split where they are, and what is both ignored and a token is
+	   a token */
+	tokenizer_create(&test, "  ab!!c d\t", " \t!", "!");
+	assert(tokenizer_next_token(&test, token, sizeof(token)));
+	assert(!strcmp(token, "ab"));
+	assert(tokenizer_next_token(&test, token, sizeof(token)));
+	assert(!strcmp(token, "!"));
+	assert(tokenizer_next_token(&test, token, sizeof(token)));
+	assert(!strcmp(token, "!"));
+	assert(tokenizer_next_token(&test, token, sizeof(token)));
+	assert(!strcmp(token, "c"));
+	assert(tokenizer_next_token(&test, token, sizeof(token)));
+	assert(!strcmp(token, "d"));
+	assert(!tokenizer_next_token(&test, token, sizeof(token)));
+	tokenizer_release(&test);
+
+	/* Runs longer than a vector, from every alignment, agree with the
+	   table */
+	memset(long_input, ' ', sizeof(long_input));
+	long_input[70] = 'x';
+	long_input[71] = ';';
+	long_input[80] = 0;
+	tokenizer_classes_create(&classes, " ", ";");
+	for(i = 0; i < 70; i++) {
+		assert(tokenizer_skip_ignored(&classes, long_input + i) ==
+				long_input + 70);
+		assert(tokenizer_find_delimiter(&classes, long_input + 70) ==
+				long_input + 71);
+	}
+	memset(long_input, 'a', 80);
+	for(i = 0; i < 80; i++) {
+		assert(tokenizer_find_delimiter(&classes, long_input + i) ==
+				long_input + 80);
+	}
+
+	/* Sets too large for the lists fall back to the table */
+	tokenizer_classes_create(&classes, "abcdefghij", "");
+	assert(!classes.m_vector);
+	assert(*tokenizer_skip_ignored(&classes, "jihgfx") == 'x');
+	assert(*tokenizer_find_delimiter(&classes, "xyza") == 'a');
 }
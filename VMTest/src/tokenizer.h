@@ -1,16 +1,57 @@
 #ifndef TOKENIZER_H_INCLUDED
 #define TOKENIZER_H_INCLUDED
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Classes of the characters of a tokenizer_classes, as bits */
+#define TOKENIZER_CLASS_IGNORE 1
+#define TOKENIZER_CLASS_TOKEN 2
+
+/* Sets larger than this are scanned a character at a time */
+#define TOKENIZER_VECTOR_CHARS 8
+
+/*
+ * The class of every character, made once from the sets of characters to
+ * ignore and of characters that are tokens on their own. A character in
+ * both is a token. The sets are also kept as lists, which past the first
+ * few characters of a run are compared against a whole vector of input at
+ * once, where SSE2 or AVX2 is there.
+ */
+struct tokenizer_classes {
+	unsigned char m_classes[256];
+	/* Characters only in the ignore set */
+	char m_ignoreChars[TOKENIZER_VECTOR_CHARS];
+	size_t m_ignoreLength;
+	/* Characters in either set */
+	char m_delimiterChars[TOKENIZER_VECTOR_CHARS];
+	size_t m_delimiterLength;
+	/* Whether the lists hold the whole sets */
+	int m_vector;
+};
+
 struct tokenizer {
 	const char* m_input;
 	const char* m_charsToIgnore;
 	const char* m_tokenChars;
+	struct tokenizer_classes m_classes;
 };
 
+void tokenizer_classes_create(struct tokenizer_classes* classes,
+		const char* charsToIgnore, const char* tokenChars);
+
+/* Returns the first character of input that isn't ignored, which may be
+   its NUL */
+const char* tokenizer_skip_ignored(const struct tokenizer_classes* classes,
+		const char* input);
+/* Returns the first character of input that is ignored or a token, or its
+   NUL */
+const char* tokenizer_find_delimiter(const struct tokenizer_classes* classes,
+		const char* input);
+
 void tokenizer_create(struct tokenizer* tokenizer, const char* input,
 		const char* charsToIgnore, const char* tokenChars);
 void tokenizer_release(struct tokenizer* tokenizer);
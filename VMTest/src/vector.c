@@ -5,26 +5,76 @@
 #include <string.h>
 
 #define DEFAULT_LENGTH 4
-#define GROWTH_FACTOR 1.5
+
+static void vector_resize(struct vector* self, size_t allocated_length)
+{
+	size_t old_length = self->allocated_length;
+
+	self->allocated_length = allocated_length;
+	if(self->data != self->inline_data) {
+		self->data = arena_heap_realloc(self->arena, self->data,
+				old_length * self->data_size,
+				self->allocated_length * self->data_size);
+		assert(self->data != NULL);
+		return;
+	}
+
+	/* Leaving the inline storage, which stays the caller's */
+	self->data = arena_heap_alloc(self->arena,
+			self->allocated_length * self->data_size);
+	assert(self->data != NULL);
+	memcpy(self->data, self->inline_data,
+			self->logical_length * self->data_size);
+}
 
 static void vector_grow(struct vector* self)
 {
-	self->allocated_length = (size_t)(self->allocated_length * GROWTH_FACTOR);
-	self->data = realloc(self->data, self->allocated_length * self->data_size);
+	size_t length = (size_t)((double)self->allocated_length *
+			self->growth_factor);
+
+	/* Small capacities would round back down to themselves */
+	if(length <= self->allocated_length) {
+		length = self->allocated_length + 1;
+	}
+	vector_resize(self, length);
 }
 
 void vector_create(struct vector* self, size_t data_size, void(*freefn)(void*)) 
+{
+	vector_create_arena(self, data_size, freefn, NULL);
+}
+
+void vector_create_arena(struct vector* self, size_t data_size,
+		void(*freefn)(void*), struct arena* arena)
 {
 	assert(data_size > 0);
 	self->logical_length = 0;
 	self->allocated_length = DEFAULT_LENGTH;
 	self->data_size = data_size;
-	self->data = malloc(self->allocated_length * self->data_size);
+	self->arena = arena;
+	self->inline_data = NULL;
+	self->growth_factor = VECTOR_GROWTH_FACTOR;
+	self->data = arena_heap_alloc(arena,
+			self->allocated_length * self->data_size);
 
 	assert(self->data != NULL);
 	self->freefn = freefn;	
 }
 
+void vector_create_inline(struct vector* self, size_t data_size,
+		void(*freefn)(void*), void* inline_data, size_t inline_length)
+{
+	assert(data_size > 0 && inline_data != NULL && inline_length > 0);
+	self->logical_length = 0;
+	self->allocated_length = inline_length;
+	self->data_size = data_size;
+	self->arena = NULL;
+	self->inline_data = inline_data;
+	self->growth_factor = VECTOR_GROWTH_FACTOR;
+	self->data = inline_data;
+	self->freefn = freefn;
+}
+
 void vector_release(struct vector* self)
 {
 	size_t i;
@@ -35,7 +85,9 @@ void vector_release(struct vector* self)
 		}
 	}
 
-	free(self->data);
+	if(self->data != self->inline_data) {
+		arena_heap_free(self->arena, self->data);
+	}
 }
 
 size_t vector_size(const struct vector* self)
@@ -53,6 +105,19 @@ int vector_empty(const struct vector* self)
 	return self->logical_length == 0;
 }
 
+void vector_reserve(struct vector* self, size_t length)
+{
+	if(length > self->allocated_length) {
+		vector_resize(self, length);
+	}
+}
+
+void vector_set_growth_factor(struct vector* self, double growth_factor)
+{
+	assert(growth_factor > 1.0);
+	self->growth_factor = growth_factor;
+}
+
 void* vector_at(const struct vector* self, size_t index)
 {
 	void* src;
@@ -95,11 +160,11 @@ void vector_pop_back(struct vector* self)
 {
 	void* loc;
 
+	self->logical_length--;
 	if(self->freefn != NULL) {
 		loc = (char*)self->data + self->logical_length*self->data_size;
 		self->freefn(loc);
 	}
-	self->logical_length--;
 }
 
 void vector_insert(struct vector* self, size_t index, void* data)
@@ -180,6 +245,8 @@ void vector_clear(struct vector* self)
 void vector_unit_test()
 {
 	struct vector v;
+	struct vector small;
+	int small_inline[2];
 	int val;
 	int val2;
 	size_t i;
@@ -204,6 +271,12 @@ void vector_unit_test()
 	val2 = *(int*)vector_at(&v, vector_size(&v) - 1);
 	assert(val == val2);
 
+	vector_reserve(&v, 100);
+	assert(vector_capacity(&v) == 100);
+	for(i = 0; i < vector_size(&v); i++) {
+		assert(*(int*)vector_at(&v, i) == val_array[i]);
+	}
+
 //	for(i = 0; i < vector_size(&v); i++) {
 //		vector_at(&v, i, &val);
 //		printf("%d ", val);
@@ -231,4 +304,26 @@ void vector_unit_test()
 	//printf("Hello, World: %d\n", vector_capacity(&v));
 
 	vector_release(&v);
+
+	/* Stays in the inline storage until it's full, then moves out with
+	   the elements */
+	vector_create_inline(&small, sizeof(int), NULL, small_inline, 2);
+	vector_set_growth_factor(&small, 2.0);
+	vector_push_back(&small, &val_array[0]);
+	vector_push_back(&small, &val_array[1]);
+	assert(vector_to_array(&small) == small_inline);
+	vector_push_back(&small, &val_array[2]);
+	assert(vector_to_array(&small) != small_inline);
+	assert(vector_capacity(&small) == 4);
+	for(i = 0; i < 3; i++) {
+		assert(*(int*)vector_at(&small, i) == val_array[i]);
+	}
+	vector_release(&small);
+
+	/* A factor rounding back down still grows */
+	vector_create_inline(&small, sizeof(int), NULL, small_inline, 1);
+	vector_push_back(&small, &val_array[0]);
+	vector_push_back(&small, &val_array[1]);
+	assert(vector_capacity(&small) == 2);
+	vector_release(&small);
 }
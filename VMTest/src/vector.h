@@ -3,24 +3,46 @@
 
 #include <stddef.h>
 
+#include "arena.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define VECTOR_GROWTH_FACTOR 1.5
+
 struct vector {
 	void* data;
 	size_t data_size;
 	size_t logical_length;
 	size_t allocated_length;
 	void(*freefn)(void*);
+	/* Where the data is allocated, or NULL for the heap */
+	struct arena* arena;
+	/* Storage given for the first elements, where data stays until they
+	   outgrow it, or NULL */
+	void* inline_data;
+	/* What the capacity is multiplied by when it runs out */
+	double growth_factor;
 };
 
 void vector_create(struct vector* self, size_t data_size, void(*freefn)(void*));
+void vector_create_arena(struct vector* self, size_t data_size,
+		void(*freefn)(void*), struct arena* arena);
+/* Keeps the first inline_length elements in inline_data, which must outlive
+   the vector, usually an array on the stack next to it. Nothing is
+   allocated until they outgrow it. */
+void vector_create_inline(struct vector* self, size_t data_size,
+		void(*freefn)(void*), void* inline_data, size_t inline_length);
 void vector_release(struct vector* self);
 
 size_t vector_size(const struct vector* self);
 size_t vector_capacity(const struct vector* self);
 int vector_empty(const struct vector* self);
+/* Makes room for at least length elements at once */
+void vector_reserve(struct vector* self, size_t length);
+/* Defaults to VECTOR_GROWTH_FACTOR, and must be more than 1 */
+void vector_set_growth_factor(struct vector* self, double growth_factor);
 
 void* vector_at(const struct vector* self, size_t index);
 void* vector_front(const struct vector* self);